@@ -43,6 +43,19 @@ extern "C" {
         COUCH_DOC_NON_JSON_MODE = 3 /**< Document was not checked (DB running in non-JSON mode) */
     };
 
+    /** Compression codecs for B-tree nodes and document bodies. LZ4 and zstd are only
+        available if the library was built with them. */
+    typedef enum {
+        COUCHSTORE_CODEC_DEFAULT = 0,   /**< Snappy; when compacting, the source's codec */
+        COUCHSTORE_CODEC_SNAPPY = 1,
+        COUCHSTORE_CODEC_LZ4 = 2,       /**< Fast to decode; good for hot B-tree nodes */
+        COUCHSTORE_CODEC_ZSTD = 3,      /**< Compresses best; good for cold doc bodies */
+        COUCHSTORE_CODEC_ZSTD_DICT = 4  /**< zstd with the file's trained dictionary. This
+                                             can't be chosen directly: doc bodies use it in
+                                             place of zstd once the file has a dictionary (see
+                                             COUCHSTORE_COMPACT_FLAG_TRAIN_DICTIONARY) */
+    } couchstore_codec_t;
+
     typedef enum {
 #ifdef POSIX_FADV_NORMAL
         /* Evict this range from FS caches if possible */
@@ -25,9 +25,68 @@ extern "C" {
         /**
          * Open the database in read only mode
          */
-        COUCHSTORE_OPEN_FLAG_RDONLY = 2
+        COUCHSTORE_OPEN_FLAG_RDONLY = 2,
+        /**
+         * Read the file through a memory mapping (see couchstore_get_mmap_file_ops).
+         * Only valid together with COUCHSTORE_OPEN_FLAG_RDONLY, and ignored by
+         * couchstore_open_db_ex, which uses the ops it's given.
+         */
+        COUCHSTORE_OPEN_FLAG_MMAP = 4,
+        /**
+         * Make couchstore_commit sync the file once instead of twice. The
+         * header is written right after the data and both are synced
+         * together; if a crash leaves the header on disk without all the
+         * data written since the previous header, the header fails
+         * validation when the file is next opened and the previous one is
+         * used instead. To make this possible, new files are created in
+         * the disk version 12 format, whose headers can record the extent
+         * and a checksum of each commit's data. Opening the file reads
+         * back the data of the last commit to check it, so commits that
+         * write more than 16MB still sync twice, as do all commits to
+         * files in older formats.
+         */
+        COUCHSTORE_OPEN_FLAG_SINGLE_SYNC = 8,
+        /**
+         * Allow the handle to be used by several threads at once. Only
+         * valid together with COUCHSTORE_OPEN_FLAG_RDONLY. Lookups,
+         * iterations and body reads can then be made concurrently; file
+         * reads go through per-thread buffers, and the handle keeps serving
+         * the header it was opened with. Don't close the handle while other
+         * threads are still using it.
+         */
+        COUCHSTORE_OPEN_FLAG_SHARED = 16,
+        /**
+         * Keep the B-tree nodes that saving documents modifies in memory,
+         * and only write them to the file at the next couchstore_commit.
+         * Later saves before the commit read and replace the in-memory
+         * nodes, so the upper levels of the trees are written once per
+         * commit rather than once per save. Uncommitted changes are lost
+         * on close either way. Until the commit, the space_used reported
+         * by couchstore_db_info is an estimate. Not valid together with
+         * COUCHSTORE_OPEN_FLAG_RDONLY.
+         */
+        COUCHSTORE_OPEN_FLAG_DEFER_NODE_WRITES = 32
     };
 
+    /**
+     * Open flags choosing the couchstore_codec_t that new B-tree nodes, and
+     * document bodies saved with COMPRESS_DOC_BODIES, are compressed with.
+     * Data compressed with any codec can be read whatever these are set to.
+     *
+     * A new file is only created in the codec-tagged format (disk version 12)
+     * if a codec other than snappy is chosen, since older versions of the
+     * library can't read that format. A file in the older format keeps using
+     * snappy until it's compacted. Opening fails with
+     * COUCHSTORE_ERROR_UNSUPPORTED_CODEC if the library wasn't built with a
+     * chosen codec.
+     *
+     * If the file has a trained zstd dictionary (see
+     * COUCHSTORE_COMPACT_FLAG_TRAIN_DICTIONARY), the body codec defaults to
+     * zstd, and bodies compressed with zstd use the dictionary.
+     */
+#define COUCHSTORE_OPEN_FLAG_NODE_CODEC(codec) ((couchstore_open_flags)(codec) << 32)
+#define COUCHSTORE_OPEN_FLAG_BODY_CODEC(codec) ((couchstore_open_flags)(codec) << 36)
+
 
     /**
      * Open a database.
@@ -83,6 +142,28 @@ extern "C" {
     LIBCOUCHSTORE_API
     const couch_file_ops *couchstore_get_default_file_ops(void);
 
+    /**
+     * Get a couch_file_ops object that reads files through a memory mapping.
+     * When a database is opened read-only with these ops, chunks that don't
+     * cross a block boundary are read in place instead of being copied into
+     * temporary buffers. Writes go straight to the file. On platforms
+     * without mmap this returns the default ops.
+     */
+    LIBCOUCHSTORE_API
+    const couch_file_ops *couchstore_get_mmap_file_ops(void);
+
+    /**
+     * Get a couch_file_ops object that can have many reads in flight at once.
+     * Lookups of several keys use it to read the B-tree nodes they'll need
+     * together, which helps on devices that service requests in parallel
+     * (SSDs, network storage.) On Linux this uses io_uring when the kernel
+     * supports it, otherwise a small thread pool; setting the environment
+     * variable COUCHSTORE_NO_IO_URING makes files opened afterwards use the
+     * pool. On other platforms this returns the default ops.
+     */
+    LIBCOUCHSTORE_API
+    const couch_file_ops *couchstore_get_async_file_ops(void);
+
     /**
      * Get information about the database.
      *
@@ -113,6 +194,77 @@ extern "C" {
     uint64_t couchstore_get_header_position(Db *db);
 
 
+    /*////////////////////  SNAPSHOTS: */
+
+    /**
+     * Opens a read-only snapshot of a database as of an earlier commit: the
+     * handle reads from the header at the given position instead of the
+     * latest one. Since files are append-only, the snapshot stays consistent
+     * however much the file is written to meanwhile (until it's compacted.)
+     *
+     * The snapshot should be closed with couchstore_close_db().
+     *
+     * @param filename The name of the file containing the database
+     * @param flags Additional open flags; COUCHSTORE_OPEN_FLAG_RDONLY is implied
+     * @param header_position The file position of a header, as returned by
+     *        couchstore_get_header_position() or couchstore_walk_headers()
+     * @param db Pointer to where you want the handle to be stored.
+     * @return COUCHSTORE_SUCCESS for success, COUCHSTORE_ERROR_NO_HEADER if
+     *         there is no header at that position.
+     */
+    LIBCOUCHSTORE_API
+    couchstore_error_t couchstore_open_snapshot(const char *filename,
+                                                couchstore_open_flags flags,
+                                                uint64_t header_position,
+                                                Db **db);
+
+    /**
+     * Opens a read-only snapshot of a database at the latest commit whose
+     * update sequence is no higher than the one given. See
+     * couchstore_open_snapshot().
+     *
+     * @return COUCHSTORE_SUCCESS for success, COUCHSTORE_ERROR_NO_HEADER if
+     *         every header in the file is newer than that.
+     */
+    LIBCOUCHSTORE_API
+    couchstore_error_t couchstore_open_snapshot_by_seq(const char *filename,
+                                                       couchstore_open_flags flags,
+                                                       uint64_t update_seq,
+                                                       Db **db);
+
+    /**
+     * Information about one of the headers in a database file.
+     */
+    typedef struct {
+        uint64_t position;      /**< File position of the header */
+        uint64_t update_seq;    /**< Last sequence number committed by it */
+        uint64_t purge_seq;     /**< Purge sequence number at that point */
+    } HeaderInfo;
+
+    /**
+     * The callback function used by couchstore_walk_headers(). A nonzero
+     * return value stops the walk; if it's negative, it's returned from
+     * couchstore_walk_headers as an error.
+     */
+    typedef int (*couchstore_header_callback_fn)(Db *db,
+                                                 const HeaderInfo *header,
+                                                 void *ctx);
+
+    /**
+     * Enumerates the valid headers in a database file, starting with the
+     * one the handle is using and going back to the first.
+     *
+     * @param db The database handle
+     * @param callback The function to call for each header
+     * @param ctx Passed to the callback
+     * @return COUCHSTORE_SUCCESS for success
+     */
+    LIBCOUCHSTORE_API
+    couchstore_error_t couchstore_walk_headers(Db *db,
+                                               couchstore_header_callback_fn callback,
+                                               void *ctx);
+
+
     /*////////////////////  WRITING DOCUMENTS: */
 
     /*
@@ -176,15 +328,135 @@ extern "C" {
                                                  DocInfo *infos[],
                                                  unsigned numDocs,
                                                  couchstore_save_options options);
+
+    /**
+     * Gives the db a memtable: an in-memory sorted table that documents
+     * saved with couchstore_save_documents go into, instead of straight into
+     * the B-trees. Their bodies are still written right away. The memtable is
+     * added to the trees in one pass when it grows past max_bytes or gets
+     * older than max_age seconds, and at every commit, so many small saves
+     * cost one tree update.
+     *
+     * couchstore_docinfo_by_id, couchstore_docinfo_by_sequence,
+     * couchstore_changes_since and couchstore_all_docs see the memtable's
+     * contents along with the trees'. Other reads and iterations, and
+     * compaction, flush the memtable into the trees first.
+     *
+     * @param db the database
+     * @param max_bytes how much memory the memtable may use before it's
+     *        flushed; 0 flushes and removes the memtable
+     * @param max_age how many seconds after its first save the memtable is
+     *        flushed (checked when saving), or 0 for no limit
+     * @return COUCHSTORE_SUCCESS on success
+     */
+    LIBCOUCHSTORE_API
+    couchstore_error_t couchstore_set_memtable(Db *db, uint64_t max_bytes, unsigned max_age);
+
     /**
      * Commit all pending changes and flush buffers to persistent storage.
      *
+     * This syncs the file twice, or usually once if the database was opened
+     * with COUCHSTORE_OPEN_FLAG_SINGLE_SYNC (see there.)
+     *
      * @param db database to perform the commit on
      * @return COUCHSTORE_SUCCESS on success
      */
     LIBCOUCHSTORE_API
     couchstore_error_t couchstore_commit(Db *db);
 
+    /**
+     * Save an array of docs and commit them, sharing the commit with other
+     * threads calling this function on the same db at the same time.
+     *
+     * This is equivalent to couchstore_save_documents() followed by
+     * couchstore_commit(), except that it may be called concurrently from
+     * several threads. Batches that arrive while a commit is in progress are
+     * queued, then saved together and made durable with a single commit, so
+     * many small concurrent commits cost little more than one. Batches are
+     * applied in the order they arrived. Each caller returns once its own
+     * batch has been committed (or has failed.)
+     *
+     * Other functions must not be called on the db while any thread may be
+     * inside this one.
+     *
+     * @param db the database to save documents in
+     * @param docs an array of document pointers, or NULL to delete
+     * @param infos an array of docinfo pointers
+     * @param numDocs the number documents to save
+     * @param options see descrtiption of COMPRESS_DOC_BODIES below
+     * @return COUCHSTORE_SUCCESS once the docs have been saved and committed
+     */
+    LIBCOUCHSTORE_API
+    couchstore_error_t couchstore_save_documents_and_commit(Db *db,
+                                                            Doc* const docs[],
+                                                            DocInfo *infos[],
+                                                            unsigned numDocs,
+                                                            couchstore_save_options options);
+
+    /*////////////////////  BULK LOADING: */
+
+    /**
+     * Builds a new database from a stream of documents, much faster than
+     * saving them: the bodies are appended to the file in the order they're
+     * added, the by-sequence index is built bottom-up as they arrive, and the
+     * by-id index is sorted and written in one pass at the end.
+     */
+    typedef struct _bulk_loader BulkLoader;
+
+    /**
+     * Starts a bulk load into a new database file.
+     *
+     * @param filename The filename of the database to create. If the file
+     *        exists it must not contain any documents.
+     * @param ops Pointer to the file I/O operations to use, or NULL for the
+     *        default ones.
+     * @param loader On success, set to the new BulkLoader.
+     * @return COUCHSTORE_SUCCESS on success, or COUCHSTORE_ERROR_INVALID_ARGUMENTS
+     *         if the file already contains a database.
+     */
+    LIBCOUCHSTORE_API
+    couchstore_error_t couchstore_bulk_load_open(const char *filename,
+                                                 const couch_file_ops *ops,
+                                                 BulkLoader **loader);
+
+    /**
+     * Adds a document to a bulk load, as couchstore_save_document would.
+     * The documents can be added in any order of ID, but no ID may be added
+     * twice (couchstore_bulk_load_finish fails if one is.) Each one is given
+     * the next sequence number, which is stored in info->db_seq.
+     *
+     * After an error the load can't continue; couchstore_bulk_load_finish
+     * will return the error.
+     *
+     * @param loader the BulkLoader
+     * @param doc the document to save, or NULL to save a deletion
+     * @param info the document's metadata
+     * @param options see the description of COMPRESS_DOC_BODIES
+     * @return COUCHSTORE_SUCCESS on success
+     */
+    LIBCOUCHSTORE_API
+    couchstore_error_t couchstore_bulk_load_add(BulkLoader *loader,
+                                                const Doc *doc,
+                                                DocInfo *info,
+                                                couchstore_save_options options);
+
+    /**
+     * Finishes a bulk load: writes the indexes, commits, and closes the file
+     * and the BulkLoader. If the load failed, the file is deleted instead.
+     * Local documents can be added afterwards by opening the database.
+     *
+     * @param loader the BulkLoader, which is freed
+     * @return COUCHSTORE_SUCCESS on success
+     */
+    LIBCOUCHSTORE_API
+    couchstore_error_t couchstore_bulk_load_finish(BulkLoader *loader);
+
+    /**
+     * Abandons a bulk load, deleting the file and freeing the BulkLoader.
+     */
+    LIBCOUCHSTORE_API
+    void couchstore_bulk_load_abort(BulkLoader *loader);
+
 
     /*////////////////////  RETRIEVING DOCUMENTS: */
 
@@ -204,6 +476,33 @@ extern "C" {
                                                 size_t idlen,
                                                 DocInfo **pInfo);
 
+    /**
+     * Gives the db a Bloom filter of its document IDs, kept in memory, so
+     * that looking up an ID that isn't in the db with couchstore_docinfo_by_id
+     * or couchstore_open_document usually needs no I/O at all. Building it
+     * scans the by-ID index once.
+     *
+     * The filter is kept up to date as documents are saved, and is grown at
+     * a commit when it holds more IDs than it was sized for. It's saved in the
+     * file at commits, and loaded when the file is opened, as long as the file
+     * is in the codec-tagged format (disk version 12); this function switches a
+     * new, still empty file to that format. Compaction gives the target a
+     * filter like the source's.
+     *
+     * Don't call this while other threads are using the handle.
+     *
+     * @param db the database
+     * @param false_positive_rate the fraction of absent IDs that should get
+     *        past the filter, e.g. 0.01; 0 removes the filter
+     * @param max_bytes the most memory the filter may use, or 0 for no limit;
+     *        if the rate needs more, the rate will be higher
+     * @return COUCHSTORE_SUCCESS on success
+     */
+    LIBCOUCHSTORE_API
+    couchstore_error_t couchstore_set_id_filter(Db *db,
+                                                double false_positive_rate,
+                                                uint64_t max_bytes);
+
     /**
      * Retrieve the document info for a given sequence number.
      *
@@ -225,7 +524,12 @@ extern "C" {
          * of the DocInfo is set.
          * This is NOT the default, and if this is not set the data field of the Doc
          * will be read from disk as-is, regardless of the content_meta flags. */
-        DECOMPRESS_DOC_BODIES = 1
+        DECOMPRESS_DOC_BODIES = 1,
+        /* Used by couchstore_open_documents(): read from the file on several
+         * threads at once. Only use this if the file ops' pread is thread-safe
+         * (the default ops' is.)
+         */
+        PARALLEL_DOC_READS = 2
     };
 
     /**
@@ -269,6 +573,103 @@ extern "C" {
                                                         Doc **pDoc,
                                                         couchstore_open_options options);
 
+    /**
+     * The callback function used by couchstore_visit_doc_body().
+     *
+     * @param db the database the body was read from
+     * @param docinfo the DocInfo that was passed to couchstore_visit_doc_body()
+     * @param body the document body. It's read-only, and is only valid until the
+     *             callback returns; copy it if you need it longer.
+     * @param ctx user context
+     * @return 0, or a negative error value to be returned by couchstore_visit_doc_body().
+     */
+    typedef int (*couchstore_body_visitor_fn)(Db *db,
+                                              const DocInfo *docinfo,
+                                              const sized_buf *body,
+                                              void *ctx);
+
+    /**
+     * Reads a document's body and passes it to a callback, without allocating a
+     * Doc. The body is read into buffers owned by the Db that are reused from one
+     * call to the next, or, if the file is memory-mapped, it may point directly
+     * into the mapping. This avoids the malloc/free pairs of
+     * couchstore_open_doc_with_docinfo() on hot read paths.
+     *
+     * The Db's buffers aren't shared, so this mustn't be called concurrently on
+     * the same Db, or re-entered from within the callback.
+     *
+     * @param db database to load the body from
+     * @param docinfo a valid DocInfo, as filled in by couchstore_docinfo_by_id()
+     * @param options See DECOMPRESS_DOC_BODIES
+     * @param callback function to be called with the body
+     * @param ctx user context passed to the callback
+     * @return COUCHSTORE_SUCCESS, or an error code from reading or from the callback
+     */
+    LIBCOUCHSTORE_API
+    couchstore_error_t couchstore_visit_doc_body(Db *db,
+                                                 const DocInfo *docinfo,
+                                                 couchstore_open_options options,
+                                                 couchstore_body_visitor_fn callback,
+                                                 void *ctx);
+
+    /**
+     * Reads a document's body into a caller-supplied, reusable buffer.
+     *
+     * The buffer's 'buf' must be NULL or a block from malloc(), and its 'size' is
+     * its capacity. If the body doesn't fit, the buffer is grown with realloc(),
+     * and its fields are updated. Reusing the same buffer for many reads avoids
+     * allocating per document. The caller frees buffer->buf when done.
+     *
+     * If the file is memory-mapped, the body may be read in place instead of
+     * being copied into the buffer; either way, 'body' is set to point at it,
+     * and stays valid until the buffer is next used or freed, or the database
+     * is closed.
+     *
+     * @param db database to load the body from
+     * @param docinfo a valid DocInfo, as filled in by couchstore_docinfo_by_id()
+     * @param buffer the reusable buffer
+     * @param body on success, set to the document body
+     * @param options See DECOMPRESS_DOC_BODIES
+     * @return COUCHSTORE_SUCCESS if found
+     */
+    LIBCOUCHSTORE_API
+    couchstore_error_t couchstore_read_doc_body(Db *db,
+                                                const DocInfo *docinfo,
+                                                sized_buf *buffer,
+                                                sized_buf *body,
+                                                couchstore_open_options options);
+
+    /**
+     * Reads the bodies of many documents at once, passing each to a callback.
+     *
+     * Rather than reading each body with its own small random read, this sorts
+     * the documents by their position in the file and coalesces nearby ones
+     * into a few large reads, which are much cheaper on both disks and SSDs.
+     * With the PARALLEL_DOC_READS option those reads are issued concurrently.
+     *
+     * The callback is called once per DocInfo, in file order rather than in
+     * the order given. A document with no body (bp of zero) is passed a NULL
+     * body. As with couchstore_visit_doc_body(), each body is only valid until
+     * the callback returns, and a negative return value from the callback
+     * stops the iteration and is returned.
+     *
+     * @param db database to load the bodies from
+     * @param docinfos array of valid DocInfos, as filled in by
+     *                 couchstore_docinfos_by_id()
+     * @param numDocs number of DocInfos in the array
+     * @param options See DECOMPRESS_DOC_BODIES and PARALLEL_DOC_READS
+     * @param callback function to be called with each body
+     * @param ctx user context passed to the callback
+     * @return COUCHSTORE_SUCCESS, or an error code from reading or from the callback
+     */
+    LIBCOUCHSTORE_API
+    couchstore_error_t couchstore_open_documents(Db *db,
+                                                 DocInfo *docinfos[],
+                                                 size_t numDocs,
+                                                 couchstore_open_options options,
+                                                 couchstore_body_visitor_fn callback,
+                                                 void *ctx);
+
     /**
      * Free all allocated resources from a document returned from
      * couchstore_open_document().
@@ -340,7 +741,15 @@ extern "C" {
         /**
          * Send only non-deleted items.
          */
-        COUCHSTORE_NO_DELETES = 4
+        COUCHSTORE_NO_DELETES = 4,
+        /**
+         * Iterate a range in descending order.
+         */
+        COUCHSTORE_DESCENDING = 8,
+        /**
+         * Leave out the end of a range.
+         */
+        COUCHSTORE_EXCLUSIVE_END = 16
     };
     
     /**
@@ -360,6 +769,34 @@ extern "C" {
                                                 couchstore_changes_callback_fn callback,
                                                 void *ctx);
 
+    /**
+     * Iterate through the changes in a range of sequence numbers, in either order.
+     *
+     * In ascending order this visits the sequences from start up to end; with
+     * COUCHSTORE_DESCENDING, from start down to end, reading only the nodes that
+     * hold them. For instance, the latest 10 changes are
+     * couchstore_changes_range(db, UINT64_MAX, 0, 10, COUCHSTORE_DESCENDING, ...).
+     * A descending iteration first flushes the db's memtable, if it has one.
+     *
+     * @param db the database to iterate through
+     * @param start the first sequence number to pass on
+     * @param end the last sequence number to pass on (UINT64_MAX for no limit, when ascending)
+     * @param limit the most changes to pass to the callback, or 0 for no limit
+     * @param options COUCHSTORE_DELETES_ONLY, COUCHSTORE_NO_DELETES,
+     *        COUCHSTORE_DESCENDING and COUCHSTORE_EXCLUSIVE_END are supported
+     * @param callback the callback function used to iterate over the changes
+     * @param ctx client context (passed to the callback)
+     * @return COUCHSTORE_SUCCESS upon success
+     */
+    LIBCOUCHSTORE_API
+    couchstore_error_t couchstore_changes_range(Db *db,
+                                                uint64_t start,
+                                                uint64_t end,
+                                                uint64_t limit,
+                                                couchstore_docinfos_options options,
+                                                couchstore_changes_callback_fn callback,
+                                                void *ctx);
+
     /**
      * Iterate through all documents in order by key.
      *
@@ -377,6 +814,107 @@ extern "C" {
                                            couchstore_changes_callback_fn callback,
                                            void *ctx);
 
+    /**
+     * Iterate through the documents in a range of keys, in either order.
+     *
+     * In ascending order this visits the keys from the start key up to the end
+     * key; with COUCHSTORE_DESCENDING, from the start key down to the end key,
+     * reading only the nodes that hold them. The callback isn't called for
+     * documents the limit or the end key leaves out, so a page of results costs
+     * only the nodes it's read from. A descending iteration first flushes the
+     * db's memtable, if it has one.
+     *
+     * @param db the database to iterate through
+     * @param startKeyPtr the key to start at, or NULL to start from the first key
+     *        (or the last, when descending)
+     * @param endKeyPtr the key to end at, or NULL to go on to the last key (or
+     *        the first, when descending)
+     * @param limit the most documents to pass to the callback, or 0 for no limit
+     * @param options COUCHSTORE_DELETES_ONLY, COUCHSTORE_NO_DELETES,
+     *        COUCHSTORE_DESCENDING and COUCHSTORE_EXCLUSIVE_END are supported
+     * @param callback the callback function used to iterate over the documents
+     * @param ctx client context (passed to the callback)
+     * @return COUCHSTORE_SUCCESS upon success
+     */
+    LIBCOUCHSTORE_API
+    couchstore_error_t couchstore_all_docs_range(Db *db,
+                                                 const sized_buf *startKeyPtr,
+                                                 const sized_buf *endKeyPtr,
+                                                 uint64_t limit,
+                                                 couchstore_docinfos_options options,
+                                                 couchstore_changes_callback_fn callback,
+                                                 void *ctx);
+
+    /** Totals for a range of documents, as returned by couchstore_count_docs_range(). */
+    typedef struct {
+        uint64_t doc_count;         /**< Number of non-deleted documents */
+        uint64_t deleted_count;     /**< Number of deleted documents */
+        uint64_t size;              /**< Total disk size of the documents' bodies */
+    } DocRangeInfo;
+
+    /**
+     * Count the documents in a range of keys.
+     *
+     * The by-ID tree keeps these totals for every subtree, so this reads only
+     * the nodes on the paths to the two ends of the range: O(log n), however
+     * many documents the range holds. Flushes the db's memtable first, if it
+     * has one.
+     *
+     * @param db the database
+     * @param startKeyPtr the first key of the range, or NULL to start from the first key
+     * @param endKeyPtr the last key of the range, or NULL to go on to the last key
+     * @param options COUCHSTORE_EXCLUSIVE_END is supported
+     * @param info set to the totals for the range
+     * @return COUCHSTORE_SUCCESS upon success
+     */
+    LIBCOUCHSTORE_API
+    couchstore_error_t couchstore_count_docs_range(Db *db,
+                                                   const sized_buf *startKeyPtr,
+                                                   const sized_buf *endKeyPtr,
+                                                   couchstore_docinfos_options options,
+                                                   DocRangeInfo *info);
+
+    /**
+     * Count the changes in a range of sequence numbers, in O(log n) like
+     * couchstore_count_docs_range(). The by-sequence tree only keeps the
+     * number of changes, so deletions aren't counted separately. Flushes the
+     * db's memtable first, if it has one.
+     *
+     * @param db the database
+     * @param start the first sequence number of the range
+     * @param end the last sequence number of the range (UINT64_MAX for no limit)
+     * @param options COUCHSTORE_EXCLUSIVE_END is supported
+     * @param count set to the number of changes in the range
+     * @return COUCHSTORE_SUCCESS upon success
+     */
+    LIBCOUCHSTORE_API
+    couchstore_error_t couchstore_count_changes_range(Db *db,
+                                                      uint64_t start,
+                                                      uint64_t end,
+                                                      couchstore_docinfos_options options,
+                                                      uint64_t *count);
+
+    /**
+     * Retrieve the info of the document at a position in key order, as for
+     * skipping to a page of couchstore_all_docs_range() results. This reads
+     * only the nodes on the path to the document: O(log n). Flushes the db's
+     * memtable first, if it has one.
+     *
+     * @param db the database
+     * @param offset the position of the document, from 0
+     * @param options With COUCHSTORE_NO_DELETES or COUCHSTORE_DELETES_ONLY only
+     *        those documents are counted. With COUCHSTORE_DESCENDING the offset
+     *        counts back from the last key.
+     * @param pInfo set to the DocInfo, which must be freed with couchstore_free_docinfo()
+     * @return COUCHSTORE_SUCCESS upon success, COUCHSTORE_ERROR_DOC_NOT_FOUND if
+     *         there aren't more than offset documents
+     */
+    LIBCOUCHSTORE_API
+    couchstore_error_t couchstore_docinfo_by_offset(Db *db,
+                                                    uint64_t offset,
+                                                    couchstore_docinfos_options options,
+                                                    DocInfo **pInfo);
+
     /**
      * Iterate over the document infos of a set of sequence numbers.
      *
@@ -512,6 +1050,75 @@ extern "C" {
                                                 couchstore_walk_tree_callback_fn callback,
                                                 void *ctx);
 
+    /**
+     * The callback function used by couchstore_all_docs_parallel() and
+     * couchstore_changes_parallel(). It's called from several threads at
+     * once, but never from two at once for the same partition. The DocInfo
+     * is handled as by couchstore_changes_callback_fn; a negative return
+     * value stops the scan and is passed back to the caller.
+     *
+     * The db is the caller's own handle, not a copy per thread. Unless it
+     * was opened with COUCHSTORE_OPEN_FLAG_SHARED, the callback must not
+     * use it at all (not even to read a document body), as the threads
+     * would share its file handle and buffers. A shared db can be read
+     * from the callback. Either way it must not be modified until the scan
+     * returns.
+     *
+     * @param db the database being scanned
+     * @param partition the index of the partition the document is in
+     * @param doc_info the document
+     * @param ctx the client context passed to the scan
+     */
+    typedef int (*couchstore_partition_callback_fn)(Db *db,
+                                                    int partition,
+                                                    DocInfo *doc_info,
+                                                    void *ctx);
+
+    /**
+     * Scan all the documents in key order, in parallel.
+     *
+     * The key space is split at the boundaries of the upper nodes of the
+     * by-ID tree into disjoint partitions, balanced by the number of
+     * documents each holds; only those nodes are read to split it. The
+     * partitions are then scanned by a pool of worker threads. Each
+     * partition's documents are passed on in key order, and every key in a
+     * partition comes before every key in the next one, so concatenating the
+     * partitions' results in index order gives the whole tree in order.
+     *
+     * The memtable and any deferred nodes are written to the file first. A
+     * db that wasn't opened with COUCHSTORE_OPEN_FLAG_SHARED gets a shared
+     * read-only handle on its file for the duration of the scan.
+     *
+     * @param db the database to scan
+     * @param partitions how many partitions to split the keys into; fewer are
+     *        used if the tree is small
+     * @param threads how many worker threads to use, at most one per partition.
+     *        With 0 or 1 the partitions are scanned in order on the calling thread.
+     * @param options COUCHSTORE_DELETES_ONLY and COUCHSTORE_NO_DELETES are supported
+     * @param callback the callback function called for each document
+     * @param ctx client context (passed to the callback)
+     * @return COUCHSTORE_SUCCESS upon success
+     */
+    LIBCOUCHSTORE_API
+    couchstore_error_t couchstore_all_docs_parallel(Db *db,
+                                                    unsigned partitions,
+                                                    unsigned threads,
+                                                    couchstore_docinfos_options options,
+                                                    couchstore_partition_callback_fn callback,
+                                                    void *ctx);
+
+    /**
+     * Scan all the changes in sequence order, in parallel, like
+     * couchstore_all_docs_parallel() does with the by-sequence tree.
+     */
+    LIBCOUCHSTORE_API
+    couchstore_error_t couchstore_changes_parallel(Db *db,
+                                                   unsigned partitions,
+                                                   unsigned threads,
+                                                   couchstore_docinfos_options options,
+                                                   couchstore_partition_callback_fn callback,
+                                                   void *ctx);
+
     /*////////////////////  LOCAL DOCUMENTS: */
 
     /**
@@ -580,9 +1187,44 @@ extern "C" {
         /**
          * Evict document body portion of target file after compaction (fadvise)
          */
-        COUCHSTORE_COMPACT_FLAG_EVICT_BODIES = 2
+        COUCHSTORE_COMPACT_FLAG_EVICT_BODIES = 2,
+        /**
+         * Use several threads: document bodies are read from the source by
+         * a few reader threads while another thread writes the target, and
+         * the by-id index is sorted while the by-sequence index is scanned.
+         * The source db's file ops must allow concurrent preads (the default
+         * ones do.)
+         */
+        COUCHSTORE_COMPACT_FLAG_PARALLEL = 4,
+        /**
+         * Verify the checksum of every document body copied. By default the
+         * bodies are copied with their stored checksums, without checking them.
+         */
+        COUCHSTORE_COMPACT_FLAG_VERIFY_CHECKSUMS = 8,
+        /**
+         * Train a zstd dictionary from a sample of the source's compressed
+         * document bodies, store it in the target, and compress the target's
+         * bodies with it. This suits many small bodies of similar shape, which
+         * compress poorly one at a time. The body codec must be zstd, which is
+         * the default with this flag. If the sample is too small to train
+         * from, the target simply has no dictionary.
+         *
+         * Without this flag, a source's dictionary is carried over to the
+         * target if the target's body codec is zstd.
+         */
+        COUCHSTORE_COMPACT_FLAG_TRAIN_DICTIONARY = 16
     };
 
+    /**
+     * Compaction flags choosing the codecs the target uses, as with
+     * COUCHSTORE_OPEN_FLAG_NODE_CODEC. By default the target uses the codecs
+     * the source was opened with. Compressed document bodies are copied as
+     * they are if they already use the target's body codec, and re-encoded
+     * otherwise.
+     */
+#define COUCHSTORE_COMPACT_FLAG_NODE_CODEC(codec) ((couchstore_compact_flags)(codec) << 32)
+#define COUCHSTORE_COMPACT_FLAG_BODY_CODEC(codec) ((couchstore_compact_flags)(codec) << 36)
+
     /**
      * Compact a database. This creates a new DB file with the same data as the
      * source db, omitting data that is no longer needed.
@@ -599,6 +1241,103 @@ extern "C" {
     couchstore_error_t couchstore_compact_db_ex(Db* source, const char* target_filename,
                                                 uint64_t flags, const couch_file_ops *ops);
 
+    /**
+     * Compact a database that is still being written to. This compacts the
+     * source's current state like couchstore_compact_db_ex, then repeatedly
+     * copies the changes committed to the source file since then into the
+     * target (see couchstore_compact_catchup), until a round copies no more
+     * than max_changes changes.
+     *
+     * The target is returned open. To finish, block writes to the source,
+     * call couchstore_compact_catchup once more, close the target and rename
+     * it over the source file.
+     *
+     * @param source the source database. Its own header is the snapshot that
+     *            is compacted; the changes are read from its file.
+     * @param target_filename the filename of the new database to create.
+     * @param flags flags that change compaction behavior
+     * @param ops Pointer to a structure containing the file I/O operations
+     *            you want the library to use.
+     * @param max_changes stop catching up once a round copies this few changes.
+     *            (It also stops after a fixed number of rounds, in case the
+     *            writer is outpacing it.)
+     * @param target on success, set to the open target database.
+     * @return COUCHSTORE_SUCCESS on success
+     */
+    LIBCOUCHSTORE_API
+    couchstore_error_t couchstore_compact_db_catchup(Db* source, const char* target_filename,
+                                                     uint64_t flags,
+                                                     const couch_file_ops *ops,
+                                                     uint64_t max_changes,
+                                                     Db** target);
+
+    /**
+     * Copies the changes committed to a database file since a compacted copy
+     * of it was made into that copy, and commits them. The changes are found
+     * by re-reading the latest header in the source's file, so they can have
+     * been made through another Db handle (or another process.) The local
+     * docs are copied again too.
+     *
+     * Deleted docs are copied even with COUCHSTORE_COMPACT_FLAG_DROP_DELETES,
+     * since the target may still have the doc they delete.
+     *
+     * @param source the database that was compacted
+     * @param target the compacted database, as returned by
+     *            couchstore_compact_db_catchup
+     * @param flags the flags the target was compacted with
+     * @param num_changes if not NULL, set to the number of changes copied
+     * @return COUCHSTORE_SUCCESS on success
+     */
+    LIBCOUCHSTORE_API
+    couchstore_error_t couchstore_compact_catchup(Db* source, Db* target, uint64_t flags,
+                                                  uint64_t *num_changes);
+
+
+    /*////////////////////  NODE CACHE: */
+
+    /**
+     * Statistics of the process-wide B-tree node cache, as returned by
+     * couchstore_get_node_cache_stats().
+     */
+    typedef struct {
+        uint64_t capacity;      /**< Configured capacity in bytes; 0 if disabled */
+        uint64_t size;          /**< Bytes currently used by cached nodes */
+        uint64_t entries;       /**< Number of cached nodes */
+        uint64_t hits;          /**< Node reads satisfied from the cache */
+        uint64_t misses;        /**< Node reads that had to go to the file */
+        uint64_t evictions;     /**< Nodes evicted to stay within the capacity */
+    } NodeCacheStats;
+
+    /**
+     * Sets the capacity of the B-tree node cache. The cache is shared by all
+     * open databases in the process and holds decompressed interior and leaf
+     * nodes, so lookups on hot trees skip the file read, CRC check and
+     * decompression. It's disabled (capacity 0) by default.
+     *
+     * Nodes are keyed by the file's device and inode, so all handles on a
+     * file share them, and they stay cached after the file is closed, for
+     * when it's opened again. A file truncated or replaced since it was last
+     * opened or closed in this process is detected (by its size and the
+     * bytes at its end) and its old nodes aren't used. Changes made to a file
+     * by other processes while it's open here aren't detected, but couchstore
+     * only ever appends to files.
+     *
+     * It's safe to call this at any time; shrinking the cache evicts the
+     * least recently used nodes immediately.
+     *
+     * @param capacity The maximum number of bytes to cache, or 0 to disable
+     */
+    LIBCOUCHSTORE_API
+    void couchstore_set_node_cache_size(size_t capacity);
+
+    /**
+     * Gets the current statistics of the B-tree node cache.
+     *
+     * @param stats Pointer to a struct to be filled in
+     */
+    LIBCOUCHSTORE_API
+    void couchstore_get_node_cache_stats(NodeCacheStats *stats);
+
 
     /*////////////////////  MISC: */
 
@@ -16,6 +16,24 @@ extern "C" {
      */
     typedef struct couch_file_handle_opaque* couch_file_handle;
 
+    /**
+     * One read in a batch passed to couch_file_ops.pread_batch.
+     */
+    typedef struct {
+        void *buf;              /**< Where to store the data */
+        size_t nbytes;          /**< Number of bytes to read */
+        cs_off_t offset;        /**< Where to read from */
+        ssize_t result;         /**< On completion: bytes read, or an error code < 0 */
+    } couch_file_read_request;
+
+    /**
+     * One piece of the data passed to couch_file_ops.pwritev.
+     */
+    typedef struct {
+        const void *buf;        /**< The data */
+        size_t nbytes;          /**< Its length */
+    } couch_file_iovec;
+
     /**
      * A structure that defines the implementation of the file I/O primitives
      * used by CouchStore. Passed to couchstore_open_db_ex().
@@ -23,7 +41,8 @@ extern "C" {
     typedef struct {
         /**
          * Version number that describes the layout of the structure. Should be set
-         * to 4.
+         * to 7. (Older versions, which end before the fields marked as newer, are
+         * still accepted.)
          */
         uint64_t version;
 
@@ -115,6 +134,54 @@ extern "C" {
          * all handles.
          */
         void *cookie;
+
+        /**
+         * Get a pointer to file data in memory, without copying it. Optional (may be
+         * NULL); new in version 5. If provided, and the file is opened read-only, reads
+         * of data that's contiguous in the file will use it instead of pread, and no
+         * buffering is layered on top of these ops.
+         *
+         * @param handle file handle to read from
+         * @param ptr on success, set to point to the data. The pointer must remain valid
+         *        until the file is closed.
+         * @param nbyte number of bytes requested
+         * @param offset where to read from
+         * @return number of bytes available at *ptr (which may be less than nbytes, e.g.
+         *         at the end of the file), or a value < 0 if an error occurred
+         */
+        ssize_t (*pread_ptr)(couch_file_handle handle, const void **ptr, size_t nbytes, cs_off_t offset);
+
+        /**
+         * Perform several reads at once. Optional (may be NULL); new in version 6.
+         * The reads should be submitted together so the device can service them in
+         * parallel; they may complete in any order, but the call doesn't return until
+         * all of them have. CouchStore uses this to fetch the child nodes needed by a
+         * multi-key B-tree lookup concurrently.
+         *
+         * @param handle file handle to read from
+         * @param reqs the reads to perform. Each one's 'result' field is set to the
+         *        number of bytes read (which may be less than nbytes), or to an error
+         *        code < 0.
+         * @param count number of reads
+         * @return COUCHSTORE_SUCCESS, or an error code if the batch couldn't be
+         *         performed at all
+         */
+        couchstore_error_t (*pread_batch)(couch_file_handle handle, couch_file_read_request *reqs, size_t count);
+
+        /**
+         * Write several pieces of data to consecutive positions in the file, as one
+         * operation. Optional (may be NULL); new in version 7. CouchStore uses this to
+         * write a chunk's header, its data and the prefix bytes at block boundaries
+         * without first copying them together.
+         *
+         * @param handle file handle to write to
+         * @param iov the pieces to write, in order
+         * @param iovcnt number of pieces
+         * @param offset where to write the first piece
+         * @return number of bytes written, which must be all of them, or a value < 0
+         *         if an error occurred
+         */
+        ssize_t (*pwritev)(couch_file_handle handle, const couch_file_iovec *iov, int iovcnt, cs_off_t offset);
     } couch_file_ops;
 
 #ifdef __cplusplus
@@ -9,6 +9,8 @@
 #include "util.h"
 #include "arena.h"
 #include "node_types.h"
+#include "node_cache.h"
+#include "dirty_nodes.h"
 
 #define CHUNK_THRESHOLD 1279
 #define CHUNK_SIZE (CHUNK_THRESHOLD * 2 / 3)
@@ -192,8 +194,11 @@ static couchstore_error_t flush_mr_partial(couchfile_modify_result *res, size_t
         return COUCHSTORE_SUCCESS;
     }
 
+    // Version 12 files get a slot directory at the end of each node, for binary search:
+    int slotted = res->rq->file->codec_tags;
+
     // nodebuf/writebuf is very short-lived and can be large, so use regular malloc heap for it:
-    nodebuf = malloc(res->node_len + 1);
+    nodebuf = malloc(res->node_len + 1 + (slotted ? sizeof(raw_32) * (res->count + 1) : 0));
     if (!nodebuf) {
         return COUCHSTORE_ERROR_ALLOC_FAIL;
     }
@@ -201,7 +206,7 @@ static couchstore_error_t flush_mr_partial(couchfile_modify_result *res, size_t
     writebuf.buf = nodebuf;
 
     dst = nodebuf;
-    *(dst++) = (char) res->node_type;
+    *(dst++) = (char) (res->node_type | (slotted ? NODE_SLOTTED : 0));
 
     nodelist *i = res->values->next;
     //We don't care that we've reached mr_quota if we haven't written out
@@ -218,10 +223,22 @@ static couchstore_error_t flush_mr_partial(couchfile_modify_result *res, size_t
         itmcount++;
     }
 
+    size_t entries_size = dst - nodebuf - 1;
+    if (slotted) {
+        dst = write_slot_directory(nodebuf, dst);
+    }
     writebuf.size = dst - nodebuf;
 
-    errcode = db_write_buf_compressed(res->rq->file, &writebuf, &diskpos, &disk_size);
-    free(nodebuf);  // here endeth the nodebuf.
+    if (res->rq->file->dirty) {
+        // Hold the node in memory until the commit; its size there stands in for its size on
+        // disk until then.
+        errcode = dirty_nodes_add(res->rq->file->dirty, nodebuf, writebuf.size, &diskpos);
+        disk_size = writebuf.size;
+    } else {
+        errcode = db_write_buf_compressed(res->rq->file, &writebuf, res->rq->file->node_codec,
+                                          &diskpos, &disk_size);
+        free(nodebuf);  // here endeth the nodebuf.
+    }
     if (errcode != COUCHSTORE_SUCCESS) {
         return errcode;
     }
@@ -261,7 +278,7 @@ static couchstore_error_t flush_mr_partial(couchfile_modify_result *res, size_t
     res->pointers_end->next = pel;
     res->pointers_end = pel;
 
-    res->node_len -= (writebuf.size - 1);
+    res->node_len -= entries_size;
 
     res->values->next = i;
     if(i == NULL) {
@@ -306,10 +323,12 @@ static couchstore_error_t modify_node(couchfile_modify_request *rq,
                                       int start, int end,
                                       couchfile_modify_result *dst)
 {
-    char *nodebuf = NULL;  // FYI, nodebuf is a malloced block, not in the arena
-    int bufpos = 1;
+    char *nodebuf = NULL;  // FYI, nodebuf is from the node cache or malloced, not in the arena
+    node_cache_entry *cached = NULL;
+    size_t bufpos = 1;
     int nodebuflen = 0;
     int errcode = 0;
+    node_layout node = {NULL, KV_NODE, 0, NULL, 0};
     couchfile_modify_result *local_result = NULL;
 
     if (start == end) {
@@ -317,17 +336,19 @@ static couchstore_error_t modify_node(couchfile_modify_request *rq,
     }
 
     if (nptr) {
-        if ((nodebuflen = pread_compressed(rq->file, nptr->pointer, (char **) &nodebuf)) < 0) {
+        if ((nodebuflen = pread_node(rq->file, nptr->pointer, (char **) &nodebuf, &cached)) < 0) {
             error_pass(COUCHSTORE_ERROR_READ);
         }
+        error_unless(parse_node(nodebuf, nodebuflen, &node), COUCHSTORE_ERROR_CORRUPT);
     }
 
     local_result = make_modres(dst->arena, rq);
     error_unless(local_result, COUCHSTORE_ERROR_ALLOC_FAIL);
 
-    if (nptr == NULL || nodebuf[0] == 1) { //KV Node
+    // Every entry is copied into the rewritten node, so the slot directory isn't needed here.
+    if (node.type == KV_NODE) {
         local_result->node_type = KV_NODE;
-        while (bufpos < nodebuflen) {
+        while (bufpos < node.end) {
             sized_buf cmp_key, val_buf;
             bufpos += read_kv(nodebuf + bufpos, &cmp_key, &val_buf);
             int advance = 0;
@@ -407,13 +428,13 @@ static couchstore_error_t modify_node(couchfile_modify_request *rq,
             }
             start++;
         }
-    } else if (nodebuf[0] == 0) { //KP Node
+    } else {
         local_result->node_type = KP_NODE;
-        while (bufpos < nodebuflen && start < end) {
+        while (bufpos < node.end && start < end) {
             sized_buf cmp_key, val_buf;
             bufpos += read_kv(nodebuf + bufpos, &cmp_key, &val_buf);
             int cmp_val = rq->cmp.compare(&cmp_key, rq->actions[start].key);
-            if (bufpos == nodebuflen) {
+            if (bufpos == node.end) {
                 //We're at the last item in the kpnode, must apply all our
                 //actions here.
                 node_pointer *desc = read_pointer(dst->arena, &cmp_key, val_buf.buf);
@@ -465,7 +486,7 @@ static couchstore_error_t modify_node(couchfile_modify_request *rq,
                 }
             }
         }
-        while (bufpos < nodebuflen) {
+        while (bufpos < node.end) {
             sized_buf cmp_key, val_buf;
             bufpos += read_kv(nodebuf + bufpos, &cmp_key, &val_buf);
             node_pointer *add = read_pointer(dst->arena, &cmp_key, val_buf.buf);
@@ -479,9 +500,6 @@ static couchstore_error_t modify_node(couchfile_modify_request *rq,
                 goto cleanup;
             }
         }
-    } else {
-        errcode = COUCHSTORE_ERROR_CORRUPT;
-        goto cleanup;
     }
     //If we've done modifications, write out the last leaf node.
     error_pass(flush_mr(local_result));
@@ -495,7 +513,7 @@ static couchstore_error_t modify_node(couchfile_modify_request *rq,
     }
 cleanup:
     if (nodebuf) {
-        free(nodebuf);
+        release_node(nodebuf, cached);
     }
 
     return errcode;
@@ -1,31 +1,121 @@
 /* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
 #include "config.h"
 #include <stdlib.h>
+#include <string.h>
 #include "couch_btree.h"
 #include "util.h"
 #include "node_types.h"
+#include "node_cache.h"
+
+#define MAX_PREFETCH 64     // Max child nodes of one KP node to read at once
+
+// A node that's already been read, as by pread_node.
+typedef struct {
+    char *buf;
+    node_cache_entry *entry;
+    int len;                // Negative if not read
+} loaded_node;
+
+/* For a multi-key lookup, finds the children of a KP node that will be descended into, and
+   reads them all at once so the reads can be serviced in parallel. Returns the number of
+   children found; the positions and any successfully read nodes are stored in the arrays. */
+static int prefetch_children(couchfile_lookup_request *rq,
+                             const node_layout *node,
+                             int current,
+                             int end,
+                             cs_off_t *positions,
+                             loaded_node *children)
+{
+    char *bufs[MAX_PREFETCH];
+    node_cache_entry *entries[MAX_PREFETCH];
+    int lens[MAX_PREFETCH];
+    int count = 0, i;
+    size_t bufpos = 1;
+    uint32_t slot = 0;
+
+    // This mirrors the KP node loop in btree_lookup_inner, for the non-fold case:
+    while (bufpos < node->end && current < end && count < MAX_PREFETCH) {
+        sized_buf cmp_key, val_buf;
+        if (node->slots) {
+            slot = node_lower_bound(node, slot, rq->keys[current], rq->cmp.compare);
+            if (slot == node->count) {
+                break;
+            }
+            bufpos = node_entry_offset(node, slot++);
+        }
+        bufpos += read_kv(node->buf + bufpos, &cmp_key, &val_buf);
+        if (rq->cmp.compare(&cmp_key, rq->keys[current]) >= 0) {
+            do {
+                current++;
+            } while (current < end && rq->cmp.compare(&cmp_key, rq->keys[current]) >= 0);
+            const raw_node_pointer *raw = (const raw_node_pointer*)val_buf.buf;
+            positions[count++] = decode_raw48(raw->pointer);
+        }
+    }
+    if (count < 2) {
+        return 0;
+    }
+
+    pread_nodes(rq->file, count, positions, bufs, entries, lens);
+    for (i = 0; i < count; ++i) {
+        children[i].buf = bufs[i];
+        children[i].entry = entries[i];
+        children[i].len = lens[i];
+    }
+    return count;
+}
 
 static couchstore_error_t btree_lookup_inner(couchfile_lookup_request *rq,
                                              uint64_t diskpos,
                                              int current,
-                                             int end)
+                                             int end,
+                                             loaded_node *preloaded)
 {
-    int bufpos = 1, nodebuflen = 0;
+    int nodebuflen = 0;
+    size_t bufpos = 1;
+    uint32_t slot = 0;
+    node_layout node;
+    cs_off_t child_positions[MAX_PREFETCH];
+    loaded_node children[MAX_PREFETCH];
+    int nchildren = 0, next_child = 0;
 
-    if (current == end) {
-        return 0;
-    }
     couchstore_error_t errcode = COUCHSTORE_SUCCESS;
 
     char *nodebuf = NULL;
+    node_cache_entry *cached = NULL;
 
-    nodebuflen = pread_compressed(rq->file, diskpos, &nodebuf);
-    error_unless(nodebuflen >= 0, nodebuflen);  // if negative, it's an error code
+    if (preloaded) {
+        nodebuf = preloaded->buf;
+        cached = preloaded->entry;
+        nodebuflen = preloaded->len;
+    }
+    if (current == end) {
+        goto cleanup;
+    }
+    if (!preloaded) {
+        nodebuflen = pread_node(rq->file, diskpos, &nodebuf, &cached);
+        error_unless(nodebuflen >= 0, nodebuflen);  // if negative, it's an error code
+    }
+    error_unless(parse_node(nodebuf, nodebuflen, &node), COUCHSTORE_ERROR_CORRUPT);
+
+    if (node.type == KP_NODE && !rq->fold && end - current > 1 &&
+            tree_file_can_batch_read(rq->file)) {
+        nchildren = prefetch_children(rq, &node, current, end, child_positions, children);
+    }
 
-    if (nodebuf[0] == 0) { //KP Node
-        while (bufpos < nodebuflen && current < end) {
+    if (node.type == KP_NODE) {
+        while (bufpos < node.end && current < end) {
             sized_buf cmp_key, val_buf;
+            if (node.slots && !rq->in_fold) {
+                // Skip the entries whose keys are less than the current key:
+                slot = node_lower_bound(&node, slot, rq->keys[current], rq->cmp.compare);
+                if (slot == node.count) {
+                    break;
+                }
+                bufpos = node_entry_offset(&node, slot);
+            }
             bufpos += read_kv(nodebuf + bufpos, &cmp_key, &val_buf);
+            slot++;
 
             if (rq->cmp.compare(&cmp_key, rq->keys[current]) >= 0) {
                 if (rq->fold) {
@@ -49,7 +139,21 @@ static couchstore_error_t btree_lookup_inner(couchfile_lookup_request *rq,
                 }
 
                 pointer = decode_raw48(raw->pointer);
-                error_pass(btree_lookup_inner(rq, pointer, current, last_item));
+                loaded_node *child = NULL;
+                if (next_child < nchildren && child_positions[next_child] == (cs_off_t)pointer) {
+                    if (children[next_child].len >= 0) {
+                        child = &children[next_child];
+                    }
+                    ++next_child;
+                }
+                if (child) {
+                    // The recursive call takes over the prefetched node and releases it:
+                    loaded_node prefetched = *child;
+                    child->len = -1;
+                    error_pass(btree_lookup_inner(rq, pointer, current, last_item, &prefetched));
+                } else {
+                    error_pass(btree_lookup_inner(rq, pointer, current, last_item, NULL));
+                }
                 if (!rq->in_fold) {
                     current = last_item;
                 }
@@ -58,10 +162,18 @@ static couchstore_error_t btree_lookup_inner(couchfile_lookup_request *rq,
                 }
             }
         }
-    } else if (nodebuf[0] == 1) { //KV Node
-        while (bufpos < nodebuflen && current < end) {
+    } else {
+        while (bufpos < node.end && current < end) {
             sized_buf cmp_key, val_buf;
+            if (node.slots && !rq->in_fold) {
+                slot = node_lower_bound(&node, slot, rq->keys[current], rq->cmp.compare);
+                if (slot == node.count) {
+                    break;
+                }
+                bufpos = node_entry_offset(&node, slot);
+            }
             bufpos += read_kv(nodebuf + bufpos, &cmp_key, &val_buf);
+            slot++;
             int cmp_val = rq->cmp.compare(&cmp_key, rq->keys[current]);
             if (cmp_val >= 0 && rq->fold && !rq->in_fold) {
                 rq->in_fold = 1;
@@ -90,7 +202,13 @@ static couchstore_error_t btree_lookup_inner(couchfile_lookup_request *rq,
     }
 
 cleanup:
-    free(nodebuf);
+    release_node(nodebuf, cached);
+    // Release any prefetched children that weren't used:
+    for (; next_child < nchildren; ++next_child) {
+        if (children[next_child].len >= 0) {
+            release_node(children[next_child].buf, children[next_child].entry);
+        }
+    }
 
     return errcode;
 }
@@ -99,6 +217,302 @@ couchstore_error_t btree_lookup(couchfile_lookup_request *rq,
                                 uint64_t root_pointer)
 {
     rq->in_fold = 0;
-    return btree_lookup_inner(rq, root_pointer, 0, rq->num_keys);
+    return btree_lookup_inner(rq, root_pointer, 0, rq->num_keys, NULL);
 }
 
+
+// Finds the offsets of the entries of a node without a slot directory, to walk it backwards.
+static couchstore_error_t find_entry_offsets(const node_layout *node, size_t **offsets,
+                                             uint32_t *count)
+{
+    size_t bufpos = 1;
+    uint32_t n = 0;
+    while (bufpos < node->end) {
+        sized_buf key, value;
+        bufpos += read_kv(node->buf + bufpos, &key, &value);
+        n++;
+    }
+    *count = n;
+    *offsets = malloc((n ? n : 1) * sizeof(size_t));
+    if (!*offsets) {
+        return COUCHSTORE_ERROR_ALLOC_FAIL;
+    }
+    for (bufpos = 1, n = 0; bufpos < node->end; n++) {
+        sized_buf key, value;
+        (*offsets)[n] = bufpos;
+        bufpos += read_kv(node->buf + bufpos, &key, &value);
+    }
+    return COUCHSTORE_SUCCESS;
+}
+
+static couchstore_error_t btree_lookup_reverse_inner(couchfile_lookup_request *rq,
+                                                     uint64_t diskpos)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    const sized_buf *start = rq->keys[0];
+    const sized_buf *stop = rq->num_keys > 1 ? rq->keys[1] : NULL;
+    char *nodebuf = NULL;
+    node_cache_entry *cached = NULL;
+    size_t *offsets = NULL;
+    node_layout node;
+    uint32_t count, i;
+
+    int nodebuflen = pread_node(rq->file, diskpos, &nodebuf, &cached);
+    error_unless(nodebuflen >= 0, nodebuflen);  // if negative, it's an error code
+    error_unless(parse_node(nodebuf, nodebuflen, &node), COUCHSTORE_ERROR_CORRUPT);
+    if (node.slots) {
+        count = node.count;
+    } else {
+        error_pass(find_entry_offsets(&node, &offsets, &count));
+    }
+
+    for (i = count; i > 0 && rq->in_fold; --i) {
+        sized_buf cmp_key, val_buf;
+        read_kv(nodebuf + (offsets ? offsets[i - 1] : node_entry_offset(&node, i - 1)),
+                &cmp_key, &val_buf);
+        if (stop && rq->cmp.compare(&cmp_key, stop) < 0) {
+            // Everything from here on is before the end of the range:
+            rq->in_fold = 0;
+            break;
+        }
+        if (node.type == KP_NODE) {
+            // The child holds the keys after the previous entry's, up to this entry's:
+            if (start && i > 1) {
+                sized_buf prev_key, prev_val;
+                read_kv(nodebuf + (offsets ? offsets[i - 2] : node_entry_offset(&node, i - 2)),
+                        &prev_key, &prev_val);
+                if (rq->cmp.compare(&prev_key, start) >= 0) {
+                    continue;
+                }
+            }
+            const raw_node_pointer *raw = (const raw_node_pointer*)val_buf.buf;
+            error_pass(btree_lookup_reverse_inner(rq, decode_raw48(raw->pointer)));
+        } else if (!start || rq->cmp.compare(&cmp_key, start) <= 0) {
+            error_pass(rq->fetch_callback(rq, &cmp_key, &val_buf));
+        }
+    }
+
+cleanup:
+    free(offsets);
+    release_node(nodebuf, cached);
+    return errcode;
+}
+
+couchstore_error_t btree_lookup_reverse(couchfile_lookup_request *rq,
+                                        uint64_t root_pointer)
+{
+    rq->in_fold = 1;
+    return btree_lookup_reverse_inner(rq, root_pointer);
+}
+
+// Returns nonzero if a key is before the start of a reduce request's range
+static int before_range(const couchfile_reduce_request *rq, const sized_buf *key)
+{
+    return rq->start && rq->cmp.compare(key, rq->start) < 0;
+}
+
+// Returns nonzero if a key isn't past the end of a reduce request's range
+static int within_end(const couchfile_reduce_request *rq, const sized_buf *key)
+{
+    if (!rq->end) {
+        return 1;
+    }
+    int cmp = rq->cmp.compare(key, rq->end);
+    return cmp < 0 || (cmp == 0 && !rq->exclusive_end);
+}
+
+/* 'after_start' and 'before_end' say whether all of the node's keys are known to be at or
+   after the start of the range, or within its end. */
+static couchstore_error_t btree_reduce_range_inner(couchfile_reduce_request *rq,
+                                                   uint64_t diskpos,
+                                                   int after_start,
+                                                   int before_end)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    char *nodebuf = NULL;
+    node_cache_entry *cached = NULL;
+    node_layout node;
+    sized_buf prev_key = {NULL, 0};
+    size_t bufpos = 1;
+
+    int nodebuflen = pread_node(rq->file, diskpos, &nodebuf, &cached);
+    error_unless(nodebuflen >= 0, nodebuflen);  // if negative, it's an error code
+    error_unless(parse_node(nodebuf, nodebuflen, &node), COUCHSTORE_ERROR_CORRUPT);
+
+    while (bufpos < node.end) {
+        sized_buf cmp_key, val_buf;
+        bufpos += read_kv(nodebuf + bufpos, &cmp_key, &val_buf);
+        if (node.type == KP_NODE) {
+            // The child holds the keys after the previous entry's, up to this entry's:
+            if (!after_start && before_range(rq, &cmp_key)) {
+                prev_key = cmp_key;
+                continue;
+            }
+            int child_after_start = after_start ||
+                                    (prev_key.buf && !before_range(rq, &prev_key));
+            int child_before_end = before_end || within_end(rq, &cmp_key);
+            const raw_node_pointer *raw = (const raw_node_pointer*)val_buf.buf;
+            if (child_after_start && child_before_end) {
+                sized_buf reduce_value =
+                    {val_buf.buf + sizeof(raw_node_pointer), decode_raw16(raw->reduce_value_size)};
+                error_pass(rq->reduce_callback(rq, &reduce_value));
+            } else {
+                error_pass(btree_reduce_range_inner(rq, decode_raw48(raw->pointer),
+                                                    child_after_start, child_before_end));
+            }
+            if (!child_before_end) {
+                break;  // The following children are all past the end
+            }
+            prev_key = cmp_key;
+        } else {
+            if (!after_start && before_range(rq, &cmp_key)) {
+                continue;
+            }
+            if (!before_end && !within_end(rq, &cmp_key)) {
+                break;
+            }
+            error_pass(rq->value_callback(rq, &cmp_key, &val_buf));
+        }
+    }
+
+cleanup:
+    release_node(nodebuf, cached);
+    return errcode;
+}
+
+couchstore_error_t btree_reduce_range(couchfile_reduce_request *rq,
+                                      const node_pointer *root)
+{
+    if (!rq->start && !rq->end) {
+        return rq->reduce_callback(rq, &root->reduce_value);
+    }
+    return btree_reduce_range_inner(rq, root->pointer, !rq->start, !rq->end);
+}
+
+static couchstore_error_t btree_seek_nth_inner(couchfile_reduce_request *rq,
+                                               uint64_t diskpos,
+                                               uint64_t n)
+{
+    couchstore_error_t errcode = COUCHSTORE_ERROR_CORRUPT;  // If the counts don't add up
+    char *nodebuf = NULL;
+    node_cache_entry *cached = NULL;
+    node_layout node;
+    size_t bufpos = 1;
+
+    int nodebuflen = pread_node(rq->file, diskpos, &nodebuf, &cached);
+    error_unless(nodebuflen >= 0, nodebuflen);  // if negative, it's an error code
+    error_unless(parse_node(nodebuf, nodebuflen, &node), COUCHSTORE_ERROR_CORRUPT);
+
+    while (bufpos < node.end) {
+        sized_buf cmp_key, val_buf;
+        bufpos += read_kv(nodebuf + bufpos, &cmp_key, &val_buf);
+        if (node.type == KP_NODE) {
+            const raw_node_pointer *raw = (const raw_node_pointer*)val_buf.buf;
+            sized_buf reduce_value =
+                {val_buf.buf + sizeof(raw_node_pointer), decode_raw16(raw->reduce_value_size)};
+            uint64_t count = rq->count_reduce(rq, &reduce_value);
+            if (n < count) {
+                errcode = btree_seek_nth_inner(rq, decode_raw48(raw->pointer), n);
+                break;
+            }
+            n -= count;
+        } else if (rq->count_value(rq, &cmp_key, &val_buf)) {
+            if (n == 0) {
+                errcode = rq->value_callback(rq, &cmp_key, &val_buf);
+                break;
+            }
+            n--;
+        }
+    }
+
+cleanup:
+    release_node(nodebuf, cached);
+    return errcode;
+}
+
+couchstore_error_t btree_seek_nth(couchfile_reduce_request *rq,
+                                  const node_pointer *root,
+                                  uint64_t n)
+{
+    if (n >= rq->count_reduce(rq, &root->reduce_value)) {
+        return COUCHSTORE_ERROR_DOC_NOT_FOUND;
+    }
+    return btree_seek_nth_inner(rq, root->pointer, n);
+}
+
+couchstore_error_t btree_partition(couchfile_reduce_request *rq,
+                                   const node_pointer *root,
+                                   size_t target,
+                                   btree_subtree **result,
+                                   size_t *result_count)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    size_t count = 1, capacity = 16, i;
+    btree_subtree *subtrees = malloc(capacity * sizeof(btree_subtree));
+    char *nodebuf = NULL;
+    node_cache_entry *cached = NULL;
+    error_unless(subtrees, COUCHSTORE_ERROR_ALLOC_FAIL);
+    subtrees[0].pointer = root->pointer;
+    subtrees[0].weight = rq->count_reduce(rq, &root->reduce_value);
+    subtrees[0].leaf = 0;
+
+    while (count < target) {
+        // Split the heaviest subtree that may not be a leaf:
+        size_t best = count;
+        for (i = 0; i < count; ++i) {
+            if (!subtrees[i].leaf && (best == count || subtrees[i].weight > subtrees[best].weight)) {
+                best = i;
+            }
+        }
+        if (best == count) {
+            break;
+        }
+
+        node_layout node;
+        size_t bufpos = 1, nchildren = 0;
+        int nodebuflen = pread_node(rq->file, subtrees[best].pointer, &nodebuf, &cached);
+        error_unless(nodebuflen >= 0, nodebuflen);  // if negative, it's an error code
+        error_unless(parse_node(nodebuf, nodebuflen, &node), COUCHSTORE_ERROR_CORRUPT);
+        if (node.type != KP_NODE) {
+            subtrees[best].leaf = 1;
+        } else {
+            while (bufpos < node.end) {
+                sized_buf cmp_key, val_buf;
+                bufpos += read_kv(nodebuf + bufpos, &cmp_key, &val_buf);
+                nchildren++;
+            }
+            if (count - 1 + nchildren > capacity) {
+                capacity = 2 * (count - 1 + nchildren);
+                btree_subtree *grown = realloc(subtrees, capacity * sizeof(btree_subtree));
+                error_unless(grown, COUCHSTORE_ERROR_ALLOC_FAIL);
+                subtrees = grown;
+            }
+            // The children take the subtree's place, in order:
+            memmove(&subtrees[best + nchildren], &subtrees[best + 1],
+                    (count - best - 1) * sizeof(btree_subtree));
+            count += nchildren - 1;
+            for (bufpos = 1, i = best; bufpos < node.end; ++i) {
+                sized_buf cmp_key, val_buf;
+                bufpos += read_kv(nodebuf + bufpos, &cmp_key, &val_buf);
+                const raw_node_pointer *raw = (const raw_node_pointer*)val_buf.buf;
+                sized_buf reduce_value =
+                    {val_buf.buf + sizeof(raw_node_pointer), decode_raw16(raw->reduce_value_size)};
+                subtrees[i].pointer = decode_raw48(raw->pointer);
+                subtrees[i].weight = rq->count_reduce(rq, &reduce_value);
+                subtrees[i].leaf = 0;
+            }
+        }
+        release_node(nodebuf, cached);
+        nodebuf = NULL;
+        cached = NULL;
+    }
+
+    *result = subtrees;
+    *result_count = count;
+    subtrees = NULL;
+
+cleanup:
+    release_node(nodebuf, cached);
+    free(subtrees);
+    return errcode;
+}
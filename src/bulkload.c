@@ -0,0 +1,127 @@
+#include "config.h"
+#include <libcouchstore/couch_db.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Builds a database from lines of the form "<id><TAB><body>", using the bulk loader. */
+
+static void exit_error(couchstore_error_t errcode)
+{
+    fprintf(stderr, "Couchstore error: %s\n", couchstore_strerror(errcode));
+    exit(-1);
+}
+
+static void usage(const char* prog) {
+    fprintf(stderr, "Usage: %s [--compress] <input file, or - for stdin> <output file>\n", prog);
+    fprintf(stderr, "Each input line is a document ID, a tab, and the document body.\n");
+    exit(-1);
+}
+
+// Reads a line into a growing buffer, without the newline. Returns its length, or -1 at EOF.
+static long read_line(FILE *in, char **buf, size_t *bufsize)
+{
+    size_t len = 0;
+    if (*buf == NULL) {
+        *bufsize = 4096;
+        *buf = malloc(*bufsize);
+        if (*buf == NULL) {
+            exit_error(COUCHSTORE_ERROR_ALLOC_FAIL);
+        }
+    }
+    while (fgets(*buf + len, (int)(*bufsize - len), in)) {
+        len += strlen(*buf + len);
+        if (len > 0 && (*buf)[len - 1] == '\n') {
+            (*buf)[--len] = '\0';
+            return (long)len;
+        }
+        if (len + 1 == *bufsize) {
+            *bufsize *= 2;
+            *buf = realloc(*buf, *bufsize);
+            if (*buf == NULL) {
+                exit_error(COUCHSTORE_ERROR_ALLOC_FAIL);
+            }
+        }
+    }
+    return len > 0 ? (long)len : -1;
+}
+
+int main(int argc, char** argv)
+{
+    couchstore_error_t errcode;
+    BulkLoader *loader;
+    couchstore_save_options options = 0;
+    FILE *in;
+    char *line = NULL;
+    size_t linesize = 0;
+    long len;
+    unsigned long count = 0, lineno = 0;
+    int argp = 1;
+
+    while (argp < argc && argv[argp][0] == '-' && argv[argp][1] == '-') {
+        if (!strcmp(argv[argp], "--compress")) {
+            options |= COMPRESS_DOC_BODIES;
+        } else {
+            usage(argv[0]);
+        }
+        argp++;
+    }
+    if (argc - argp != 2) {
+        usage(argv[0]);
+    }
+
+    if (!strcmp(argv[argp], "-")) {
+        in = stdin;
+    } else {
+        in = fopen(argv[argp], "r");
+        if (in == NULL) {
+            perror(argv[argp]);
+            exit(-1);
+        }
+    }
+
+    errcode = couchstore_bulk_load_open(argv[argp + 1], NULL, &loader);
+    if (errcode) {
+        exit_error(errcode);
+    }
+    while ((len = read_line(in, &line, &linesize)) >= 0) {
+        Doc doc;
+        DocInfo info;
+        char *tab = memchr(line, '\t', len);
+        lineno++;
+        if (tab == NULL || tab == line) {
+            fprintf(stderr, "Line %lu: expected an ID, a tab and a body\n", lineno);
+            couchstore_bulk_load_abort(loader);
+            exit(-1);
+        }
+        memset(&doc, 0, sizeof(doc));
+        memset(&info, 0, sizeof(info));
+        doc.id.buf = line;
+        doc.id.size = tab - line;
+        doc.data.buf = tab + 1;
+        doc.data.size = len - (doc.id.size + 1);
+        info.id = doc.id;
+        info.rev_seq = 1;
+        info.content_meta = COUCH_DOC_NON_JSON_MODE;
+        if (options & COMPRESS_DOC_BODIES) {
+            info.content_meta |= COUCH_DOC_IS_COMPRESSED;
+        }
+        errcode = couchstore_bulk_load_add(loader, &doc, &info, options);
+        if (errcode) {
+            couchstore_bulk_load_abort(loader);
+            exit_error(errcode);
+        }
+        count++;
+    }
+    errcode = couchstore_bulk_load_finish(loader);
+    if (errcode) {
+        exit_error(errcode);
+    }
+    free(line);
+    if (in != stdin) {
+        fclose(in);
+    }
+
+    printf("Loaded %lu documents into %s\n", count, argv[argp + 1]);
+    return 0;
+}
@@ -0,0 +1,418 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#include "config.h"
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <snappy-c.h>
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#include <zdict.h>
+#endif
+
+#include "codec.h"
+
+#define LZ4_LENGTH_SIZE 4       // Size of the uncompressed length before an LZ4 block
+#define ZSTD_LEVEL 3
+
+struct codec_dict {
+    sized_buf data;
+#ifdef HAVE_ZSTD
+    ZSTD_CDict *cdict;
+    ZSTD_DDict *ddict;
+#endif
+};
+
+#ifdef HAVE_ZSTD
+// zstd contexts are expensive to set up, so each thread keeps a pair around.
+typedef struct {
+    ZSTD_CCtx *cctx;
+    ZSTD_DCtx *dctx;
+} zstd_contexts;
+
+static pthread_once_t zstd_contexts_once = PTHREAD_ONCE_INIT;
+static pthread_key_t zstd_contexts_key;
+
+static void free_zstd_contexts(void *ptr)
+{
+    zstd_contexts *contexts = ptr;
+    ZSTD_freeCCtx(contexts->cctx);
+    ZSTD_freeDCtx(contexts->dctx);
+    free(contexts);
+}
+
+static void init_zstd_contexts_key(void)
+{
+    pthread_key_create(&zstd_contexts_key, free_zstd_contexts);
+}
+
+// Returns the calling thread's zstd contexts, creating them if necessary.
+static zstd_contexts *get_zstd_contexts(void)
+{
+    pthread_once(&zstd_contexts_once, init_zstd_contexts_key);
+    zstd_contexts *contexts = pthread_getspecific(zstd_contexts_key);
+    if (contexts == NULL) {
+        contexts = calloc(1, sizeof(zstd_contexts));
+        if (contexts == NULL) {
+            return NULL;
+        }
+        contexts->cctx = ZSTD_createCCtx();
+        contexts->dctx = ZSTD_createDCtx();
+        if (contexts->cctx == NULL || contexts->dctx == NULL ||
+                pthread_setspecific(zstd_contexts_key, contexts) != 0) {
+            free_zstd_contexts(contexts);
+            return NULL;
+        }
+    }
+    return contexts;
+}
+#endif
+
+couchstore_codec_t codec_from_flags(uint64_t flags, int shift)
+{
+    return (couchstore_codec_t)((flags >> shift) & 0xF);
+}
+
+int codec_supported(couchstore_codec_t codec)
+{
+    switch (codec) {
+    case COUCHSTORE_CODEC_DEFAULT:
+    case COUCHSTORE_CODEC_SNAPPY:
+        return 1;
+#ifdef HAVE_LZ4
+    case COUCHSTORE_CODEC_LZ4:
+        return 1;
+#endif
+#ifdef HAVE_ZSTD
+    case COUCHSTORE_CODEC_ZSTD:
+    case COUCHSTORE_CODEC_ZSTD_DICT:
+        return 1;
+#endif
+    default:
+        return 0;
+    }
+}
+
+size_t codec_max_compressed_length(couchstore_codec_t codec, int tagged, size_t len)
+{
+    size_t tag_size = tagged ? 1 : 0;
+    switch (codec) {
+#ifdef HAVE_LZ4
+    case COUCHSTORE_CODEC_LZ4:
+        return tag_size + LZ4_LENGTH_SIZE + LZ4_compressBound((int)len);
+#endif
+#ifdef HAVE_ZSTD
+    case COUCHSTORE_CODEC_ZSTD:
+    case COUCHSTORE_CODEC_ZSTD_DICT:
+        return tag_size + ZSTD_compressBound(len);
+#endif
+    default:
+        return tag_size + snappy_max_compressed_length(len);
+    }
+}
+
+couchstore_error_t codec_compress(couchstore_codec_t codec, int tagged,
+                                  const codec_dict *dict, const char *in, size_t len,
+                                  char *out, size_t *out_len)
+{
+    size_t capacity = *out_len;
+    size_t tag_size = tagged ? 1 : 0;
+    if (codec == COUCHSTORE_CODEC_DEFAULT) {
+        codec = COUCHSTORE_CODEC_SNAPPY;
+    }
+    if (!codec_supported(codec)) {
+        return COUCHSTORE_ERROR_UNSUPPORTED_CODEC;
+    }
+    if ((!tagged && codec != COUCHSTORE_CODEC_SNAPPY) ||
+            (codec == COUCHSTORE_CODEC_ZSTD_DICT && dict == NULL)) {
+        return COUCHSTORE_ERROR_INVALID_ARGUMENTS;
+    }
+    if (tagged) {
+        *out++ = (char)codec;
+        capacity--;
+    }
+
+    switch (codec) {
+#ifdef HAVE_LZ4
+    case COUCHSTORE_CODEC_LZ4: {
+        if (len > LZ4_MAX_INPUT_SIZE) {
+            return COUCHSTORE_ERROR_INVALID_ARGUMENTS;
+        }
+        uint32_t raw_len = htonl((uint32_t)len);
+        memcpy(out, &raw_len, LZ4_LENGTH_SIZE);
+        int compressed = LZ4_compress_default(in, out + LZ4_LENGTH_SIZE, (int)len,
+                                              (int)(capacity - LZ4_LENGTH_SIZE));
+        if (compressed <= 0) {
+            return COUCHSTORE_ERROR_WRITE;
+        }
+        *out_len = tag_size + LZ4_LENGTH_SIZE + compressed;
+        return COUCHSTORE_SUCCESS;
+    }
+#endif
+#ifdef HAVE_ZSTD
+    case COUCHSTORE_CODEC_ZSTD: {
+        zstd_contexts *contexts = get_zstd_contexts();
+        if (contexts == NULL) {
+            return COUCHSTORE_ERROR_ALLOC_FAIL;
+        }
+        size_t compressed = ZSTD_compressCCtx(contexts->cctx, out, capacity, in, len,
+                                              ZSTD_LEVEL);
+        if (ZSTD_isError(compressed)) {
+            return COUCHSTORE_ERROR_WRITE;
+        }
+        *out_len = tag_size + compressed;
+        return COUCHSTORE_SUCCESS;
+    }
+    case COUCHSTORE_CODEC_ZSTD_DICT: {
+        zstd_contexts *contexts = get_zstd_contexts();
+        if (contexts == NULL) {
+            return COUCHSTORE_ERROR_ALLOC_FAIL;
+        }
+        // Small bodies are what dictionaries are for, so leave out the 4-byte dictionary ID:
+        size_t compressed = ZSTD_CCtx_refCDict(contexts->cctx, dict->cdict);
+        if (!ZSTD_isError(compressed)) {
+            compressed = ZSTD_CCtx_setParameter(contexts->cctx, ZSTD_c_dictIDFlag, 0);
+        }
+        if (!ZSTD_isError(compressed)) {
+            compressed = ZSTD_compress2(contexts->cctx, out, capacity, in, len);
+        }
+        ZSTD_CCtx_reset(contexts->cctx, ZSTD_reset_session_and_parameters);
+        if (ZSTD_isError(compressed)) {
+            return COUCHSTORE_ERROR_WRITE;
+        }
+        *out_len = tag_size + compressed;
+        return COUCHSTORE_SUCCESS;
+    }
+#endif
+    default:
+        if (snappy_compress(in, len, out, &capacity) != SNAPPY_OK) {
+            return COUCHSTORE_ERROR_WRITE;
+        }
+        *out_len = tag_size + capacity;
+        return COUCHSTORE_SUCCESS;
+    }
+}
+
+couchstore_codec_t codec_of(int tagged, const char *in, size_t len)
+{
+    if (!tagged) {
+        return COUCHSTORE_CODEC_SNAPPY;
+    }
+    if (len == 0 || in[0] < COUCHSTORE_CODEC_SNAPPY || in[0] > COUCHSTORE_CODEC_ZSTD_DICT) {
+        return COUCHSTORE_CODEC_DEFAULT;
+    }
+    return (couchstore_codec_t)in[0];
+}
+
+couchstore_error_t codec_uncompressed_length(int tagged, const char *in, size_t len,
+                                             size_t *result)
+{
+    couchstore_codec_t codec = codec_of(tagged, in, len);
+    if (codec == COUCHSTORE_CODEC_DEFAULT) {
+        return COUCHSTORE_ERROR_CORRUPT;
+    }
+    if (!codec_supported(codec)) {
+        return COUCHSTORE_ERROR_UNSUPPORTED_CODEC;
+    }
+    if (tagged) {
+        in++;
+        len--;
+    }
+
+    switch (codec) {
+#ifdef HAVE_LZ4
+    case COUCHSTORE_CODEC_LZ4: {
+        uint32_t raw_len;
+        if (len < LZ4_LENGTH_SIZE) {
+            return COUCHSTORE_ERROR_CORRUPT;
+        }
+        memcpy(&raw_len, in, LZ4_LENGTH_SIZE);
+        *result = ntohl(raw_len);
+        return COUCHSTORE_SUCCESS;
+    }
+#endif
+#ifdef HAVE_ZSTD
+    case COUCHSTORE_CODEC_ZSTD:
+    case COUCHSTORE_CODEC_ZSTD_DICT: {
+        unsigned long long content_size = ZSTD_getFrameContentSize(in, len);
+        if (content_size == ZSTD_CONTENTSIZE_UNKNOWN ||
+                content_size == ZSTD_CONTENTSIZE_ERROR) {
+            return COUCHSTORE_ERROR_CORRUPT;
+        }
+        *result = (size_t)content_size;
+        return COUCHSTORE_SUCCESS;
+    }
+#endif
+    default:
+        if (snappy_uncompressed_length(in, len, result) != SNAPPY_OK) {
+            return COUCHSTORE_ERROR_CORRUPT;
+        }
+        return COUCHSTORE_SUCCESS;
+    }
+}
+
+couchstore_error_t codec_decompress(int tagged, const codec_dict *dict,
+                                    const char *in, size_t len,
+                                    char *out, size_t *out_len)
+{
+    couchstore_codec_t codec = codec_of(tagged, in, len);
+    if (codec == COUCHSTORE_CODEC_DEFAULT) {
+        return COUCHSTORE_ERROR_CORRUPT;
+    }
+    if (!codec_supported(codec)) {
+        return COUCHSTORE_ERROR_UNSUPPORTED_CODEC;
+    }
+    if (tagged) {
+        in++;
+        len--;
+    }
+
+    switch (codec) {
+#ifdef HAVE_LZ4
+    case COUCHSTORE_CODEC_LZ4: {
+        uint32_t raw_len;
+        if (len < LZ4_LENGTH_SIZE) {
+            return COUCHSTORE_ERROR_CORRUPT;
+        }
+        memcpy(&raw_len, in, LZ4_LENGTH_SIZE);
+        size_t expected = ntohl(raw_len);
+        if (expected > *out_len) {
+            return COUCHSTORE_ERROR_CORRUPT;
+        }
+        int decompressed = LZ4_decompress_safe(in + LZ4_LENGTH_SIZE, out,
+                                               (int)(len - LZ4_LENGTH_SIZE), (int)expected);
+        if (decompressed < 0 || (size_t)decompressed != expected) {
+            return COUCHSTORE_ERROR_CORRUPT;
+        }
+        *out_len = expected;
+        return COUCHSTORE_SUCCESS;
+    }
+#endif
+#ifdef HAVE_ZSTD
+    case COUCHSTORE_CODEC_ZSTD: {
+        zstd_contexts *contexts = get_zstd_contexts();
+        if (contexts == NULL) {
+            return COUCHSTORE_ERROR_ALLOC_FAIL;
+        }
+        size_t decompressed = ZSTD_decompressDCtx(contexts->dctx, out, *out_len, in, len);
+        if (ZSTD_isError(decompressed)) {
+            return COUCHSTORE_ERROR_CORRUPT;
+        }
+        *out_len = decompressed;
+        return COUCHSTORE_SUCCESS;
+    }
+    case COUCHSTORE_CODEC_ZSTD_DICT: {
+        if (dict == NULL) {
+            return COUCHSTORE_ERROR_CORRUPT;    // The file has no dictionary
+        }
+        zstd_contexts *contexts = get_zstd_contexts();
+        if (contexts == NULL) {
+            return COUCHSTORE_ERROR_ALLOC_FAIL;
+        }
+        size_t decompressed = ZSTD_decompress_usingDDict(contexts->dctx, out, *out_len,
+                                                         in, len, dict->ddict);
+        if (ZSTD_isError(decompressed)) {
+            return COUCHSTORE_ERROR_CORRUPT;
+        }
+        *out_len = decompressed;
+        return COUCHSTORE_SUCCESS;
+    }
+#endif
+    default:
+        if (snappy_uncompress(in, len, out, out_len) != SNAPPY_OK) {
+            return COUCHSTORE_ERROR_CORRUPT;
+        }
+        return COUCHSTORE_SUCCESS;
+    }
+}
+
+couchstore_codec_t codec_for_body(const tree_file *file, couchstore_codec_t codec)
+{
+    if (!file->codec_tags || codec == COUCHSTORE_CODEC_DEFAULT) {
+        return COUCHSTORE_CODEC_SNAPPY;
+    }
+    if (codec == COUCHSTORE_CODEC_ZSTD && file->dict != NULL) {
+        return COUCHSTORE_CODEC_ZSTD_DICT;
+    }
+    return codec;
+}
+
+couchstore_error_t codec_train_dict(const char *samples, const size_t *sample_sizes,
+                                    unsigned count, char *out, size_t *out_len)
+{
+#ifdef HAVE_ZSTD
+    size_t dict_len = ZDICT_trainFromBuffer(out, *out_len, samples, sample_sizes, count);
+    // Training fails if there isn't enough sample data to find anything worth keeping:
+    *out_len = ZDICT_isError(dict_len) ? 0 : dict_len;
+    return COUCHSTORE_SUCCESS;
+#else
+    (void)samples;
+    (void)sample_sizes;
+    (void)count;
+    (void)out;
+    (void)out_len;
+    return COUCHSTORE_ERROR_UNSUPPORTED_CODEC;
+#endif
+}
+
+couchstore_error_t codec_dict_create(const char *data, size_t len, codec_dict **result)
+{
+#ifdef HAVE_ZSTD
+    codec_dict *dict = calloc(1, sizeof(codec_dict));
+    if (dict == NULL) {
+        return COUCHSTORE_ERROR_ALLOC_FAIL;
+    }
+    dict->data.buf = malloc(len);
+    if (dict->data.buf == NULL) {
+        free(dict);
+        return COUCHSTORE_ERROR_ALLOC_FAIL;
+    }
+    memcpy(dict->data.buf, data, len);
+    dict->data.size = len;
+    if (ZDICT_getDictID(data, len) == 0) {
+        codec_dict_free(dict);
+        return COUCHSTORE_ERROR_CORRUPT;
+    }
+    dict->cdict = ZSTD_createCDict(data, len, ZSTD_LEVEL);
+    dict->ddict = ZSTD_createDDict(data, len);
+    if (dict->cdict == NULL || dict->ddict == NULL) {
+        codec_dict_free(dict);
+        return COUCHSTORE_ERROR_ALLOC_FAIL;
+    }
+    *result = dict;
+    return COUCHSTORE_SUCCESS;
+#else
+    (void)data;
+    (void)len;
+    (void)result;
+    return COUCHSTORE_ERROR_UNSUPPORTED_CODEC;
+#endif
+}
+
+void codec_dict_free(codec_dict *dict)
+{
+    if (dict == NULL) {
+        return;
+    }
+#ifdef HAVE_ZSTD
+    ZSTD_freeCDict(dict->cdict);
+    ZSTD_freeDDict(dict->ddict);
+#endif
+    free(dict->data.buf);
+    free(dict);
+}
+
+sized_buf codec_dict_data(const codec_dict *dict)
+{
+    return dict->data;
+}
+
+int codec_dict_equal(const codec_dict *a, const codec_dict *b)
+{
+    if (a == NULL || b == NULL) {
+        return a == b;
+    }
+    return a->data.size == b->data.size && memcmp(a->data.buf, b->data.buf, a->data.size) == 0;
+}
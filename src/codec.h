@@ -0,0 +1,102 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef LIBCOUCHSTORE_CODEC_H
+#define LIBCOUCHSTORE_CODEC_H 1
+
+#include "internal.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    /*
+     * Compression codecs for chunk data. In a file of disk version 12 or later, compressed data
+     * is "tagged": it starts with a byte holding its couchstore_codec_t, so each chunk can use a
+     * different codec. Older files hold untagged snappy data.
+     *
+     * After the tag, snappy and zstd data are in their native formats (both of which record
+     * the uncompressed length.) LZ4 data is a 4-byte big-endian uncompressed length followed by
+     * an LZ4 block. COUCHSTORE_CODEC_ZSTD_DICT data is a zstd frame compressed with the file's
+     * trained dictionary, without the dictionary ID zstd would normally record.
+     */
+
+    /** Bit positions of the codecs in open and compaction flags; see
+        COUCHSTORE_OPEN_FLAG_NODE_CODEC and COUCHSTORE_OPEN_FLAG_BODY_CODEC. */
+#define CODEC_FLAGS_NODE_SHIFT 32
+#define CODEC_FLAGS_BODY_SHIFT 36
+
+    /** Extracts a codec from open or compaction flags. */
+    couchstore_codec_t codec_from_flags(uint64_t flags, int shift);
+
+    /** Returns nonzero if this build of the library supports a codec. */
+    int codec_supported(couchstore_codec_t codec);
+
+    /** Returns the largest size codec_compress can produce for 'len' bytes of input. */
+    size_t codec_max_compressed_length(couchstore_codec_t codec, int tagged, size_t len);
+
+    /** Compresses data.
+        @param codec The codec to use; must be snappy if 'tagged' is zero
+        @param tagged If nonzero, the output starts with the codec's tag byte
+        @param dict The dictionary to use with COUCHSTORE_CODEC_ZSTD_DICT; otherwise ignored
+        @param out Buffer of at least codec_max_compressed_length bytes
+        @param out_len On success, set to the length of the compressed data
+        @return COUCHSTORE_SUCCESS, or COUCHSTORE_ERROR_UNSUPPORTED_CODEC, or another error */
+    couchstore_error_t codec_compress(couchstore_codec_t codec, int tagged,
+                                      const codec_dict *dict, const char *in, size_t len,
+                                      char *out, size_t *out_len);
+
+    /** Returns the codec compressed data was compressed with, or COUCHSTORE_CODEC_DEFAULT if
+        it's not valid tagged data. Untagged data is always snappy. */
+    couchstore_codec_t codec_of(int tagged, const char *in, size_t len);
+
+    /** Finds the length compressed data will have once decompressed.
+        @return COUCHSTORE_SUCCESS, COUCHSTORE_ERROR_CORRUPT if the data isn't valid, or
+                COUCHSTORE_ERROR_UNSUPPORTED_CODEC */
+    couchstore_error_t codec_uncompressed_length(int tagged, const char *in, size_t len,
+                                                 size_t *result);
+
+    /** Decompresses data.
+        @param dict The dictionary COUCHSTORE_CODEC_ZSTD_DICT data was compressed with, or NULL
+        @param out Buffer of the size found by codec_uncompressed_length
+        @param out_len On entry, the size of 'out'; on success, the decompressed length
+        @return COUCHSTORE_SUCCESS, COUCHSTORE_ERROR_CORRUPT if the data isn't valid, or
+                COUCHSTORE_ERROR_UNSUPPORTED_CODEC */
+    couchstore_error_t codec_decompress(int tagged, const codec_dict *dict,
+                                        const char *in, size_t len,
+                                        char *out, size_t *out_len);
+
+    /** Returns the codec doc bodies are compressed with in a file, given the db's body codec:
+        snappy if the file's data is untagged, or the file's dictionary in place of plain zstd. */
+    couchstore_codec_t codec_for_body(const tree_file *file, couchstore_codec_t codec);
+
+    /** Trains a zstd dictionary from sample doc bodies.
+        @param samples The samples, one after another
+        @param sample_sizes The length of each sample
+        @param out Buffer for the dictionary
+        @param out_len On entry, the size of 'out', which is the largest dictionary to make; on
+                success, the dictionary's length, which is 0 if the samples were too few or too
+                dissimilar to train one from
+        @return COUCHSTORE_SUCCESS, or COUCHSTORE_ERROR_UNSUPPORTED_CODEC without zstd */
+    couchstore_error_t codec_train_dict(const char *samples, const size_t *sample_sizes,
+                                        unsigned count, char *out, size_t *out_len);
+
+    /** Prepares a dictionary made by codec_train_dict for use. The result can be used by several
+        threads at once. It keeps its own copy of the data.
+        @return COUCHSTORE_SUCCESS, COUCHSTORE_ERROR_CORRUPT if the data isn't a valid
+                dictionary, or COUCHSTORE_ERROR_UNSUPPORTED_CODEC without zstd */
+    couchstore_error_t codec_dict_create(const char *data, size_t len, codec_dict **result);
+
+    /** Frees a dictionary made by codec_dict_create. NULL is allowed. */
+    void codec_dict_free(codec_dict *dict);
+
+    /** Returns a dictionary's data, as given to codec_dict_create. */
+    sized_buf codec_dict_data(const codec_dict *dict);
+
+    /** Returns nonzero if two dictionaries (either of which may be NULL) hold the same data, so
+        data compressed with one can be decompressed with the other. */
+    int codec_dict_equal(const codec_dict *a, const codec_dict *b);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
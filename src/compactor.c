@@ -11,10 +11,26 @@ static void exit_error(couchstore_error_t errcode)
 }
 
 static void usage(const char* prog) {
-    fprintf(stderr, "Usage: %s [--dropdeletes] [--evict] <input file> <output file>\n", prog);
+    fprintf(stderr, "Usage: %s [--dropdeletes] [--evict] [--parallel] [--verify] "
+            "[--node-codec <codec>] [--body-codec <codec>] [--train-dictionary] "
+            "<input file> <output file>\n"
+            "Codecs: snappy, lz4, zstd\n", prog);
     exit(-1);
 }
 
+static couchstore_codec_t parse_codec(const char* prog, const char* name)
+{
+    if(!strcmp(name, "snappy")) {
+        return COUCHSTORE_CODEC_SNAPPY;
+    } else if(!strcmp(name, "lz4")) {
+        return COUCHSTORE_CODEC_LZ4;
+    } else if(!strcmp(name, "zstd")) {
+        return COUCHSTORE_CODEC_ZSTD;
+    }
+    usage(prog);
+    return COUCHSTORE_CODEC_DEFAULT;
+}
+
 int main(int argc, char** argv)
 {
     Db* source;
@@ -42,6 +58,41 @@ int main(int argc, char** argv)
             }
             flags |= COUCHSTORE_COMPACT_FLAG_EVICT_BODIES;
         }
+        if(!strcmp(argv[argp],"--parallel")) {
+            argp++;
+            if(argc < (argp + 2)) {
+                usage(argv[0]);
+            }
+            flags |= COUCHSTORE_COMPACT_FLAG_PARALLEL;
+        }
+        if(!strcmp(argv[argp],"--verify")) {
+            argp++;
+            if(argc < (argp + 2)) {
+                usage(argv[0]);
+            }
+            flags |= COUCHSTORE_COMPACT_FLAG_VERIFY_CHECKSUMS;
+        }
+        if(!strcmp(argv[argp],"--node-codec")) {
+            argp += 2;
+            if(argc < (argp + 2)) {
+                usage(argv[0]);
+            }
+            flags |= COUCHSTORE_COMPACT_FLAG_NODE_CODEC(parse_codec(argv[0], argv[argp - 1]));
+        }
+        if(!strcmp(argv[argp],"--body-codec")) {
+            argp += 2;
+            if(argc < (argp + 2)) {
+                usage(argv[0]);
+            }
+            flags |= COUCHSTORE_COMPACT_FLAG_BODY_CODEC(parse_codec(argv[0], argv[argp - 1]));
+        }
+        if(!strcmp(argv[argp],"--train-dictionary")) {
+            argp++;
+            if(argc < (argp + 2)) {
+                usage(argv[0]);
+            }
+            flags |= COUCHSTORE_COMPACT_FLAG_TRAIN_DICTIONARY;
+        }
     }
 
     errcode = couchstore_open_db(argv[argp++], COUCHSTORE_OPEN_FLAG_RDONLY, &source);
@@ -44,6 +44,68 @@ extern "C" {
     couchstore_error_t btree_lookup(couchfile_lookup_request *rq,
                                     uint64_t root_pointer);
 
+    /* Calls fetch_callback for the keys from key 0 down to and including key 1, in descending
+       order; or from the last key, if key 0 is NULL; or down to the first key, if the keys
+       array contains only one key. 'fold' is ignored and node_callback isn't called. */
+    couchstore_error_t btree_lookup_reverse(couchfile_lookup_request *rq,
+                                            uint64_t root_pointer);
+
+    /* Reductions */
+
+    typedef struct couchfile_reduce_request {
+        compare_info cmp;
+        tree_file *file;
+        /* The range btree_reduce_range covers; a NULL key is no bound at that end */
+        const sized_buf *start;
+        const sized_buf *end;
+        int exclusive_end;
+        void *callback_ctx;
+        /* btree_reduce_range calls this with the reduce value of each subtree wholly in the
+           range, and value_callback for each key/value in the range in the other leaves it
+           reads; btree_seek_nth calls value_callback with the key/value it finds. */
+        couchstore_error_t (*reduce_callback) (struct couchfile_reduce_request *rq,
+                                               const sized_buf *reduce_value);
+        couchstore_error_t (*value_callback) (struct couchfile_reduce_request *rq,
+                                              const sized_buf *k,
+                                              const sized_buf *v);
+        /* btree_seek_nth counts the key/values in a subtree from its reduce value with this,
+           and whether each key/value in a leaf counts with count_value. */
+        uint64_t (*count_reduce) (struct couchfile_reduce_request *rq,
+                                  const sized_buf *reduce_value);
+        int (*count_value) (struct couchfile_reduce_request *rq,
+                            const sized_buf *k,
+                            const sized_buf *v);
+    } couchfile_reduce_request;
+
+    /* Combines the reductions of the key/values in a range, reading only the nodes along the
+       paths to its two ends. */
+    couchstore_error_t btree_reduce_range(couchfile_reduce_request *rq,
+                                          const node_pointer *root);
+
+    /* Finds the key/value with index n (from 0) among those that count, reading only the nodes
+       along the path to it. Returns COUCHSTORE_ERROR_DOC_NOT_FOUND if there aren't that many. */
+    couchstore_error_t btree_seek_nth(couchfile_reduce_request *rq,
+                                      const node_pointer *root,
+                                      uint64_t n);
+
+    /* A subtree found by btree_partition */
+    typedef struct {
+        uint64_t pointer;
+        uint64_t weight;        // Number of key/values, going by count_reduce
+        int leaf;               // Set once the subtree is known to be a single leaf
+    } btree_subtree;
+
+    /* Splits a tree into about 'target' subtrees that between them hold all its key/values, in
+       key order, by repeatedly replacing the heaviest one with its children; only the upper
+       levels are read. Returns fewer if the tree has fewer nodes. The subtrees' weights come
+       from rq->count_reduce.
+       @param result On success, set to a malloced array the caller must free */
+    couchstore_error_t btree_partition(couchfile_reduce_request *rq,
+                                       const node_pointer *root,
+                                       size_t target,
+                                       btree_subtree **result,
+                                       size_t *result_count);
+
     /* Modify */
     typedef struct nodelist {
         sized_buf data;
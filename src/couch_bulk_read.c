@@ -0,0 +1,357 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#include "config.h"
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "internal.h"
+#include "util.h"
+
+/*
+ * couchstore_open_documents reads many document bodies with a few large reads instead of one
+ * small random read per document. The requested docs are sorted by file position, and runs of
+ * nearby chunks are coalesced into groups that are each fetched with a single pread (or borrowed
+ * straight from the mapping, with memory-mapped files.) The DocInfo's 'size' is the chunk's size
+ * on disk, which tells us how far each group has to extend; if it's wrong, the chunk is just
+ * read on its own.
+ *
+ * With PARALLEL_DOC_READS, groups are read by a pool of worker threads (started once, and
+ * shared by all calls) while the calling thread decodes finished groups and runs the callback,
+ * in file order. The calling thread reads the next group itself if no worker has got to it.
+ */
+
+#define BULK_READ_MAX_GAP (16 * 1024)       // Read through gaps this large between chunks
+#define BULK_READ_MAX_SIZE (1024 * 1024)    // Largest single coalesced read
+#define BULK_READ_THREADS 4                 // Reader threads in the pool
+#define BULK_READ_WINDOW 16                 // Max groups read ahead of the callback
+
+typedef struct {
+    cs_off_t start;             // File position of the range to read
+    size_t length;              // Length of the range
+    size_t first, end;          // Range of indexes into the sorted DocInfo array
+    const char *data;           // Data read, once 'done' is set
+    ssize_t result;             // Number of bytes read, or error code
+    int borrowed;               // Is 'data' borrowed from the file's memory mapping?
+    int done;
+} read_group;
+
+typedef struct bulk_reader {
+    struct bulk_reader *next_reader;    // Next call's reader in the pool's list
+    tree_file *file;
+    read_group *groups;
+    size_t ngroups;
+    size_t next;                // Next group to be claimed by a reader thread
+    size_t consumed;            // Number of groups the callback thread is done with
+    size_t reading;             // Number of groups pool threads are reading right now
+    int stop;
+    pthread_cond_t cond;        // Signaled when one of this reader's groups is done
+} bulk_reader;
+
+// The reader thread pool. Its lock also guards the state of the readers in its list.
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t work;        // Signaled when there may be groups to read
+    bulk_reader *readers;       // Calls with groups to read
+    int nthreads;
+} pool = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, 0};
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+
+
+static int compare_bp(const void *a, const void *b)
+{
+    uint64_t bp_a = (*(DocInfo* const*)a)->bp;
+    uint64_t bp_b = (*(DocInfo* const*)b)->bp;
+    return bp_a < bp_b ? -1 : (bp_a > bp_b ? 1 : 0);
+}
+
+// The file position just past the end of a doc's chunk, going by its DocInfo.
+static cs_off_t chunk_end(const DocInfo *info)
+{
+    // At least read the chunk header, even if the size is bogus:
+    return info->bp + (info->size > 8 ? info->size : 8);
+}
+
+// Splits the (sorted) docinfos into groups of nearby chunks. Returns the number of groups.
+static size_t plan_groups(DocInfo **infos, size_t count, read_group *groups)
+{
+    size_t ngroups = 0;
+    size_t i = 0;
+    while (i < count) {
+        read_group *g = &groups[ngroups++];
+        memset(g, 0, sizeof(*g));
+        g->start = infos[i]->bp;
+        cs_off_t end = chunk_end(infos[i]);
+        g->first = i++;
+        while (i < count) {
+            cs_off_t next_end = chunk_end(infos[i]);
+            if ((cs_off_t)infos[i]->bp > end + BULK_READ_MAX_GAP ||
+                    next_end - g->start > BULK_READ_MAX_SIZE) {
+                break;
+            }
+            if (next_end > end) {
+                end = next_end;
+            }
+            ++i;
+        }
+        g->end = i;
+        g->length = (size_t)(end - g->start);
+    }
+    return ngroups;
+}
+
+static void read_group_data(tree_file *file, read_group *g, int direct)
+{
+    g->result = pread_raw_range(file, g->start, g->length, direct, &g->data, &g->borrowed);
+}
+
+static void free_group_data(read_group *g)
+{
+    if (g->result >= 0 && !g->borrowed) {
+        free((char*)g->data);
+    }
+    g->data = NULL;
+}
+
+// Returns whether a reader has a group that may be read now. Call with the pool's lock held.
+static int can_claim(const bulk_reader *r)
+{
+    return !r->stop && r->next < r->ngroups && r->next < r->consumed + BULK_READ_WINDOW;
+}
+
+static void *bulk_reader_thread(void *arg)
+{
+    (void)arg;
+    pthread_mutex_lock(&pool.lock);
+    for (;;) {
+        bulk_reader *r = pool.readers;
+        while (r && !can_claim(r)) {
+            r = r->next_reader;
+        }
+        if (!r) {
+            pthread_cond_wait(&pool.work, &pool.lock);
+            continue;
+        }
+        read_group *g = &r->groups[r->next++];
+        r->reading++;
+        pthread_mutex_unlock(&pool.lock);
+        read_group_data(r->file, g, 1);
+        pthread_mutex_lock(&pool.lock);
+        g->done = 1;
+        r->reading--;
+        pthread_cond_broadcast(&r->cond);
+    }
+    return NULL;
+}
+
+static void start_pool(void)
+{
+    int i;
+    for (i = 0; i < BULK_READ_THREADS; ++i) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, bulk_reader_thread, NULL) != 0) {
+            break;  // Callers will read the groups themselves
+        }
+        pthread_detach(thread);
+        pool.nthreads++;
+    }
+}
+
+// Decodes the docs in a group that's been read, and passes their bodies to the callback.
+// The chunks and decompressed bodies are copied into the given reusable buffers if necessary.
+static couchstore_error_t process_group(Db *db,
+                                        sized_buf *read_scratch,
+                                        sized_buf *body_scratch,
+                                        DocInfo **infos,
+                                        read_group *g,
+                                        couchstore_open_options options,
+                                        couchstore_body_visitor_fn callback,
+                                        void *ctx)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    size_t i;
+    error_unless(g->result >= 0, (couchstore_error_t) g->result);
+
+    for (i = g->first; i < g->end; ++i) {
+        const DocInfo *info = infos[i];
+        const char *chunk = NULL;
+        int len = decode_chunk_in_memory(g->data, g->start, (size_t)g->result, info->bp,
+                                         read_scratch, &chunk, NULL);
+        if (len == COUCHSTORE_ERROR_READ) {
+            // Chunk wasn't entirely within the data read, so read it on its own:
+            len = pread_bin_reusing(&db->file, info->bp, read_scratch, &chunk);
+        }
+        error_unless(len >= 0, len);
+
+        sized_buf body = {(char*)chunk, len};
+        if (info->content_meta & COUCH_DOC_IS_COMPRESSED) {
+            if (options & DECOMPRESS_DOC_BODIES) {
+                len = decompress_reusing(&db->file, chunk, len, body_scratch);
+                error_unless(len >= 0, len);
+                body.buf = body_scratch->buf;
+            } else {
+                len = compressed_to_snappy(&db->file, chunk, len, body_scratch, &chunk);
+                error_unless(len >= 0, len);
+                body.buf = (char*)chunk;
+            }
+            body.size = len;
+        }
+        error_pass(callback(db, info, &body, ctx));
+    }
+    errcode = COUCHSTORE_SUCCESS;
+
+cleanup:
+    return errcode;
+}
+
+static couchstore_error_t read_groups_serially(Db *db,
+                                               sized_buf *read_scratch,
+                                               sized_buf *body_scratch,
+                                               DocInfo **infos,
+                                               read_group *groups,
+                                               size_t ngroups,
+                                               couchstore_open_options options,
+                                               couchstore_body_visitor_fn callback,
+                                               void *ctx)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    size_t i;
+    for (i = 0; i < ngroups && errcode == COUCHSTORE_SUCCESS; ++i) {
+        read_group_data(&db->file, &groups[i], 0);
+        errcode = process_group(db, read_scratch, body_scratch, infos, &groups[i],
+                                options, callback, ctx);
+        free_group_data(&groups[i]);
+    }
+    return errcode;
+}
+
+static couchstore_error_t read_groups_in_parallel(Db *db,
+                                                  sized_buf *read_scratch,
+                                                  sized_buf *body_scratch,
+                                                  DocInfo **infos,
+                                                  read_group *groups,
+                                                  size_t ngroups,
+                                                  couchstore_open_options options,
+                                                  couchstore_body_visitor_fn callback,
+                                                  void *ctx)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    bulk_reader r, **link;
+    size_t i;
+
+    // The readers bypass the write buffer, so make sure it's empty:
+    error_pass(tree_file_flush(&db->file));
+
+    pthread_once(&pool_once, start_pool);
+    if (pool.nthreads == 0) {
+        return read_groups_serially(db, read_scratch, body_scratch, infos, groups, ngroups,
+                                    options, callback, ctx);
+    }
+
+    memset(&r, 0, sizeof(r));
+    r.file = &db->file;
+    r.groups = groups;
+    r.ngroups = ngroups;
+    pthread_cond_init(&r.cond, NULL);
+
+    pthread_mutex_lock(&pool.lock);
+    r.next_reader = pool.readers;
+    pool.readers = &r;
+    pthread_cond_broadcast(&pool.work);
+    for (i = 0; i < ngroups && errcode == COUCHSTORE_SUCCESS; ++i) {
+        if (r.next == i) {
+            // No worker has got to this group yet (they may be busy with other calls):
+            r.next++;
+            pthread_mutex_unlock(&pool.lock);
+            read_group_data(r.file, &groups[i], 1);
+            pthread_mutex_lock(&pool.lock);
+            groups[i].done = 1;
+        }
+        while (!groups[i].done) {
+            pthread_cond_wait(&r.cond, &pool.lock);
+        }
+        pthread_mutex_unlock(&pool.lock);
+
+        errcode = process_group(db, read_scratch, body_scratch, infos, &groups[i],
+                                options, callback, ctx);
+        free_group_data(&groups[i]);
+
+        pthread_mutex_lock(&pool.lock);
+        r.consumed = i + 1;
+        pthread_cond_broadcast(&pool.work);
+    }
+
+    // Leave the pool's list, and wait for the groups being read to finish:
+    r.stop = 1;
+    for (link = &pool.readers; *link != &r; link = &(*link)->next_reader) {
+    }
+    *link = r.next_reader;
+    while (r.reading > 0) {
+        pthread_cond_wait(&r.cond, &pool.lock);
+    }
+    pthread_mutex_unlock(&pool.lock);
+
+    // If we stopped early, free whatever the readers got ahead of us:
+    for (i = 0; i < ngroups; ++i) {
+        if (groups[i].done && groups[i].data) {
+            free_group_data(&groups[i]);
+        }
+    }
+    pthread_cond_destroy(&r.cond);
+cleanup:
+    return errcode;
+}
+
+LIBCOUCHSTORE_API
+couchstore_error_t couchstore_open_documents(Db *db,
+                                             DocInfo *docinfos[],
+                                             size_t numDocs,
+                                             couchstore_open_options options,
+                                             couchstore_body_visitor_fn callback,
+                                             void *ctx)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    DocInfo **sorted = NULL;
+    read_group *groups = NULL;
+    size_t count = 0, i;
+    // A shared handle may be in use by other threads, so it can't lend its buffers:
+    sized_buf local_scratch[2] = {{NULL, 0}, {NULL, 0}};
+    sized_buf *read_scratch = db->shared ? &local_scratch[0] : &db->read_scratch;
+    sized_buf *body_scratch = db->shared ? &local_scratch[1] : &db->body_scratch;
+
+    if (numDocs == 0) {
+        return COUCHSTORE_SUCCESS;
+    }
+    error_unless(sorted = malloc(numDocs * sizeof(DocInfo*)), COUCHSTORE_ERROR_ALLOC_FAIL);
+
+    // Docs without bodies are reported first; the rest get sorted by position.
+    for (i = 0; i < numDocs; ++i) {
+        if (docinfos[i]->bp == 0) {
+            error_pass(callback(db, docinfos[i], NULL, ctx));
+        } else {
+            sorted[count++] = docinfos[i];
+        }
+    }
+    errcode = COUCHSTORE_SUCCESS;
+    if (count == 0) {
+        goto cleanup;
+    }
+    qsort(sorted, count, sizeof(DocInfo*), compare_bp);
+
+    error_unless(groups = malloc(count * sizeof(read_group)), COUCHSTORE_ERROR_ALLOC_FAIL);
+    size_t ngroups = plan_groups(sorted, count, groups);
+
+    if ((options & PARALLEL_DOC_READS) && ngroups > 1) {
+        error_pass(read_groups_in_parallel(db, read_scratch, body_scratch, sorted, groups,
+                                           ngroups, options, callback, ctx));
+    } else {
+        error_pass(read_groups_serially(db, read_scratch, body_scratch, sorted, groups,
+                                        ngroups, options, callback, ctx));
+    }
+
+cleanup:
+    free(local_scratch[0].buf);
+    free(local_scratch[1].buf);
+    free(groups);
+    free(sorted);
+    return errcode;
+}
@@ -7,17 +7,35 @@
 #include <stdio.h>
 
 #include "internal.h"
+#include "codec.h"
+#include "id_filter.h"
+#include "dirty_nodes.h"
+#include "memtable.h"
 #include "node_types.h"
+#include "node_cache.h"
 #include "couch_btree.h"
 #include "bitfield.h"
 #include "reduces.h"
 #include "util.h"
+#include "crc32.h"
 
 #define ROOT_BASE_SIZE 12
 #define HEADER_BASE_SIZE 25
+#define TRAILER_FIELD_SIZE 6    // Size of each position some version 12 headers end with
+#define COMMIT_TRAILER_FIELDS 5 // Trailer fields in a header that records its commit's chunks
+#define SINGLE_SYNC_MAX_COMMIT (16 * 1024 * 1024)  // Bigger commits sync twice, which bounds
+                                                    // what opening the file has to check
+#define ID_FILTER_MIN_CAPACITY 1024
+#define ID_FILTER_GROWTH 2          // New ID filters have room for this many times the IDs
+#define ID_FILTER_SAVE_FRACTION 8   // Resave the ID filter after this fraction of its capacity
+                                    // in changes
+#define DIRTY_NODES_LIMIT (16 * 1024 * 1024)    // Most memory nodes waiting for a commit may use
+#define MAX_SEQUENCE 0xFFFFFFFFFFFFULL          // Sequences are 48 bits
+#define SCAN_SUBTREES_PER_PARTITION 4   // Partitions are balanced out of this many pieces
+#define SCAN_MAX_THREADS 64
 
 // Initializes one of the db's root node pointers from data in the file header
-static couchstore_error_t read_db_root(Db *db, node_pointer **root,
+static couchstore_error_t read_db_root(const db_header *header, node_pointer **root,
                                        void *root_data, int root_size)
 {
     couchstore_error_t errcode = COUCHSTORE_SUCCESS;
@@ -25,7 +43,7 @@ static couchstore_error_t read_db_root(Db *db, node_pointer **root,
         error_unless(root_size >= ROOT_BASE_SIZE, COUCHSTORE_ERROR_CORRUPT);
         *root = read_root(root_data, root_size);
         error_unless(*root, COUCHSTORE_ERROR_ALLOC_FAIL);
-        error_unless((*root)->pointer < db->header.position, COUCHSTORE_ERROR_CORRUPT);
+        error_unless((*root)->pointer < header->position, COUCHSTORE_ERROR_CORRUPT);
     } else {
         *root = NULL;
     }
@@ -33,8 +51,114 @@ cleanup:
     return errcode;
 }
 
-// Attempts to initialize the database from a header at the given file position
-static couchstore_error_t find_header_at_pos(Db *db, cs_off_t pos)
+/* Checks that a root node a header points to made it to disk intact. (After a crash, a header
+   written by a single-sync commit may be on disk even though the nodes it points to aren't.)
+   If 'max_seq' is non-NULL the node is a by-sequence node, and it's set to the node's highest
+   sequence number. */
+static couchstore_error_t check_root_node(Db *db, const node_pointer *root, uint64_t *max_seq)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    char *nodebuf = NULL;
+    node_cache_entry *entry = NULL;
+    int nodebuflen = 0;
+    node_layout node;
+    if (!root) {
+        return COUCHSTORE_SUCCESS;
+    }
+
+    nodebuflen = pread_node(&db->file, root->pointer, &nodebuf, &entry);
+    error_unless(nodebuflen > 0, COUCHSTORE_ERROR_CORRUPT);
+    error_unless(parse_node(nodebuf, nodebuflen, &node), COUCHSTORE_ERROR_CORRUPT);
+    if (max_seq) {
+        sized_buf key = {NULL, 0}, value;
+        size_t bufpos = 1;
+        while (bufpos < node.end) {
+            bufpos += read_kv(nodebuf + bufpos, &key, &value);
+        }
+        error_unless(bufpos == node.end && key.size == sizeof(raw_by_seq_key),
+                     COUCHSTORE_ERROR_CORRUPT);
+        *max_seq = decode_sequence_key(&key);
+    }
+
+cleanup:
+    if (nodebuflen >= 0) {
+        release_node(nodebuf, entry);
+    }
+    return errcode;
+}
+
+static void free_header_roots(db_header *header)
+{
+    free(header->by_seq_root);
+    free(header->by_id_root);
+    free(header->local_docs_root);
+    header->by_seq_root = header->by_id_root = header->local_docs_root = NULL;
+}
+
+// Returns the size of the positions at the end of a header
+static size_t header_trailer_size(const db_header *header)
+{
+    if (header->commit_end > header->commit_start) {
+        return COMMIT_TRAILER_FIELDS * TRAILER_FIELD_SIZE;
+    } else if (header->id_filter_pos) {
+        return 2 * TRAILER_FIELD_SIZE;
+    } else if (header->dict_pos) {
+        return TRAILER_FIELD_SIZE;
+    }
+    return 0;
+}
+
+static uint64_t decode_trailer_field(const char *trailer, int index)
+{
+    raw_48 field;
+    memcpy(&field, trailer + index * TRAILER_FIELD_SIZE, TRAILER_FIELD_SIZE);
+    return decode_raw48(field);
+}
+
+static void encode_trailer_field(uint8_t *trailer, int index, uint64_t value)
+{
+    raw_48 field = encode_raw48(value);
+    memcpy(trailer + index * TRAILER_FIELD_SIZE, &field, TRAILER_FIELD_SIZE);
+}
+
+/* Checks that every chunk a single-sync commit wrote made it to disk intact, by reading them
+   all back and comparing their digest with the one the header recorded. */
+static couchstore_error_t check_commit(Db *db, const db_header *header)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    sized_buf buffer = {NULL, 0};
+    uint32_t digest = 0;
+    uint64_t pos = header->commit_start;
+    while (pos < header->commit_end) {
+        cs_off_t end_pos;
+        const char *data;
+        uint32_t crc;
+        // Check the length first, so a garbage one can't make us allocate a huge buffer:
+        int len = pread_chunk_size(&db->file, pos, &end_pos);
+        error_unless(len >= 0 && (uint64_t)end_pos <= header->commit_end,
+                     COUCHSTORE_ERROR_CORRUPT);
+        len = pread_bin_raw(&db->file, pos, &buffer, &data, &crc);
+        if (len == COUCHSTORE_ERROR_ALLOC_FAIL) {
+            error_pass(len);
+        }
+        error_unless(len >= 0 && crc == hash_crc32(data, len), COUCHSTORE_ERROR_CORRUPT);
+        digest = commit_digest_add(digest, (uint32_t)len, crc);
+        pos = (uint64_t)end_pos;
+    }
+    error_unless(pos == header->commit_end && digest == header->commit_digest,
+                 COUCHSTORE_ERROR_CORRUPT);
+
+cleanup:
+    free(buffer.buf);
+    return errcode;
+}
+
+/* Attempts to read a database header at the given file position. If 'verify' is set and the
+   header was written by a single-sync commit, which a crash could have left on disk without all
+   the data it points to, that data is checked too. (Only the last header in the file needs this:
+   any later commit's sync made the data of the headers before it durable.) */
+static couchstore_error_t find_header_at_pos(Db *db, cs_off_t pos, db_header *header,
+                                             int verify)
 {
     int errcode = COUCHSTORE_SUCCESS;
     raw_file_header *header_buf = NULL;
@@ -52,40 +176,83 @@ static couchstore_error_t find_header_at_pos(Db *db, cs_off_t pos)
         error_pass(header_len);
     }
 
-    db->header.position = pos;
-    db->header.disk_version = decode_raw08(header_buf->version);
-    error_unless(db->header.disk_version == COUCH_DISK_VERSION,
+    header->position = pos;
+    header->disk_version = decode_raw08(header_buf->version);
+    error_unless(header->disk_version == COUCH_DISK_VERSION ||
+                 header->disk_version == COUCH_SNAPPY_DISK_VERSION,
                  COUCHSTORE_ERROR_HEADER_VERSION);
-    db->header.update_seq = decode_raw48(header_buf->update_seq);
-    db->header.purge_seq = decode_raw48(header_buf->purge_seq);
-    db->header.purge_ptr = decode_raw48(header_buf->purge_ptr);
-    error_unless(db->header.purge_ptr <= db->header.position, COUCHSTORE_ERROR_CORRUPT);
+    // A file's format never changes, so this is needed before reading its nodes:
+    db->file.codec_tags = (header->disk_version >= COUCH_DISK_VERSION);
+    header->update_seq = decode_raw48(header_buf->update_seq);
+    header->purge_seq = decode_raw48(header_buf->purge_seq);
+    header->purge_ptr = decode_raw48(header_buf->purge_ptr);
+    error_unless(header->purge_ptr <= header->position, COUCHSTORE_ERROR_CORRUPT);
     int seqrootsize = decode_raw16(header_buf->seqrootsize);
     int idrootsize = decode_raw16(header_buf->idrootsize);
     int localrootsize = decode_raw16(header_buf->localrootsize);
-    error_unless(header_len == HEADER_BASE_SIZE + seqrootsize + idrootsize + localrootsize,
+    int rootsize = seqrootsize + idrootsize + localrootsize;
+    char *root_data = (char*) (header_buf + 1);  // i.e. just past *header_buf
+    // Version 12 headers may end with the positions of the zstd dictionary and ID filter,
+    // followed by the range and digest of the chunks a single-sync commit wrote:
+    int trailer_size = header_len - (HEADER_BASE_SIZE + rootsize);
+    error_unless(trailer_size == 0 ||
+                 (header->disk_version >= COUCH_DISK_VERSION &&
+                  (trailer_size == TRAILER_FIELD_SIZE || trailer_size == 2 * TRAILER_FIELD_SIZE ||
+                   trailer_size == COMMIT_TRAILER_FIELDS * TRAILER_FIELD_SIZE)),
+                 COUCHSTORE_ERROR_CORRUPT);
+    header->dict_pos = header->id_filter_pos = 0;
+    header->commit_start = header->commit_end = header->commit_digest = 0;
+    if (trailer_size > 0) {
+        header->dict_pos = decode_trailer_field(root_data + rootsize, 0);
+    }
+    if (trailer_size > TRAILER_FIELD_SIZE) {
+        header->id_filter_pos = decode_trailer_field(root_data + rootsize, 1);
+    }
+    if (trailer_size > 2 * TRAILER_FIELD_SIZE) {
+        header->commit_start = decode_trailer_field(root_data + rootsize, 2);
+        header->commit_end = decode_trailer_field(root_data + rootsize, 3);
+        header->commit_digest = (uint32_t)decode_trailer_field(root_data + rootsize, 4);
+        error_unless(header->commit_start < header->commit_end &&
+                     header->commit_end <= header->position, COUCHSTORE_ERROR_CORRUPT);
+    }
+    error_unless((header->dict_pos == 0 || header->dict_pos < header->position) &&
+                 (header->id_filter_pos == 0 || header->id_filter_pos < header->position),
                  COUCHSTORE_ERROR_CORRUPT);
 
-    char *root_data = (char*) (header_buf + 1);  // i.e. just past *header_buf
-    error_pass(read_db_root(db, &db->header.by_seq_root, root_data, seqrootsize));
+    error_pass(read_db_root(header, &header->by_seq_root, root_data, seqrootsize));
     root_data += seqrootsize;
-    error_pass(read_db_root(db, &db->header.by_id_root, root_data, idrootsize));
+    error_pass(read_db_root(header, &header->by_id_root, root_data, idrootsize));
     root_data += idrootsize;
-    error_pass(read_db_root(db, &db->header.local_docs_root, root_data, localrootsize));
+    error_pass(read_db_root(header, &header->local_docs_root, root_data, localrootsize));
+
+    if (verify && header->commit_end > header->commit_start) {
+        // Make sure the roots are really there, and that none is newer than the header, and then
+        // that everything else the commit wrote is intact:
+        uint64_t max_seq = 0;
+        error_pass(check_root_node(db, header->by_seq_root, &max_seq));
+        error_unless(max_seq <= header->update_seq, COUCHSTORE_ERROR_CORRUPT);
+        error_pass(check_root_node(db, header->by_id_root, NULL));
+        error_pass(check_root_node(db, header->local_docs_root, NULL));
+        error_pass(check_commit(db, header));
+    }
 
 cleanup:
     free(header_buf);
+    if (errcode != COUCHSTORE_SUCCESS) {
+        // Don't leak the roots if we go on to try an earlier header:
+        free_header_roots(header);
+    }
     return errcode;
 }
 
-// Finds the database header by scanning back from the end of the file at 4k boundaries
-static couchstore_error_t find_header(Db *db)
+// Finds the last valid header at or before a file position, by scanning back at 4k boundaries.
+// 'verify' is passed on to find_header_at_pos.
+static couchstore_error_t find_header_before(Db *db, int64_t pos, db_header *header, int verify)
 {
     couchstore_error_t last_header_errcode = COUCHSTORE_ERROR_NO_HEADER;
-    int64_t pos = db->file.pos - 2;
     pos -= pos % COUCH_BLOCK_SIZE;
     for (; pos >= 0; pos -= COUCH_BLOCK_SIZE) {
-        couchstore_error_t errcode = find_header_at_pos(db, pos);
+        couchstore_error_t errcode = find_header_at_pos(db, pos, header, verify);
         switch(errcode) {
             case COUCHSTORE_SUCCESS:
                 // Found it!
@@ -105,6 +272,20 @@ static couchstore_error_t find_header(Db *db)
     return last_header_errcode;
 }
 
+// Finds the database header by scanning back from the end of the file
+static couchstore_error_t find_header(Db *db)
+{
+    return find_header_before(db, db->file.pos - 2, &db->header, 1);
+}
+
+/* Returns nonzero if the commit in progress syncs once. That needs a version 12 file, whose
+   header can record what the commit wrote, and a commit small enough to check on open. */
+static int commit_syncs_once(Db *db)
+{
+    return db->single_sync_commit && db->file.codec_tags &&
+           db->file.pos - db->file.commit_start <= SINGLE_SYNC_MAX_COMMIT;
+}
+
 static couchstore_error_t write_header(Db *db)
 {
     sized_buf writebuf;
@@ -118,10 +299,21 @@ static couchstore_error_t write_header(Db *db)
     if (db->header.local_docs_root) {
         localrootsize = ROOT_BASE_SIZE + db->header.local_docs_root->reduce_value.size;
     }
-    writebuf.size = sizeof(raw_file_header) + seqrootsize + idrootsize + localrootsize;
+    // Headers of single-sync commits record the chunks written since the last header, so that
+    // find_header can tell if any of them were lost:
+    if (commit_syncs_once(db) && db->file.pos > db->file.commit_start) {
+        db->header.commit_start = db->file.commit_start;
+        db->header.commit_end = db->file.pos;
+        db->header.commit_digest = db->file.commit_digest;
+    } else {
+        db->header.commit_start = db->header.commit_end = db->header.commit_digest = 0;
+    }
+    size_t trailer_size = header_trailer_size(&db->header);
+    writebuf.size = sizeof(raw_file_header) + seqrootsize + idrootsize + localrootsize +
+                    trailer_size;
     writebuf.buf = (char *) calloc(1, writebuf.size);
     raw_file_header* header = (raw_file_header*)writebuf.buf;
-    header->version = encode_raw08(COUCH_DISK_VERSION);
+    header->version = encode_raw08(db->header.disk_version);
     header->update_seq = encode_raw48(db->header.update_seq);
     header->purge_seq = encode_raw48(db->header.purge_seq);
     header->purge_ptr = encode_raw48(db->header.purge_ptr);
@@ -134,6 +326,18 @@ static couchstore_error_t write_header(Db *db)
     encode_root(root, db->header.by_id_root);
     root += idrootsize;
     encode_root(root, db->header.local_docs_root);
+    root += localrootsize;
+    if (trailer_size > 0) {
+        encode_trailer_field(root, 0, db->header.dict_pos);
+    }
+    if (trailer_size > TRAILER_FIELD_SIZE) {
+        encode_trailer_field(root, 1, db->header.id_filter_pos);
+    }
+    if (trailer_size > 2 * TRAILER_FIELD_SIZE) {
+        encode_trailer_field(root, 2, db->header.commit_start);
+        encode_trailer_field(root, 3, db->header.commit_end);
+        encode_trailer_field(root, 4, db->header.commit_digest);
+    }
     cs_off_t pos;
     couchstore_error_t errcode = db_write_header(&db->file, &writebuf, &pos);
     if (errcode == COUCHSTORE_SUCCESS) {
@@ -145,13 +349,24 @@ static couchstore_error_t write_header(Db *db)
 
 static couchstore_error_t create_header(Db *db)
 {
-    db->header.disk_version = COUCH_DISK_VERSION;
+    // Only use the codec-tagged format if it's needed, so older versions can read the file.
+    // Single-sync commits need it to record what they wrote in their headers.
+    if (db->file.node_codec > COUCHSTORE_CODEC_SNAPPY ||
+            db->body_codec > COUCHSTORE_CODEC_SNAPPY || db->single_sync_commit) {
+        db->header.disk_version = COUCH_DISK_VERSION;
+    } else {
+        db->header.disk_version = COUCH_SNAPPY_DISK_VERSION;
+    }
+    db->file.codec_tags = (db->header.disk_version >= COUCH_DISK_VERSION);
     db->header.update_seq = 0;
     db->header.by_id_root = NULL;
     db->header.by_seq_root = NULL;
     db->header.local_docs_root = NULL;
     db->header.purge_seq = 0;
     db->header.purge_ptr = 0;
+    db->header.dict_pos = 0;
+    db->header.id_filter_pos = 0;
+    db->header.commit_start = db->header.commit_end = db->header.commit_digest = 0;
     db->header.position = 0;
     return write_header(db);
 }
@@ -162,9 +377,178 @@ uint64_t couchstore_get_header_position(Db *db)
     return db->header.position;
 }
 
+static int add_id_cb(Db *db, DocInfo *info, void *ctx)
+{
+    (void)ctx;
+    id_filter_add(db->id_filter, info->id.buf, info->id.size);
+    db->id_filter_unsaved++;
+    return 0;
+}
+
+couchstore_error_t db_reset_id_filter(Db *db, double false_positive_rate,
+                                      uint64_t max_bytes, uint64_t num_ids)
+{
+    id_filter *filter;
+    uint64_t capacity = num_ids * ID_FILTER_GROWTH;
+    if (capacity < ID_FILTER_MIN_CAPACITY) {
+        capacity = ID_FILTER_MIN_CAPACITY;
+    }
+    couchstore_error_t errcode = id_filter_create(false_positive_rate, max_bytes, capacity,
+                                                  &filter);
+    if (errcode != COUCHSTORE_SUCCESS) {
+        return errcode;
+    }
+    id_filter_free(db->id_filter);
+    db->id_filter = filter;
+    db->id_filter_unsaved = 0;
+    db->header.id_filter_pos = 0;
+
+    // Only the codec-tagged format's header can point to a filter. Nothing's been written to an
+    // empty file in the old format yet, so it can still switch:
+    if (!db->file.codec_tags && db->header.position == 0 && db->header.update_seq == 0 &&
+            !db->header.by_id_root && !db->header.by_seq_root && !db->header.local_docs_root) {
+        db->header.disk_version = COUCH_DISK_VERSION;
+        db->file.codec_tags = 1;
+    }
+    return COUCHSTORE_SUCCESS;
+}
+
+// Gives the db a new ID filter holding all its IDs, found by scanning the by-ID index
+static couchstore_error_t build_id_filter(Db *db, double false_positive_rate, uint64_t max_bytes)
+{
+    couchstore_error_t errcode;
+    DbInfo info;
+    error_pass(couchstore_db_info(db, &info));
+    error_pass(db_reset_id_filter(db, false_positive_rate, max_bytes,
+                                  info.doc_count + info.deleted_count));
+    if (db->header.by_id_root) {
+        error_pass(couchstore_all_docs(db, NULL, 0, add_id_cb, NULL));
+    }
+cleanup:
+    if (errcode != COUCHSTORE_SUCCESS) {
+        // A filter missing some IDs would hide their docs:
+        id_filter_free(db->id_filter);
+        db->id_filter = NULL;
+        db->header.id_filter_pos = 0;
+    }
+    return errcode;
+}
+
+// Reads the ID filter the db's header points to, and adds the IDs saved since it was written
+static couchstore_error_t load_id_filter(Db *db)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    char *data = NULL;
+    uint64_t seq;
+    int len = pread_bin(&db->file, db->header.id_filter_pos, &data);
+    error_unless(len >= 0, len);
+    error_pass(id_filter_decode(data, len, &db->id_filter, &seq));
+    if (seq < db->header.update_seq) {
+        error_pass(couchstore_changes_since(db, seq + 1, 0, add_id_cb, NULL));
+    }
+cleanup:
+    free(data);
+    if (errcode != COUCHSTORE_SUCCESS) {
+        id_filter_free(db->id_filter);
+        db->id_filter = NULL;
+    }
+    return errcode;
+}
+
+// At a commit, grows the ID filter if it's full, and saves it if enough has changed since it
+// was last saved. (Opening the file replays the changes made since then into it.)
+static couchstore_error_t save_id_filter(Db *db)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    sized_buf buf = {NULL, 0};
+    cs_off_t pos;
+    if (db->id_filter == NULL) {
+        return COUCHSTORE_SUCCESS;
+    }
+    if (id_filter_is_full(db->id_filter)) {
+        error_pass(build_id_filter(db, db->id_filter->false_positive_rate,
+                                   db->id_filter->max_bytes));
+    }
+    if (!db->file.codec_tags || (db->header.id_filter_pos != 0 &&
+            db->id_filter_unsaved * ID_FILTER_SAVE_FRACTION < db->id_filter->capacity)) {
+        return COUCHSTORE_SUCCESS;
+    }
+    error_pass(id_filter_encode(db->id_filter, db->header.update_seq, &buf));
+    error_pass(db_write_buf(&db->file, &buf, &pos, NULL));
+    db->header.id_filter_pos = pos;
+    db->id_filter_unsaved = 0;
+cleanup:
+    free(buf.buf);
+    return errcode;
+}
+
+LIBCOUCHSTORE_API
+couchstore_error_t couchstore_set_id_filter(Db *db, double false_positive_rate,
+                                            uint64_t max_bytes)
+{
+    if (false_positive_rate == 0) {
+        id_filter_free(db->id_filter);
+        db->id_filter = NULL;
+        db->header.id_filter_pos = 0;
+        return COUCHSTORE_SUCCESS;
+    } else if (!(false_positive_rate > 0 && false_positive_rate < 1)) {
+        return COUCHSTORE_ERROR_INVALID_ARGUMENTS;
+    }
+    return build_id_filter(db, false_positive_rate, max_bytes);
+}
+
+couchstore_error_t db_write_dirty_nodes(Db *db)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    if (!db->file.dirty) {
+        return COUCHSTORE_SUCCESS;
+    }
+    error_pass(dirty_nodes_write(&db->file, db->header.by_id_root));
+    error_pass(dirty_nodes_write(&db->file, db->header.by_seq_root));
+    error_pass(dirty_nodes_write(&db->file, db->header.local_docs_root));
+    dirty_nodes_clear(db->file.dirty);
+cleanup:
+    return errcode;
+}
+
+couchstore_error_t db_trim_dirty_nodes(Db *db)
+{
+    if (!db->file.dirty || dirty_nodes_size(db->file.dirty) < DIRTY_NODES_LIMIT) {
+        return COUCHSTORE_SUCCESS;
+    }
+    node_pointer *roots[3] = {db->header.by_id_root, db->header.by_seq_root,
+                              db->header.local_docs_root};
+    dirty_nodes_sweep(db->file.dirty, roots, 3);
+    // Sweeping on every change once near the limit would be slow, so leave some room:
+    if (dirty_nodes_size(db->file.dirty) >= DIRTY_NODES_LIMIT / 2) {
+        return db_write_dirty_nodes(db);
+    }
+    return COUCHSTORE_SUCCESS;
+}
+
 LIBCOUCHSTORE_API
 couchstore_error_t couchstore_commit(Db *db)
 {
+    couchstore_error_t errcode = db_flush_memtable(db);
+    if (errcode == COUCHSTORE_SUCCESS) {
+        errcode = db_write_dirty_nodes(db);
+    }
+    if (errcode == COUCHSTORE_SUCCESS) {
+        errcode = save_id_filter(db);
+    }
+    if (errcode != COUCHSTORE_SUCCESS) {
+        return errcode;
+    }
+    if (commit_syncs_once(db)) {
+        // The header's CRC, and the checks in find_header of the roots and of the chunks the
+        // header records, protect against it reaching the disk before the data it points to.
+        errcode = write_header(db);
+        if (errcode == COUCHSTORE_SUCCESS) {
+            errcode = db->file.ops->sync(db->file.handle);
+        }
+        return errcode;
+    }
+
     cs_off_t curpos = db->file.pos;
     sized_buf zerobyte = {"\0", 1};
     size_t seqrootsize = 0, idrootsize = 0, localrootsize = 0;
@@ -177,11 +561,12 @@ couchstore_error_t couchstore_commit(Db *db)
     if (db->header.local_docs_root) {
         localrootsize = 12 + db->header.local_docs_root->reduce_value.size;
     }
-    db->file.pos += 25 + seqrootsize + idrootsize + localrootsize;
+    db->file.pos += HEADER_BASE_SIZE + seqrootsize + idrootsize + localrootsize +
+                    header_trailer_size(&db->header);
     //Extend file size to where end of header will land before we do first sync
     db_write_buf(&db->file, &zerobyte, NULL, NULL);
 
-    couchstore_error_t errcode = db->file.ops->sync(db->file.handle);
+    errcode = db->file.ops->sync(db->file.handle);
 
     //Set the pos back to where it was when we started to write the real header.
     db->file.pos = curpos;
@@ -196,13 +581,29 @@ couchstore_error_t couchstore_commit(Db *db)
     return errcode;
 }
 
+// Reads the zstd dictionary the db's header points to
+static couchstore_error_t load_dict(Db *db)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    char *data = NULL;
+    int len = pread_bin(&db->file, db->header.dict_pos, &data);
+    error_unless(len >= 0, len);
+    error_pass(codec_dict_create(data, len, &db->file.dict));
+cleanup:
+    free(data);
+    return errcode;
+}
+
 LIBCOUCHSTORE_API
 couchstore_error_t couchstore_open_db(const char *filename,
                                       couchstore_open_flags flags,
                                       Db **pDb)
 {
-    return couchstore_open_db_ex(filename, flags,
-                                 couchstore_get_default_file_ops(), pDb);
+    const couch_file_ops *ops = couchstore_get_default_file_ops();
+    if (flags & COUCHSTORE_OPEN_FLAG_MMAP) {
+        ops = couchstore_get_mmap_file_ops();
+    }
+    return couchstore_open_db_ex(filename, flags, ops, pDb);
 }
 
 LIBCOUCHSTORE_API
@@ -214,16 +615,35 @@ couchstore_error_t couchstore_open_db_ex(const char *filename,
     couchstore_error_t errcode = COUCHSTORE_SUCCESS;
     Db *db;
     int openflags;
+    couchstore_codec_t node_codec = codec_from_flags(flags, CODEC_FLAGS_NODE_SHIFT);
+    couchstore_codec_t body_codec = codec_from_flags(flags, CODEC_FLAGS_BODY_SHIFT);
 
     /* Sanity check input parameters */
     if ((flags & COUCHSTORE_OPEN_FLAG_RDONLY) &&
         (flags & COUCHSTORE_OPEN_FLAG_CREATE)) {
         return COUCHSTORE_ERROR_INVALID_ARGUMENTS;
     }
+    if ((flags & (COUCHSTORE_OPEN_FLAG_MMAP | COUCHSTORE_OPEN_FLAG_SHARED)) &&
+        !(flags & COUCHSTORE_OPEN_FLAG_RDONLY)) {
+        return COUCHSTORE_ERROR_INVALID_ARGUMENTS;
+    }
+    if ((flags & COUCHSTORE_OPEN_FLAG_DEFER_NODE_WRITES) &&
+        (flags & COUCHSTORE_OPEN_FLAG_RDONLY)) {
+        return COUCHSTORE_ERROR_INVALID_ARGUMENTS;
+    }
+    if (node_codec > COUCHSTORE_CODEC_ZSTD || body_codec > COUCHSTORE_CODEC_ZSTD) {
+        return COUCHSTORE_ERROR_INVALID_ARGUMENTS;
+    }
+    if (!codec_supported(node_codec) || !codec_supported(body_codec)) {
+        return COUCHSTORE_ERROR_UNSUPPORTED_CODEC;
+    }
 
     if ((db = calloc(1, sizeof(Db))) == NULL) {
         return COUCHSTORE_ERROR_ALLOC_FAIL;
     }
+    pthread_mutex_init(&db->commit_lock, NULL);
+    pthread_cond_init(&db->commit_cond, NULL);
+    db->commit_queue_tail = &db->commit_queue;
 
     if (flags & COUCHSTORE_OPEN_FLAG_RDONLY) {
         openflags = O_RDONLY;
@@ -234,10 +654,20 @@ couchstore_error_t couchstore_open_db_ex(const char *filename,
     if (flags & COUCHSTORE_OPEN_FLAG_CREATE) {
         openflags |= O_CREAT;
     }
+    db->single_sync_commit = (flags & COUCHSTORE_OPEN_FLAG_SINGLE_SYNC) != 0;
+    db->shared = (flags & COUCHSTORE_OPEN_FLAG_SHARED) != 0;
+    db->file_ops = ops;
 
-    error_pass(tree_file_open(&db->file, filename, openflags, ops));
+    error_pass(tree_file_open(&db->file, filename, openflags, db->shared, ops));
+    db->file.node_codec = node_codec;
+    db->body_codec = body_codec;
+    if (flags & COUCHSTORE_OPEN_FLAG_DEFER_NODE_WRITES) {
+        error_pass(dirty_nodes_create(&db->file.dirty));
+    }
 
-    if ((db->file.pos = db->file.ops->goto_eof(db->file.handle)) == 0) {
+    db->file.pos = db->file.ops->goto_eof(db->file.handle);
+    db->file.commit_start = db->file.pos;
+    if (db->file.pos == 0) {
         /* This is an empty file. Create a new fileheader unless the
          * user wanted a read-only version of the file
          */
@@ -248,6 +678,16 @@ couchstore_error_t couchstore_open_db_ex(const char *filename,
         }
     } else {
         error_pass(find_header(db));
+        if (db->header.dict_pos && codec_supported(COUCHSTORE_CODEC_ZSTD_DICT)) {
+            error_pass(load_dict(db));
+            // Unless told otherwise, keep compressing bodies with the dictionary:
+            if (db->body_codec == COUCHSTORE_CODEC_DEFAULT) {
+                db->body_codec = COUCHSTORE_CODEC_ZSTD;
+            }
+        }
+        if (db->header.id_filter_pos) {
+            error_pass(load_id_filter(db));
+        }
     }
 
     *pDb = db;
@@ -258,14 +698,114 @@ cleanup:
     return errcode;
 }
 
+// Switches an open db to another header, which takes over the header's roots.
+static void use_header(Db *db, const db_header *header)
+{
+    free_header_roots(&db->header);
+    db->header = *header;
+}
+
+LIBCOUCHSTORE_API
+couchstore_error_t couchstore_open_snapshot(const char *filename,
+                                            couchstore_open_flags flags,
+                                            uint64_t header_position,
+                                            Db **pDb)
+{
+    couchstore_error_t errcode;
+    Db *db = NULL;
+    db_header header;
+    memset(&header, 0, sizeof(header));
+
+    if (header_position % COUCH_BLOCK_SIZE != 0) {
+        return COUCHSTORE_ERROR_NO_HEADER;
+    }
+    error_pass(couchstore_open_db(filename, flags | COUCHSTORE_OPEN_FLAG_RDONLY, &db));
+    error_unless(header_position <= db->header.position, COUCHSTORE_ERROR_NO_HEADER);
+    error_pass(find_header_at_pos(db, header_position, &header, 0));
+    use_header(db, &header);
+    *pDb = db;
+    db = NULL;
+
+cleanup:
+    if (db) {
+        couchstore_close_db(db);
+    }
+    return errcode;
+}
+
+LIBCOUCHSTORE_API
+couchstore_error_t couchstore_open_snapshot_by_seq(const char *filename,
+                                                   couchstore_open_flags flags,
+                                                   uint64_t update_seq,
+                                                   Db **pDb)
+{
+    couchstore_error_t errcode;
+    Db *db = NULL;
+    db_header header;
+
+    error_pass(couchstore_open_db(filename, flags | COUCHSTORE_OPEN_FLAG_RDONLY, &db));
+    while (db->header.update_seq > update_seq) {
+        // Sequences only increase, so step back through earlier headers until one qualifies:
+        error_unless(db->header.position > 0, COUCHSTORE_ERROR_NO_HEADER);
+        memset(&header, 0, sizeof(header));
+        error_pass(find_header_before(db, (int64_t)db->header.position - 1, &header, 0));
+        use_header(db, &header);
+    }
+    *pDb = db;
+    db = NULL;
+
+cleanup:
+    if (db) {
+        couchstore_close_db(db);
+    }
+    return errcode;
+}
+
+LIBCOUCHSTORE_API
+couchstore_error_t couchstore_walk_headers(Db *db,
+                                           couchstore_header_callback_fn callback,
+                                           void *ctx)
+{
+    int64_t pos = (int64_t)db->header.position;
+    while (pos >= 0) {
+        db_header header;
+        HeaderInfo info;
+        memset(&header, 0, sizeof(header));
+        couchstore_error_t errcode = find_header_before(db, pos, &header, 0);
+        if (errcode == COUCHSTORE_ERROR_ALLOC_FAIL || errcode == COUCHSTORE_ERROR_READ) {
+            return errcode;
+        } else if (errcode != COUCHSTORE_SUCCESS) {
+            break;      // No more valid headers
+        }
+        free_header_roots(&header);
+        info.position = header.position;
+        info.update_seq = header.update_seq;
+        info.purge_seq = header.purge_seq;
+        int result = callback(db, &info, ctx);
+        if (result < 0) {
+            return (couchstore_error_t)result;
+        } else if (result > 0) {
+            break;
+        }
+        pos = (int64_t)header.position - 1;
+    }
+    return COUCHSTORE_SUCCESS;
+}
+
 LIBCOUCHSTORE_API
 couchstore_error_t couchstore_close_db(Db *db)
 {
     tree_file_close(&db->file);
 
+    id_filter_free(db->id_filter);
+    memtable_release(db->memtable);
     free(db->header.by_id_root);
     free(db->header.by_seq_root);
     free(db->header.local_docs_root);
+    free(db->read_scratch.buf);
+    free(db->body_scratch.buf);
+    pthread_cond_destroy(&db->commit_cond);
+    pthread_mutex_destroy(&db->commit_lock);
 
     memset(db, 0xa5, sizeof(*db));
     free(db);
@@ -392,21 +932,31 @@ static couchstore_error_t by_id_read_docinfo(DocInfo **pInfo, sized_buf *k, size
 }
 
 //Fill in doc from reading file.
-static couchstore_error_t bp_to_doc(Doc **pDoc, Db *db, cs_off_t bp, couchstore_open_options options)
+static couchstore_error_t bp_to_doc(Doc **pDoc, Db *db, const DocInfo *docinfo,
+                                    couchstore_open_options options)
 {
     couchstore_error_t errcode = COUCHSTORE_SUCCESS;
     int bodylen = 0;
     char *docbody = NULL;
+    const char *body = NULL;
+    int borrowed = 0;
     fatbuf *docbuf = NULL;
+    sized_buf snappy_buf = {NULL, 0};
 
     if (options & DECOMPRESS_DOC_BODIES) {
-        bodylen = pread_compressed(&db->file, bp, &docbody);
+        bodylen = pread_compressed(&db->file, docinfo->bp, &docbody);
     } else {
-        bodylen = pread_bin(&db->file, bp, &docbody);
+        bodylen = pread_bin_borrowed(&db->file, docinfo->bp, (const char**)&docbody, &borrowed);
     }
 
     error_unless(bodylen >= 0, bodylen);    // if bodylen is negative it's an error code
     error_unless(docbody || bodylen == 0, COUCHSTORE_ERROR_READ);
+    body = docbody;
+    if (!(options & DECOMPRESS_DOC_BODIES) &&
+            (docinfo->content_meta & COUCH_DOC_IS_COMPRESSED)) {
+        bodylen = compressed_to_snappy(&db->file, docbody, bodylen, &snappy_buf, &body);
+        error_unless(bodylen >= 0, bodylen);
+    }
 
     error_unless(docbuf = fatbuf_alloc(sizeof(Doc) + bodylen), COUCHSTORE_ERROR_ALLOC_FAIL);
     *pDoc = (Doc *) fatbuf_get(docbuf, sizeof(Doc));
@@ -419,10 +969,13 @@ static couchstore_error_t bp_to_doc(Doc **pDoc, Db *db, cs_off_t bp, couchstore_
 
     (*pDoc)->data.buf = (char *) fatbuf_get(docbuf, bodylen);
     (*pDoc)->data.size = bodylen;
-    memcpy((*pDoc)->data.buf, docbody, bodylen);
+    memcpy((*pDoc)->data.buf, body, bodylen);
 
 cleanup:
-    free(docbody);
+    if (!borrowed) {
+        free(docbody);
+    }
+    free(snappy_buf.buf);
     if (errcode < 0) {
         fatbuf_free(docbuf);
     }
@@ -453,6 +1006,19 @@ static couchstore_error_t docinfo_fetch_by_seq(couchfile_lookup_request *rq,
     return by_seq_read_docinfo(pInfo, id, v);
 }
 
+// Returns a malloced copy of a DocInfo, which couchstore_free_docinfo can free
+static DocInfo *copy_docinfo(const DocInfo *info)
+{
+    DocInfo *copy = couchstore_alloc_docinfo(&info->id, &info->rev_meta);
+    if (copy) {
+        sized_buf id = copy->id, rev_meta = copy->rev_meta;
+        *copy = *info;
+        copy->id = id;
+        copy->rev_meta = rev_meta;
+    }
+    return copy;
+}
+
 LIBCOUCHSTORE_API
 couchstore_error_t couchstore_docinfo_by_id(Db *db,
                                             const void *id,
@@ -465,13 +1031,21 @@ couchstore_error_t couchstore_docinfo_by_id(Db *db,
     sized_buf cmptmp;
     couchstore_error_t errcode;
 
-    if (db->header.by_id_root == NULL) {
-        return COUCHSTORE_ERROR_DOC_NOT_FOUND;
-    }
-
     key.buf = (char *) id;
     key.size = idlen;
 
+    if (db->memtable) {
+        const DocInfo *info = memtable_find(db->memtable, &key);
+        if (info) {
+            *pInfo = copy_docinfo(info);
+            return *pInfo ? COUCHSTORE_SUCCESS : COUCHSTORE_ERROR_ALLOC_FAIL;
+        }
+    }
+    if (db->header.by_id_root == NULL ||
+            (db->id_filter && !id_filter_may_contain(db->id_filter, id, idlen))) {
+        return COUCHSTORE_ERROR_DOC_NOT_FOUND;
+    }
+
     rq.cmp.compare = ebin_cmp;
     rq.cmp.arg = &cmptmp;
     rq.file = &db->file;
@@ -502,6 +1076,13 @@ couchstore_error_t couchstore_docinfo_by_sequence(Db *db,
     sized_buf cmptmp;
     couchstore_error_t errcode;
 
+    if (db->memtable) {
+        const memtable_entry *entry = memtable_since(db->memtable, sequence);
+        if (entry && memtable_entry_info(entry)->db_seq == sequence) {
+            *pInfo = copy_docinfo(memtable_entry_info(entry));
+            return *pInfo ? COUCHSTORE_SUCCESS : COUCHSTORE_ERROR_ALLOC_FAIL;
+        }
+    }
     if (db->header.by_id_root == NULL) {
         return COUCHSTORE_ERROR_DOC_NOT_FOUND;
     }
@@ -524,6 +1105,11 @@ couchstore_error_t couchstore_docinfo_by_sequence(Db *db,
     if (errcode == COUCHSTORE_SUCCESS) {
         if (*pInfo == NULL) {
             errcode = COUCHSTORE_ERROR_DOC_NOT_FOUND;
+        } else if (db->memtable && memtable_find(db->memtable, &(*pInfo)->id)) {
+            // The memtable has a newer revision, so this sequence is obsolete:
+            couchstore_free_docinfo(*pInfo);
+            *pInfo = NULL;
+            errcode = COUCHSTORE_ERROR_DOC_NOT_FOUND;
         }
     }
     return errcode;
@@ -546,7 +1132,7 @@ couchstore_error_t couchstore_open_doc_with_docinfo(Db *db,
         options &= ~DECOMPRESS_DOC_BODIES;
     }
 
-    errcode = bp_to_doc(pDoc, db, docinfo->bp, options);
+    errcode = bp_to_doc(pDoc, db, docinfo, options);
     if (errcode == COUCHSTORE_SUCCESS) {
         (*pDoc)->id.buf = docinfo->id.buf;
         (*pDoc)->id.size = docinfo->id.size;
@@ -580,6 +1166,76 @@ couchstore_error_t couchstore_open_document(Db *db,
     return errcode;
 }
 
+// Reads a doc body, using the given reusable buffers instead of allocating.
+static couchstore_error_t read_doc_body(Db *db,
+                                        const DocInfo *docinfo,
+                                        couchstore_open_options options,
+                                        sized_buf *scratch,
+                                        sized_buf *buffer,
+                                        sized_buf *body)
+{
+    int bodylen;
+
+    if (docinfo->bp == 0) {
+        return COUCHSTORE_ERROR_DOC_NOT_FOUND;
+    }
+
+    if ((options & DECOMPRESS_DOC_BODIES) &&
+            (docinfo->content_meta & COUCH_DOC_IS_COMPRESSED)) {
+        bodylen = pread_compressed_reusing(&db->file, docinfo->bp, scratch, buffer);
+        body->buf = buffer->buf;
+    } else {
+        const char *data = NULL;
+        bodylen = pread_bin_reusing(&db->file, docinfo->bp, buffer, &data);
+        if (bodylen >= 0 && (docinfo->content_meta & COUCH_DOC_IS_COMPRESSED)) {
+            bodylen = compressed_to_snappy(&db->file, data, bodylen, scratch, &data);
+        }
+        body->buf = (char *) data;
+    }
+    if (bodylen < 0) {
+        return (couchstore_error_t) bodylen;
+    }
+    body->size = bodylen;
+    return COUCHSTORE_SUCCESS;
+}
+
+LIBCOUCHSTORE_API
+couchstore_error_t couchstore_visit_doc_body(Db *db,
+                                             const DocInfo *docinfo,
+                                             couchstore_open_options options,
+                                             couchstore_body_visitor_fn callback,
+                                             void *ctx)
+{
+    sized_buf body;
+    sized_buf local_scratch[2] = {{NULL, 0}, {NULL, 0}};
+    // A shared handle may be in use by other threads, so it can't lend its buffers:
+    sized_buf *scratch = db->shared ? &local_scratch[0] : &db->read_scratch;
+    sized_buf *buffer = db->shared ? &local_scratch[1] : &db->body_scratch;
+    couchstore_error_t errcode = read_doc_body(db, docinfo, options, scratch, buffer, &body);
+    if (errcode == COUCHSTORE_SUCCESS) {
+        errcode = (couchstore_error_t) callback(db, docinfo, &body, ctx);
+    }
+    free(local_scratch[0].buf);
+    free(local_scratch[1].buf);
+    return errcode;
+}
+
+LIBCOUCHSTORE_API
+couchstore_error_t couchstore_read_doc_body(Db *db,
+                                            const DocInfo *docinfo,
+                                            sized_buf *buffer,
+                                            sized_buf *body,
+                                            couchstore_open_options options)
+{
+    if (db->shared) {
+        sized_buf scratch = {NULL, 0};
+        couchstore_error_t errcode = read_doc_body(db, docinfo, options, &scratch, buffer, body);
+        free(scratch.buf);
+        return errcode;
+    }
+    return read_doc_body(db, docinfo, options, &db->read_scratch, buffer, body);
+}
+
 // context info passed to lookup_callback via btree_lookup
 typedef struct {
     Db *db;
@@ -589,32 +1245,43 @@ typedef struct {
     int by_id;
     int depth;
     couchstore_walk_tree_callback_fn walk_callback;
+    memtable *memtable;         // Memtable to merge into the results, if any
+    memtable_entry *mem_next;   // Next memtable entry to pass on, for an iteration by ID
+    int bounded;                // If nonzero, the iteration stops after end_key or end_seq
+    const sized_buf *end_key;   // Last ID to pass on, or NULL for no limit
+    uint64_t end_seq;           // Last sequence to pass on
+    uint64_t remaining;         // How many more DocInfos to pass on, or 0 for no limit
+    int stopped;                // Set when the end or the limit has been reached
 } lookup_context;
 
-// btree_lookup callback, called while iterating keys
-static couchstore_error_t lookup_callback(couchfile_lookup_request *rq,
-                                          void *k, sized_buf *v)
+// Returns nonzero if a DocInfo is past the end of a bounded iteration's range.
+static int past_end(const lookup_context *context, const DocInfo *docinfo)
 {
-    if (v == NULL) {
-        return COUCHSTORE_SUCCESS;
-    }
-
-    const lookup_context *context = rq->callback_ctx;
-    sized_buf *seqterm = (sized_buf *) k;
-    DocInfo *docinfo = NULL;
-    couchstore_error_t errcode;
+    int cmp;
     if (context->by_id) {
-        errcode = by_id_read_docinfo(&docinfo, seqterm, v);
+        if (!context->end_key) {
+            return 0;
+        }
+        cmp = ebin_cmp(&docinfo->id, context->end_key);
     } else {
-        errcode = by_seq_read_docinfo(&docinfo, seqterm, v);
+        cmp = (docinfo->db_seq > context->end_seq) - (docinfo->db_seq < context->end_seq);
     }
-    if (errcode == COUCHSTORE_ERROR_CORRUPT && (context->options & COUCHSTORE_INCLUDE_CORRUPT_DOCS)) {
-        // Invoke callback even if doc info is corrupted/unreadable, if magic flag is set
-        docinfo = calloc(sizeof(DocInfo), 1);
-        docinfo->id = *seqterm;
-        docinfo->rev_meta = *v;
-    } else if (errcode) {
-        return errcode;
+    if (context->options & COUCHSTORE_DESCENDING) {
+        cmp = -cmp;
+    }
+    return cmp > 0 || (cmp == 0 && (context->options & COUCHSTORE_EXCLUSIVE_END));
+}
+
+// Filters a DocInfo by the iteration's options and passes it to the callback, which takes
+// over the DocInfo if it returns a positive value. Returns COUCHSTORE_ERROR_CANCEL, setting
+// 'stopped', once a bounded iteration is done.
+static couchstore_error_t deliver_docinfo(lookup_context *context, DocInfo *docinfo)
+{
+    couchstore_error_t errcode;
+    if (context->bounded && past_end(context, docinfo)) {
+        couchstore_free_docinfo(docinfo);
+        context->stopped = 1;
+        return COUCHSTORE_ERROR_CANCEL;
     }
 
     if ((context->options & COUCHSTORE_DELETES_ONLY) && docinfo->deleted == 0) {
@@ -641,84 +1308,260 @@ static couchstore_error_t lookup_callback(couchfile_lookup_request *rq,
         couchstore_free_docinfo(docinfo);
     } else {
         // User requested docinfo not be freed, don't free it, return success
-        return COUCHSTORE_SUCCESS;
+        errcode = COUCHSTORE_SUCCESS;
+    }
+    if (errcode == COUCHSTORE_SUCCESS && context->remaining > 0 && --context->remaining == 0) {
+        context->stopped = 1;
+        return COUCHSTORE_ERROR_CANCEL;
     }
     return errcode;
 }
 
-LIBCOUCHSTORE_API
-couchstore_error_t couchstore_changes_since(Db *db,
-                                            uint64_t since,
-                                            couchstore_docinfos_options options,
-                                            couchstore_changes_callback_fn callback,
-                                            void *ctx)
+static couchstore_error_t deliver_memtable_entry(lookup_context *context,
+                                                 const memtable_entry *entry)
 {
-    char since_termbuf[6];
-    sized_buf since_term;
-    sized_buf *keylist = &since_term;
-    lookup_context cbctx = {db, options, callback, ctx, 0, 0, NULL};
-    couchfile_lookup_request rq;
-    sized_buf cmptmp;
-    couchstore_error_t errcode;
+    DocInfo *docinfo = copy_docinfo(memtable_entry_info(entry));
+    if (!docinfo) {
+        return COUCHSTORE_ERROR_ALLOC_FAIL;
+    }
+    return deliver_docinfo(context, docinfo);
+}
 
-    if (db->header.by_seq_root == NULL) {
+// Merges the memtable into an iteration, before a DocInfo from the tree is passed on. Sets
+// *superseded if the memtable has a newer revision of the doc, so that this one is dropped.
+static couchstore_error_t merge_memtable(lookup_context *context, const DocInfo *docinfo,
+                                         int *superseded)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    if (!context->by_id) {
+        // Everything in the memtable comes after everything in the tree, by sequence:
+        *superseded = (memtable_find(context->memtable, &docinfo->id) != NULL);
         return COUCHSTORE_SUCCESS;
     }
+    while (context->mem_next &&
+           ebin_cmp(&memtable_entry_info(context->mem_next)->id, &docinfo->id) < 0) {
+        error_pass(deliver_memtable_entry(context, context->mem_next));
+        context->mem_next = memtable_next(context->mem_next);
+    }
+    *superseded = (context->mem_next &&
+                   ebin_cmp(&memtable_entry_info(context->mem_next)->id, &docinfo->id) == 0);
+cleanup:
+    return errcode;
+}
 
-    since_term.buf = since_termbuf;
-    since_term.size = 6;
-    *(raw_48*)since_term.buf = encode_raw48(since);
+// btree_lookup callback, called while iterating keys
+static couchstore_error_t lookup_callback(couchfile_lookup_request *rq,
+                                          void *k, sized_buf *v)
+{
+    if (v == NULL) {
+        return COUCHSTORE_SUCCESS;
+    }
 
-    rq.cmp.compare = seq_cmp;
-    rq.cmp.arg = &cmptmp;
-    rq.file = &db->file;
-    rq.num_keys = 1;
-    rq.keys = &keylist;
-    rq.callback_ctx = &cbctx;
-    rq.fetch_callback = lookup_callback;
-    rq.node_callback = NULL;
-    rq.fold = 1;
+    lookup_context *context = rq->callback_ctx;
+    sized_buf *seqterm = (sized_buf *) k;
+    DocInfo *docinfo = NULL;
+    couchstore_error_t errcode;
+    if (context->by_id) {
+        errcode = by_id_read_docinfo(&docinfo, seqterm, v);
+    } else {
+        errcode = by_seq_read_docinfo(&docinfo, seqterm, v);
+    }
+    if (errcode == COUCHSTORE_ERROR_CORRUPT && (context->options & COUCHSTORE_INCLUDE_CORRUPT_DOCS)) {
+        // Invoke callback even if doc info is corrupted/unreadable, if magic flag is set
+        docinfo = calloc(sizeof(DocInfo), 1);
+        docinfo->id = *seqterm;
+        docinfo->rev_meta = *v;
+    } else if (errcode) {
+        return errcode;
+    }
 
-    errcode = btree_lookup(&rq, db->header.by_seq_root->pointer);
+    if (context->memtable) {
+        int superseded = 0;
+        errcode = merge_memtable(context, docinfo, &superseded);
+        if (errcode < 0 || superseded) {
+            couchstore_free_docinfo(docinfo);
+            return errcode;
+        }
+    }
+    return deliver_docinfo(context, docinfo);
+}
+
+// Passes on the memtable entries an iteration hasn't reached yet, once the tree is done.
+static couchstore_error_t finish_memtable(lookup_context *context, uint64_t since)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    memtable_entry *entry;
+    DocInfo **infos = NULL;
+    size_t count = 0, i = 0;
+    if (context->by_id) {
+        for (entry = context->mem_next; entry; entry = memtable_next(entry)) {
+            error_pass(deliver_memtable_entry(context, entry));
+        }
+        return COUCHSTORE_SUCCESS;
+    }
+
+    // Saving a doc moves its entry to the end of the sequence order, so a save from the
+    // callback would derail a walk of the live list. Snapshot the entries first:
+    for (entry = memtable_since(context->memtable, since); entry;
+            entry = memtable_next_seq(entry)) {
+        ++count;
+    }
+    if (count == 0) {
+        return COUCHSTORE_SUCCESS;
+    }
+    infos = calloc(count, sizeof(DocInfo*));
+    error_unless(infos, COUCHSTORE_ERROR_ALLOC_FAIL);
+    for (entry = memtable_since(context->memtable, since); entry;
+            entry = memtable_next_seq(entry)) {
+        infos[i] = copy_docinfo(memtable_entry_info(entry));
+        error_unless(infos[i], COUCHSTORE_ERROR_ALLOC_FAIL);
+        ++i;
+    }
+    for (i = 0; i < count; ++i) {
+        DocInfo *docinfo = infos[i];
+        infos[i] = NULL;
+        error_pass(deliver_docinfo(context, docinfo));
+    }
+cleanup:
+    if (infos) {
+        for (i = 0; i < count; ++i) {
+            couchstore_free_docinfo(infos[i]);
+        }
+        free(infos);
+    }
     return errcode;
 }
 
-LIBCOUCHSTORE_API
-couchstore_error_t couchstore_all_docs(Db *db,
-                                       const sized_buf* startKeyPtr,
-                                       couchstore_docinfos_options options,
-                                       couchstore_changes_callback_fn callback,
-                                       void *ctx)
+// Common subroutine of couchstore_changes_range and couchstore_all_docs_range
+static couchstore_error_t iterate_range(Db *db,
+                                        sized_buf *start,
+                                        sized_buf *end,
+                                        lookup_context *cbctx)
 {
-    sized_buf startKey = {NULL, 0};
-    sized_buf *keylist = &startKey;
-    lookup_context cbctx = {db, options, callback, ctx, 1, 0, NULL};
+    sized_buf *keylist[2] = {start, end};
     couchfile_lookup_request rq;
     sized_buf cmptmp;
-    couchstore_error_t errcode;
+    const node_pointer *root;
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
 
-    if (db->header.by_id_root == NULL) {
-        return COUCHSTORE_SUCCESS;
+    if (cbctx->options & COUCHSTORE_DESCENDING) {
+        // The memtable can only be merged in ascending order:
+        error_pass(db_flush_memtable(db));
+    } else if (db->memtable) {
+        // (Retained, as a save from the callback may flush the db's memtable and replace it)
+        cbctx->memtable = memtable_retain(db->memtable);
+        if (cbctx->by_id) {
+            cbctx->mem_next = memtable_seek(cbctx->memtable, start);
+        }
     }
-
-    if (startKeyPtr) {
-        startKey = *startKeyPtr;
+    root = cbctx->by_id ? db->header.by_id_root : db->header.by_seq_root;
+    if (root == NULL) {
+        goto finish;
     }
 
-    rq.cmp.compare = ebin_cmp;
+    rq.cmp.compare = cbctx->by_id ? ebin_cmp : seq_cmp;
     rq.cmp.arg = &cmptmp;
     rq.file = &db->file;
-    rq.num_keys = 1;
-    rq.keys = &keylist;
-    rq.callback_ctx = &cbctx;
+    rq.num_keys = end ? 2 : 1;
+    rq.keys = keylist;
+    rq.callback_ctx = cbctx;
     rq.fetch_callback = lookup_callback;
     rq.node_callback = NULL;
     rq.fold = 1;
 
-    errcode = btree_lookup(&rq, db->header.by_id_root->pointer);
+    if (cbctx->options & COUCHSTORE_DESCENDING) {
+        errcode = btree_lookup_reverse(&rq, root->pointer);
+    } else {
+        errcode = btree_lookup(&rq, root->pointer);
+    }
+finish:
+    if (cbctx->memtable && errcode == COUCHSTORE_SUCCESS) {
+        errcode = finish_memtable(cbctx, cbctx->by_id ? 0 : decode_sequence_key(start));
+    }
+    if (errcode == COUCHSTORE_ERROR_CANCEL && cbctx->stopped) {
+        errcode = COUCHSTORE_SUCCESS;
+    }
+cleanup:
+    memtable_release(cbctx->memtable);
     return errcode;
 }
 
+LIBCOUCHSTORE_API
+couchstore_error_t couchstore_changes_range(Db *db,
+                                            uint64_t start,
+                                            uint64_t end,
+                                            uint64_t limit,
+                                            couchstore_docinfos_options options,
+                                            couchstore_changes_callback_fn callback,
+                                            void *ctx)
+{
+    raw_48 start_termbuf, end_termbuf;
+    sized_buf start_term = {(char*)&start_termbuf, 6};
+    sized_buf end_term = {(char*)&end_termbuf, 6};
+    lookup_context cbctx = {.db = db, .options = options, .callback = callback,
+                            .callback_context = ctx};
+
+    // Sequences are 48 bits, so larger bounds are no bounds:
+    start = start < MAX_SEQUENCE ? start : MAX_SEQUENCE;
+    end = end < MAX_SEQUENCE ? end : MAX_SEQUENCE;
+    start_termbuf = encode_raw48(start);
+    end_termbuf = encode_raw48(end);
+    cbctx.bounded = 1;
+    cbctx.end_seq = end;
+    cbctx.remaining = limit;
+    return iterate_range(db, &start_term, &end_term, &cbctx);
+}
+
+LIBCOUCHSTORE_API
+couchstore_error_t couchstore_changes_since(Db *db,
+                                            uint64_t since,
+                                            couchstore_docinfos_options options,
+                                            couchstore_changes_callback_fn callback,
+                                            void *ctx)
+{
+    options &= ~(COUCHSTORE_DESCENDING | COUCHSTORE_EXCLUSIVE_END);
+    return couchstore_changes_range(db, since, MAX_SEQUENCE, 0, options, callback, ctx);
+}
+
+LIBCOUCHSTORE_API
+couchstore_error_t couchstore_all_docs_range(Db *db,
+                                             const sized_buf *startKeyPtr,
+                                             const sized_buf *endKeyPtr,
+                                             uint64_t limit,
+                                             couchstore_docinfos_options options,
+                                             couchstore_changes_callback_fn callback,
+                                             void *ctx)
+{
+    sized_buf startKey = {NULL, 0}, endKey = {NULL, 0};
+    lookup_context cbctx = {.db = db, .options = options, .callback = callback,
+                            .callback_context = ctx, .by_id = 1};
+
+    if (startKeyPtr) {
+        startKey = *startKeyPtr;
+    }
+    if (endKeyPtr) {
+        endKey = *endKeyPtr;
+        cbctx.end_key = &endKey;
+    }
+    cbctx.bounded = 1;
+    cbctx.remaining = limit;
+    return iterate_range(db,
+                         (startKeyPtr || !(options & COUCHSTORE_DESCENDING)) ? &startKey : NULL,
+                         endKeyPtr ? &endKey : NULL,
+                         &cbctx);
+}
+
+LIBCOUCHSTORE_API
+couchstore_error_t couchstore_all_docs(Db *db,
+                                       const sized_buf* startKeyPtr,
+                                       couchstore_docinfos_options options,
+                                       couchstore_changes_callback_fn callback,
+                                       void *ctx)
+{
+    options &= ~(COUCHSTORE_DESCENDING | COUCHSTORE_EXCLUSIVE_END);
+    return couchstore_all_docs_range(db, startKeyPtr, NULL, 0, options, callback, ctx);
+}
+
 static couchstore_error_t walk_node_callback(struct couchfile_lookup_request *rq,
                                                  uint64_t subtreeSize,
                                                  const sized_buf *reduceValue)
@@ -771,7 +1614,8 @@ couchstore_error_t couchstore_walk_tree(Db *db,
     }
     sized_buf *keylist = &startKey;
 
-    lookup_context lookup_ctx = {db, options, NULL, ctx, by_id, 1, callback};
+    lookup_context lookup_ctx = {.db = db, .options = options, .callback_context = ctx,
+                                 .by_id = by_id, .depth = 1, .walk_callback = callback};
     sized_buf cmptmp;
     couchfile_lookup_request rq;
 
@@ -795,6 +1639,10 @@ couchstore_error_t couchstore_walk_id_tree(Db *db,
                                            couchstore_walk_tree_callback_fn callback,
                                            void *ctx)
 {
+    couchstore_error_t errcode = db_flush_memtable(db);
+    if (errcode != COUCHSTORE_SUCCESS) {
+        return errcode;
+    }
     return couchstore_walk_tree(db, 1, db->header.by_id_root, startDocID,
                                 options, ebin_cmp, callback, ctx);
 }
@@ -808,11 +1656,247 @@ couchstore_error_t couchstore_walk_seq_tree(Db *db,
 {
     raw_48 start_termbuf = encode_raw48(startSequence);
     sized_buf start_term = {(char*)&start_termbuf, 6};
+    couchstore_error_t errcode = db_flush_memtable(db);
+    if (errcode != COUCHSTORE_SUCCESS) {
+        return errcode;
+    }
 
     return couchstore_walk_tree(db, 0, db->header.by_seq_root, &start_term,
                                 options, seq_cmp, callback, ctx);
 }
 
+// A parallel scan of one of the trees (couchstore_all_docs_parallel and
+// couchstore_changes_parallel.) Each partition is a run of consecutive subtrees; worker threads
+// claim partitions in order until there are none left.
+typedef struct {
+    Db *db;
+    tree_file *file;                // What the workers read nodes from
+    int by_id;
+    couchstore_docinfos_options options;
+    couchstore_partition_callback_fn callback;
+    void *callback_context;
+    btree_subtree *subtrees;
+    size_t *partition_ends;         // Index past the last subtree of each partition
+    size_t num_partitions;
+    size_t next;                    // Next partition to be claimed
+    int stop;
+    couchstore_error_t errcode;
+    pthread_mutex_t lock;
+} parallel_scan;
+
+// context info of the partition a worker is scanning, passed to partition_callback
+typedef struct {
+    parallel_scan *scan;
+    int partition;
+} scan_partition_context;
+
+static uint64_t scan_count_reduce(couchfile_reduce_request *rq, const sized_buf *reduce_value)
+{
+    const parallel_scan *scan = rq->callback_ctx;
+    if (scan->by_id) {
+        const raw_by_id_reduce *reduce = (const raw_by_id_reduce*)reduce_value->buf;
+        return decode_raw40(reduce->notdeleted) + decode_raw40(reduce->deleted);
+    } else {
+        const raw_by_seq_reduce *reduce = (const raw_by_seq_reduce*)reduce_value->buf;
+        return decode_raw40(reduce->count);
+    }
+}
+
+// (The db passed on is the caller's, which is only safe to use from here if it's shared; see
+// couchstore_partition_callback_fn.)
+static int partition_callback(Db *db, DocInfo *info, void *ctx)
+{
+    const scan_partition_context *context = ctx;
+    return context->scan->callback(db, context->partition, info,
+                                   context->scan->callback_context);
+}
+
+static couchstore_error_t scan_partition(parallel_scan *scan, size_t partition)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    scan_partition_context pctx = {scan, (int)partition};
+    lookup_context cbctx = {.db = scan->db, .options = scan->options,
+                            .callback = partition_callback, .callback_context = &pctx,
+                            .by_id = scan->by_id};
+    sized_buf low_key = {(char*)"\0\0\0\0\0\0", scan->by_id ? 0 : 6};
+    sized_buf *keylist = &low_key;
+    couchfile_lookup_request rq;
+    sized_buf cmptmp;
+    size_t i = partition > 0 ? scan->partition_ends[partition - 1] : 0;
+
+    rq.cmp.compare = scan->by_id ? ebin_cmp : seq_cmp;
+    rq.cmp.arg = &cmptmp;
+    rq.file = scan->file;
+    rq.num_keys = 1;
+    rq.keys = &keylist;
+    rq.callback_ctx = &cbctx;
+    rq.fetch_callback = lookup_callback;
+    rq.node_callback = NULL;
+    for (; i < scan->partition_ends[partition] && errcode == COUCHSTORE_SUCCESS; ++i) {
+        // (Another partition failing stops this one at the next subtree)
+        pthread_mutex_lock(&scan->lock);
+        int stop = scan->stop;
+        pthread_mutex_unlock(&scan->lock);
+        if (stop) {
+            break;
+        }
+        rq.fold = 1;
+        errcode = btree_lookup(&rq, scan->subtrees[i].pointer);
+    }
+    return errcode;
+}
+
+static void *scan_thread(void *arg)
+{
+    parallel_scan *scan = arg;
+    pthread_mutex_lock(&scan->lock);
+    while (!scan->stop && scan->next < scan->num_partitions) {
+        size_t partition = scan->next++;
+        pthread_mutex_unlock(&scan->lock);
+        couchstore_error_t errcode = scan_partition(scan, partition);
+        pthread_mutex_lock(&scan->lock);
+        if (errcode != COUCHSTORE_SUCCESS && !scan->stop) {
+            scan->stop = 1;
+            scan->errcode = errcode;
+        }
+    }
+    pthread_mutex_unlock(&scan->lock);
+    return NULL;
+}
+
+// Groups the subtrees into partitions of about equal weight, each with at least one subtree
+static void plan_partitions(parallel_scan *scan, size_t num_subtrees, size_t num_partitions)
+{
+    uint64_t total = 0, done = 0;
+    size_t i, p = 0;
+    for (i = 0; i < num_subtrees; ++i) {
+        total += scan->subtrees[i].weight;
+    }
+    if (num_partitions > num_subtrees) {
+        num_partitions = num_subtrees;
+    }
+    for (i = 0; i < num_subtrees; ++i) {
+        done += scan->subtrees[i].weight;
+        if (p + 1 < num_partitions &&
+                (done * num_partitions >= total * (p + 1) ||
+                 num_subtrees - (i + 1) == num_partitions - (p + 1))) {
+            scan->partition_ends[p++] = i + 1;
+        }
+    }
+    scan->partition_ends[p] = num_subtrees;
+    scan->num_partitions = p + 1;
+}
+
+static couchstore_error_t parallel_scan_tree(Db *db,
+                                             int by_id,
+                                             unsigned partitions,
+                                             unsigned threads,
+                                             couchstore_docinfos_options options,
+                                             couchstore_partition_callback_fn callback,
+                                             void *ctx)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    parallel_scan scan;
+    couchfile_reduce_request rq;
+    tree_file scan_file;
+    int have_scan_file = 0;
+    size_t num_subtrees = 0, i;
+    pthread_t workers[SCAN_MAX_THREADS];
+    size_t nworkers = 0;
+    const node_pointer *root;
+
+    if (partitions == 0) {
+        return COUCHSTORE_ERROR_INVALID_ARGUMENTS;
+    }
+    memset(&scan, 0, sizeof(scan));
+    pthread_mutex_init(&scan.lock, NULL);
+
+    // The workers read the trees straight from the file:
+    error_pass(db_flush_memtable(db));
+    error_pass(db_write_dirty_nodes(db));
+    root = by_id ? db->header.by_id_root : db->header.by_seq_root;
+    if (root == NULL) {
+        goto cleanup;
+    }
+    if (db->shared) {
+        scan.file = &db->file;
+    } else {
+        // The db's own handle can only be read by one thread at a time, so open one that can
+        // be shared. It uses the db's node cache entries, as it reads the same nodes.
+        error_pass(tree_file_flush(&db->file));
+        error_pass(tree_file_open(&scan_file, db->file.path, O_RDONLY, 1, db->file_ops));
+        have_scan_file = 1;
+        scan_file.cache_id = db->file.cache_id;
+        scan_file.codec_tags = db->file.codec_tags;
+        scan.file = &scan_file;
+    }
+
+    scan.db = db;
+    scan.by_id = by_id;
+    scan.options = options;
+    scan.callback = callback;
+    scan.callback_context = ctx;
+    memset(&rq, 0, sizeof(rq));
+    rq.file = scan.file;
+    rq.callback_ctx = &scan;
+    rq.count_reduce = scan_count_reduce;
+    error_pass(btree_partition(&rq, root, (size_t)partitions * SCAN_SUBTREES_PER_PARTITION,
+                               &scan.subtrees, &num_subtrees));
+    scan.partition_ends = malloc(partitions * sizeof(size_t));
+    error_unless(scan.partition_ends, COUCHSTORE_ERROR_ALLOC_FAIL);
+    plan_partitions(&scan, num_subtrees, partitions);
+
+    if (threads > scan.num_partitions) {
+        threads = (unsigned)scan.num_partitions;
+    }
+    if (threads > SCAN_MAX_THREADS) {
+        threads = SCAN_MAX_THREADS;
+    }
+    while (threads > 1 && nworkers < threads &&
+           pthread_create(&workers[nworkers], NULL, scan_thread, &scan) == 0) {
+        ++nworkers;
+    }
+    if (nworkers == 0) {
+        scan_thread(&scan);
+    }
+    for (i = 0; i < nworkers; ++i) {
+        pthread_join(workers[i], NULL);
+    }
+    errcode = scan.errcode;
+
+cleanup:
+    if (have_scan_file) {
+        scan_file.cache_id = 0;     // The db's entries aren't this handle's to forget
+        tree_file_close(&scan_file);
+    }
+    free(scan.subtrees);
+    free(scan.partition_ends);
+    pthread_mutex_destroy(&scan.lock);
+    return errcode;
+}
+
+LIBCOUCHSTORE_API
+couchstore_error_t couchstore_all_docs_parallel(Db *db,
+                                                unsigned partitions,
+                                                unsigned threads,
+                                                couchstore_docinfos_options options,
+                                                couchstore_partition_callback_fn callback,
+                                                void *ctx)
+{
+    return parallel_scan_tree(db, 1, partitions, threads, options, callback, ctx);
+}
+
+LIBCOUCHSTORE_API
+couchstore_error_t couchstore_changes_parallel(Db *db,
+                                               unsigned partitions,
+                                               unsigned threads,
+                                               couchstore_docinfos_options options,
+                                               couchstore_partition_callback_fn callback,
+                                               void *ctx)
+{
+    return parallel_scan_tree(db, 0, partitions, threads, options, callback, ctx);
+}
+
 static int id_ptr_cmp(const void *a, const void *b)
 {
     sized_buf **buf1 = (sized_buf**) a;
@@ -858,7 +1942,8 @@ static couchstore_error_t iterate_docinfos(Db *db,
     }
 
     // Construct the lookup request:
-    lookup_context cbctx = {db, 0, callback, ctx, (tree == db->header.by_id_root), 0, NULL};
+    lookup_context cbctx = {.db = db, .callback = callback, .callback_context = ctx,
+                            .by_id = (tree == db->header.by_id_root)};
     couchfile_lookup_request rq;
     sized_buf cmptmp;
     rq.cmp.compare = key_compare;
@@ -886,6 +1971,10 @@ couchstore_error_t couchstore_docinfos_by_id(Db *db,
                                              couchstore_changes_callback_fn callback,
                                              void *ctx)
 {
+    couchstore_error_t errcode = db_flush_memtable(db);
+    if (errcode != COUCHSTORE_SUCCESS) {
+        return errcode;
+    }
     return iterate_docinfos(db, ids, numDocs,
                             db->header.by_id_root, id_ptr_cmp, ebin_cmp,
                             callback,
@@ -906,6 +1995,7 @@ couchstore_error_t couchstore_docinfos_by_sequence(Db *db,
     raw_by_seq_key *keyvalues = malloc(numDocs * sizeof(raw_by_seq_key));
     couchstore_error_t errcode;
     error_unless(keylist && keyvalues, COUCHSTORE_ERROR_ALLOC_FAIL);
+    error_pass(db_flush_memtable(db));
     unsigned i;
     for (i = 0; i< numDocs; ++i) {
         keyvalues[i].sequence = encode_raw48(sequence[i]);
@@ -926,6 +2016,10 @@ cleanup:
 
 LIBCOUCHSTORE_API
 couchstore_error_t couchstore_db_info(Db *db, DbInfo* dbinfo) {
+    couchstore_error_t errcode = db_flush_memtable(db);
+    if (errcode != COUCHSTORE_SUCCESS) {
+        return errcode;
+    }
     const node_pointer *id_root = db->header.by_id_root;
     const node_pointer *seq_root = db->header.by_seq_root;
     const node_pointer *local_root = db->header.local_docs_root;
@@ -949,6 +2043,184 @@ couchstore_error_t couchstore_db_info(Db *db, DbInfo* dbinfo) {
     return COUCHSTORE_SUCCESS;
 }
 
+static couchstore_error_t count_id_reduce(couchfile_reduce_request *rq,
+                                          const sized_buf *reduce_value)
+{
+    DocRangeInfo *info = rq->callback_ctx;
+    const raw_by_id_reduce *reduce = (const raw_by_id_reduce*)reduce_value->buf;
+    info->doc_count += decode_raw40(reduce->notdeleted);
+    info->deleted_count += decode_raw40(reduce->deleted);
+    info->size += decode_raw48(reduce->size);
+    return COUCHSTORE_SUCCESS;
+}
+
+static couchstore_error_t count_id_value(couchfile_reduce_request *rq,
+                                         const sized_buf *k,
+                                         const sized_buf *v)
+{
+    DocRangeInfo *info = rq->callback_ctx;
+    const raw_id_index_value *raw = (const raw_id_index_value*)v->buf;
+    (void)k;
+    if (decode_raw48(raw->bp) & BP_DELETED_FLAG) {
+        info->deleted_count++;
+    } else {
+        info->doc_count++;
+    }
+    info->size += decode_raw32(raw->size);
+    return COUCHSTORE_SUCCESS;
+}
+
+LIBCOUCHSTORE_API
+couchstore_error_t couchstore_count_docs_range(Db *db,
+                                               const sized_buf *startKeyPtr,
+                                               const sized_buf *endKeyPtr,
+                                               couchstore_docinfos_options options,
+                                               DocRangeInfo *info)
+{
+    couchfile_reduce_request rq;
+    couchstore_error_t errcode = db_flush_memtable(db);
+    memset(info, 0, sizeof(DocRangeInfo));
+    if (errcode != COUCHSTORE_SUCCESS || db->header.by_id_root == NULL) {
+        return errcode;
+    }
+
+    memset(&rq, 0, sizeof(rq));
+    rq.cmp.compare = ebin_cmp;
+    rq.file = &db->file;
+    rq.start = startKeyPtr;
+    rq.end = endKeyPtr;
+    rq.exclusive_end = (options & COUCHSTORE_EXCLUSIVE_END) != 0;
+    rq.callback_ctx = info;
+    rq.reduce_callback = count_id_reduce;
+    rq.value_callback = count_id_value;
+    return btree_reduce_range(&rq, db->header.by_id_root);
+}
+
+static couchstore_error_t count_seq_reduce(couchfile_reduce_request *rq,
+                                           const sized_buf *reduce_value)
+{
+    const raw_by_seq_reduce *reduce = (const raw_by_seq_reduce*)reduce_value->buf;
+    *(uint64_t*)rq->callback_ctx += decode_raw40(reduce->count);
+    return COUCHSTORE_SUCCESS;
+}
+
+static couchstore_error_t count_seq_value(couchfile_reduce_request *rq,
+                                          const sized_buf *k,
+                                          const sized_buf *v)
+{
+    (void)k;
+    (void)v;
+    ++*(uint64_t*)rq->callback_ctx;
+    return COUCHSTORE_SUCCESS;
+}
+
+LIBCOUCHSTORE_API
+couchstore_error_t couchstore_count_changes_range(Db *db,
+                                                  uint64_t start,
+                                                  uint64_t end,
+                                                  couchstore_docinfos_options options,
+                                                  uint64_t *count)
+{
+    raw_48 start_termbuf, end_termbuf;
+    sized_buf start_term = {(char*)&start_termbuf, 6};
+    sized_buf end_term = {(char*)&end_termbuf, 6};
+    couchfile_reduce_request rq;
+    couchstore_error_t errcode = db_flush_memtable(db);
+    *count = 0;
+    if (errcode != COUCHSTORE_SUCCESS || db->header.by_seq_root == NULL) {
+        return errcode;
+    }
+
+    start_termbuf = encode_raw48(start < MAX_SEQUENCE ? start : MAX_SEQUENCE);
+    end_termbuf = encode_raw48(end < MAX_SEQUENCE ? end : MAX_SEQUENCE);
+    memset(&rq, 0, sizeof(rq));
+    rq.cmp.compare = seq_cmp;
+    rq.file = &db->file;
+    rq.start = start > 0 ? &start_term : NULL;
+    rq.end = end < MAX_SEQUENCE ? &end_term : NULL;
+    rq.exclusive_end = (options & COUCHSTORE_EXCLUSIVE_END) != 0;
+    rq.callback_ctx = count;
+    rq.reduce_callback = count_seq_reduce;
+    rq.value_callback = count_seq_value;
+    return btree_reduce_range(&rq, db->header.by_seq_root);
+}
+
+// context info passed to the btree_seek_nth callbacks by couchstore_docinfo_by_offset
+typedef struct {
+    couchstore_docinfos_options options;
+    DocInfo **pInfo;
+} offset_context;
+
+static uint64_t offset_count_reduce(couchfile_reduce_request *rq, const sized_buf *reduce_value)
+{
+    const offset_context *context = rq->callback_ctx;
+    const raw_by_id_reduce *reduce = (const raw_by_id_reduce*)reduce_value->buf;
+    uint64_t count = 0;
+    if (!(context->options & COUCHSTORE_DELETES_ONLY)) {
+        count += decode_raw40(reduce->notdeleted);
+    }
+    if (!(context->options & COUCHSTORE_NO_DELETES)) {
+        count += decode_raw40(reduce->deleted);
+    }
+    return count;
+}
+
+static int offset_count_value(couchfile_reduce_request *rq, const sized_buf *k,
+                              const sized_buf *v)
+{
+    const offset_context *context = rq->callback_ctx;
+    const raw_id_index_value *raw = (const raw_id_index_value*)v->buf;
+    (void)k;
+    if (decode_raw48(raw->bp) & BP_DELETED_FLAG) {
+        return !(context->options & COUCHSTORE_NO_DELETES);
+    } else {
+        return !(context->options & COUCHSTORE_DELETES_ONLY);
+    }
+}
+
+static couchstore_error_t offset_found(couchfile_reduce_request *rq,
+                                       const sized_buf *k,
+                                       const sized_buf *v)
+{
+    const offset_context *context = rq->callback_ctx;
+    sized_buf key = *k, value = *v;
+    return by_id_read_docinfo(context->pInfo, &key, &value);
+}
+
+LIBCOUCHSTORE_API
+couchstore_error_t couchstore_docinfo_by_offset(Db *db,
+                                                uint64_t offset,
+                                                couchstore_docinfos_options options,
+                                                DocInfo **pInfo)
+{
+    couchfile_reduce_request rq;
+    offset_context context = {options, pInfo};
+    couchstore_error_t errcode = db_flush_memtable(db);
+    *pInfo = NULL;
+    if (errcode != COUCHSTORE_SUCCESS) {
+        return errcode;
+    }
+    if (db->header.by_id_root == NULL) {
+        return COUCHSTORE_ERROR_DOC_NOT_FOUND;
+    }
+
+    memset(&rq, 0, sizeof(rq));
+    rq.cmp.compare = ebin_cmp;
+    rq.file = &db->file;
+    rq.callback_ctx = &context;
+    rq.value_callback = offset_found;
+    rq.count_reduce = offset_count_reduce;
+    rq.count_value = offset_count_value;
+    if (options & COUCHSTORE_DESCENDING) {
+        uint64_t count = offset_count_reduce(&rq, &db->header.by_id_root->reduce_value);
+        if (offset >= count) {
+            return COUCHSTORE_ERROR_DOC_NOT_FOUND;
+        }
+        offset = count - 1 - offset;
+    }
+    return btree_seek_nth(&rq, db->header.by_id_root, offset);
+}
+
 static couchstore_error_t local_doc_fetch(couchfile_lookup_request *rq,
                                           void *k,
                                           sized_buf *v)
@@ -1051,6 +2323,7 @@ couchstore_error_t couchstore_save_local_document(Db *db, LocalDoc *lDoc)
     if (errcode == COUCHSTORE_SUCCESS && nroot != db->header.local_docs_root) {
         free(db->header.local_docs_root);
         db->header.local_docs_root = nroot;
+        errcode = db_trim_dirty_nodes(db);
     }
 
     return errcode;
@@ -5,10 +5,12 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
-#include <snappy-c.h>
 
 #include "internal.h"
+#include "codec.h"
+#include "dirty_nodes.h"
 #include "iobuffer.h"
+#include "node_cache.h"
 #include "bitfield.h"
 #include "crc32.h"
 #include "util.h"
@@ -18,13 +20,14 @@
 couchstore_error_t tree_file_open(tree_file* file,
                                   const char *filename,
                                   int openflags,
+                                  int shared,
                                   const couch_file_ops *ops)
 {
     couchstore_error_t errcode = COUCHSTORE_SUCCESS;
 
     /* Sanity check input parameters */
     if (filename == NULL || file == NULL || ops == NULL ||
-            ops->version != 4 || ops->constructor == NULL || ops->open == NULL ||
+            ops->version < 4 || ops->version > 7 || ops->constructor == NULL || ops->open == NULL ||
             ops->close == NULL || ops->pread == NULL ||
             ops->pwrite == NULL || ops->goto_eof == NULL ||
             ops->sync == NULL || ops->destructor == NULL) {
@@ -36,10 +39,20 @@ couchstore_error_t tree_file_open(tree_file* file,
     file->path = strdup(filename);
     error_unless(file->path, COUCHSTORE_ERROR_ALLOC_FAIL);
 
-    file->ops = couch_get_buffered_file_ops(ops, &file->handle);
-    error_unless(file->ops, COUCHSTORE_ERROR_ALLOC_FAIL);
+    if (ops->version >= 5 && ops->pread_ptr && (openflags & (O_WRONLY | O_RDWR)) == 0) {
+        // Reads come straight from memory, so buffering would only add copies:
+        file->ops = ops;
+        file->handle = ops->constructor(ops->cookie);
+    } else if (shared) {
+        file->ops = couch_get_shared_file_ops(ops, &file->handle);
+        error_unless(file->ops, COUCHSTORE_ERROR_ALLOC_FAIL);
+    } else {
+        file->ops = couch_get_buffered_file_ops(ops, &file->handle);
+        error_unless(file->ops, COUCHSTORE_ERROR_ALLOC_FAIL);
+    }
 
     error_pass(file->ops->open(&file->handle, filename, openflags));
+    node_cache_open_file(file);
 
 cleanup:
     return errcode;
@@ -47,10 +60,17 @@ cleanup:
 
 void tree_file_close(tree_file* file)
 {
+    if (file->cache_id) {
+        node_cache_close_file(file);
+    }
     if (file->ops) {
         file->ops->close(file->handle);
         file->ops->destructor(file->handle);
     }
+    codec_dict_free(file->dict);
+    file->dict = NULL;
+    dirty_nodes_free(file->dirty);
+    file->dirty = NULL;
     free((char*)file->path);
 }
 
@@ -81,10 +101,43 @@ static couchstore_error_t read_skipping_prefixes(tree_file *file, cs_off_t *pos,
     return COUCHSTORE_SUCCESS;
 }
 
-/** Common subroutine of pread_bin, pread_compressed and pread_header.
-    Parameters and return value are the same as for pread_bin,
-    except the 'header' parameter which is 1 if reading a header, 0 otherwise. */
-static int pread_bin_internal(tree_file *file, cs_off_t pos, char **ret_ptr, int header)
+/** Returns a pointer to 'len' bytes of file data at 'pos' in the file's memory mapping,
+    or NULL if the file isn't mapped or that range isn't available. */
+static const char *borrow_bytes(tree_file *file, cs_off_t pos, size_t len)
+{
+    if (file->ops->version < 5 || file->ops->pread_ptr == NULL) {
+        return NULL;
+    }
+    const void *ptr;
+    ssize_t got = file->ops->pread_ptr(file->handle, &ptr, len, pos);
+    if (got < (ssize_t)len) {
+        return NULL;
+    }
+    return ptr;
+}
+
+/** Makes sure a reusable buffer can hold at least 'size' bytes, growing it if needed. */
+static couchstore_error_t reserve_buffer(sized_buf *buffer, size_t size)
+{
+    if (buffer->size < size) {
+        char *newbuf = realloc(buffer->buf, size);
+        if (!newbuf) {
+            return COUCHSTORE_ERROR_ALLOC_FAIL;
+        }
+        buffer->buf = newbuf;
+        buffer->size = size;
+    }
+    return COUCHSTORE_SUCCESS;
+}
+
+/** Common subroutine of pread_bin, pread_bin_borrowed, pread_bin_reusing, pread_compressed and
+    pread_header. Parameters and return value are the same as for pread_bin_borrowed, except:
+    'borrowed' may be NULL to require data in a buffer;
+    'reuse', if not NULL, is a reusable buffer to read into instead of a new malloced one;
+    'header' is 1 if reading a header, 0 otherwise;
+    'crc', if not NULL, receives the chunk's stored CRC, which then isn't verified. */
+static int pread_bin_internal(tree_file *file, cs_off_t pos, char **ret_ptr, int *borrowed,
+                              sized_buf *reuse, int header, uint32_t *crc)
 {
     struct {
         uint32_t chunk_len;
@@ -103,17 +156,53 @@ static int pread_bin_internal(tree_file *file, cs_off_t pos, char **ret_ptr, int
         info.chunk_len -= 4;    //Header len includes CRC len.
     }
     info.crc32 = ntohl(info.crc32);
+    if (crc) {
+        *crc = info.crc32;
+        info.crc32 = 0;     // i.e. don't check it
+    }
 
-    char* buf = malloc(info.chunk_len);
-    if (!buf) {
-        return COUCHSTORE_ERROR_ALLOC_FAIL;
+    if (borrowed) {
+        *borrowed = 0;
+        // The data can only be used in place if no block prefix byte is inside it:
+        cs_off_t datapos = pos;
+        if (datapos % COUCH_BLOCK_SIZE == 0) {
+            ++datapos;
+        }
+        if (info.chunk_len > 0 &&
+                datapos % COUCH_BLOCK_SIZE + info.chunk_len <= COUCH_BLOCK_SIZE) {
+            const char *data = borrow_bytes(file, datapos, info.chunk_len);
+            if (data) {
+                if (info.crc32 && info.crc32 != hash_crc32(data, info.chunk_len)) {
+                    return COUCHSTORE_ERROR_CHECKSUM_FAIL;
+                }
+                *ret_ptr = (char*)data;
+                *borrowed = 1;
+                return info.chunk_len;
+            }
+        }
+    }
+
+    char* buf;
+    if (reuse) {
+        err = reserve_buffer(reuse, info.chunk_len);
+        if (err < 0) {
+            return err;
+        }
+        buf = reuse->buf;
+    } else {
+        buf = malloc(info.chunk_len);
+        if (!buf) {
+            return COUCHSTORE_ERROR_ALLOC_FAIL;
+        }
     }
     err = read_skipping_prefixes(file, &pos, info.chunk_len, buf);
     if (!err && info.crc32 && info.crc32 != hash_crc32(buf, info.chunk_len)) {
         err = COUCHSTORE_ERROR_CHECKSUM_FAIL;
     }
     if (err < 0) {
-        free(buf);
+        if (!reuse) {
+            free(buf);
+        }
         return err;
     }
 
@@ -123,33 +212,43 @@ static int pread_bin_internal(tree_file *file, cs_off_t pos, char **ret_ptr, int
 
 int pread_header(tree_file *file, cs_off_t pos, char **ret_ptr)
 {
-    return pread_bin_internal(file, pos + 1, ret_ptr, 1);
+    return pread_bin_internal(file, pos + 1, ret_ptr, NULL, NULL, 1, NULL);
 }
 
 int pread_compressed(tree_file *file, cs_off_t pos, char **ret_ptr)
 {
     char *compressed_buf;
     char *new_buf;
-    int len = pread_bin_internal(file, pos, &compressed_buf, 0);
+    int borrowed;
+    int len = pread_bin_internal(file, pos, &compressed_buf, &borrowed, NULL, 0, NULL);
     if (len < 0) {
         return len;
     }
     size_t uncompressed_len;
-    if (snappy_uncompressed_length(compressed_buf, len, &uncompressed_len) != SNAPPY_OK) {
-        //should be compressed but snappy doesn't see it as valid.
-        free(compressed_buf);
-        return COUCHSTORE_ERROR_CORRUPT;
+    couchstore_error_t err = codec_uncompressed_length(file->codec_tags, compressed_buf, len,
+                                                       &uncompressed_len);
+    if (err < 0) {
+        if (!borrowed) {
+            free(compressed_buf);
+        }
+        return err;
     }
 
     new_buf = (char *) malloc(uncompressed_len);
     if (!new_buf) {
-        free(compressed_buf);
+        if (!borrowed) {
+            free(compressed_buf);
+        }
         return COUCHSTORE_ERROR_ALLOC_FAIL;
     }
-    snappy_status ss = (snappy_uncompress(compressed_buf, len, new_buf, &uncompressed_len));
-    free(compressed_buf);
-    if (ss != SNAPPY_OK) {
-        return COUCHSTORE_ERROR_CORRUPT;
+    err = codec_decompress(file->codec_tags, file->dict, compressed_buf, len, new_buf,
+                           &uncompressed_len);
+    if (!borrowed) {
+        free(compressed_buf);
+    }
+    if (err < 0) {
+        free(new_buf);
+        return err;
     }
 
     *ret_ptr = new_buf;
@@ -158,5 +257,311 @@ int pread_compressed(tree_file *file, cs_off_t pos, char **ret_ptr)
 
 int pread_bin(tree_file *file, cs_off_t pos, char **ret_ptr)
 {
-    return pread_bin_internal(file, pos, ret_ptr, 0);
+    return pread_bin_internal(file, pos, ret_ptr, NULL, NULL, 0, NULL);
+}
+
+int pread_bin_borrowed(tree_file *file, cs_off_t pos, const char **ret_ptr, int *borrowed)
+{
+    return pread_bin_internal(file, pos, (char**)ret_ptr, borrowed, NULL, 0, NULL);
+}
+
+int pread_bin_reusing(tree_file *file, cs_off_t pos, sized_buf *buffer, const char **ret_ptr)
+{
+    int borrowed;
+    return pread_bin_internal(file, pos, (char**)ret_ptr, &borrowed, buffer, 0, NULL);
+}
+
+int pread_bin_raw(tree_file *file, cs_off_t pos, sized_buf *buffer, const char **ret_ptr,
+                  uint32_t *crc)
+{
+    int borrowed;
+    return pread_bin_internal(file, pos, (char**)ret_ptr, &borrowed, buffer, 0, crc);
+}
+
+int pread_chunk_size(tree_file *file, cs_off_t pos, cs_off_t *end_pos)
+{
+    uint32_t chunk_len;
+    couchstore_error_t err = read_skipping_prefixes(file, &pos, sizeof(chunk_len), &chunk_len);
+    if (err < 0) {
+        return err;
+    }
+    chunk_len = ntohl(chunk_len) & ~0x80000000;
+    if (chunk_len > INT32_MAX - 4) {
+        return COUCHSTORE_ERROR_CORRUPT;
+    }
+
+    // Step over the CRC and the data, and the prefix byte at the start of each block:
+    size_t remaining = 4 + chunk_len;
+    while (remaining > 0) {
+        if (pos % COUCH_BLOCK_SIZE == 0) {
+            ++pos;
+        }
+        size_t block_remain = COUCH_BLOCK_SIZE - (pos % COUCH_BLOCK_SIZE);
+        if (block_remain > remaining) {
+            block_remain = remaining;
+        }
+        pos += block_remain;
+        remaining -= block_remain;
+    }
+    *end_pos = pos;
+    return (int)chunk_len;
+}
+
+int pread_compressed_reusing(tree_file *file, cs_off_t pos, sized_buf *scratch,
+                             sized_buf *buffer)
+{
+    const char *compressed_buf;
+    int len = pread_bin_reusing(file, pos, scratch, &compressed_buf);
+    if (len < 0) {
+        return len;
+    }
+    return decompress_reusing(file, compressed_buf, len, buffer);
+}
+
+int decompress_reusing(tree_file *file, const char *compressed_buf, size_t len,
+                       sized_buf *buffer)
+{
+    size_t uncompressed_len;
+    couchstore_error_t err = codec_uncompressed_length(file->codec_tags, compressed_buf, len,
+                                                       &uncompressed_len);
+    if (err < 0) {
+        return err;
+    }
+    err = reserve_buffer(buffer, uncompressed_len);
+    if (err < 0) {
+        return err;
+    }
+    uncompressed_len = buffer->size;
+    err = codec_decompress(file->codec_tags, file->dict, compressed_buf, len, buffer->buf,
+                           &uncompressed_len);
+    if (err < 0) {
+        return err;
+    }
+    return (int) uncompressed_len;
+}
+
+int compressed_to_snappy(tree_file *file, const char *compressed_buf, size_t len,
+                         sized_buf *buffer, const char **ret_ptr)
+{
+    if (!file->codec_tags) {
+        *ret_ptr = compressed_buf;
+        return (int) len;
+    } else if (codec_of(1, compressed_buf, len) == COUCHSTORE_CODEC_SNAPPY) {
+        *ret_ptr = compressed_buf + 1;
+        return (int) len - 1;
+    }
+
+    // Decompress it, then recompress it with snappy:
+    sized_buf plain = {NULL, 0};
+    int plain_len = decompress_reusing(file, compressed_buf, len, &plain);
+    if (plain_len < 0) {
+        free(plain.buf);
+        return plain_len;
+    }
+    size_t snappy_len = codec_max_compressed_length(COUCHSTORE_CODEC_SNAPPY, 0, plain_len);
+    couchstore_error_t err = reserve_buffer(buffer, snappy_len);
+    if (err == COUCHSTORE_SUCCESS) {
+        snappy_len = buffer->size;
+        err = codec_compress(COUCHSTORE_CODEC_SNAPPY, 0, NULL, plain.buf, plain_len,
+                             buffer->buf, &snappy_len);
+    }
+    free(plain.buf);
+    if (err < 0) {
+        return err;
+    }
+    *ret_ptr = buffer->buf;
+    return (int) snappy_len;
+}
+
+couchstore_error_t tree_file_flush(tree_file *file)
+{
+    if (couch_is_buffered_file_ops(file->ops)) {
+        return couch_buffered_flush(file->handle);
+    }
+    return COUCHSTORE_SUCCESS;
+}
+
+ssize_t pread_raw_range(tree_file *file, cs_off_t pos, size_t len, int direct,
+                        const char **ret_ptr, int *borrowed)
+{
+    const char *data = borrow_bytes(file, pos, len);
+    if (data) {
+        *ret_ptr = data;
+        *borrowed = 1;
+        return len;
+    }
+    *borrowed = 0;
+
+    char *buf = malloc(len);
+    if (!buf) {
+        return COUCHSTORE_ERROR_ALLOC_FAIL;
+    }
+    size_t total = 0;
+    while (total < len) {
+        ssize_t got;
+        if (direct && couch_is_buffered_file_ops(file->ops)) {
+            got = couch_buffered_pread_direct(file->handle, buf + total, len - total, pos + total);
+        } else {
+            got = file->ops->pread(file->handle, buf + total, len - total, pos + total);
+        }
+        if (got < 0) {
+            free(buf);
+            return got;
+        } else if (got == 0) {
+            break;      // EOF
+        }
+        total += got;
+    }
+    *ret_ptr = buf;
+    return total;
+}
+
+/** Like read_skipping_prefixes, but copies from file data that's already in memory.
+    Returns COUCHSTORE_ERROR_READ if the range isn't entirely within that data. */
+static couchstore_error_t copy_skipping_prefixes(const char *data, cs_off_t data_pos,
+                                                 size_t data_len, cs_off_t *pos,
+                                                 size_t len, void *dst)
+{
+    if (*pos % COUCH_BLOCK_SIZE == 0) {
+        ++*pos;
+    }
+    while (len > 0) {
+        size_t copy_size = COUCH_BLOCK_SIZE - (*pos % COUCH_BLOCK_SIZE);
+        if (copy_size > len) {
+            copy_size = len;
+        }
+        if (*pos < data_pos || *pos + copy_size > data_pos + data_len) {
+            return COUCHSTORE_ERROR_READ;
+        }
+        memcpy(dst, data + (*pos - data_pos), copy_size);
+        *pos += copy_size;
+        len -= copy_size;
+        dst = (char*)dst + copy_size;
+        if (*pos % COUCH_BLOCK_SIZE == 0) {
+            ++*pos;
+        }
+    }
+    return COUCHSTORE_SUCCESS;
+}
+
+int decode_chunk_in_memory(const char *data, cs_off_t data_pos, size_t data_len,
+                           cs_off_t pos, sized_buf *buffer, const char **ret_ptr, uint32_t *crc)
+{
+    struct {
+        uint32_t chunk_len;
+        uint32_t crc32;
+    } info;
+
+    couchstore_error_t err = copy_skipping_prefixes(data, data_pos, data_len, &pos,
+                                                    sizeof(info), &info);
+    if (err < 0) {
+        return err;
+    }
+    info.chunk_len = ntohl(info.chunk_len) & ~0x80000000;
+    info.crc32 = ntohl(info.crc32);
+    if (crc) {
+        *crc = info.crc32;
+        info.crc32 = 0;     // i.e. don't check it
+    }
+
+    cs_off_t datapos = pos;
+    if (datapos % COUCH_BLOCK_SIZE == 0) {
+        ++datapos;
+    }
+    const char *chunk;
+    if (datapos % COUCH_BLOCK_SIZE + info.chunk_len <= COUCH_BLOCK_SIZE) {
+        // Contiguous; use it in place:
+        if (datapos < data_pos || datapos + info.chunk_len > data_pos + data_len) {
+            return COUCHSTORE_ERROR_READ;
+        }
+        chunk = data + (datapos - data_pos);
+    } else {
+        err = reserve_buffer(buffer, info.chunk_len);
+        if (err < 0) {
+            return err;
+        }
+        err = copy_skipping_prefixes(data, data_pos, data_len, &pos, info.chunk_len,
+                                     buffer->buf);
+        if (err < 0) {
+            return err;
+        }
+        chunk = buffer->buf;
+    }
+    if (info.crc32 && info.crc32 != hash_crc32(chunk, info.chunk_len)) {
+        return COUCHSTORE_ERROR_CHECKSUM_FAIL;
+    }
+    *ret_ptr = chunk;
+    return info.chunk_len;
+}
+
+int pread_bin_direct(tree_file *file, cs_off_t pos, size_t size_hint, char **ret_ptr,
+                     uint32_t *crc)
+{
+    // Number of raw bytes that 'len' bytes of chunk data can occupy, counting block prefixes:
+#define RAW_EXTENT(len) ((len) + (len) / (COUCH_BLOCK_SIZE - 1) + 2)
+    size_t extent = RAW_EXTENT((size_hint > 8 ? size_hint : 8));
+    sized_buf buffer = {NULL, 0};
+    int attempt;
+    int result = COUCHSTORE_ERROR_READ;
+
+    for (attempt = 0; attempt < 2; ++attempt) {
+        const char *data, *chunk;
+        int borrowed;
+        ssize_t got = pread_raw_range(file, pos, extent, 1, &data, &borrowed);
+        if (got < 0) {
+            result = (int)got;
+            break;
+        }
+        result = decode_chunk_in_memory(data, pos, (size_t)got, pos, &buffer, &chunk, crc);
+        if (result >= 0) {
+            char *copy = malloc(result > 0 ? result : 1);
+            if (copy) {
+                memcpy(copy, chunk, result);
+                *ret_ptr = copy;
+            } else {
+                result = COUCHSTORE_ERROR_ALLOC_FAIL;
+            }
+        } else if (result == COUCHSTORE_ERROR_READ && attempt == 0) {
+            // The hint was too small; get the real length from the chunk header and try again:
+            uint32_t chunk_len;
+            cs_off_t hdrpos = pos;
+            if (copy_skipping_prefixes(data, pos, (size_t)got, &hdrpos, 4, &chunk_len) == 0) {
+                chunk_len = ntohl(chunk_len) & ~0x80000000;
+                extent = RAW_EXTENT((size_t)chunk_len + 8);
+            }
+        }
+        if (!borrowed) {
+            free((char*)data);
+        }
+        if (result != COUCHSTORE_ERROR_READ) {
+            break;
+        }
+    }
+#undef RAW_EXTENT
+    free(buffer.buf);
+    return result;
+}
+
+int tree_file_can_batch_read(tree_file *file)
+{
+    if (couch_is_buffered_file_ops(file->ops)) {
+        return couch_buffered_can_batch(file->handle);
+    } else if (couch_is_shared_file_ops(file->ops)) {
+        return couch_shared_can_batch(file->handle);
+    }
+    return file->ops->version >= 6 && file->ops->pread_batch != NULL;
+}
+
+couchstore_error_t tree_file_pread_batch(tree_file *file, couch_file_read_request *reqs,
+                                         size_t count)
+{
+    if (file->ops->version >= 6 && file->ops->pread_batch != NULL) {
+        return file->ops->pread_batch(file->handle, reqs, count);
+    }
+    size_t i;
+    for (i = 0; i < count; ++i) {
+        reqs[i].result = file->ops->pread(file->handle, reqs[i].buf, reqs[i].nbytes,
+                                          reqs[i].offset);
+    }
+    return COUCHSTORE_SUCCESS;
 }
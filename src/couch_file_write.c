@@ -4,12 +4,13 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <sys/types.h>
-#include <snappy-c.h>
+#include <string.h>
 #include <libcouchstore/couch_db.h>
 
 #include "rfc1321/global.h"
 #include "rfc1321/md5.h"
 #include "internal.h"
+#include "codec.h"
 #include "crc32.h"
 #include "util.h"
 
@@ -46,6 +47,88 @@ static ssize_t raw_write(tree_file *file, const sized_buf *buf, cs_off_t pos)
     return (ssize_t)(write_pos - pos);
 }
 
+#define CHUNK_IOV_STACK 64      // Pieces a vectored write can assemble without malloc
+
+static const char zero_prefix = 0;
+
+// The most iovec pieces that append_pieces can produce for 'size' bytes of data.
+static size_t max_pieces(size_t size)
+{
+    return 2 * (size / COUCH_BLOCK_SIZE + 2);
+}
+
+// Adds pieces to an iovec list that together write 'buf' at *write_pos, the way raw_write
+// does: a zero prefix byte goes at the start of each block. Advances *write_pos.
+static int append_pieces(couch_file_iovec *vec, int n, const sized_buf *buf, cs_off_t *write_pos)
+{
+    size_t buf_pos = 0;
+    while (buf_pos < buf->size) {
+        if (*write_pos % COUCH_BLOCK_SIZE == 0) {
+            vec[n].buf = &zero_prefix;
+            vec[n].nbytes = 1;
+            ++n;
+            *write_pos += 1;
+        }
+        size_t block_remain = COUCH_BLOCK_SIZE - (*write_pos % COUCH_BLOCK_SIZE);
+        if (block_remain > buf->size - buf_pos) {
+            block_remain = buf->size - buf_pos;
+        }
+        vec[n].buf = buf->buf + buf_pos;
+        vec[n].nbytes = block_remain;
+        ++n;
+        buf_pos += block_remain;
+        *write_pos += block_remain;
+    }
+    return n;
+}
+
+static int can_write_vectored(tree_file *file)
+{
+    return file->ops->version >= 7 && file->ops->pwritev != NULL;
+}
+
+/* Writes data at a file position with the ops' pwritev, in a single call: first 'verbatim' (if
+   not NULL) as is, then each of the 'bufs' with block prefixes inserted as by raw_write.
+   Only call this if can_write_vectored is true.
+   Returns the number of bytes written, or an error code. */
+static ssize_t vectored_write(tree_file *file, const sized_buf *verbatim,
+                              const sized_buf *bufs, int nbufs, cs_off_t pos)
+{
+    couch_file_iovec stack_vec[CHUNK_IOV_STACK];
+    couch_file_iovec *vec = stack_vec;
+    size_t capacity = 1;
+    cs_off_t write_pos = pos;
+    int i, n = 0;
+
+    for (i = 0; i < nbufs; ++i) {
+        capacity += max_pieces(bufs[i].size);
+    }
+    if (capacity > CHUNK_IOV_STACK) {
+        vec = malloc(capacity * sizeof(couch_file_iovec));
+        if (!vec) {
+            return COUCHSTORE_ERROR_ALLOC_FAIL;
+        }
+    }
+    if (verbatim) {
+        vec[n].buf = verbatim->buf;
+        vec[n].nbytes = verbatim->size;
+        ++n;
+        write_pos += verbatim->size;
+    }
+    for (i = 0; i < nbufs; ++i) {
+        n = append_pieces(vec, n, &bufs[i], &write_pos);
+    }
+
+    ssize_t written = file->ops->pwritev(file->handle, vec, n, pos);
+    if (vec != stack_vec) {
+        free(vec);
+    }
+    if (written < 0) {
+        return written;
+    }
+    return (ssize_t)(write_pos - pos);
+}
+
 couchstore_error_t db_write_header(tree_file *file, sized_buf *buf, cs_off_t *pos)
 {
     cs_off_t write_pos = file->pos;
@@ -64,6 +147,18 @@ couchstore_error_t db_write_header(tree_file *file, sized_buf *buf, cs_off_t *po
     memcpy(&headerbuf[1], &size, 4);
     memcpy(&headerbuf[5], &crc32, 4);
 
+    if (can_write_vectored(file)) {
+        sized_buf sized_headerbuf = { headerbuf, sizeof(headerbuf) };
+        written = vectored_write(file, &sized_headerbuf, buf, 1, write_pos);
+        if (written < 0) {
+            return (couchstore_error_t)written;
+        }
+        file->pos = write_pos + written;
+        file->commit_start = file->pos;
+        file->commit_digest = 0;
+        return COUCHSTORE_SUCCESS;
+    }
+
     written = file->ops->pwrite(file->handle, &headerbuf, sizeof(headerbuf), write_pos);
     if (written < 0) {
         return (couchstore_error_t)written;
@@ -77,42 +172,65 @@ couchstore_error_t db_write_header(tree_file *file, sized_buf *buf, cs_off_t *po
     }
     write_pos += written;
     file->pos = write_pos;
+    file->commit_start = file->pos;
+    file->commit_digest = 0;
 
     return COUCHSTORE_SUCCESS;
 }
 
+uint32_t commit_digest_add(uint32_t digest, uint32_t size, uint32_t crc)
+{
+    uint32_t words[3] = { htonl(digest), htonl(size), htonl(crc) };
+    return hash_crc32((const char*)words, sizeof(words));
+}
+
 int db_write_buf(tree_file *file, const sized_buf *buf, cs_off_t *pos, size_t *disk_size)
+{
+    return db_write_buf_with_crc(file, buf, hash_crc32(buf->buf, buf->size), pos, disk_size);
+}
+
+int db_write_buf_with_crc(tree_file *file, const sized_buf *buf, uint32_t crc,
+                          cs_off_t *pos, size_t *disk_size)
 {
     cs_off_t write_pos = file->pos;
     cs_off_t end_pos = write_pos;
     ssize_t written;
     uint32_t size = htonl(buf->size | 0x80000000);
-    uint32_t crc32 = htonl(hash_crc32(buf->buf, buf->size));
+    uint32_t crc32 = htonl(crc);
     char headerbuf[4 + 4];
 
     // Write the buffer's header:
     memcpy(&headerbuf[0], &size, 4);
     memcpy(&headerbuf[4], &crc32, 4);
 
-    sized_buf sized_headerbuf = { headerbuf, 8 };
-    written = raw_write(file, &sized_headerbuf, end_pos);
-    if (written < 0) {
-        return (int)written;
-    }
-    end_pos += written;
+    sized_buf pieces[2] = { { headerbuf, 8 }, *buf };
+    if (can_write_vectored(file)) {
+        written = vectored_write(file, NULL, pieces, 2, end_pos);
+        if (written < 0) {
+            return (int)written;
+        }
+        end_pos += written;
+    } else {
+        // No pwritev, so write the header and then the buffer:
+        written = raw_write(file, &pieces[0], end_pos);
+        if (written < 0) {
+            return (int)written;
+        }
+        end_pos += written;
 
-    // Write actual buffer:
-    written = raw_write(file, buf, end_pos);
-    if (written < 0) {
-        return (int)written;
+        written = raw_write(file, buf, end_pos);
+        if (written < 0) {
+            return (int)written;
+        }
+        end_pos += written;
     }
-    end_pos += written;
 
     if (pos) {
         *pos = write_pos;
     }
 
     file->pos = end_pos;
+    file->commit_digest = commit_digest_add(file->commit_digest, (uint32_t)buf->size, crc);
     if (disk_size) {
         *disk_size = (size_t) (end_pos - write_pos);
     }
@@ -120,18 +238,41 @@ int db_write_buf(tree_file *file, const sized_buf *buf, cs_off_t *pos, size_t *d
     return 0;
 }
 
-int db_write_buf_compressed(tree_file *file, const sized_buf *buf, cs_off_t *pos, size_t *disk_size)
+int db_write_buf_compressed(tree_file *file, const sized_buf *buf, couchstore_codec_t codec,
+                            cs_off_t *pos, size_t *disk_size)
 {
     int errcode = 0;
     sized_buf to_write;
-    size_t max_size = snappy_max_compressed_length(buf->size);
+    if (!file->codec_tags) {
+        codec = COUCHSTORE_CODEC_SNAPPY;
+    }
+    size_t max_size = codec_max_compressed_length(codec, file->codec_tags, buf->size);
 
     to_write.buf = (char *) malloc(max_size);
     to_write.size = max_size;
     error_unless(to_write.buf, COUCHSTORE_ERROR_ALLOC_FAIL);
-    error_unless(snappy_compress(buf->buf, buf->size, to_write.buf,
-                                 &to_write.size) == SNAPPY_OK,
-                 COUCHSTORE_ERROR_WRITE);
+    error_pass(codec_compress(codec, file->codec_tags, file->dict, buf->buf, buf->size,
+                              to_write.buf, &to_write.size));
+
+    error_pass(db_write_buf(file, &to_write, pos, disk_size));
+cleanup:
+    free(to_write.buf);
+    return errcode;
+}
+
+int db_write_buf_snappy(tree_file *file, const sized_buf *buf, cs_off_t *pos, size_t *disk_size)
+{
+    int errcode = 0;
+    sized_buf to_write = {NULL, 0};
+    if (!file->codec_tags) {
+        return db_write_buf(file, buf, pos, disk_size);
+    }
+
+    to_write.size = buf->size + 1;
+    to_write.buf = (char *) malloc(to_write.size);
+    error_unless(to_write.buf, COUCHSTORE_ERROR_ALLOC_FAIL);
+    to_write.buf[0] = COUCHSTORE_CODEC_SNAPPY;
+    memcpy(to_write.buf + 1, buf->buf, buf->size);
 
     error_pass(db_write_buf(file, &to_write, pos, disk_size));
 cleanup:
@@ -60,7 +60,7 @@ couchstore_error_t couchstore_create_index(const char *filename,
 
     CouchStoreIndex* file = calloc(1, sizeof(*file));
     error_unless(file != NULL, COUCHSTORE_ERROR_ALLOC_FAIL);
-    error_pass(tree_file_open(&file->file, filename, O_RDWR | O_CREAT | O_TRUNC,
+    error_pass(tree_file_open(&file->file, filename, O_RDWR | O_CREAT | O_TRUNC, 0,
                               couchstore_get_default_file_ops()));
     file->back_root_index = UINT32_MAX;
     *index = file;
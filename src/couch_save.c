@@ -2,10 +2,17 @@
 #include "config.h"
 #include <string.h>
 #include <stddef.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <pthread.h>
 
 #include "internal.h"
+#include "codec.h"
+#include "id_filter.h"
+#include "memtable.h"
+#include "couch_btree.h"
 #include "node_types.h"
+#include "tree_writer.h"
 #include "util.h"
 #include "reduces.h"
 
@@ -42,12 +49,17 @@ static size_t assemble_id_index_value(DocInfo *docinfo, char *dst)
     return dst - start;
 }
 
-static couchstore_error_t write_doc(Db *db, const Doc *doc, uint64_t *bp,
+static couchstore_error_t write_doc(Db *db, const Doc *doc, const DocInfo *info, uint64_t *bp,
                                     size_t* disk_size, couchstore_save_options writeopts)
 {
     couchstore_error_t errcode;
     if (writeopts & COMPRESS_DOC_BODIES) {
-        errcode = db_write_buf_compressed(&db->file, &doc->data, (cs_off_t *) bp, disk_size);
+        errcode = db_write_buf_compressed(&db->file, &doc->data,
+                                          codec_for_body(&db->file, db->body_codec),
+                                          (cs_off_t *) bp, disk_size);
+    } else if (info->content_meta & COUCH_DOC_IS_COMPRESSED) {
+        // The caller already compressed it with snappy:
+        errcode = db_write_buf_snappy(&db->file, &doc->data, (cs_off_t *) bp, disk_size);
     } else {
         errcode = db_write_buf(&db->file, &doc->data, (cs_off_t *) bp, disk_size);
     }
@@ -203,6 +215,12 @@ static couchstore_error_t update_indexes(Db *db,
 
     new_id_root = modify_btree(&idrq, db->header.by_id_root, &errcode);
     error_pass(errcode);
+    if (db->id_filter) {
+        for (ii = 0; ii < numdocs; ii++) {
+            id_filter_add(db->id_filter, ids[ii].buf, ids[ii].size);
+        }
+        db->id_filter_unsaved += numdocs;
+    }
 
     while (fetcharg.valpos < numdocs) {
         seqacts[fetcharg.actpos].type = ACTION_INSERT;
@@ -240,6 +258,7 @@ static couchstore_error_t update_indexes(Db *db,
         free(db->header.by_seq_root);
         db->header.by_seq_root = new_seq_root;
     }
+    errcode = db_trim_dirty_nodes(db);
 
 cleanup:
     free(sorted_ids);
@@ -247,25 +266,45 @@ cleanup:
     return errcode;
 }
 
-static couchstore_error_t add_doc_to_update_list(Db *db,
-                                                 const Doc *doc,
-                                                 const DocInfo *info,
-                                                 fatbuf *fb,
-                                                 sized_buf *seqterm,
-                                                 sized_buf *idterm,
-                                                 sized_buf *seqval,
-                                                 sized_buf *idval,
-                                                 uint64_t seq,
-                                                 couchstore_save_options options)
+// Assembles the seq and id index keys and values for a doc that's already been written.
+static couchstore_error_t add_info_to_update_list(const DocInfo *updated,
+                                                  fatbuf *fb,
+                                                  sized_buf *seqterm,
+                                                  sized_buf *idterm,
+                                                  sized_buf *seqval,
+                                                  sized_buf *idval)
 {
     couchstore_error_t errcode = COUCHSTORE_SUCCESS;
-    DocInfo updated = *info;
-    updated.db_seq = seq;
-
     seqterm->buf = (char *) fatbuf_get(fb, 6);
     seqterm->size = 6;
     error_unless(seqterm->buf, COUCHSTORE_ERROR_ALLOC_FAIL);
-    *(raw_48*)seqterm->buf = encode_raw48(seq);
+    *(raw_48*)seqterm->buf = encode_raw48(updated->db_seq);
+
+    *idterm = updated->id;
+
+    seqval->buf = (char *) fatbuf_get(fb, (44 + updated->id.size + updated->rev_meta.size));
+    error_unless(seqval->buf, COUCHSTORE_ERROR_ALLOC_FAIL);
+    seqval->size = assemble_seq_index_value((DocInfo*)updated, seqval->buf);
+
+    idval->buf = (char *) fatbuf_get(fb, (44 + 10 + updated->rev_meta.size));
+    error_unless(idval->buf, COUCHSTORE_ERROR_ALLOC_FAIL);
+    idval->size = assemble_id_index_value((DocInfo*)updated, idval->buf);
+
+    //We use 37 + id.size + 2 * rev_meta.size bytes
+cleanup:
+    return errcode;
+}
+
+// Writes a doc's body (if it isn't a deletion), and fills in the DocInfo to index it with.
+static couchstore_error_t write_doc_info(Db *db,
+                                        const Doc *doc,
+                                        const DocInfo *info,
+                                        uint64_t seq,
+                                        couchstore_save_options options,
+                                        DocInfo *updated)
+{
+    *updated = *info;
+    updated->db_seq = seq;
 
     if (doc) {
         size_t disk_size;
@@ -274,30 +313,132 @@ static couchstore_error_t add_doc_to_update_list(Db *db,
         if (!(info->content_meta & COUCH_DOC_IS_COMPRESSED)) {
             options &= ~COMPRESS_DOC_BODIES;
         }
-        errcode = write_doc(db, doc, &updated.bp, &disk_size, options);
+        couchstore_error_t errcode = write_doc(db, doc, info, &updated->bp, &disk_size,
+                                               options);
 
         if (errcode != COUCHSTORE_SUCCESS) {
             return errcode;
         }
-        updated.size = disk_size;
+        updated->size = disk_size;
     } else {
-        updated.deleted = 1;
-        updated.bp = 0;
-        updated.size = 0;
+        updated->deleted = 1;
+        updated->bp = 0;
+        updated->size = 0;
     }
+    return COUCHSTORE_SUCCESS;
+}
 
-    *idterm = updated.id;
+static couchstore_error_t add_doc_to_update_list(Db *db,
+                                                 const Doc *doc,
+                                                 const DocInfo *info,
+                                                 fatbuf *fb,
+                                                 sized_buf *seqterm,
+                                                 sized_buf *idterm,
+                                                 sized_buf *seqval,
+                                                 sized_buf *idval,
+                                                 uint64_t seq,
+                                                 couchstore_save_options options)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    DocInfo updated;
 
-    seqval->buf = (char *) fatbuf_get(fb, (44 + updated.id.size + updated.rev_meta.size));
-    error_unless(seqval->buf, COUCHSTORE_ERROR_ALLOC_FAIL);
-    seqval->size = assemble_seq_index_value(&updated, seqval->buf);
+    error_pass(write_doc_info(db, doc, info, seq, options, &updated));
+    errcode = add_info_to_update_list(&updated, fb, seqterm, idterm, seqval, idval);
+cleanup:
+    return errcode;
+}
 
-    idval->buf = (char *) fatbuf_get(fb, (44 + 10 + updated.rev_meta.size));
-    error_unless(idval->buf, COUCHSTORE_ERROR_ALLOC_FAIL);
-    idval->size = assemble_id_index_value(&updated, idval->buf);
+// Returns the fatbuf space add_doc_to_update_list and add_info_to_update_list need for
+// numdocs docs, including the key and value lists.
+static size_t update_list_size(DocInfo *infos[], unsigned numdocs)
+{
+    size_t term_meta_size = 0;
+    unsigned ii;
+    for (ii = 0; ii < numdocs; ii++) {
+        // Get additional size for terms to be inserted into indexes
+        // IMPORTANT: This must match the sizes of the fatbuf_get calls in add_info_to_update_list!
+        term_meta_size += 6
+                        + 44 + infos[ii]->id.size + infos[ii]->rev_meta.size
+                        + 44 + 10 + infos[ii]->rev_meta.size;
+    }
+    return term_meta_size + numdocs * (sizeof(sized_buf) * 4); //seq/id key and value lists
+}
+
+// Saves docs into the db's memtable instead of its trees, flushing it if it's grown too big
+// or old.
+static couchstore_error_t save_to_memtable(Db *db,
+                                          Doc* const docs[],
+                                          DocInfo *infos[],
+                                          unsigned numdocs,
+                                          couchstore_save_options options)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    unsigned ii;
+    memtable *mt = db->memtable;
+    DocInfo *updated = malloc(numdocs * sizeof(DocInfo));
+    error_unless(updated || numdocs == 0, COUCHSTORE_ERROR_ALLOC_FAIL);
+
+    for (ii = 0; ii < numdocs; ii++) {
+        error_pass(write_doc_info(db, docs ? docs[ii] : NULL, infos[ii],
+                                  db->header.update_seq + ii + 1, options, &updated[ii]));
+    }
+    for (ii = 0; ii < numdocs; ii++) {
+        error_pass(memtable_add(mt, &updated[ii]));
+        infos[ii]->db_seq = db->header.update_seq = updated[ii].db_seq;
+    }
+
+    if (memtable_size(mt) >= db->memtable_max_bytes ||
+            (db->memtable_max_age > 0 &&
+             time(NULL) - memtable_started(mt) >= (time_t)db->memtable_max_age)) {
+        error_pass(db_flush_memtable(db));
+    }
+
+cleanup:
+    free(updated);
+    return errcode;
+}
+
+couchstore_error_t db_flush_memtable(Db *db)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    memtable *fresh = NULL;
+    DocInfo **infos = NULL;
+    size_t count;
+    if (!db->memtable || (count = memtable_count(db->memtable)) == 0) {
+        return COUCHSTORE_SUCCESS;
+    }
+
+    infos = malloc(count * sizeof(DocInfo*));
+    error_unless(infos, COUCHSTORE_ERROR_ALLOC_FAIL);
+    error_pass(memtable_create(&fresh));
+    memtable_infos(db->memtable, infos);
+    error_pass(db_save_docinfos(db, infos, (unsigned)count));
+    // An iteration may still be using the old memtable; it's freed once that's done.
+    memtable_release(db->memtable);
+    db->memtable = fresh;
+    fresh = NULL;
 
-    //We use 37 + id.size + 2 * rev_meta.size bytes
 cleanup:
+    memtable_release(fresh);
+    free(infos);
+    return errcode;
+}
+
+LIBCOUCHSTORE_API
+couchstore_error_t couchstore_set_memtable(Db *db, uint64_t max_bytes, unsigned max_age)
+{
+    couchstore_error_t errcode = db_flush_memtable(db);
+    if (errcode != COUCHSTORE_SUCCESS) {
+        return errcode;
+    }
+    if (max_bytes == 0) {
+        memtable_release(db->memtable);
+        db->memtable = NULL;
+    } else if (!db->memtable) {
+        errcode = memtable_create(&db->memtable);
+    }
+    db->memtable_max_bytes = max_bytes;
+    db->memtable_max_age = max_age;
     return errcode;
 }
 
@@ -311,22 +452,14 @@ couchstore_error_t couchstore_save_documents(Db *db,
     couchstore_error_t errcode = COUCHSTORE_SUCCESS;
     unsigned ii;
     sized_buf *seqklist, *idklist, *seqvlist, *idvlist;
-    size_t term_meta_size = 0;
     const Doc *curdoc;
     uint64_t seq = db->header.update_seq;
 
-    fatbuf *fb;
-
-    for (ii = 0; ii < numdocs; ii++) {
-        // Get additional size for terms to be inserted into indexes
-        // IMPORTANT: This must match the sizes of the fatbuf_get calls in add_doc_to_update_list!
-        term_meta_size += 6
-                        + 44 + infos[ii]->id.size + infos[ii]->rev_meta.size
-                        + 44 + 10 + infos[ii]->rev_meta.size;
+    if (db->memtable) {
+        return save_to_memtable(db, docs, infos, numdocs, options);
     }
 
-    fb = fatbuf_alloc(term_meta_size +
-                      numdocs * (sizeof(sized_buf) * 4)); //seq/id key and value lists
+    fatbuf *fb = fatbuf_alloc(update_list_size(infos, numdocs));
 
     if (fb == NULL) {
         return COUCHSTORE_ERROR_ALLOC_FAIL;
@@ -373,9 +506,375 @@ couchstore_error_t couchstore_save_documents(Db *db,
     return errcode;
 }
 
+couchstore_error_t db_save_docinfos(Db *db, DocInfo *infos[], unsigned numdocs)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    unsigned ii;
+    sized_buf *seqklist, *idklist, *seqvlist, *idvlist;
+    uint64_t seq = db->header.update_seq;
+
+    fatbuf *fb = fatbuf_alloc(update_list_size(infos, numdocs));
+    error_unless(fb, COUCHSTORE_ERROR_ALLOC_FAIL);
+
+    seqklist = fatbuf_get(fb, numdocs * sizeof(sized_buf));
+    idklist = fatbuf_get(fb, numdocs * sizeof(sized_buf));
+    seqvlist = fatbuf_get(fb, numdocs * sizeof(sized_buf));
+    idvlist = fatbuf_get(fb, numdocs * sizeof(sized_buf));
+
+    for (ii = 0; ii < numdocs; ii++) {
+        error_pass(add_info_to_update_list(infos[ii], fb, &seqklist[ii], &idklist[ii],
+                                           &seqvlist[ii], &idvlist[ii]));
+        if (infos[ii]->db_seq > seq) {
+            seq = infos[ii]->db_seq;
+        }
+    }
+    error_pass(update_indexes(db, seqklist, seqvlist, idklist, idvlist, numdocs));
+    db->header.update_seq = seq;
+
+cleanup:
+    fatbuf_free(fb);
+    return errcode;
+}
+
 LIBCOUCHSTORE_API
 couchstore_error_t couchstore_save_document(Db *db, const Doc *doc,
                                             DocInfo *info, couchstore_save_options options)
 {
     return couchstore_save_documents(db, (Doc**)&doc, (DocInfo**)&info, 1, options);
 }
+
+/*
+ * Group commit: couchstore_save_documents_and_commit queues each caller's batch on the Db.
+ * Whichever caller finds no commit in progress becomes the leader; it takes every batch queued
+ * so far, saves them with as few update_indexes passes as possible, commits once, and then
+ * wakes the other callers. Callers that arrive meanwhile queue up for the next group.
+ */
+
+struct group_commit_batch {
+    group_commit_batch *next;
+    Doc* const *docs;
+    DocInfo **infos;
+    unsigned numdocs;
+    couchstore_save_options options;
+    couchstore_error_t status;
+    int done;
+};
+
+// Returns true if any of a batch's ids is in the sorted array 'ids'.
+static int batch_overlaps(const group_commit_batch *batch, const sized_buf **ids, size_t nids)
+{
+    unsigned ii;
+    for (ii = 0; ii < batch->numdocs; ++ii) {
+        const sized_buf *id = &batch->infos[ii]->id;
+        if (bsearch(&id, ids, nids, sizeof(ids[0]), &ebin_ptr_compare)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Merges the sorted arrays ids[0..n1) and ids[n1..n1+n2) into 'out'.
+static void merge_ids(const sized_buf **ids, size_t n1, size_t n2, const sized_buf **out)
+{
+    const sized_buf **a = ids, **a_end = ids + n1;
+    const sized_buf **b = a_end, **b_end = a_end + n2;
+    while (a < a_end && b < b_end) {
+        *out++ = (ebin_ptr_compare(b, a) < 0) ? *b++ : *a++;
+    }
+    while (a < a_end) {
+        *out++ = *a++;
+    }
+    while (b < b_end) {
+        *out++ = *b++;
+    }
+}
+
+/* Saves a list of batches and commits them. Consecutive batches are merged into a single
+   couchstore_save_documents call, unless their options differ or they update the same doc
+   (whose updates have to be applied in order.) */
+static void commit_group(Db *db, group_commit_batch *batches)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    group_commit_batch *run, *batch;
+    Doc **docs = NULL;
+    DocInfo **infos = NULL;
+    const sized_buf **ids = NULL, **merged = NULL, **tmp;
+    size_t total = 0;
+    int saved = 0;
+
+    for (batch = batches; batch; batch = batch->next) {
+        total += batch->numdocs;
+    }
+    if (total > 0) {
+        docs = malloc(total * sizeof(Doc*));
+        infos = malloc(total * sizeof(DocInfo*));
+        ids = malloc(total * sizeof(sized_buf*));
+        merged = malloc(total * sizeof(sized_buf*));
+        error_unless(docs && infos && ids && merged, COUCHSTORE_ERROR_ALLOC_FAIL);
+    }
+
+    run = batches;
+    while (run) {
+        size_t count = 0;
+        unsigned ii;
+        for (batch = run; batch; batch = batch->next) {
+            if (batch != run && (batch->options != run->options ||
+                                 batch_overlaps(batch, ids, count))) {
+                break;
+            }
+            for (ii = 0; ii < batch->numdocs; ++ii) {
+                docs[count + ii] = batch->docs ? batch->docs[ii] : NULL;
+                infos[count + ii] = batch->infos[ii];
+                ids[count + ii] = &batch->infos[ii]->id;
+            }
+            // Keep ids[] sorted for batch_overlaps by sorting just the new batch's ids and
+            // merging them in, rather than sorting everything again:
+            qsort(ids + count, batch->numdocs, sizeof(ids[0]), &ebin_ptr_compare);
+            if (count > 0) {
+                merge_ids(ids, count, batch->numdocs, merged);
+                tmp = ids;
+                ids = merged;
+                merged = tmp;
+            }
+            count += batch->numdocs;
+        }
+
+        if (count > 0) {
+            errcode = couchstore_save_documents(db, docs, infos, (unsigned)count, run->options);
+        } else {
+            errcode = COUCHSTORE_SUCCESS;
+        }
+        saved |= (errcode == COUCHSTORE_SUCCESS);
+        for (; run != batch; run = run->next) {
+            run->status = errcode;
+        }
+    }
+
+    errcode = saved ? couchstore_commit(db) : COUCHSTORE_SUCCESS;
+
+cleanup:
+    for (batch = batches; batch; batch = batch->next) {
+        if (errcode != COUCHSTORE_SUCCESS && batch->status == COUCHSTORE_SUCCESS) {
+            batch->status = errcode;
+        }
+    }
+    free(merged);
+    free(ids);
+    free(infos);
+    free(docs);
+}
+
+LIBCOUCHSTORE_API
+couchstore_error_t couchstore_save_documents_and_commit(Db *db,
+                                                        Doc* const docs[],
+                                                        DocInfo *infos[],
+                                                        unsigned numdocs,
+                                                        couchstore_save_options options)
+{
+    group_commit_batch self = {NULL, docs, infos, numdocs, options, COUCHSTORE_SUCCESS, 0};
+
+    pthread_mutex_lock(&db->commit_lock);
+    *db->commit_queue_tail = &self;
+    db->commit_queue_tail = &self.next;
+    while (!self.done) {
+        if (db->committing) {
+            pthread_cond_wait(&db->commit_cond, &db->commit_lock);
+            continue;
+        }
+        // Become the leader and commit everything queued so far, including our own batch:
+        group_commit_batch *group = db->commit_queue, *batch;
+        db->commit_queue = NULL;
+        db->commit_queue_tail = &db->commit_queue;
+        db->committing = 1;
+        pthread_mutex_unlock(&db->commit_lock);
+
+        commit_group(db, group);
+
+        pthread_mutex_lock(&db->commit_lock);
+        for (batch = group; batch; ) {
+            // Once 'done' is set the batch's owner may return, so read 'next' first:
+            group_commit_batch *next = batch->next;
+            batch->done = 1;
+            batch = next;
+        }
+        db->committing = 0;
+        pthread_cond_broadcast(&db->commit_cond);
+    }
+    pthread_mutex_unlock(&db->commit_lock);
+    return self.status;
+}
+
+
+//////// BULK LOADING:
+
+/*
+ * A BulkLoader builds a new database without modify_btree: each doc's body is appended to the
+ * file as it arrives and it gets the next sequence number, so the by-sequence tree can be
+ * built bottom-up as the docs stream in (as the compactor does.) The by-id entries go to a
+ * TreeWriter, which sorts them in the background and writes the by-id tree at the end.
+ */
+
+struct _bulk_loader {
+    Db *db;
+    char *filename;
+    arena *transient_arena;
+    arena *persistent_arena;
+    couchfile_modify_result *seq_mr;
+    TreeWriter *id_writer;
+    uint64_t count;
+    couchstore_error_t errcode;     // The first error, which makes the load fail
+};
+
+static void free_bulk_loader(BulkLoader *loader, int remove_file)
+{
+    if (loader->db) {
+        couchstore_close_db(loader->db);
+        if (remove_file) {
+            remove(loader->filename);
+        }
+    }
+    TreeWriterFree(loader->id_writer);
+    delete_arena(loader->transient_arena);
+    delete_arena(loader->persistent_arena);
+    free(loader->filename);
+    free(loader);
+}
+
+LIBCOUCHSTORE_API
+couchstore_error_t couchstore_bulk_load_open(const char *filename,
+                                             const couch_file_ops *ops,
+                                             BulkLoader **pLoader)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    compare_info seqcmp;
+    sized_buf tmp;
+    BulkLoader *loader = calloc(1, sizeof(BulkLoader));
+    error_unless(loader, COUCHSTORE_ERROR_ALLOC_FAIL);
+    loader->filename = strdup(filename);
+    loader->transient_arena = new_arena(0);
+    loader->persistent_arena = new_arena(0);
+    error_unless(loader->filename && loader->transient_arena && loader->persistent_arena,
+                 COUCHSTORE_ERROR_ALLOC_FAIL);
+
+    if (ops == NULL) {
+        ops = couchstore_get_default_file_ops();
+    }
+    error_pass(couchstore_open_db_ex(filename, COUCHSTORE_OPEN_FLAG_CREATE, ops, &loader->db));
+    if (loader->db->header.by_id_root || loader->db->header.by_seq_root ||
+            loader->db->header.local_docs_root) {
+        // Only an empty file can be loaded; don't delete an existing database!
+        couchstore_close_db(loader->db);
+        loader->db = NULL;
+        error_pass(COUCHSTORE_ERROR_INVALID_ARGUMENTS);
+    }
+
+    seqcmp.compare = seq_cmp;
+    seqcmp.arg = &tmp;
+    loader->seq_mr = new_btree_modres(loader->persistent_arena, loader->transient_arena,
+                                      &loader->db->file, &seqcmp,
+                                      by_seq_reduce, by_seq_rereduce);
+    error_unless(loader->seq_mr, COUCHSTORE_ERROR_ALLOC_FAIL);
+    error_pass(TreeWriterOpen(NULL, ebin_cmp, by_id_reduce, by_id_rereduce,
+                              &loader->id_writer));
+    TreeWriterRequireUniqueKeys(loader->id_writer);
+    error_pass(TreeWriterStartSort(loader->id_writer));
+    *pLoader = loader;
+    loader = NULL;
+
+cleanup:
+    if (loader) {
+        free_bulk_loader(loader, 1);
+    }
+    return errcode;
+}
+
+LIBCOUCHSTORE_API
+couchstore_error_t couchstore_bulk_load_add(BulkLoader *loader,
+                                            const Doc *doc,
+                                            DocInfo *info,
+                                            couchstore_save_options options)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    Db *db = loader->db;
+    DocInfo updated = *info;
+    sized_buf *seqterm, *seqval;
+    sized_buf idval;
+    error_pass(loader->errcode);
+
+    updated.db_seq = db->header.update_seq + 1;
+    if (doc) {
+        size_t disk_size;
+        // Don't compress a doc unless the meta flag is set
+        if (!(info->content_meta & COUCH_DOC_IS_COMPRESSED)) {
+            options &= ~COMPRESS_DOC_BODIES;
+        }
+        error_pass(write_doc(db, doc, info, &updated.bp, &disk_size, options));
+        updated.size = disk_size;
+    } else {
+        updated.deleted = 1;
+        updated.bp = 0;
+        updated.size = 0;
+    }
+
+    // The by-seq tree's items, which must last until seq_mr writes them out:
+    seqterm = arena_alloc(loader->transient_arena, sizeof(sized_buf));
+    seqval = arena_alloc(loader->transient_arena, sizeof(sized_buf));
+    error_unless(seqterm && seqval, COUCHSTORE_ERROR_ALLOC_FAIL);
+    seqterm->size = 6;
+    seqterm->buf = arena_alloc(loader->transient_arena, seqterm->size);
+    seqval->buf = arena_alloc(loader->transient_arena,
+                              sizeof(raw_seq_index_value) + updated.id.size +
+                              updated.rev_meta.size);
+    error_unless(seqterm->buf && seqval->buf, COUCHSTORE_ERROR_ALLOC_FAIL);
+    *(raw_48*)seqterm->buf = encode_raw48(updated.db_seq);
+    seqval->size = assemble_seq_index_value(&updated, seqval->buf);
+
+    // The by-id tree's item, which the TreeWriter copies:
+    idval.buf = arena_alloc(loader->transient_arena,
+                            sizeof(raw_id_index_value) + updated.rev_meta.size);
+    error_unless(idval.buf, COUCHSTORE_ERROR_ALLOC_FAIL);
+    idval.size = assemble_id_index_value(&updated, idval.buf);
+    error_pass(TreeWriterAddItem(loader->id_writer, updated.id, idval));
+
+    error_pass(mr_push_item(seqterm, seqval, loader->seq_mr));
+    if (loader->seq_mr->count == 0) {
+        // The items were just written out, so the transient arena can be rewound.
+        arena_free_all(loader->transient_arena);
+    }
+
+    db->header.update_seq = updated.db_seq;
+    info->db_seq = updated.db_seq;
+    loader->count++;
+
+cleanup:
+    if (errcode != COUCHSTORE_SUCCESS && loader->errcode == COUCHSTORE_SUCCESS) {
+        loader->errcode = errcode;
+    }
+    return errcode;
+}
+
+LIBCOUCHSTORE_API
+couchstore_error_t couchstore_bulk_load_finish(BulkLoader *loader)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    Db *db = loader->db;
+    error_pass(loader->errcode);
+
+    if (loader->count > 0) {
+        db->header.by_seq_root = complete_new_btree(loader->seq_mr, &errcode);
+        error_pass(errcode);
+        error_pass(TreeWriterSort(loader->id_writer));
+        error_pass(TreeWriterWrite(loader->id_writer, &db->file, &db->header.by_id_root));
+    }
+    error_pass(couchstore_commit(db));
+
+cleanup:
+    free_bulk_loader(loader, errcode != COUCHSTORE_SUCCESS);
+    return errcode;
+}
+
+LIBCOUCHSTORE_API
+void couchstore_bulk_load_abort(BulkLoader *loader)
+{
+    free_bulk_loader(loader, 1);
+}
@@ -4,10 +4,32 @@
  * tree via the files contrib/ltree/crc32.[ch] and from FreeBSD at
  * src/usr.bin/cksum/crc32.c.
  */
+/* The slicing-by-8 and hardware kernels below compute the same CRC-32 (the
+ * reflected 0xEDB88320 polynomial) much faster; hash_crc32 picks the best
+ * one the CPU supports on first use.
+ */
+#include "config.h"
 #include <stdint.h>
+#include <string.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include "crc32.h"
 
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define CRC32_HAVE_PCLMUL 1
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+#if defined(__aarch64__) && defined(__GNUC__) && defined(__linux__)
+#define CRC32_HAVE_ARMV8 1
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#ifndef HWCAP_CRC32
+#define HWCAP_CRC32 (1 << 7)
+#endif
+#endif
+
 static const uint32_t crc32tab[256] = {
     0x00000000, 0x77073096, 0xee0e612c, 0x990951ba,
     0x076dc419, 0x706af48f, 0xe963a535, 0x9e6495a3,
@@ -75,14 +97,241 @@ static const uint32_t crc32tab[256] = {
     0xb40bbe37, 0xc30c8ea1, 0x5a05df1b, 0x2d02ef8d,
 };
 
-uint32_t hash_crc32(const char *key, size_t key_length)
+/* Every kernel takes and returns the running CRC register (before the final inversion.) */
+typedef uint32_t (*crc32_fn)(uint32_t crc, const uint8_t *buf, size_t len);
+
+static uint32_t crc32_bytewise(uint32_t crc, const uint8_t *buf, size_t len)
+{
+    size_t x;
+    for (x = 0; x < len; x++) {
+        crc = (crc >> 8) ^ crc32tab[(crc ^ buf[x]) & 0xff];
+    }
+    return crc;
+}
+
+/* crc32slice[k][n] is the CRC of byte n followed by k zero bytes, so eight bytes can be
+   folded in with eight independent table lookups. Table 0 is crc32tab. */
+static uint32_t crc32slice[8][256];
+
+static void init_slice_tables(void)
+{
+    int k, n;
+    memcpy(crc32slice[0], crc32tab, sizeof(crc32tab));
+    for (k = 1; k < 8; k++) {
+        for (n = 0; n < 256; n++) {
+            uint32_t prev = crc32slice[k - 1][n];
+            crc32slice[k][n] = (prev >> 8) ^ crc32tab[prev & 0xff];
+        }
+    }
+}
+
+static uint32_t crc32_slice8(uint32_t crc, const uint8_t *buf, size_t len)
+{
+    while (len >= 8) {
+        uint32_t one = crc ^ ((uint32_t)buf[0] | (uint32_t)buf[1] << 8 |
+                              (uint32_t)buf[2] << 16 | (uint32_t)buf[3] << 24);
+        uint32_t two = (uint32_t)buf[4] | (uint32_t)buf[5] << 8 |
+                       (uint32_t)buf[6] << 16 | (uint32_t)buf[7] << 24;
+        crc = crc32slice[7][one & 0xff] ^
+              crc32slice[6][(one >> 8) & 0xff] ^
+              crc32slice[5][(one >> 16) & 0xff] ^
+              crc32slice[4][one >> 24] ^
+              crc32slice[3][two & 0xff] ^
+              crc32slice[2][(two >> 8) & 0xff] ^
+              crc32slice[1][(two >> 16) & 0xff] ^
+              crc32slice[0][two >> 24];
+        buf += 8;
+        len -= 8;
+    }
+    return crc32_bytewise(crc, buf, len);
+}
+
+#ifdef CRC32_HAVE_PCLMUL
+/* Carry-less multiplication folding, after Intel's "Fast CRC Computation for Generic
+   Polynomials Using PCLMULQDQ Instruction" (the constants are for the reflected CRC-32
+   polynomial.) Folds four 128-bit lanes at a time, then reduces them with a Barrett
+   reduction. 'len' must be at least 64 and a multiple of 16. */
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t crc32_pclmul_fold(uint32_t crc, const uint8_t *buf, size_t len)
 {
-    uint64_t x;
-    uint32_t crc = UINT32_MAX;
+    static const uint64_t k1k2[2] __attribute__((aligned(16))) = {0x0154442bd4, 0x01c6e41596};
+    static const uint64_t k3k4[2] __attribute__((aligned(16))) = {0x01751997d0, 0x00ccaa009e};
+    static const uint64_t k5k0[2] __attribute__((aligned(16))) = {0x0163cd6124, 0x0000000000};
+    static const uint64_t poly[2] __attribute__((aligned(16))) = {0x01db710641, 0x01f7011641};
+    __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+
+    x1 = _mm_loadu_si128((const __m128i *)(buf + 0x00));
+    x2 = _mm_loadu_si128((const __m128i *)(buf + 0x10));
+    x3 = _mm_loadu_si128((const __m128i *)(buf + 0x20));
+    x4 = _mm_loadu_si128((const __m128i *)(buf + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)crc));
+    x0 = _mm_load_si128((const __m128i *)k1k2);
+    buf += 64;
+    len -= 64;
 
-    for (x = 0; x < key_length; x++) {
-        crc = (crc >> 8) ^ crc32tab[(crc ^ (uint64_t)key[x]) & 0xff];
+    // Fold 64 bytes at a time:
+    while (len >= 64) {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+        y5 = _mm_loadu_si128((const __m128i *)(buf + 0x00));
+        y6 = _mm_loadu_si128((const __m128i *)(buf + 0x10));
+        y7 = _mm_loadu_si128((const __m128i *)(buf + 0x20));
+        y8 = _mm_loadu_si128((const __m128i *)(buf + 0x30));
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+        buf += 64;
+        len -= 64;
     }
 
-    return (crc ^ 0xFFFFFFFF);
+    // Fold the four lanes into one:
+    x0 = _mm_load_si128((const __m128i *)k3k4);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+    // Fold any remaining 16-byte blocks:
+    while (len >= 16) {
+        x2 = _mm_loadu_si128((const __m128i *)buf);
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+        buf += 16;
+        len -= 16;
+    }
+
+    // Fold 128 bits down to 64:
+    x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+    x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+    x1 = _mm_srli_si128(x1, 8);
+    x1 = _mm_xor_si128(x1, x2);
+    x0 = _mm_loadl_epi64((const __m128i *)k5k0);
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, x3);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    // Barrett reduction to 32 bits:
+    x0 = _mm_load_si128((const __m128i *)poly);
+    x2 = _mm_and_si128(x1, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+    x2 = _mm_and_si128(x2, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+    return (uint32_t)_mm_extract_epi32(x1, 1);
+}
+
+static uint32_t crc32_pclmul(uint32_t crc, const uint8_t *buf, size_t len)
+{
+    if (len >= 64) {
+        size_t folded = len & ~(size_t)15;
+        crc = crc32_pclmul_fold(crc, buf, folded);
+        buf += folded;
+        len -= folded;
+    }
+    return crc32_slice8(crc, buf, len);
+}
+
+static int have_pclmul(void)
+{
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+        return 0;
+    }
+    return (ecx & bit_PCLMUL) && (ecx & bit_SSE4_1);
+}
+#endif
+
+#ifdef CRC32_HAVE_ARMV8
+/* The ARMv8 CRC32 instructions implement this same polynomial (the CRC32C ones don't.) */
+#ifdef __clang__
+__attribute__((target("crc")))
+#else
+__attribute__((target("+crc")))
+#endif
+static uint32_t crc32_armv8(uint32_t crc, const uint8_t *buf, size_t len)
+{
+    while (len > 0 && ((uintptr_t)buf & 7) != 0) {
+        crc = __crc32b(crc, *buf++);
+        len--;
+    }
+    while (len >= 8) {
+        uint64_t word;
+        memcpy(&word, buf, 8);
+        crc = __crc32d(crc, word);
+        buf += 8;
+        len -= 8;
+    }
+    while (len > 0) {
+        crc = __crc32b(crc, *buf++);
+        len--;
+    }
+    return crc;
+}
+
+static int have_armv8_crc(void)
+{
+    return (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+}
+#endif
+
+static crc32_kernel kernels[4];
+static size_t num_kernels;
+static crc32_fn best_kernel;
+static pthread_once_t kernels_once = PTHREAD_ONCE_INIT;
+
+static void add_kernel(const char *name, crc32_fn fn)
+{
+    kernels[num_kernels].name = name;
+    kernels[num_kernels].fn = fn;
+    num_kernels++;
+    best_kernel = fn;   // Kernels are added from slowest to fastest
+}
+
+static void init_kernels(void)
+{
+    init_slice_tables();
+    add_kernel("bytewise", crc32_bytewise);
+    add_kernel("slice8", crc32_slice8);
+#ifdef CRC32_HAVE_PCLMUL
+    if (have_pclmul()) {
+        add_kernel("pclmul", crc32_pclmul);
+    }
+#endif
+#ifdef CRC32_HAVE_ARMV8
+    if (have_armv8_crc()) {
+        add_kernel("armv8", crc32_armv8);
+    }
+#endif
+}
+
+const crc32_kernel *crc32_get_kernels(size_t *count)
+{
+    pthread_once(&kernels_once, init_kernels);
+    *count = num_kernels;
+    return kernels;
+}
+
+uint32_t crc32_with_kernel(const crc32_kernel *kernel, const char *key, size_t key_length)
+{
+    return kernel->fn(UINT32_MAX, (const uint8_t *)key, key_length) ^ 0xFFFFFFFF;
+}
+
+uint32_t hash_crc32(const char *key, size_t key_length)
+{
+    pthread_once(&kernels_once, init_kernels);
+    return best_kernel(UINT32_MAX, (const uint8_t *)key, key_length) ^ 0xFFFFFFFF;
 }
@@ -1,14 +1,30 @@
 #ifndef COUCHSTORE_CRC32_H
-#define COUCHSTORE_CRC_H 1
+#define COUCHSTORE_CRC32_H 1
 
+#include <stdint.h>
 #include <sys/types.h>
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+    /** Computes the CRC-32 of a buffer, with the fastest kernel the CPU supports. */
     uint32_t hash_crc32(const char *key, size_t key_length);
 
+    /** One implementation of hash_crc32. All of them produce identical results. */
+    typedef struct {
+        const char *name;
+        uint32_t (*fn)(uint32_t crc, const uint8_t *buf, size_t len);
+    } crc32_kernel;
+
+    /** Returns the CRC kernels the CPU supports, slowest first; hash_crc32 uses the last.
+        (For testing and benchmarking.)
+        @param count On return, the number of kernels */
+    const crc32_kernel *crc32_get_kernels(size_t *count);
+
+    /** Computes the CRC-32 of a buffer with a specific kernel. */
+    uint32_t crc32_with_kernel(const crc32_kernel *kernel, const char *key, size_t key_length);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,71 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/* Measures the throughput of each CRC-32 kernel the CPU supports. */
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "crc32.h"
+
+#define TOTAL_BYTES (256 * 1024 * 1024)     // Bytes hashed per kernel and buffer size
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+    static const size_t sizes[] = {64, 256, 4096, 65536, 1024 * 1024};
+    const crc32_kernel *kernels;
+    size_t num_kernels, k, s, i;
+    size_t max_size = sizes[sizeof(sizes) / sizeof(sizes[0]) - 1];
+    char *buf = malloc(max_size);
+    (void)argc;
+    (void)argv;
+
+    if (buf == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    for (i = 0; i < max_size; ++i) {
+        buf[i] = (char)rand();
+    }
+
+    kernels = crc32_get_kernels(&num_kernels);
+    printf("%-10s", "size");
+    for (k = 0; k < num_kernels; ++k) {
+        printf("%12s", kernels[k].name);
+    }
+    printf("   (GB/s)\n");
+
+    for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s) {
+        size_t size = sizes[s];
+        size_t iterations = TOTAL_BYTES / size;
+        uint32_t expected = crc32_with_kernel(&kernels[0], buf, size);
+        printf("%-10lu", (unsigned long)size);
+        for (k = 0; k < num_kernels; ++k) {
+            volatile uint32_t crc = 0;
+            // The bytewise kernel is slow; give it less work.
+            size_t n = (k == 0) ? iterations / 8 : iterations;
+            double start = now();
+            for (i = 0; i < n; ++i) {
+                crc ^= crc32_with_kernel(&kernels[k], buf, size);
+            }
+            double elapsed = now() - start;
+            uint32_t result = crc32_with_kernel(&kernels[k], buf, size);
+            if (result != expected) {
+                fprintf(stderr, "\nKernel %s computed the wrong CRC (%08x, not %08x)\n",
+                        kernels[k].name, result, expected);
+                return 1;
+            }
+            printf("%12.2f", (double)n * size / elapsed / 1e9);
+        }
+        printf("\n");
+    }
+    free(buf);
+    return 0;
+}
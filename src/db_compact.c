@@ -7,10 +7,26 @@
 #include "tree_writer.h"
 #include "node_types.h"
 #include "util.h"
+#include "crc32.h"
+#include "codec.h"
+#include "id_filter.h"
 
 #include <stdlib.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <pthread.h>
+
+#define COMPACT_BATCH_ITEMS 256         // Seq tree items per pipeline batch
+#define COMPACT_PIPELINE_DEPTH 16       // Max batches in flight
+#define COMPACT_READER_THREADS 4        // Threads reading doc bodies from the source
+#define CATCHUP_BATCH_DOCS 256          // Changes replayed per index update when catching up
+#define CATCHUP_MAX_ROUNDS 16           // Give up waiting for the delta to shrink after this
+#define DICT_SIZE (32 * 1024)           // Largest zstd dictionary to train
+#define DICT_SAMPLES 4096               // Most doc bodies to train a dictionary from
+#define DICT_SAMPLE_BYTES (1024 * 1024) // Most body data to train a dictionary from
+#define DICT_MAX_SAMPLE_SIZE 4096       // Larger bodies don't need a dictionary, so skip them
+
+typedef struct compact_pipeline compact_pipeline;
 
 typedef struct compact_ctx {
     TreeWriter* tree_writer;
@@ -22,24 +38,77 @@ typedef struct compact_ctx {
     couchfile_modify_result *target_mr;
     tree_file* target_file;
     couchstore_compact_flags flags;
+    compact_pipeline *pipeline;     // Only with COUCHSTORE_COMPACT_FLAG_PARALLEL
+    sized_buf body_buf;             // Reusable buffer for doc bodies being copied
+    sized_buf recode_buf;           // Reusable buffer for re-encoded doc bodies
+    tree_file *source_file;
+    couchstore_codec_t body_codec;  // The target's codec for compressed bodies
+    int same_dict;                  // Do the source and target have the same zstd dictionary?
+    id_filter *id_filter;           // The target's ID filter, if the source has one
 } compact_ctx;
 
 static couchstore_error_t compact_seq_tree(Db* source, Db* target, compact_ctx *ctx);
 static couchstore_error_t compact_localdocs_tree(Db* source, Db* target, compact_ctx *ctx);
+static couchstore_error_t train_dict(Db* source, Db* target);
+static couchstore_error_t set_dict(Db* target, const sized_buf *data);
 
-couchstore_error_t couchstore_compact_db_ex(Db* source, const char* target_filename,
-                                            couchstore_compact_flags flags,
-                                            const couch_file_ops *ops)
+// Compacts the source into a new file. If pTarget is not NULL, the target db is left open and
+// returned through it, instead of being closed.
+static couchstore_error_t compact_db(Db* source, const char* target_filename,
+                                     couchstore_compact_flags flags,
+                                     const couch_file_ops *ops,
+                                     Db** pTarget)
 {
     Db* target = NULL;
     couchstore_error_t errcode;
-    compact_ctx ctx = {NULL, new_arena(0), new_arena(0), NULL, 0};
+    compact_ctx ctx;
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.transient_arena = new_arena(0);
+    ctx.persistent_arena = new_arena(0);
     ctx.flags = flags;
     error_unless(ctx.transient_arena && ctx.persistent_arena, COUCHSTORE_ERROR_ALLOC_FAIL);
+    // Compaction reads the source's trees straight from its file:
+    error_pass(db_flush_memtable(source));
+    error_pass(db_write_dirty_nodes(source));
 
-    error_pass(couchstore_open_db_ex(target_filename, COUCHSTORE_OPEN_FLAG_CREATE, ops, &target));
+    // The target uses the source handle's codecs unless the flags say otherwise:
+    couchstore_codec_t node_codec = codec_from_flags(flags, CODEC_FLAGS_NODE_SHIFT);
+    couchstore_codec_t body_codec = codec_from_flags(flags, CODEC_FLAGS_BODY_SHIFT);
+    if (node_codec == COUCHSTORE_CODEC_DEFAULT) {
+        node_codec = source->file.node_codec;
+    }
+    if (body_codec == COUCHSTORE_CODEC_DEFAULT) {
+        body_codec = (flags & COUCHSTORE_COMPACT_FLAG_TRAIN_DICTIONARY) ? COUCHSTORE_CODEC_ZSTD
+                                                                        : source->body_codec;
+    }
+    error_unless(!(flags & COUCHSTORE_COMPACT_FLAG_TRAIN_DICTIONARY) ||
+                 body_codec == COUCHSTORE_CODEC_ZSTD, COUCHSTORE_ERROR_INVALID_ARGUMENTS);
+    error_pass(couchstore_open_db_ex(target_filename,
+                                     COUCHSTORE_OPEN_FLAG_CREATE |
+                                     COUCHSTORE_OPEN_FLAG_NODE_CODEC(node_codec) |
+                                     COUCHSTORE_OPEN_FLAG_BODY_CODEC(body_codec),
+                                     ops, &target));
+    ctx.source_file = &source->file;
+    ctx.target_file = &target->file;
+    ctx.body_codec = target->body_codec;
 
     target->file.pos = 1;
+    if(source->id_filter) {
+        // Give the target a filter like the source's; output_seqtree_item fills it in.
+        DbInfo info;
+        error_pass(couchstore_db_info(source, &info));
+        error_pass(db_reset_id_filter(target, source->id_filter->false_positive_rate,
+                                      source->id_filter->max_bytes,
+                                      info.doc_count + info.deleted_count));
+        ctx.id_filter = target->id_filter;
+    }
+    if(flags & COUCHSTORE_COMPACT_FLAG_TRAIN_DICTIONARY) {
+        error_pass(train_dict(source, target));
+    } else if(source->file.dict && target->body_codec == COUCHSTORE_CODEC_ZSTD) {
+        sized_buf dict = codec_dict_data(source->file.dict);
+        error_pass(set_dict(target, &dict));
+    }
+    ctx.same_dict = codec_dict_equal(source->file.dict, target->file.dict);
     target->header.update_seq = source->header.update_seq;
     if(flags & COUCHSTORE_COMPACT_FLAG_DROP_DELETES) {
         //Count the number of times purge has happened
@@ -51,6 +120,9 @@ couchstore_error_t couchstore_compact_db_ex(Db* source, const char* target_filen
 
     if(source->header.by_seq_root) {
         error_pass(TreeWriterOpen(NULL, ebin_cmp, by_id_reduce, by_id_rereduce, &ctx.tree_writer));
+        if (flags & COUCHSTORE_COMPACT_FLAG_PARALLEL) {
+            error_pass(TreeWriterStartSort(ctx.tree_writer));
+        }
         error_pass(compact_seq_tree(source, target, &ctx));
         error_pass(TreeWriterSort(ctx.tree_writer));
         error_pass(TreeWriterWrite(ctx.tree_writer, &target->file, &target->header.by_id_root));
@@ -62,17 +134,32 @@ couchstore_error_t couchstore_compact_db_ex(Db* source, const char* target_filen
         error_pass(compact_localdocs_tree(source, target, &ctx));
     }
     error_pass(couchstore_commit(target));
+    if(pTarget) {
+        *pTarget = target;
+        target = NULL;
+    }
 cleanup:
     TreeWriterFree(ctx.tree_writer);
     delete_arena(ctx.transient_arena);
     delete_arena(ctx.persistent_arena);
-    couchstore_close_db(target);
-    if(errcode != COUCHSTORE_SUCCESS && target != NULL) {
-        unlink(target_filename);
+    free(ctx.body_buf.buf);
+    free(ctx.recode_buf.buf);
+    if(target != NULL) {
+        couchstore_close_db(target);
+        if(errcode != COUCHSTORE_SUCCESS) {
+            unlink(target_filename);
+        }
     }
     return errcode;
 }
 
+couchstore_error_t couchstore_compact_db_ex(Db* source, const char* target_filename,
+                                            couchstore_compact_flags flags,
+                                            const couch_file_ops *ops)
+{
+    return compact_db(source, target_filename, flags, ops, NULL);
+}
+
 couchstore_error_t couchstore_compact_db(Db* source, const char* target_filename)
 {
     return couchstore_compact_db_ex(source, target_filename, 0, couchstore_get_default_file_ops());
@@ -119,6 +206,9 @@ static couchstore_error_t output_seqtree_item(sized_buf* k, sized_buf *v, compac
     sized_buf id_k, id_v;
     id_k.buf = (char*)(rawSeq + 1);
     id_k.size = idsize;
+    if(ctx->id_filter) {
+        id_filter_add(ctx->id_filter, id_k.buf, id_k.size);
+    }
     id_v.size = sizeof(raw_id_index_value) + revMetaSize;
     id_v.buf = arena_alloc(ctx->transient_arena, id_v.size);
 
@@ -141,6 +231,116 @@ cleanup:
     return errcode;
 }
 
+// Writes a doc body to the target file, and points the seq tree value at the copy.
+// The body's chunk is copied as-is, with the CRC it had in the source file, unless it was
+// re-encoded by recode_body; then 'recoded' is set, and the seq tree value gets its new size.
+static couchstore_error_t write_body(sized_buf *v, const sized_buf *body, uint32_t crc,
+                                     int recoded, compact_ctx *ctx)
+{
+    raw_seq_index_value* rawSeq = (raw_seq_index_value*)v->buf;
+    uint64_t bpWithDeleted = decode_raw48(rawSeq->bp);
+    cs_off_t new_bp = 0;
+    size_t new_size = 0;
+
+    int err = db_write_buf_with_crc(ctx->target_mr->rq->file, body, crc, &new_bp, &new_size);
+    if(err < 0) {
+        return err;
+    }
+
+    bpWithDeleted = (bpWithDeleted & BP_DELETED_FLAG) | new_bp;  //Preserve high bit
+    rawSeq->bp = encode_raw48(bpWithDeleted);
+    if(recoded) {
+        uint32_t idsize, datasize;
+        decode_kv_length(&rawSeq->sizes, &idsize, &datasize);
+        rawSeq->sizes = encode_kv_length(idsize, new_size);
+    }
+    return COUCHSTORE_SUCCESS;
+}
+
+// Checks a body's stored CRC if COUCHSTORE_COMPACT_FLAG_VERIFY_CHECKSUMS is set (recode_body
+// checks it anyway.) A body without a CRC (as written by old versions) gets one computed for
+// the copy.
+static couchstore_error_t verify_body(const sized_buf *body, uint32_t *crc, compact_ctx *ctx)
+{
+    if(*crc == 0) {
+        *crc = hash_crc32(body->buf, body->size);
+    } else if((ctx->flags & COUCHSTORE_COMPACT_FLAG_VERIFY_CHECKSUMS) &&
+              *crc != hash_crc32(body->buf, body->size)) {
+        return COUCHSTORE_ERROR_CHECKSUM_FAIL;
+    }
+    return COUCHSTORE_SUCCESS;
+}
+
+// Re-encodes a compressed doc body if it's not in the form the target stores them in: if it
+// uses another codec than the target's, or if only one of the files tags compressed data with
+// its codec, or if it was compressed with another zstd dictionary than the target's. On return
+// 'body' and 'crc' describe the data to write, which may now be in
+// 'buffer' (a reusable buffer, grown with realloc as needed.) Returns 1 if it was re-encoded.
+// This only reads the ctx, so the parallel pipeline's reader threads can call it.
+static int recode_body(compact_ctx *ctx, uint8_t content_meta, sized_buf *body, uint32_t *crc,
+                       sized_buf *buffer)
+{
+    tree_file *source = ctx->source_file, *target = ctx->target_file;
+    couchstore_codec_t codec = codec_of(source->codec_tags, body->buf, body->size);
+    couchstore_codec_t target_codec = codec_for_body(target, ctx->body_codec);
+    if(!(content_meta & COUCH_DOC_IS_COMPRESSED) ||
+       (codec == target_codec && source->codec_tags == target->codec_tags &&
+        (codec != COUCHSTORE_CODEC_ZSTD_DICT || ctx->same_dict))) {
+        return 0;
+    }
+
+    int errcode = COUCHSTORE_SUCCESS;
+    sized_buf plain = {NULL, 0};
+    size_t len;
+    // The copy gets a new CRC, so it has to be checked against the old one first (unless
+    // verify_body already has), or damaged data would be given a valid checksum:
+    if(!(ctx->flags & COUCHSTORE_COMPACT_FLAG_VERIFY_CHECKSUMS) &&
+       *crc != hash_crc32(body->buf, body->size)) {
+        return COUCHSTORE_ERROR_CHECKSUM_FAIL;
+    }
+    if(codec == COUCHSTORE_CODEC_SNAPPY && target_codec == COUCHSTORE_CODEC_SNAPPY) {
+        // Only the codec tag needs adding or removing:
+        if(source->codec_tags) {
+            body->buf++;
+            body->size--;
+        } else {
+            len = body->size + 1;
+            if(buffer->size < len) {
+                char *newbuf = realloc(buffer->buf, len);
+                error_unless(newbuf, COUCHSTORE_ERROR_ALLOC_FAIL);
+                buffer->buf = newbuf;
+                buffer->size = len;
+            }
+            buffer->buf[0] = COUCHSTORE_CODEC_SNAPPY;
+            memcpy(buffer->buf + 1, body->buf, body->size);
+            body->buf = buffer->buf;
+            body->size = len;
+        }
+    } else {
+        int plain_len = decompress_reusing(source, body->buf, body->size, &plain);
+        error_unless(plain_len >= 0, plain_len);
+        len = codec_max_compressed_length(target_codec, target->codec_tags, plain_len);
+        if(buffer->size < len) {
+            char *newbuf = realloc(buffer->buf, len);
+            error_unless(newbuf, COUCHSTORE_ERROR_ALLOC_FAIL);
+            buffer->buf = newbuf;
+            buffer->size = len;
+        }
+        error_pass(codec_compress(target_codec, target->codec_tags, target->dict,
+                                  plain.buf, plain_len, buffer->buf, &len));
+        body->buf = buffer->buf;
+        body->size = len;
+    }
+    *crc = hash_crc32(body->buf, body->size);
+    errcode = 1;
+cleanup:
+    free(plain.buf);
+    return errcode;
+}
+
+static couchstore_error_t queue_seqtree_item(sized_buf *k, sized_buf *v, uint64_t bp,
+                                             compact_ctx *ctx);
+
 static couchstore_error_t compact_seq_fetchcb(couchfile_lookup_request *rq, void *k, sized_buf *v)
 {
     compact_ctx *ctx = (compact_ctx *) rq->callback_ctx;
@@ -152,28 +352,345 @@ static couchstore_error_t compact_seq_fetchcb(couchfile_lookup_request *rq, void
         return COUCHSTORE_SUCCESS;
     }
 
+    if(ctx->pipeline) {
+        return queue_seqtree_item(k, v, bp, ctx);
+    }
+
     if(bp != 0) {
-        cs_off_t new_bp = 0;
         // Copy the document from the old db file to the new one:
-        size_t new_size = 0;
         sized_buf item;
-        item.buf = NULL;
-
-        int itemsize = pread_bin(rq->file, bp, &item.buf);
+        uint32_t crc;
+        int itemsize = pread_bin_raw(rq->file, bp, &ctx->body_buf, (const char**)&item.buf, &crc);
         if(itemsize < 0)
         {
             return itemsize;
         }
         item.size = itemsize;
+        couchstore_error_t errcode = verify_body(&item, &crc, ctx);
+        if(errcode == COUCHSTORE_SUCCESS) {
+            int recoded = recode_body(ctx, decode_raw08(rawSeq->content_meta), &item, &crc,
+                                      &ctx->recode_buf);
+            errcode = recoded < 0 ? recoded : write_body(v, &item, crc, recoded, ctx);
+        }
+        if(errcode < 0) {
+            return errcode;
+        }
+    }
+
+    return output_seqtree_item(k, v, ctx);
+}
+
+
+//////// PARALLEL COMPACTION:
 
-        db_write_buf(ctx->target_mr->rq->file, &item, &new_bp, &new_size);
+/*
+ * With COUCHSTORE_COMPACT_FLAG_PARALLEL the seq tree is compacted by a pipeline:
+ *  - The calling thread scans the source seq tree, copying items into batches.
+ *  - Reader threads read the doc bodies of each batch from the source file.
+ *  - A writer thread takes the batches in order, appends the bodies to the target, and
+ *    builds the new seq tree and the by-id records (which the TreeWriter sorts in the
+ *    background as they arrive.)
+ * So the source tree scan, the body reads and the target writes all overlap.
+ */
 
-        bpWithDeleted = (bpWithDeleted & BP_DELETED_FLAG) | new_bp;  //Preserve high bit
-        rawSeq->bp = encode_raw48(bpWithDeleted);
-        free(item.buf);
+typedef struct {
+    size_t key_offset, value_offset;    // Offsets into the batch's kv buffer
+    size_t key_size, value_size;
+    uint64_t bp;                        // Body position in the source, or 0
+    char *body;                         // Body read from the source (malloced)
+    int body_size;
+    uint32_t body_crc;                  // The body chunk's stored CRC
+    int body_recoded;                   // Was the body re-encoded by recode_body?
+} compact_item;
+
+typedef struct {
+    compact_item items[COMPACT_BATCH_ITEMS];
+    size_t count;
+    sized_buf kv;                       // Copies of the items' keys and values
+    size_t kv_used;
+    int read_done;
+    couchstore_error_t errcode;
+} compact_batch;
+
+struct compact_pipeline {
+    compact_ctx *ctx;
+    tree_file *source;
+    compact_batch batches[COMPACT_PIPELINE_DEPTH];  // Batch n lives in batches[n % DEPTH]
+    size_t filled;          // Number of batches handed over by the scanner
+    size_t claimed;         // Number of batches claimed by reader threads
+    size_t written;         // Number of batches finished by the writer thread
+    int scan_done;
+    int stop;               // Set on error, to shut everything down
+    couchstore_error_t errcode;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+static void pipeline_fail(compact_pipeline *p, couchstore_error_t errcode)
+{
+    pthread_mutex_lock(&p->lock);
+    if(!p->stop) {
+        p->stop = 1;
+        p->errcode = errcode;
     }
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+}
 
-    return output_seqtree_item(k, v, ctx);
+static void clear_batch(compact_batch *batch)
+{
+    size_t i;
+    for(i = 0; i < batch->count; ++i) {
+        free(batch->items[i].body);
+        batch->items[i].body = NULL;
+    }
+    batch->count = 0;
+    batch->kv_used = 0;
+    batch->read_done = 0;
+    batch->errcode = COUCHSTORE_SUCCESS;
+}
+
+// Copies bytes into a batch's kv buffer, returning their offset or -1 on failure.
+static ssize_t batch_copy(compact_batch *batch, const void *data, size_t size)
+{
+    if(batch->kv_used + size > batch->kv.size) {
+        size_t new_size = batch->kv.size ? batch->kv.size * 2 : 64 * 1024;
+        while(new_size < batch->kv_used + size) {
+            new_size *= 2;
+        }
+        char *buf = realloc(batch->kv.buf, new_size);
+        if(!buf) {
+            return -1;
+        }
+        batch->kv.buf = buf;
+        batch->kv.size = new_size;
+    }
+    memcpy(batch->kv.buf + batch->kv_used, data, size);
+    batch->kv_used += size;
+    return (ssize_t)(batch->kv_used - size);
+}
+
+// Called on the scanning thread: hands the batch being filled over to the readers.
+static couchstore_error_t submit_batch(compact_pipeline *p)
+{
+    couchstore_error_t errcode;
+    pthread_mutex_lock(&p->lock);
+    p->filled++;
+    pthread_cond_broadcast(&p->cond);
+    // Wait for the next slot to be free:
+    while(!p->stop && p->filled - p->written >= COMPACT_PIPELINE_DEPTH) {
+        pthread_cond_wait(&p->cond, &p->lock);
+    }
+    errcode = p->stop ? p->errcode : COUCHSTORE_SUCCESS;
+    pthread_mutex_unlock(&p->lock);
+    return errcode;
+}
+
+static couchstore_error_t queue_seqtree_item(sized_buf *k, sized_buf *v, uint64_t bp,
+                                             compact_ctx *ctx)
+{
+    compact_pipeline *p = ctx->pipeline;
+    compact_batch *batch = &p->batches[p->filled % COMPACT_PIPELINE_DEPTH];
+    compact_item *item = &batch->items[batch->count];
+    ssize_t key_offset = batch_copy(batch, k->buf, k->size);
+    ssize_t value_offset = batch_copy(batch, v->buf, v->size);
+    if(key_offset < 0 || value_offset < 0) {
+        return COUCHSTORE_ERROR_ALLOC_FAIL;
+    }
+    item->key_offset = key_offset;
+    item->key_size = k->size;
+    item->value_offset = value_offset;
+    item->value_size = v->size;
+    item->bp = bp;
+    item->body = NULL;
+    item->body_size = 0;
+    item->body_recoded = 0;
+    if(++batch->count == COMPACT_BATCH_ITEMS) {
+        return submit_batch(p);
+    }
+    return COUCHSTORE_SUCCESS;
+}
+
+static void read_batch_bodies(compact_pipeline *p, compact_batch *batch)
+{
+    size_t i;
+    for(i = 0; i < batch->count; ++i) {
+        compact_item *item = &batch->items[i];
+        if(item->bp == 0) {
+            continue;
+        }
+        const raw_seq_index_value *rawSeq =
+            (const raw_seq_index_value*)(batch->kv.buf + item->value_offset);
+        uint32_t idsize, datasize;
+        decode_kv_length(&rawSeq->sizes, &idsize, &datasize);
+        int size = pread_bin_direct(p->source, item->bp, datasize + 8, &item->body,
+                                    &item->body_crc);
+        if(size < 0) {
+            batch->errcode = size;
+            return;
+        }
+        item->body_size = size;
+        sized_buf body = {item->body, (size_t)size};
+        couchstore_error_t errcode = verify_body(&body, &item->body_crc, p->ctx);
+        if(errcode < 0) {
+            batch->errcode = errcode;
+            return;
+        }
+        sized_buf recoded = {NULL, 0};
+        int result = recode_body(p->ctx, decode_raw08(rawSeq->content_meta), &body,
+                                 &item->body_crc, &recoded);
+        if(result < 0) {
+            free(recoded.buf);
+            batch->errcode = result;
+            return;
+        } else if(result > 0) {
+            if(recoded.buf == NULL) {
+                // Just had its codec tag skipped:
+                memmove(item->body, body.buf, body.size);
+            } else {
+                free(item->body);
+                item->body = recoded.buf;
+            }
+            item->body_size = (int)body.size;
+            item->body_recoded = 1;
+        }
+    }
+}
+
+static void *compact_reader_thread(void *arg)
+{
+    compact_pipeline *p = arg;
+    pthread_mutex_lock(&p->lock);
+    while(!p->stop) {
+        if(p->claimed == p->filled) {
+            if(p->scan_done) {
+                break;
+            }
+            pthread_cond_wait(&p->cond, &p->lock);
+            continue;
+        }
+        compact_batch *batch = &p->batches[p->claimed++ % COMPACT_PIPELINE_DEPTH];
+        pthread_mutex_unlock(&p->lock);
+        read_batch_bodies(p, batch);
+        pthread_mutex_lock(&p->lock);
+        batch->read_done = 1;
+        pthread_cond_broadcast(&p->cond);
+    }
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+static couchstore_error_t write_batch(compact_ctx *ctx, compact_batch *batch)
+{
+    couchstore_error_t errcode = batch->errcode;
+    size_t i;
+    for(i = 0; i < batch->count && errcode == COUCHSTORE_SUCCESS; ++i) {
+        compact_item *item = &batch->items[i];
+        sized_buf k = {batch->kv.buf + item->key_offset, item->key_size};
+        sized_buf v = {batch->kv.buf + item->value_offset, item->value_size};
+        if(item->body) {
+            sized_buf body = {item->body, item->body_size};
+            errcode = write_body(&v, &body, item->body_crc, item->body_recoded, ctx);
+        }
+        if(errcode == COUCHSTORE_SUCCESS) {
+            errcode = output_seqtree_item(&k, &v, ctx);
+        }
+    }
+    return errcode;
+}
+
+static void *compact_writer_thread(void *arg)
+{
+    compact_pipeline *p = arg;
+    pthread_mutex_lock(&p->lock);
+    while(!p->stop) {
+        if(p->written == p->filled && p->scan_done) {
+            break;
+        }
+        compact_batch *batch = &p->batches[p->written % COMPACT_PIPELINE_DEPTH];
+        if(p->written == p->filled || !batch->read_done) {
+            pthread_cond_wait(&p->cond, &p->lock);
+            continue;
+        }
+        pthread_mutex_unlock(&p->lock);
+        couchstore_error_t errcode = write_batch(p->ctx, batch);
+        clear_batch(batch);
+        if(errcode != COUCHSTORE_SUCCESS) {
+            pipeline_fail(p, errcode);
+        }
+        pthread_mutex_lock(&p->lock);
+        p->written++;
+        pthread_cond_broadcast(&p->cond);
+    }
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+static couchstore_error_t compact_seq_tree_parallel(couchfile_lookup_request *srcfold,
+                                                    uint64_t root_pointer,
+                                                    compact_ctx *ctx)
+{
+    couchstore_error_t errcode;
+    compact_pipeline *p = calloc(1, sizeof(compact_pipeline));
+    pthread_t readers[COMPACT_READER_THREADS], writer;
+    size_t nreaders = 0, i;
+    int have_writer = 0;
+    if(!p) {
+        return COUCHSTORE_ERROR_ALLOC_FAIL;
+    }
+    p->ctx = ctx;
+    p->source = srcfold->file;
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->cond, NULL);
+
+    // The readers bypass the source's buffers:
+    errcode = tree_file_flush(p->source);
+    if(errcode == COUCHSTORE_SUCCESS) {
+        have_writer = (pthread_create(&writer, NULL, compact_writer_thread, p) == 0);
+        while(have_writer && nreaders < COMPACT_READER_THREADS &&
+              pthread_create(&readers[nreaders], NULL, compact_reader_thread, p) == 0) {
+            ++nreaders;
+        }
+        if(nreaders == 0) {
+            errcode = COUCHSTORE_ERROR_ALLOC_FAIL;
+        }
+    }
+
+    if(errcode == COUCHSTORE_SUCCESS) {
+        ctx->pipeline = p;
+        errcode = btree_lookup(srcfold, root_pointer);
+        ctx->pipeline = NULL;
+        if(errcode == COUCHSTORE_SUCCESS &&
+           p->batches[p->filled % COMPACT_PIPELINE_DEPTH].count > 0) {
+            errcode = submit_batch(p);
+        }
+    }
+    if(errcode != COUCHSTORE_SUCCESS) {
+        pipeline_fail(p, errcode);
+    }
+
+    pthread_mutex_lock(&p->lock);
+    p->scan_done = 1;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+    for(i = 0; i < nreaders; ++i) {
+        pthread_join(readers[i], NULL);
+    }
+    if(have_writer) {
+        pthread_join(writer, NULL);
+    }
+    if(p->stop) {
+        errcode = p->errcode;
+    }
+
+    for(i = 0; i < COMPACT_PIPELINE_DEPTH; ++i) {
+        clear_batch(&p->batches[i]);
+        free(p->batches[i].kv.buf);
+    }
+    pthread_cond_destroy(&p->cond);
+    pthread_mutex_destroy(&p->lock);
+    free(p);
+    return errcode;
 }
 
 static couchstore_error_t compact_seq_tree(Db* source, Db* target, compact_ctx *ctx)
@@ -206,7 +723,11 @@ static couchstore_error_t compact_seq_tree(Db* source, Db* target, compact_ctx *
     srcfold.fetch_callback = compact_seq_fetchcb;
     srcfold.node_callback = NULL;
 
-    errcode = btree_lookup(&srcfold, source->header.by_seq_root->pointer);
+    if(ctx->flags & COUCHSTORE_COMPACT_FLAG_PARALLEL) {
+        errcode = compact_seq_tree_parallel(&srcfold, source->header.by_seq_root->pointer, ctx);
+    } else {
+        errcode = btree_lookup(&srcfold, source->header.by_seq_root->pointer);
+    }
     if(errcode == COUCHSTORE_SUCCESS) {
         target->header.by_seq_root = complete_new_btree(ctx->target_mr, &errcode);
     }
@@ -263,3 +784,293 @@ cleanup:
     return errcode;
 }
 
+
+//////// ZSTD DICTIONARIES:
+
+/*
+ * With COUCHSTORE_COMPACT_FLAG_TRAIN_DICTIONARY, the compactor trains a zstd dictionary from
+ * compressed bodies spread evenly through the source's by-sequence index, and writes it to the
+ * target before any bodies, which recode_body then compresses with it.
+ *
+ * Bodies are sampled at a fixed stride. The stride starts from the doc count, but if the
+ * samples outgrow their limits before the end of the index, every other one is dropped and
+ * the stride doubles, so the samples always come from the whole file.
+ */
+
+typedef struct {
+    uint64_t stride;        // Sample every stride'th compressed body
+    uint64_t seen;          // Compressed bodies seen so far
+    char *samples;
+    size_t samples_size;
+    size_t sample_sizes[DICT_SAMPLES];
+    uint64_t sample_pos[DICT_SAMPLES];  // Value of 'seen' each sample was taken at
+    unsigned count;
+} dict_sampler;
+
+// Doubles the stride, dropping the samples that aren't on it
+static void thin_samples(dict_sampler *ds)
+{
+    unsigned i, kept = 0;
+    size_t from = 0, to = 0;
+    ds->stride *= 2;
+    for (i = 0; i < ds->count; ++i) {
+        size_t size = ds->sample_sizes[i];
+        if (ds->sample_pos[i] % ds->stride == 0) {
+            memmove(ds->samples + to, ds->samples + from, size);
+            ds->sample_sizes[kept] = size;
+            ds->sample_pos[kept] = ds->sample_pos[i];
+            ++kept;
+            to += size;
+        }
+        from += size;
+    }
+    ds->count = kept;
+    ds->samples_size = to;
+}
+
+static int dict_sample_cb(Db *db, DocInfo *info, void *ctx)
+{
+    dict_sampler *ds = ctx;
+    Doc *doc = NULL;
+    uint64_t pos;
+    if(info->deleted || info->bp == 0 || !(info->content_meta & COUCH_DOC_IS_COMPRESSED)) {
+        return 0;
+    }
+    pos = ds->seen++;
+    if(pos % ds->stride != 0) {
+        return 0;
+    }
+    couchstore_error_t errcode = couchstore_open_doc_with_docinfo(db, info, &doc,
+                                                                  DECOMPRESS_DOC_BODIES);
+    if(errcode != COUCHSTORE_SUCCESS) {
+        return errcode;
+    }
+    if(doc->data.size <= DICT_MAX_SAMPLE_SIZE) {
+        while(ds->count == DICT_SAMPLES ||
+              ds->samples_size + doc->data.size > DICT_SAMPLE_BYTES) {
+            thin_samples(ds);
+        }
+        if(pos % ds->stride == 0) {
+            memcpy(ds->samples + ds->samples_size, doc->data.buf, doc->data.size);
+            ds->samples_size += doc->data.size;
+            ds->sample_sizes[ds->count] = doc->data.size;
+            ds->sample_pos[ds->count++] = pos;
+        }
+    }
+    couchstore_free_document(doc);
+    return 0;
+}
+
+// Trains a dictionary from the source's bodies, and gives it to the target
+static couchstore_error_t train_dict(Db* source, Db* target)
+{
+    couchstore_error_t errcode;
+    DbInfo info;
+    char *dict = NULL;
+    size_t dict_len = DICT_SIZE;
+    dict_sampler *ds = calloc(1, sizeof(dict_sampler));
+    error_unless(ds, COUCHSTORE_ERROR_ALLOC_FAIL);
+    ds->samples = malloc(DICT_SAMPLE_BYTES);
+    dict = malloc(DICT_SIZE);
+    error_unless(ds->samples && dict, COUCHSTORE_ERROR_ALLOC_FAIL);
+
+    error_pass(couchstore_db_info(source, &info));
+    ds->stride = info.doc_count / DICT_SAMPLES + 1;
+    error_pass(couchstore_changes_since(source, 0, 0, dict_sample_cb, ds));
+
+    error_pass(codec_train_dict(ds->samples, ds->sample_sizes, ds->count, dict, &dict_len));
+    if(dict_len > 0) {
+        sized_buf data = {dict, dict_len};
+        error_pass(set_dict(target, &data));
+    }
+cleanup:
+    if(ds) {
+        free(ds->samples);
+    }
+    free(ds);
+    free(dict);
+    return errcode;
+}
+
+// Writes a dictionary to the target, whose header will then point to it
+static couchstore_error_t set_dict(Db* target, const sized_buf *data)
+{
+    couchstore_error_t errcode;
+    cs_off_t pos;
+    error_pass(codec_dict_create(data->buf, data->size, &target->file.dict));
+    error_pass(db_write_buf(&target->file, data, &pos, NULL));
+    target->header.dict_pos = pos;
+cleanup:
+    return errcode;
+}
+
+
+//////// CATCH-UP COMPACTION:
+
+/*
+ * couchstore_compact_db_catchup compacts a snapshot of the source, and then replays the changes
+ * committed to the source file since then (as found by couchstore_changes_since) into the
+ * target, round after round, while a writer keeps updating the source. Each round copies the
+ * changed bodies like the compactor does, and adds them to the target's indexes with their
+ * original sequence numbers.
+ */
+
+typedef struct {
+    Db *source;             // The fresh handle the changes are read from
+    Db *target;
+    compact_ctx *ctx;
+    DocInfo *infos[CATCHUP_BATCH_DOCS];
+    unsigned count;
+    uint64_t changes;
+    couchstore_error_t errcode;
+} catchup_ctx;
+
+static void free_catchup_batch(catchup_ctx *cu)
+{
+    unsigned i;
+    for(i = 0; i < cu->count; ++i) {
+        couchstore_free_docinfo(cu->infos[i]);
+    }
+    cu->count = 0;
+}
+
+static couchstore_error_t flush_catchup_batch(catchup_ctx *cu)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    if(cu->count > 0) {
+        errcode = db_save_docinfos(cu->target, cu->infos, cu->count);
+    }
+    free_catchup_batch(cu);
+    return errcode;
+}
+
+static int catchup_changes_cb(Db *db, DocInfo *info, void *ctx)
+{
+    catchup_ctx *cu = ctx;
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    (void)db;
+
+    if(info->bp != 0) {
+        // Copy the body over, as in compact_seq_fetchcb:
+        sized_buf body;
+        uint32_t crc;
+        cs_off_t new_bp;
+        size_t new_size;
+        int size = pread_bin_raw(&cu->source->file, info->bp, &cu->ctx->body_buf,
+                                 (const char**)&body.buf, &crc);
+        error_unless(size >= 0, size);
+        body.size = size;
+        error_pass(verify_body(&body, &crc, cu->ctx));
+        size = recode_body(cu->ctx, info->content_meta, &body, &crc, &cu->ctx->recode_buf);
+        error_unless(size >= 0, size);
+        error_pass(db_write_buf_with_crc(&cu->target->file, &body, crc, &new_bp, &new_size));
+        info->bp = new_bp;
+        info->size = new_size;
+    }
+    if(cu->count == CATCHUP_BATCH_DOCS) {
+        error_pass(flush_catchup_batch(cu));
+    }
+    cu->infos[cu->count++] = info;
+    cu->changes++;
+    return 1;       // Keep the DocInfo; flush_catchup_batch frees it
+
+cleanup:
+    // (The DocInfo isn't in the batch yet, and couchstore_changes_since frees it)
+    cu->errcode = errcode;
+    return errcode;
+}
+
+couchstore_error_t couchstore_compact_catchup(Db* source, Db* target,
+                                              couchstore_compact_flags flags,
+                                              uint64_t *num_changes)
+{
+    couchstore_error_t errcode;
+    Db* current = NULL;
+    compact_ctx ctx;
+    catchup_ctx cu;
+    memset(&ctx, 0, sizeof(ctx));
+    memset(&cu, 0, sizeof(cu));
+    ctx.transient_arena = new_arena(0);
+    ctx.persistent_arena = new_arena(0);
+    ctx.flags = flags;
+    error_unless(ctx.transient_arena && ctx.persistent_arena, COUCHSTORE_ERROR_ALLOC_FAIL);
+
+    // Open the source file again, to see the latest header committed to it:
+    error_pass(couchstore_open_db_ex(couchstore_get_db_filename(source),
+                                     COUCHSTORE_OPEN_FLAG_RDONLY, source->file.ops, &current));
+    ctx.source_file = &current->file;
+    ctx.target_file = &target->file;
+    ctx.body_codec = target->body_codec;
+    ctx.same_dict = codec_dict_equal(current->file.dict, target->file.dict);
+    cu.source = current;
+    cu.target = target;
+    cu.ctx = &ctx;
+
+    // Tombstones are replayed even with COUCHSTORE_COMPACT_FLAG_DROP_DELETES, since the
+    // target may still have the live doc they replace.
+    errcode = couchstore_changes_since(current, target->header.update_seq + 1, 0,
+                                       catchup_changes_cb, &cu);
+    if(cu.errcode != COUCHSTORE_SUCCESS) {
+        errcode = cu.errcode;
+    }
+    error_pass(errcode);
+    error_pass(flush_catchup_batch(&cu));
+
+    target->header.update_seq = current->header.update_seq;
+    if(flags & COUCHSTORE_COMPACT_FLAG_DROP_DELETES) {
+        target->header.purge_seq = current->header.purge_seq + 1;
+    } else {
+        target->header.purge_seq = current->header.purge_seq;
+    }
+    target->header.purge_ptr = current->header.purge_ptr;
+
+    // Local docs aren't in the changes feed, so copy the whole local docs tree again:
+    free(target->header.local_docs_root);
+    target->header.local_docs_root = NULL;
+    if(current->header.local_docs_root) {
+        error_pass(compact_localdocs_tree(current, target, &ctx));
+    }
+    error_pass(couchstore_commit(target));
+    if(num_changes) {
+        *num_changes = cu.changes;
+    }
+
+cleanup:
+    free_catchup_batch(&cu);
+    delete_arena(ctx.transient_arena);
+    delete_arena(ctx.persistent_arena);
+    free(ctx.body_buf.buf);
+    free(ctx.recode_buf.buf);
+    if(current != NULL) {
+        couchstore_close_db(current);
+    }
+    return errcode;
+}
+
+couchstore_error_t couchstore_compact_db_catchup(Db* source, const char* target_filename,
+                                                 couchstore_compact_flags flags,
+                                                 const couch_file_ops *ops,
+                                                 uint64_t max_changes,
+                                                 Db** pTarget)
+{
+    couchstore_error_t errcode;
+    Db* target = NULL;
+    uint64_t changes;
+    int round;
+
+    error_pass(compact_db(source, target_filename, flags, ops, &target));
+    for(round = 0; round < CATCHUP_MAX_ROUNDS; ++round) {
+        error_pass(couchstore_compact_catchup(source, target, flags, &changes));
+        if(changes <= max_changes) {
+            break;
+        }
+    }
+    *pTarget = target;
+    target = NULL;
+cleanup:
+    if(target) {
+        couchstore_close_db(target);
+        unlink(target_filename);
+    }
+    return errcode;
+}
@@ -0,0 +1,183 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#include "config.h"
+#include <stdlib.h>
+#include <string.h>
+
+#include "dirty_nodes.h"
+#include "couch_btree.h"
+#include "node_types.h"
+#include "util.h"
+
+typedef struct {
+    char *buf;          // NULL once freed
+    size_t size;
+    int marked;         // Used by dirty_nodes_sweep
+} dirty_node;
+
+struct dirty_nodes {
+    dirty_node *nodes;  // Indexed by position, less DIRTY_NODE_FLAG
+    size_t count;
+    size_t capacity;
+    size_t size;        // Total size of the nodes not yet freed
+};
+
+couchstore_error_t dirty_nodes_create(dirty_nodes **result)
+{
+    *result = calloc(1, sizeof(dirty_nodes));
+    return *result ? COUCHSTORE_SUCCESS : COUCHSTORE_ERROR_ALLOC_FAIL;
+}
+
+void dirty_nodes_free(dirty_nodes *nodes)
+{
+    if (nodes) {
+        dirty_nodes_clear(nodes);
+        free(nodes->nodes);
+        free(nodes);
+    }
+}
+
+couchstore_error_t dirty_nodes_add(dirty_nodes *nodes, char *buf, size_t size, cs_off_t *pos)
+{
+    if (nodes->count == nodes->capacity) {
+        size_t capacity = nodes->capacity ? 2 * nodes->capacity : 64;
+        dirty_node *grown = realloc(nodes->nodes, capacity * sizeof(dirty_node));
+        if (!grown) {
+            free(buf);
+            return COUCHSTORE_ERROR_ALLOC_FAIL;
+        }
+        nodes->nodes = grown;
+        nodes->capacity = capacity;
+    }
+    dirty_node *node = &nodes->nodes[nodes->count];
+    node->buf = buf;
+    node->size = size;
+    node->marked = 0;
+    nodes->size += size;
+    *pos = DIRTY_NODE_FLAG | nodes->count++;
+    return COUCHSTORE_SUCCESS;
+}
+
+// Returns the node at a position, or NULL if there's no such node
+static dirty_node *find_node(const dirty_nodes *nodes, cs_off_t pos)
+{
+    uint64_t index = pos & ~DIRTY_NODE_FLAG;
+    if (!is_dirty_node(pos) || index >= nodes->count || !nodes->nodes[index].buf) {
+        return NULL;
+    }
+    return &nodes->nodes[index];
+}
+
+int dirty_nodes_read(const dirty_nodes *nodes, cs_off_t pos, char **ret_ptr)
+{
+    const dirty_node *node = find_node(nodes, pos);
+    if (!node) {
+        return COUCHSTORE_ERROR_CORRUPT;
+    }
+    *ret_ptr = malloc(node->size);
+    if (!*ret_ptr) {
+        return COUCHSTORE_ERROR_ALLOC_FAIL;
+    }
+    memcpy(*ret_ptr, node->buf, node->size);
+    return (int) node->size;
+}
+
+size_t dirty_nodes_size(const dirty_nodes *nodes)
+{
+    return nodes->size;
+}
+
+static void mark_node(dirty_nodes *nodes, cs_off_t pos)
+{
+    dirty_node *node = find_node(nodes, pos);
+    node_layout layout;
+    size_t bufpos = 1;
+    if (!node || node->marked) {
+        return;
+    }
+    node->marked = 1;
+    if (!parse_node(node->buf, node->size, &layout) || layout.type != KP_NODE) {
+        return;
+    }
+    while (bufpos < layout.end) {
+        sized_buf key, value;
+        bufpos += read_kv(node->buf + bufpos, &key, &value);
+        const raw_node_pointer *raw = (const raw_node_pointer*)value.buf;
+        mark_node(nodes, decode_raw48(raw->pointer));
+    }
+}
+
+void dirty_nodes_sweep(dirty_nodes *nodes, node_pointer * const roots[], int count)
+{
+    size_t i;
+    int r;
+    for (r = 0; r < count; ++r) {
+        if (roots[r]) {
+            mark_node(nodes, roots[r]->pointer);
+        }
+    }
+    for (i = 0; i < nodes->count; ++i) {
+        dirty_node *node = &nodes->nodes[i];
+        if (node->buf && !node->marked) {
+            nodes->size -= node->size;
+            free(node->buf);
+            node->buf = NULL;
+        }
+        node->marked = 0;
+    }
+}
+
+// Writes an in-memory node and its in-memory descendants, and updates the pointer to it
+static couchstore_error_t write_node(tree_file *file, uint64_t *pointer, uint64_t *subtreesize)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    dirty_node *node = find_node(file->dirty, *pointer);
+    node_layout layout;
+    uint64_t children_size = 0;
+    size_t bufpos = 1;
+    cs_off_t pos;
+    size_t disk_size;
+
+    error_unless(node, COUCHSTORE_ERROR_CORRUPT);
+    error_unless(parse_node(node->buf, node->size, &layout), COUCHSTORE_ERROR_CORRUPT);
+    if (layout.type == KP_NODE) {
+        // The children's real positions and sizes are patched into this node's pointers:
+        while (bufpos < layout.end) {
+            sized_buf key, value;
+            bufpos += read_kv(node->buf + bufpos, &key, &value);
+            raw_node_pointer *raw = (raw_node_pointer*)value.buf;
+            uint64_t child = decode_raw48(raw->pointer);
+            uint64_t child_size = decode_raw48(raw->subtreesize);
+            if (is_dirty_node(child)) {
+                error_pass(write_node(file, &child, &child_size));
+                raw->pointer = encode_raw48(child);
+                raw->subtreesize = encode_raw48(child_size);
+            }
+            children_size += child_size;
+        }
+    }
+
+    sized_buf writebuf = {node->buf, node->size};
+    error_pass(db_write_buf_compressed(file, &writebuf, file->node_codec, &pos, &disk_size));
+    *pointer = pos;
+    *subtreesize = children_size + disk_size;
+cleanup:
+    return errcode;
+}
+
+couchstore_error_t dirty_nodes_write(tree_file *file, node_pointer *root)
+{
+    if (!root || !is_dirty_node(root->pointer)) {
+        return COUCHSTORE_SUCCESS;
+    }
+    return write_node(file, &root->pointer, &root->subtreesize);
+}
+
+void dirty_nodes_clear(dirty_nodes *nodes)
+{
+    size_t i;
+    for (i = 0; i < nodes->count; ++i) {
+        free(nodes->nodes[i].buf);
+    }
+    nodes->count = 0;
+    nodes->size = 0;
+}
@@ -0,0 +1,63 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef LIBCOUCHSTORE_DIRTY_NODES_H
+#define LIBCOUCHSTORE_DIRTY_NODES_H 1
+
+#include "internal.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    /*
+     * B-tree nodes that have been built but not yet written to the file, for
+     * COUCHSTORE_OPEN_FLAG_DEFER_NODE_WRITES. Each is given a position with DIRTY_NODE_FLAG set,
+     * which node pointers hold like any other position; pread_node reads the node from memory.
+     * At a commit the nodes still reachable from the roots are written, children first, and
+     * the pointers to them are rewritten with their real positions and subtree sizes.
+     */
+
+    /** Set in the positions of nodes held in memory. No file gets this big. */
+#define DIRTY_NODE_FLAG ((uint64_t)1 << 47)
+
+    static inline int is_dirty_node(uint64_t pos)
+    {
+        return (pos & DIRTY_NODE_FLAG) != 0;
+    }
+
+    /** Creates an empty set of nodes. */
+    couchstore_error_t dirty_nodes_create(dirty_nodes **result);
+
+    /** Frees a set of nodes, and the nodes. NULL is allowed. */
+    void dirty_nodes_free(dirty_nodes *nodes);
+
+    /** Adds a node.
+        @param buf The node data, a malloced block the set takes ownership of (even on failure)
+        @param pos On success, set to the node's in-memory position */
+    couchstore_error_t dirty_nodes_add(dirty_nodes *nodes, char *buf, size_t size,
+                                       cs_off_t *pos);
+
+    /** Copies a node's data, like pread_node.
+        @param ret_ptr On success, set to a malloced copy the caller must free
+        @return The length of the node data, or a negative error code */
+    int dirty_nodes_read(const dirty_nodes *nodes, cs_off_t pos, char **ret_ptr);
+
+    /** Returns the total size of the nodes held. */
+    size_t dirty_nodes_size(const dirty_nodes *nodes);
+
+    /** Frees the nodes that can't be reached from any of the given roots (NULLs are allowed),
+        as when a later change has replaced them. */
+    void dirty_nodes_sweep(dirty_nodes *nodes, node_pointer * const roots[], int count);
+
+    /** Writes the in-memory nodes reachable from a root to the file, updating the root's
+        position and subtree size. Doesn't free them; call dirty_nodes_clear once every root
+        has been written. */
+    couchstore_error_t dirty_nodes_write(tree_file *file, node_pointer *root);
+
+    /** Frees all the nodes, and starts handing out positions from the beginning again. */
+    void dirty_nodes_clear(dirty_nodes *nodes);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,221 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#include "config.h"
+#include <stdlib.h>
+#include <string.h>
+
+#include "id_filter.h"
+#include "bitfield.h"
+
+#define BLOCK_BYTES 64
+#define BLOCK_BITS (BLOCK_BYTES * 8)
+#define MAX_HASHES 16
+#define LN2 0.6931471805599453
+
+// The filter as written to the file, followed by the blocks:
+typedef struct {
+    raw_48 seq;
+    raw_48 count;
+    raw_48 capacity;
+    raw_48 max_bytes;
+    raw_32 false_positive_ppb;  // False positive rate in parts per billion
+    raw_32 num_blocks;
+    raw_08 num_hashes;
+} raw_id_filter;
+
+// log2 of x >= 1, to within 2^-20, without needing libm
+static double log2_of(double x)
+{
+    double result = 0, bit = 1;
+    int i;
+    while (x >= 2) {
+        x /= 2;
+        result += 1;
+    }
+    for (i = 0; i < 20; ++i) {
+        x *= x;
+        bit /= 2;
+        if (x >= 2) {
+            x /= 2;
+            result += bit;
+        }
+    }
+    return result;
+}
+
+// FNV-1a, with a final mix (from MurmurHash3) to spread short IDs' bits
+static uint64_t hash_id(const char *id, size_t idlen)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    size_t i;
+    for (i = 0; i < idlen; ++i) {
+        h = (h ^ (uint8_t)id[i]) * 0x100000001b3ULL;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+// Finds the block an ID's bits are in. Its i'th bit is bit (*a + i * *b) % BLOCK_BITS.
+static uint8_t *find_block(const id_filter *filter, const char *id, size_t idlen,
+                           uint32_t *a, uint32_t *b)
+{
+    uint64_t hash = hash_id(id, idlen);
+    *a = (uint32_t)hash;
+    *b = (uint32_t)((hash * 0x9e3779b97f4a7c15ULL) >> 32) | 1;
+    return filter->bits + ((hash >> 32) * filter->num_blocks >> 32) * BLOCK_BYTES;
+}
+
+// Sets up a filter's sizes; the bits are allocated by the caller.
+static couchstore_error_t init_filter(id_filter *filter, double false_positive_rate,
+                                      uint64_t max_bytes, uint64_t capacity,
+                                      uint64_t num_blocks, unsigned num_hashes)
+{
+    if (num_blocks == 0 || num_blocks > UINT32_MAX || num_hashes == 0 ||
+            num_hashes > MAX_HASHES) {
+        return COUCHSTORE_ERROR_INVALID_ARGUMENTS;
+    }
+    filter->false_positive_rate = false_positive_rate;
+    filter->max_bytes = max_bytes;
+    filter->capacity = capacity;
+    filter->num_blocks = (uint32_t)num_blocks;
+    filter->num_hashes = (uint8_t)num_hashes;
+    filter->bits = calloc(num_blocks, BLOCK_BYTES);
+    return filter->bits ? COUCHSTORE_SUCCESS : COUCHSTORE_ERROR_ALLOC_FAIL;
+}
+
+couchstore_error_t id_filter_create(double false_positive_rate, uint64_t max_bytes,
+                                    uint64_t capacity, id_filter **result)
+{
+    if (!(false_positive_rate > 0 && false_positive_rate < 1) || capacity == 0) {
+        return COUCHSTORE_ERROR_INVALID_ARGUMENTS;
+    }
+    // A Bloom filter needs log2(1/p) / ln 2 bits per key for a false positive rate p:
+    double bits_per_id = log2_of(1 / false_positive_rate) / LN2;
+    uint64_t num_blocks = (uint64_t)(bits_per_id * capacity / BLOCK_BITS) + 1;
+    if (max_bytes > 0 && num_blocks * BLOCK_BYTES > max_bytes) {
+        num_blocks = max_bytes / BLOCK_BYTES;
+        if (num_blocks == 0) {
+            num_blocks = 1;
+        }
+        bits_per_id = (double)num_blocks * BLOCK_BITS / capacity;
+    }
+    // The best number of hashes is bits_per_id * ln 2:
+    unsigned num_hashes = (unsigned)(bits_per_id * LN2 + 0.5);
+    if (num_hashes < 1) {
+        num_hashes = 1;
+    } else if (num_hashes > MAX_HASHES) {
+        num_hashes = MAX_HASHES;
+    }
+
+    id_filter *filter = calloc(1, sizeof(id_filter));
+    if (filter == NULL) {
+        return COUCHSTORE_ERROR_ALLOC_FAIL;
+    }
+    couchstore_error_t errcode = init_filter(filter, false_positive_rate, max_bytes, capacity,
+                                             num_blocks, num_hashes);
+    if (errcode != COUCHSTORE_SUCCESS) {
+        id_filter_free(filter);
+        return errcode;
+    }
+    *result = filter;
+    return COUCHSTORE_SUCCESS;
+}
+
+void id_filter_free(id_filter *filter)
+{
+    if (filter) {
+        free(filter->bits);
+        free(filter);
+    }
+}
+
+void id_filter_add(id_filter *filter, const char *id, size_t idlen)
+{
+    uint32_t a, b, i;
+    uint8_t *block = find_block(filter, id, idlen, &a, &b);
+    int added = 0;
+    for (i = 0; i < filter->num_hashes; ++i) {
+        uint32_t bit = (a + i * b) % BLOCK_BITS;
+        if (!(block[bit / 8] & (1 << (bit % 8)))) {
+            block[bit / 8] |= (uint8_t)(1 << (bit % 8));
+            added = 1;
+        }
+    }
+    if (added) {
+        filter->count++;
+    }
+}
+
+int id_filter_may_contain(const id_filter *filter, const char *id, size_t idlen)
+{
+    uint32_t a, b, i;
+    const uint8_t *block = find_block(filter, id, idlen, &a, &b);
+    for (i = 0; i < filter->num_hashes; ++i) {
+        uint32_t bit = (a + i * b) % BLOCK_BITS;
+        if (!(block[bit / 8] & (1 << (bit % 8)))) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int id_filter_is_full(const id_filter *filter)
+{
+    return filter->count > filter->capacity;
+}
+
+couchstore_error_t id_filter_encode(const id_filter *filter, uint64_t seq, sized_buf *out)
+{
+    size_t bits_size = (size_t)filter->num_blocks * BLOCK_BYTES;
+    out->size = sizeof(raw_id_filter) + bits_size;
+    out->buf = malloc(out->size);
+    if (out->buf == NULL) {
+        return COUCHSTORE_ERROR_ALLOC_FAIL;
+    }
+    raw_id_filter *raw = (raw_id_filter*)out->buf;
+    raw->seq = encode_raw48(seq);
+    raw->count = encode_raw48(filter->count);
+    raw->capacity = encode_raw48(filter->capacity);
+    raw->max_bytes = encode_raw48(filter->max_bytes);
+    raw->false_positive_ppb = encode_raw32((uint32_t)(filter->false_positive_rate * 1e9 + 0.5));
+    raw->num_blocks = encode_raw32(filter->num_blocks);
+    raw->num_hashes = encode_raw08(filter->num_hashes);
+    memcpy(raw + 1, filter->bits, bits_size);
+    return COUCHSTORE_SUCCESS;
+}
+
+couchstore_error_t id_filter_decode(const char *buf, size_t len, id_filter **result,
+                                    uint64_t *seq)
+{
+    const raw_id_filter *raw = (const raw_id_filter*)buf;
+    if (len < sizeof(raw_id_filter)) {
+        return COUCHSTORE_ERROR_CORRUPT;
+    }
+    uint32_t num_blocks = decode_raw32(raw->num_blocks);
+    if (len != sizeof(raw_id_filter) + (size_t)num_blocks * BLOCK_BYTES) {
+        return COUCHSTORE_ERROR_CORRUPT;
+    }
+
+    id_filter *filter = calloc(1, sizeof(id_filter));
+    if (filter == NULL) {
+        return COUCHSTORE_ERROR_ALLOC_FAIL;
+    }
+    couchstore_error_t errcode = init_filter(filter,
+                                             decode_raw32(raw->false_positive_ppb) / 1e9,
+                                             decode_raw48(raw->max_bytes),
+                                             decode_raw48(raw->capacity),
+                                             num_blocks, decode_raw08(raw->num_hashes));
+    if (errcode != COUCHSTORE_SUCCESS) {
+        id_filter_free(filter);
+        return errcode == COUCHSTORE_ERROR_INVALID_ARGUMENTS ? COUCHSTORE_ERROR_CORRUPT
+                                                             : errcode;
+    }
+    filter->count = decode_raw48(raw->count);
+    memcpy(filter->bits, raw + 1, (size_t)num_blocks * BLOCK_BYTES);
+    *seq = decode_raw48(raw->seq);
+    *result = filter;
+    return COUCHSTORE_SUCCESS;
+}
@@ -0,0 +1,65 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef LIBCOUCHSTORE_ID_FILTER_H
+#define LIBCOUCHSTORE_ID_FILTER_H 1
+
+#include "internal.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    /*
+     * A blocked Bloom filter of document IDs. Each ID sets bits within a single 64-byte block,
+     * so checking one costs a single cache miss however many hash functions are used, for a
+     * slightly higher false positive rate than a plain Bloom filter of the same size.
+     */
+
+    struct id_filter {
+        double false_positive_rate; // The rate it was sized for
+        uint64_t max_bytes;         // Memory budget it was sized within, or 0 for none
+        uint64_t capacity;          // Number of IDs it was sized for
+        uint64_t count;             // IDs added; ones added again are usually not counted
+        uint32_t num_blocks;
+        uint8_t num_hashes;         // Bits set per ID
+        uint8_t *bits;
+    };
+
+    /** Creates an empty filter.
+        @param false_positive_rate The fraction of absent IDs that should pass the filter once
+                'capacity' IDs are in it (0 < rate < 1)
+        @param max_bytes The most memory the bits may use, or 0 for no limit. If the rate
+                needs more, the filter gets this much, and a higher false positive rate.
+        @param capacity The number of IDs to size the filter for */
+    couchstore_error_t id_filter_create(double false_positive_rate, uint64_t max_bytes,
+                                        uint64_t capacity, id_filter **result);
+
+    /** Frees a filter. NULL is allowed. */
+    void id_filter_free(id_filter *filter);
+
+    /** Adds an ID to a filter. */
+    void id_filter_add(id_filter *filter, const char *id, size_t idlen);
+
+    /** Returns zero if an ID was definitely never added to a filter, nonzero if it may have
+        been. */
+    int id_filter_may_contain(const id_filter *filter, const char *id, size_t idlen);
+
+    /** Returns nonzero if a filter holds more IDs than it was sized for, so its false positive
+        rate is worse than asked for. */
+    int id_filter_is_full(const id_filter *filter);
+
+    /** Encodes a filter to be written to the file.
+        @param seq The db's update_seq: the filter holds the IDs of all docs saved up to it
+        @param out On success, set to a malloced buffer the caller must free */
+    couchstore_error_t id_filter_encode(const id_filter *filter, uint64_t seq, sized_buf *out);
+
+    /** Decodes a filter written by id_filter_encode.
+        @param seq On success, set to the update_seq the filter was encoded at
+        @return COUCHSTORE_SUCCESS, COUCHSTORE_ERROR_CORRUPT or COUCHSTORE_ERROR_ALLOC_FAIL */
+    couchstore_error_t id_filter_decode(const char *buf, size_t len, id_filter **result,
+                                        uint64_t *seq);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
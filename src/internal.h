@@ -14,7 +14,8 @@
 #include <pthread.h>
 
 #define COUCH_BLOCK_SIZE 4096
-#define COUCH_DISK_VERSION 11
+#define COUCH_DISK_VERSION 12           // Compressed chunks are tagged with their codec
+#define COUCH_SNAPPY_DISK_VERSION 11    // Compressed chunks are all untagged snappy
 #define COUCH_SNAPPY_THRESHOLD 64
 
 enum {
@@ -26,12 +27,25 @@ enum {
 extern "C" {
 #endif
 
+    typedef struct codec_dict codec_dict;
+    typedef struct id_filter id_filter;
+    typedef struct dirty_nodes dirty_nodes;
+    typedef struct memtable memtable;
+
     // Structure representing an open file; "superclass" of Db
     typedef struct _treefile {
         uint64_t pos;
         const couch_file_ops *ops;
         couch_file_handle handle;
         const char* path;
+        uint64_t cache_id;      // Identifies this file's entries in the node cache; shared by
+                                // all handles on the file (see node_cache.c)
+        int codec_tags;         // Compressed chunks start with their codec (see codec.h)
+        couchstore_codec_t node_codec;  // Codec new B-tree nodes are compressed with
+        codec_dict *dict;       // The file's trained zstd dictionary for doc bodies, if any
+        dirty_nodes *dirty;     // Nodes not written yet (COUCHSTORE_OPEN_FLAG_DEFER_NODE_WRITES)
+        uint64_t commit_start;  // Where the chunks written since the last header begin
+        uint32_t commit_digest; // Digest of those chunks (see commit_digest_add)
     } tree_file;
 
     typedef struct _nodepointer {
@@ -49,6 +63,11 @@ extern "C" {
         node_pointer *local_docs_root;
         uint64_t purge_seq;
         uint64_t purge_ptr;
+        uint64_t dict_pos;      // Position of the zstd dictionary chunk, or 0 if there's none
+        uint64_t id_filter_pos; // Position of the saved ID filter chunk, or 0 if there's none
+        uint64_t commit_start;  // Range of the chunks written by a single-sync commit, and
+        uint64_t commit_end;    // their digest; start == end if the header doesn't record them
+        uint32_t commit_digest;
         uint64_t position;
     } db_header;
 
@@ -59,10 +78,29 @@ extern "C" {
 #endif
     };
 
+    typedef struct group_commit_batch group_commit_batch;
+
     struct _db {
         tree_file file;
         db_header header;
         void *userdata;
+        sized_buf read_scratch;     // Reusable buffers for couchstore_visit_doc_body
+        sized_buf body_scratch;
+        // Group commit state, for couchstore_save_documents_and_commit:
+        pthread_mutex_t commit_lock;
+        pthread_cond_t commit_cond;
+        group_commit_batch *commit_queue;   // Batches waiting for the next group
+        group_commit_batch **commit_queue_tail;
+        int committing;                     // Is a leader saving a group right now?
+        int single_sync_commit;             // COUCHSTORE_OPEN_FLAG_SINGLE_SYNC
+        int shared;                         // COUCHSTORE_OPEN_FLAG_SHARED: no per-Db read state
+        const couch_file_ops *file_ops;     // The ops the file was opened with
+        couchstore_codec_t body_codec;      // Codec bodies saved with COMPRESS_DOC_BODIES use
+        id_filter *id_filter;               // Filter of doc IDs (see couchstore_set_id_filter)
+        uint64_t id_filter_unsaved;         // Changes added to it since it was last saved
+        memtable *memtable;                 // Saves not in the trees yet (couchstore_set_memtable)
+        uint64_t memtable_max_bytes;
+        unsigned memtable_max_age;          // Seconds, or 0
     };
 
     const couch_file_ops *couch_get_default_file_ops(void);
@@ -71,10 +109,13 @@ extern "C" {
         @param file  Pointer to tree_file struct to initialize.
         @param filename  Path to the file
         @param flags  POSIX open-mode flags
+        @param shared  If nonzero, the file is read-only and can be read from several threads
+                at once (see couch_get_shared_file_ops)
         @param ops  File I/O operations to use */
     couchstore_error_t tree_file_open(tree_file* file,
                                       const char *filename,
                                       int openflags,
+                                      int shared,
                                       const couch_file_ops *ops);
     /** Closes a tree_file.
         @param file  Pointer to open tree_file. Does not free this pointer! */
@@ -89,6 +130,100 @@ extern "C" {
         @return The length of the chunk (zero is a valid length!), or a negative error code */
     int pread_bin(tree_file *file, cs_off_t pos, char **ret_ptr);
 
+    /** Reads a chunk from the file at a given position, without copying it if possible.
+        If the file is memory-mapped and the chunk doesn't span a block boundary, *ret_ptr
+        will point directly into the mapping (valid until the file is closed) and *borrowed
+        will be set to 1; otherwise this behaves like pread_bin and sets *borrowed to 0.
+        Only free the buffer if it wasn't borrowed. */
+    int pread_bin_borrowed(tree_file *file, cs_off_t pos, const char **ret_ptr, int *borrowed);
+
+    /** Reads a chunk from the file at a given position into a reusable buffer.
+        The data is borrowed from the file's memory mapping if possible (see pread_bin_borrowed);
+        otherwise it's read into 'buffer', which is grown with realloc if it's too small
+        (its 'size' is its capacity.)
+        @param ret_ptr On success, will be set to point to the chunk data.
+        @return The length of the chunk, or a negative error code */
+    int pread_bin_reusing(tree_file *file, cs_off_t pos, sized_buf *buffer, const char **ret_ptr);
+
+    /** Reads a chunk into a reusable buffer like pread_bin_reusing, but without verifying its
+        CRC; the stored CRC is returned instead, so the chunk can be copied elsewhere with
+        db_write_buf_with_crc.
+        @param crc On success, set to the chunk's stored CRC (0 if it has none)
+        @return The length of the chunk, or a negative error code */
+    int pread_bin_raw(tree_file *file, cs_off_t pos, sized_buf *buffer, const char **ret_ptr,
+                      uint32_t *crc);
+
+    /** Reads the length of the chunk at a file position, without reading the chunk itself.
+        @param end_pos On success, set to the file position just past the end of the chunk
+        @return The length of the chunk, or a negative error code */
+    int pread_chunk_size(tree_file *file, cs_off_t pos, cs_off_t *end_pos);
+
+    /** Reads a compressed chunk and decompresses it into a reusable buffer, which is grown with
+        realloc if it's too small. 'scratch' is another reusable buffer that may be used to hold
+        the compressed data.
+        @return The length of the decompressed data, or a negative error code */
+    int pread_compressed_reusing(tree_file *file, cs_off_t pos, sized_buf *scratch,
+                                 sized_buf *buffer);
+
+    /** Decompresses a compressed chunk's data into a reusable buffer, which is grown with
+        realloc if it's too small.
+        @return The length of the decompressed data, or a negative error code */
+    int decompress_reusing(tree_file *file, const char *compressed_buf, size_t len,
+                           sized_buf *buffer);
+
+    /** Gets a compressed chunk's data in plain snappy format, as clients are given compressed
+        doc bodies. In files older than disk version 12 it already is. Otherwise snappy data
+        only needs its codec tag skipped, but other codecs' data is decompressed and recompressed
+        into a reusable buffer, which is grown with realloc if it's too small.
+        @param ret_ptr On success, set to point to the snappy data
+        @return The length of the snappy data, or a negative error code */
+    int compressed_to_snappy(tree_file *file, const char *compressed_buf, size_t len,
+                             sized_buf *buffer, const char **ret_ptr);
+
+    /** Writes any buffered data through to the file, without syncing it. */
+    couchstore_error_t tree_file_flush(tree_file *file);
+
+    /** Reads a range of raw file data, block prefixes and all, into memory.
+        @param direct If nonzero, bypasses the file's buffers, so that several threads can call
+                this at once provided the underlying file ops are thread-safe. Call
+                tree_file_flush first so buffered writes are visible.
+        @param ret_ptr On success, set to point to the data. This is a malloced buffer the caller
+                must free, unless *borrowed is set to 1, in which case it points into the file's
+                memory mapping.
+        @return The number of bytes read (less than len if EOF was reached), or an error code */
+    ssize_t pread_raw_range(tree_file *file, cs_off_t pos, size_t len, int direct,
+                            const char **ret_ptr, int *borrowed);
+
+    /** Extracts a chunk from raw file data already read into memory by pread_raw_range.
+        @param data The raw file data, starting at file position data_pos
+        @param pos The file position of the chunk
+        @param buffer Reusable buffer to copy the chunk into, if it spans block boundaries
+        @param ret_ptr On success, set to point to the chunk data (in 'data' or 'buffer')
+        @param crc If not NULL, receives the chunk's stored CRC, which then isn't verified
+        @return The length of the chunk, COUCHSTORE_ERROR_READ if it doesn't lie entirely
+                within the data, or another negative error code */
+    int decode_chunk_in_memory(const char *data, cs_off_t data_pos, size_t data_len,
+                               cs_off_t pos, sized_buf *buffer, const char **ret_ptr,
+                               uint32_t *crc);
+
+    /** Reads a chunk like pread_bin, but bypassing the file's buffers (see pread_raw_range), so
+        several threads can read at once. Call tree_file_flush first.
+        @param size_hint The expected size of the chunk, as from DocInfo.size. It's only used to
+                decide how much to read at first; if it's too small, a second read is made.
+        @param ret_ptr On success, set to a malloced buffer containing the chunk data.
+        @param crc If not NULL, receives the chunk's stored CRC, which then isn't verified
+        @return The length of the chunk, or a negative error code */
+    int pread_bin_direct(tree_file *file, cs_off_t pos, size_t size_hint, char **ret_ptr,
+                         uint32_t *crc);
+
+    /** Returns nonzero if the file's ops can submit a batch of reads concurrently. */
+    int tree_file_can_batch_read(tree_file *file);
+
+    /** Performs several reads at once, using the file ops' pread_batch if there is one, or
+        else one at a time. See couch_file_ops.pread_batch. */
+    couchstore_error_t tree_file_pread_batch(tree_file *file, couch_file_read_request *reqs,
+                                             size_t count);
+
     /** Reads a compressed chunk from the file at a given position.
         Parameters and return value are the same as for pread_bin. */
     int pread_compressed(tree_file *file, cs_off_t pos, char **ret_ptr);
@@ -97,9 +232,56 @@ extern "C" {
         Parameters and return value are the same as for pread_bin. */
     int pread_header(tree_file *file, cs_off_t pos, char **ret_ptr);
 
+    /** Writes a header chunk at the next block boundary. Afterwards file->commit_start is the
+        end of the header and file->commit_digest is reset, ready for the next commit. */
     couchstore_error_t db_write_header(tree_file *file, sized_buf *buf, cs_off_t *pos);
+
+    /** Adds a chunk's length and CRC to a digest of all the chunks written since the last
+        header, which single-sync commits store in the header. */
+    uint32_t commit_digest_add(uint32_t digest, uint32_t size, uint32_t crc);
     int db_write_buf(tree_file *file, const sized_buf *buf, cs_off_t *pos, size_t *disk_size);
-    int db_write_buf_compressed(tree_file *file, const sized_buf *buf, cs_off_t *pos, size_t *disk_size);
+
+    /** Writes a chunk like db_write_buf, but with a CRC already known to match its contents
+        (as when copying a chunk read by pread_bin_raw), instead of computing one. */
+    int db_write_buf_with_crc(tree_file *file, const sized_buf *buf, uint32_t crc,
+                              cs_off_t *pos, size_t *disk_size);
+
+    /** Compresses data and writes it as a chunk, like db_write_buf. Files older than disk
+        version 12 only hold snappy data, so there 'codec' is ignored. */
+    int db_write_buf_compressed(tree_file *file, const sized_buf *buf, couchstore_codec_t codec,
+                                cs_off_t *pos, size_t *disk_size);
+
+    /** Writes data that's already snappy-compressed as a compressed chunk, like db_write_buf,
+        adding a codec tag if the file's format needs one. */
+    int db_write_buf_snappy(tree_file *file, const sized_buf *buf, cs_off_t *pos,
+                            size_t *disk_size);
+
+    /** Adds docs whose bodies are already written to the db's indexes, keeping the sequence
+        numbers, body positions and sizes in their DocInfos (unlike couchstore_save_documents,
+        which assigns new sequence numbers.) Used to replay changes into a compacted file.
+        The db's update_seq is raised to the highest sequence number saved. */
+    couchstore_error_t db_save_docinfos(Db *db, DocInfo *infos[], unsigned numdocs);
+
+    /** Adds the docs in the db's memtable, if it has one, to its indexes, and empties it.
+        Called when the memtable fills up, and before a commit or any read that doesn't look
+        in the memtable itself. */
+    couchstore_error_t db_flush_memtable(Db *db);
+
+    /** Gives a db a new, empty ID filter with room for 'num_ids' IDs and more, for the caller
+        to fill in; it's saved at the next commit. A still-empty file is switched to disk
+        version 12 so that the filter can be saved in it. */
+    couchstore_error_t db_reset_id_filter(Db *db, double false_positive_rate,
+                                          uint64_t max_bytes, uint64_t num_ids);
+
+    /** Writes the db's B-tree nodes that are being held in memory (see
+        COUCHSTORE_OPEN_FLAG_DEFER_NODE_WRITES), and points its roots at them. Called by
+        couchstore_commit, and before compacting. */
+    couchstore_error_t db_write_dirty_nodes(Db *db);
+
+    /** After a change, frees the in-memory nodes it replaced, and writes the rest if they
+        still take up too much memory. */
+    couchstore_error_t db_trim_dirty_nodes(Db *db);
+
     struct _os_error *get_os_error_store(void);
 
     extern pthread_key_t os_err_key;
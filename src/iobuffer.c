@@ -9,6 +9,8 @@
 #include "config.h"
 #include "iobuffer.h"
 #include "internal.h"
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -21,6 +23,30 @@
 #define MAX_READ_BUFFERS 8
 #define WRITE_BUFFER_CAPACITY (128*1024)
 #define READ_BUFFER_CAPACITY (8*1024)
+#define READ_BUFFER_HASH_SIZE 16            // Buckets for looking up read buffers by offset
+#define DIRECT_WRITE_THRESHOLD (32*1024)    // Vectored writes this large bypass the write buffer
+#define WRITE_IOV_STACK 16                  // Pieces a vectored write can pass on without malloc
+
+/*
+ * Readahead: besides the small read buffers, which suit random access, a handle watches for
+ * runs of reads that each start at or a little past where the previous one ended (a scan, or a
+ * strided walk through the file.) Reading a chunk takes a read of its header and then one of
+ * its data, which together count as a single step. Once a run scores READAHEAD_TRIGGER, misses
+ * are served from a separate readahead buffer instead, whose window starts at READAHEAD_MIN and
+ * doubles each time it's refilled, up to READAHEAD_MAX. A step that jumps elsewhere halves the
+ * score, so a scan survives the odd jump (as to a parent B-tree node), but random access soon
+ * drops back to the small buffers, and the readahead buffer is freed. Going back to a chunk read
+ * a few steps earlier, as each lookup does to the B-tree's root, resets the score outright.
+ */
+#define READAHEAD_TRIGGER 4
+#define READAHEAD_MAX_SCORE 8
+#define READAHEAD_MIN (32*1024)
+#define READAHEAD_MAX (2*1024*1024)
+#define READAHEAD_MAX_GAP (64*1024)         // Largest forward skip that continues a run, until
+                                            // readahead has served a read (then the window's size)
+#define READAHEAD_HISTORY 8                 // Recent steps remembered, to notice going back
+#define CHUNK_HEADER_SIZE 8                 // Reads this small start a step that the next
+                                            // contiguous read continues
 
 #ifdef min
 #undef min
@@ -32,6 +58,7 @@ static inline ssize_t min(ssize_t a, ssize_t b) {return a < b ? a : b;}
 typedef struct file_buffer {
     struct file_buffer* prev;
     struct file_buffer* next;
+    struct file_buffer* hash_next;      // Next read buffer in the same hash bucket
     struct buffered_file_handle *owner;
     size_t capacity;
     size_t length;
@@ -47,14 +74,28 @@ typedef struct buffered_file_handle {
     couch_file_handle raw_ops_handle;
     unsigned nbuffers;
     file_buffer* write_buffer;
-    file_buffer* first_buffer;
+    file_buffer* first_buffer;          // Most recently used read buffer
+    file_buffer* last_buffer;           // Least recently used read buffer
+    file_buffer* buckets[READ_BUFFER_HASH_SIZE];
+    // Readahead state:
+    file_buffer* readahead;             // Allocated only while a run is in progress
+    cs_off_t run_start;                 // Start of the run's last step
+    cs_off_t run_end;                   // End of the run's last step
+    unsigned run_score;                 // Forward steps, less jumps (see above)
+    int jumped;                         // Did the current step jump away from the run?
+    cs_off_t step_end;                  // End of the previous read
+    size_t step_size;                   // Bytes read so far by the current step
+    cs_off_t recent_steps[READAHEAD_HISTORY];   // Where recent steps started
+    unsigned next_recent;               // Index in recent_steps to overwrite next
+    size_t readahead_window;            // Size of the next readahead, or 0 if not reading ahead
+    int readahead_hit;                  // Has the readahead buffer served a later read yet?
 } buffered_file_handle;
 
 
 static file_buffer* new_buffer(buffered_file_handle* owner, size_t capacity) {
     file_buffer *buf = malloc(sizeof(file_buffer) + capacity);
     if (buf) {
-        buf->prev = buf->next = NULL;
+        buf->prev = buf->next = buf->hash_next = NULL;
         buf->owner = owner;
         buf->capacity = capacity;
         buf->length = 0;
@@ -122,17 +163,23 @@ static couchstore_error_t flush_buffer(file_buffer* buf) {
 //////// BUFFER READS:
 
 
-static size_t read_from_buffer(file_buffer* buf, void *bytes, size_t nbyte, cs_off_t offset) {
-    if (offset < buf->offset || offset >= buf->offset + (cs_off_t)buf->length) {
+// Copies as many of the requested bytes as possible out of a block of file data.
+static size_t read_from_block(const uint8_t *block, cs_off_t block_offset, size_t block_length,
+                              void *bytes, size_t nbyte, cs_off_t offset) {
+    if (offset < block_offset || offset >= block_offset + (cs_off_t)block_length) {
         return 0;
     }
-    size_t offset_in_buffer = (size_t)(offset - buf->offset);
-    size_t buffer_nbyte = min(buf->length - offset_in_buffer, nbyte);
+    size_t offset_in_buffer = (size_t)(offset - block_offset);
+    size_t buffer_nbyte = min(block_length - offset_in_buffer, nbyte);
 
-    memcpy(bytes, buf->bytes + offset_in_buffer, buffer_nbyte);
+    memcpy(bytes, block + offset_in_buffer, buffer_nbyte);
     return buffer_nbyte;
 }
 
+static size_t read_from_buffer(file_buffer* buf, void *bytes, size_t nbyte, cs_off_t offset) {
+    return read_from_block(buf->bytes, buf->offset, buf->length, bytes, nbyte, offset);
+}
+
 
 static couchstore_error_t load_buffer_from(file_buffer* buf, cs_off_t offset, size_t nbyte) {
     if (buf->dirty) {
@@ -168,28 +215,57 @@ static couchstore_error_t load_buffer_from(file_buffer* buf, cs_off_t offset, si
 //////// BUFFER MANAGEMENT:
 
 
+static inline unsigned bucket_of(cs_off_t block_offset) {
+    return (unsigned)(block_offset / READ_BUFFER_CAPACITY) % READ_BUFFER_HASH_SIZE;
+}
+
+static void hash_remove(buffered_file_handle* h, file_buffer* buffer) {
+    file_buffer** link = &h->buckets[bucket_of(buffer->offset)];
+    while (*link && *link != buffer)
+        link = &(*link)->hash_next;
+    if (*link)
+        *link = buffer->hash_next;
+    buffer->hash_next = NULL;
+}
+
+static void hash_insert(buffered_file_handle* h, file_buffer* buffer) {
+    unsigned bucket = bucket_of(buffer->offset);
+    buffer->hash_next = h->buckets[bucket];
+    h->buckets[bucket] = buffer;
+}
+
 static file_buffer* find_buffer(buffered_file_handle* h, cs_off_t offset) {
     offset = offset - offset % READ_BUFFER_CAPACITY;
-    // Find a buffer for this offset, or use the last one:
-    file_buffer* buffer = h->first_buffer;
-    while (buffer->offset != offset && buffer->next != NULL)
-        buffer = buffer->next;
-    if (buffer->offset != offset) {
+    // Look for a buffer for this offset in its hash bucket:
+    file_buffer* buffer = h->buckets[bucket_of(offset)];
+    while (buffer && buffer->offset != offset)
+        buffer = buffer->hash_next;
+    if (!buffer) {
         if (h->nbuffers < MAX_READ_BUFFERS) {
             // Didn't find a matching one, but we can still create another:
-            file_buffer* buffer2 = new_buffer(h, READ_BUFFER_CAPACITY);
-            if (buffer2) {
-                buffer = buffer2;
+            buffer = new_buffer(h, READ_BUFFER_CAPACITY);
+            if (buffer) {
                 ++h->nbuffers;
+                buffer->next = h->first_buffer;
+                h->first_buffer->prev = buffer;
+                h->first_buffer = buffer;
             }
-        } else {
+        }
+        if (!buffer) {
+            // Recycle the least recently used one:
+            buffer = h->last_buffer;
+            hash_remove(h, buffer);
 #if LOG_BUFFER
             fprintf(stderr, "BUFFER: %p recycled, from %zd to %zd\n", buffer, buffer->offset, offset);
 #endif
         }
+        buffer->offset = offset;
+        buffer->length = 0;
+        hash_insert(h, buffer);
     }
     if (buffer != h->first_buffer) {
         // Move the buffer to the start of the list:
+        if (buffer == h->last_buffer) h->last_buffer = buffer->prev;
         if (buffer->prev) buffer->prev->next = buffer->next;
         if (buffer->next) buffer->next->prev = buffer->prev;
         buffer->prev = NULL;
@@ -201,6 +277,104 @@ static file_buffer* find_buffer(buffered_file_handle* h, cs_off_t offset) {
 }
 
 
+//////// READAHEAD:
+
+
+static inline int buffer_covers(const file_buffer* buf, cs_off_t offset) {
+    return offset >= buf->offset && offset < buf->offset + (cs_off_t)buf->length;
+}
+
+static void stop_readahead(buffered_file_handle* h) {
+    free_buffer(h->readahead);
+    h->readahead = NULL;
+    h->readahead_window = 0;
+    h->readahead_hit = 0;
+}
+
+// Notes the position of each read, to tell whether a run of forward reads is in progress.
+static void track_read(buffered_file_handle* h, cs_off_t offset, size_t nbyte) {
+    if (h->step_size <= CHUNK_HEADER_SIZE &&
+            (offset == h->step_end || offset == h->step_end + 1)) {
+        // The rest of a chunk whose header was just read (perhaps past a block prefix):
+        h->step_end = offset + nbyte;
+        h->step_size += nbyte;
+        if (!h->jumped) {
+            h->run_end = h->step_end;
+        }
+        return;
+    }
+    h->step_end = offset + nbyte;
+    h->step_size = nbyte;
+
+    int revisit = 0;
+    unsigned i;
+    for (i = 0; i < READAHEAD_HISTORY; ++i) {
+        revisit |= (h->recent_steps[i] == offset);
+    }
+    h->recent_steps[h->next_recent] = offset;
+    h->next_recent = (h->next_recent + 1) % READAHEAD_HISTORY;
+
+    cs_off_t max_gap = READAHEAD_MAX_GAP;
+    if (h->readahead_hit && (cs_off_t)h->readahead_window > max_gap) {
+        max_gap = (cs_off_t)h->readahead_window;
+    }
+    h->jumped = 0;
+    if (revisit && (offset < h->run_start || offset >= h->run_end)) {
+        // Back to a chunk read a few steps ago, so this isn't a scan:
+        h->run_score = 0;
+        if (h->readahead) {
+            stop_readahead(h);
+        }
+    } else if (offset >= h->run_end && offset - h->run_end <= max_gap) {
+        if (h->run_score < READAHEAD_MAX_SCORE) {
+            ++h->run_score;
+        }
+    } else if ((offset < h->run_start || offset >= h->run_end) &&
+               !(h->readahead && buffer_covers(h->readahead, offset))) {
+        // Jumped backward, or too far forward. (Re-reading the last range, or anything that
+        // was read ahead, doesn't count.) While the run survives, this is treated as a detour
+        // and the next read is still compared with the run's position.
+        h->run_score /= 2;
+        if (h->run_score < READAHEAD_TRIGGER && h->readahead) {
+            stop_readahead(h);
+        }
+        h->jumped = 1;
+        if (h->run_score > 0) {
+            return;
+        }
+    }
+    h->run_start = offset;
+    h->run_end = offset + nbyte;
+}
+
+// Refills the readahead buffer starting at the block containing 'offset', growing its window.
+// Returns NULL if readahead isn't warranted (or the buffer can't be allocated.)
+static file_buffer* load_readahead(buffered_file_handle* h, cs_off_t offset, couchstore_error_t *err) {
+    *err = COUCHSTORE_SUCCESS;
+    if (h->run_score < READAHEAD_TRIGGER || h->jumped) {
+        // A read away from the run uses the small buffers, leaving the window where it was.
+        return NULL;
+    }
+    size_t window = h->readahead_window ? h->readahead_window * 2 : READAHEAD_MIN;
+    if (window > READAHEAD_MAX) {
+        window = READAHEAD_MAX;
+    }
+    if (!h->readahead || h->readahead->capacity < window) {
+        free_buffer(h->readahead);
+        h->readahead = new_buffer(h, window);
+        if (!h->readahead) {
+            h->readahead_window = 0;
+            return NULL;
+        }
+    }
+    h->readahead_window = window;
+    h->readahead->offset = offset - offset % READ_BUFFER_CAPACITY;
+    h->readahead->length = 0;
+    *err = load_buffer_from(h->readahead, h->readahead->offset, window);
+    return *err < 0 ? NULL : h->readahead;
+}
+
+
 //////// FILE API:
 
 
@@ -213,6 +387,7 @@ static void buffered_destructor(couch_file_handle handle)
     h->raw_ops->destructor(h->raw_ops_handle);
 	
     free_buffer(h->write_buffer);
+    free_buffer(h->readahead);
     file_buffer* buffer, *next;
     for (buffer = h->first_buffer; buffer; buffer = next) {
         next = buffer->next;
@@ -223,17 +398,23 @@ static void buffered_destructor(couch_file_handle handle)
 
 static couch_file_handle buffered_constructor_with_raw_ops(const couch_file_ops* raw_ops)
 {
-    buffered_file_handle *h = malloc(sizeof(buffered_file_handle));
+    buffered_file_handle *h = calloc(1, sizeof(buffered_file_handle));
     if (h) {
         h->raw_ops = raw_ops;
         h->raw_ops_handle = raw_ops->constructor(raw_ops->cookie);
         h->nbuffers = 1;
+        unsigned i;
+        for (i = 0; i < READAHEAD_HISTORY; ++i) {
+            h->recent_steps[i] = -1;
+        }
         h->write_buffer = new_buffer(h, WRITE_BUFFER_CAPACITY);
-        h->first_buffer = new_buffer(h, READ_BUFFER_CAPACITY);
+        h->first_buffer = h->last_buffer = new_buffer(h, READ_BUFFER_CAPACITY);
         
         if (!h->write_buffer || !h->first_buffer) {
             buffered_destructor((couch_file_handle)h);
             h = NULL;
+        } else {
+            hash_insert(h, h->first_buffer);
         }
     }
     return (couch_file_handle) h;
@@ -273,20 +454,48 @@ static ssize_t buffered_pread(couch_file_handle handle, void *buf, size_t nbyte,
         return err;
     }
     
+    track_read(h, offset, nbyte);
+
     ssize_t total_read = 0;
     while (nbyte > 0) {
+        ssize_t nbyte_read = 0;
+        if (h->readahead) {
+            nbyte_read = read_from_buffer(h->readahead, buf, nbyte, offset);
+            h->readahead_hit |= (nbyte_read > 0);
+        }
+        if (nbyte_read == 0 && h->run_score >= READAHEAD_TRIGGER && !h->jumped) {
+            // In a run of forward reads, so fetch a larger window instead of a small buffer:
+            file_buffer* readahead = load_readahead(h, offset, &err);
+            if (err < 0) {
+                return err;
+            } else if (readahead) {
+                nbyte_read = read_from_buffer(readahead, buf, nbyte, offset);
+                if (nbyte_read == 0)
+                    break;  // must be at EOF
+            }
+        }
+        if (nbyte_read > 0) {
+            buf = (char*)buf + nbyte_read;
+            nbyte -= nbyte_read;
+            offset += nbyte_read;
+            total_read += nbyte_read;
+            continue;
+        }
+
         file_buffer* buffer = find_buffer(h, offset);
         
         // Read as much as we can from the current buffer:
-        ssize_t nbyte_read = read_from_buffer(buffer, buf, nbyte, offset);
+        nbyte_read = read_from_buffer(buffer, buf, nbyte, offset);
         if (nbyte_read == 0) {
-            /*if (nbyte > buffer->capacity) {
+            if (nbyte > buffer->capacity) {
                 // Remainder won't fit in a single buffer, so just read it directly:
                 nbyte_read = h->raw_ops->pread(h->raw_ops_handle, buf, nbyte, offset);
                 if (nbyte_read < 0) {
                     return nbyte_read;
+                } else if (nbyte_read == 0) {
+                    break;  // must be at EOF
                 }
-            } else*/ {
+            } else {
                 // Move the buffer to cover the remainder of the data to be read.
                 cs_off_t block_start = offset - (offset % READ_BUFFER_CAPACITY);
                 err = load_buffer_from(buffer, block_start, (size_t)(offset + nbyte - block_start));
@@ -354,6 +563,85 @@ static ssize_t buffered_pwrite(couch_file_handle handle, const void *buf, size_t
     return nbyte_written;
 }
 
+static ssize_t buffered_pwritev(couch_file_handle handle, const couch_file_iovec *iov, int iovcnt,
+                                cs_off_t offset)
+{
+    buffered_file_handle *h = (buffered_file_handle*)handle;
+    file_buffer* buffer = h->write_buffer;
+    size_t total = 0;
+    int i;
+    for (i = 0; i < iovcnt; ++i) {
+        total += iov[i].nbytes;
+    }
+
+    if (total < DIRECT_WRITE_THRESHOLD || h->raw_ops->version < 7 || !h->raw_ops->pwritev) {
+        // Small enough to be worth copying into the write buffer (or there's no raw pwritev):
+        for (i = 0; i < iovcnt; ++i) {
+            const char *buf = iov[i].buf;
+            size_t nbyte = iov[i].nbytes;
+            while (nbyte > 0) {
+                ssize_t written = buffered_pwrite(handle, buf, nbyte, offset);
+                if (written < 0) {
+                    return written;
+                } else if (written == 0) {
+                    return COUCHSTORE_ERROR_WRITE;
+                }
+                buf += written;
+                nbyte -= written;
+                offset += written;
+            }
+        }
+        return (ssize_t)total;
+    }
+
+    // Write the pieces straight from the caller's memory. If the write buffer holds data
+    // just before them, it goes out in the same call; otherwise it's flushed first.
+    couch_file_iovec stack_vec[WRITE_IOV_STACK];
+    couch_file_iovec *vec = stack_vec;
+    int nvec = 0, include_buffer = 0;
+    cs_off_t start = offset;
+    if (buffer->length > 0 && buffer->dirty &&
+            buffer->offset + (cs_off_t)buffer->length == offset) {
+        include_buffer = 1;
+    } else {
+        couchstore_error_t err = flush_buffer(buffer);
+        if (err < 0) {
+            return err;
+        }
+    }
+    if (iovcnt + include_buffer > WRITE_IOV_STACK) {
+        vec = malloc((iovcnt + include_buffer) * sizeof(couch_file_iovec));
+        if (!vec) {
+            return COUCHSTORE_ERROR_ALLOC_FAIL;
+        }
+    }
+    if (include_buffer) {
+        vec[nvec].buf = buffer->bytes;
+        vec[nvec].nbytes = buffer->length;
+        ++nvec;
+        start = buffer->offset;
+    }
+    memcpy(vec + nvec, iov, iovcnt * sizeof(couch_file_iovec));
+    nvec += iovcnt;
+
+    ssize_t written = h->raw_ops->pwritev(h->raw_ops_handle, vec, nvec, start);
+#if LOG_BUFFER
+    fprintf(stderr, "BUFFER: passthru %zu bytes in %d pieces at %zd --> %zd\n",
+            total, nvec, start, written);
+#endif
+    if (vec != stack_vec) {
+        free(vec);
+    }
+    if (written < 0) {
+        return written;
+    }
+    if (include_buffer) {
+        buffer->length = 0;
+        buffer->dirty = 0;
+    }
+    return (ssize_t)total;
+}
+
 static cs_off_t buffered_goto_eof(couch_file_handle handle)
 {
     buffered_file_handle *h = (buffered_file_handle*)handle;
@@ -376,8 +664,26 @@ static couchstore_error_t buffered_advise(couch_file_handle handle, cs_off_t off
     return h->raw_ops->advise(h->raw_ops_handle, offs, len, adv);
 }
 
+static couchstore_error_t buffered_pread_batch(couch_file_handle handle, couch_file_read_request *reqs, size_t count)
+{
+    buffered_file_handle *h = (buffered_file_handle*)handle;
+    // Flush the write buffer before trying to read anything:
+    couchstore_error_t err = flush_buffer(h->write_buffer);
+    if (err < 0) {
+        return err;
+    }
+    if (h->raw_ops->version >= 6 && h->raw_ops->pread_batch) {
+        return h->raw_ops->pread_batch(h->raw_ops_handle, reqs, count);
+    }
+    size_t i;
+    for (i = 0; i < count; ++i) {
+        reqs[i].result = h->raw_ops->pread(h->raw_ops_handle, reqs[i].buf, reqs[i].nbytes, reqs[i].offset);
+    }
+    return COUCHSTORE_SUCCESS;
+}
+
 static const couch_file_ops ops = {
-    (uint64_t)4,
+    (uint64_t)7,
     buffered_constructor,
     buffered_open,
     buffered_close,
@@ -387,7 +693,10 @@ static const couch_file_ops ops = {
     buffered_sync,
     buffered_advise,
     buffered_destructor,
-    NULL
+    NULL,
+    NULL,
+    buffered_pread_batch,
+    buffered_pwritev
 };
 
 const couch_file_ops *couch_get_buffered_file_ops(const couch_file_ops* raw_ops,
@@ -396,3 +705,260 @@ const couch_file_ops *couch_get_buffered_file_ops(const couch_file_ops* raw_ops,
     *handle = buffered_constructor_with_raw_ops(raw_ops);
     return &ops;
 }
+
+int couch_is_buffered_file_ops(const couch_file_ops *file_ops)
+{
+    return file_ops == &ops;
+}
+
+couchstore_error_t couch_buffered_flush(couch_file_handle handle)
+{
+    buffered_file_handle *h = (buffered_file_handle*)handle;
+    return flush_buffer(h->write_buffer);
+}
+
+ssize_t couch_buffered_pread_direct(couch_file_handle handle, void *buf, size_t nbyte, cs_off_t offset)
+{
+    buffered_file_handle *h = (buffered_file_handle*)handle;
+    return h->raw_ops->pread(h->raw_ops_handle, buf, nbyte, offset);
+}
+
+int couch_buffered_can_batch(couch_file_handle handle)
+{
+    buffered_file_handle *h = (buffered_file_handle*)handle;
+    return h->raw_ops->version >= 6 && h->raw_ops->pread_batch != NULL;
+}
+
+
+//////// SHARED READ-ONLY FILES:
+
+/*
+ * A shared handle can be read from by many threads at once. Instead of the handle owning its
+ * read buffers, each thread has a small set of its own (found through a pthread key, like the
+ * OS error store) that it uses for any shared handle. Buffers are tagged with the id of the
+ * handle that filled them, so they're never confused across files; since a shared handle is
+ * read-only and the file is append-only, a buffer's contents never go stale.
+ */
+
+#define SHARED_READ_BUFFERS 4
+
+typedef struct {
+    uint64_t owner_id;          // Id of the shared handle that filled it, or 0 if unused
+    cs_off_t offset;
+    size_t length;
+    uint8_t bytes[READ_BUFFER_CAPACITY];
+} thread_read_buffer;
+
+typedef struct {
+    thread_read_buffer buffers[SHARED_READ_BUFFERS];
+    unsigned next_victim;
+} thread_read_buffers;
+
+typedef struct {
+    const couch_file_ops* raw_ops;
+    couch_file_handle raw_ops_handle;
+    uint64_t id;
+} shared_file_handle;
+
+static pthread_once_t thread_buffers_once = PTHREAD_ONCE_INIT;
+static pthread_key_t thread_buffers_key;
+static pthread_mutex_t shared_id_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t last_shared_id = 0;
+
+static void init_thread_buffers_key(void)
+{
+    pthread_key_create(&thread_buffers_key, free);
+}
+
+static thread_read_buffers *get_thread_buffers(void)
+{
+    pthread_once(&thread_buffers_once, init_thread_buffers_key);
+    thread_read_buffers *tb = pthread_getspecific(thread_buffers_key);
+    if (tb == NULL) {
+        tb = calloc(1, sizeof(thread_read_buffers));
+        if (tb && pthread_setspecific(thread_buffers_key, tb) != 0) {
+            free(tb);
+            tb = NULL;
+        }
+    }
+    return tb;
+}
+
+// Finds this thread's buffer holding the block of a shared file that contains 'offset',
+// filling the least recently filled one from the file if there isn't one.
+static thread_read_buffer *find_thread_buffer(shared_file_handle *h, thread_read_buffers *tb,
+                                              cs_off_t offset, ssize_t *error)
+{
+    cs_off_t block_start = offset - offset % READ_BUFFER_CAPACITY;
+    unsigned i;
+    for (i = 0; i < SHARED_READ_BUFFERS; ++i) {
+        thread_read_buffer *buf = &tb->buffers[i];
+        if (buf->owner_id == h->id && buf->offset == block_start &&
+                offset < buf->offset + (cs_off_t)buf->length) {
+            return buf;
+        }
+    }
+    thread_read_buffer *buf = &tb->buffers[tb->next_victim];
+    tb->next_victim = (tb->next_victim + 1) % SHARED_READ_BUFFERS;
+    ssize_t bytes_read = h->raw_ops->pread(h->raw_ops_handle, buf->bytes,
+                                           READ_BUFFER_CAPACITY, block_start);
+    if (bytes_read < 0) {
+        buf->owner_id = 0;
+        *error = bytes_read;
+        return NULL;
+    }
+    buf->owner_id = h->id;
+    buf->offset = block_start;
+    buf->length = (size_t)bytes_read;
+    return buf;
+}
+
+static couch_file_handle shared_constructor_with_raw_ops(const couch_file_ops* raw_ops)
+{
+    shared_file_handle *h = malloc(sizeof(shared_file_handle));
+    if (h) {
+        h->raw_ops = raw_ops;
+        h->raw_ops_handle = raw_ops->constructor(raw_ops->cookie);
+        pthread_mutex_lock(&shared_id_lock);
+        h->id = ++last_shared_id;
+        pthread_mutex_unlock(&shared_id_lock);
+    }
+    return (couch_file_handle) h;
+}
+
+static couch_file_handle shared_constructor(void* cookie)
+{
+    (void) cookie;
+    return shared_constructor_with_raw_ops(couchstore_get_default_file_ops());
+}
+
+static void shared_destructor(couch_file_handle handle)
+{
+    shared_file_handle *h = (shared_file_handle*)handle;
+    if (!h) {
+        return;
+    }
+    h->raw_ops->destructor(h->raw_ops_handle);
+    free(h);
+}
+
+static couchstore_error_t shared_open(couch_file_handle* handle, const char *path, int oflag)
+{
+    shared_file_handle *h = (shared_file_handle*)*handle;
+    if (oflag & (O_WRONLY | O_RDWR)) {
+        return COUCHSTORE_ERROR_INVALID_ARGUMENTS;
+    }
+    return h->raw_ops->open(&h->raw_ops_handle, path, oflag);
+}
+
+static void shared_close(couch_file_handle handle)
+{
+    shared_file_handle *h = (shared_file_handle*)handle;
+    if (h) {
+        h->raw_ops->close(h->raw_ops_handle);
+    }
+}
+
+static ssize_t shared_pread(couch_file_handle handle, void *buf, size_t nbyte, cs_off_t offset)
+{
+    shared_file_handle *h = (shared_file_handle*)handle;
+    thread_read_buffers *tb = get_thread_buffers();
+    if (tb == NULL || nbyte > READ_BUFFER_CAPACITY) {
+        // Large reads (and any made without buffers) go straight to the file:
+        return h->raw_ops->pread(h->raw_ops_handle, buf, nbyte, offset);
+    }
+
+    ssize_t total_read = 0;
+    while (nbyte > 0) {
+        ssize_t error = 0;
+        thread_read_buffer *buffer = find_thread_buffer(h, tb, offset, &error);
+        if (buffer == NULL) {
+            return error;
+        }
+        size_t nbyte_read = read_from_block(buffer->bytes, buffer->offset, buffer->length,
+                                            buf, nbyte, offset);
+        if (nbyte_read == 0) {
+            break;  // must be at EOF
+        }
+        buf = (char*)buf + nbyte_read;
+        nbyte -= nbyte_read;
+        offset += nbyte_read;
+        total_read += nbyte_read;
+    }
+    return total_read;
+}
+
+static ssize_t shared_pwrite(couch_file_handle handle, const void *buf, size_t nbyte, cs_off_t offset)
+{
+    (void)handle;
+    (void)buf;
+    (void)nbyte;
+    (void)offset;
+    return COUCHSTORE_ERROR_WRITE;
+}
+
+static cs_off_t shared_goto_eof(couch_file_handle handle)
+{
+    shared_file_handle *h = (shared_file_handle*)handle;
+    return h->raw_ops->goto_eof(h->raw_ops_handle);
+}
+
+static couchstore_error_t shared_sync(couch_file_handle handle)
+{
+    (void)handle;
+    return COUCHSTORE_SUCCESS;
+}
+
+static couchstore_error_t shared_advise(couch_file_handle handle, cs_off_t offs, cs_off_t len, couchstore_file_advice_t adv)
+{
+    shared_file_handle *h = (shared_file_handle*)handle;
+    return h->raw_ops->advise(h->raw_ops_handle, offs, len, adv);
+}
+
+static couchstore_error_t shared_pread_batch(couch_file_handle handle, couch_file_read_request *reqs, size_t count)
+{
+    shared_file_handle *h = (shared_file_handle*)handle;
+    if (h->raw_ops->version >= 6 && h->raw_ops->pread_batch) {
+        return h->raw_ops->pread_batch(h->raw_ops_handle, reqs, count);
+    }
+    size_t i;
+    for (i = 0; i < count; ++i) {
+        reqs[i].result = h->raw_ops->pread(h->raw_ops_handle, reqs[i].buf, reqs[i].nbytes, reqs[i].offset);
+    }
+    return COUCHSTORE_SUCCESS;
+}
+
+static const couch_file_ops shared_ops = {
+    (uint64_t)7,
+    shared_constructor,
+    shared_open,
+    shared_close,
+    shared_pread,
+    shared_pwrite,
+    shared_goto_eof,
+    shared_sync,
+    shared_advise,
+    shared_destructor,
+    NULL,
+    NULL,
+    shared_pread_batch,
+    NULL                // pwritev: shared handles are read-only
+};
+
+const couch_file_ops *couch_get_shared_file_ops(const couch_file_ops* raw_ops,
+                                                couch_file_handle* handle)
+{
+    *handle = shared_constructor_with_raw_ops(raw_ops);
+    return *handle ? &shared_ops : NULL;
+}
+
+int couch_is_shared_file_ops(const couch_file_ops *file_ops)
+{
+    return file_ops == &shared_ops;
+}
+
+int couch_shared_can_batch(couch_file_handle handle)
+{
+    shared_file_handle *h = (shared_file_handle*)handle;
+    return h->raw_ops->version >= 6 && h->raw_ops->pread_batch != NULL;
+}
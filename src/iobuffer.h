@@ -21,4 +21,47 @@
 const couch_file_ops *couch_get_buffered_file_ops(const couch_file_ops* raw_ops,
                                                   couch_file_handle* handle);
 
+/**
+ * Returns nonzero if the ops are the buffered ops returned by couch_get_buffered_file_ops.
+ */
+int couch_is_buffered_file_ops(const couch_file_ops *ops);
+
+/**
+ * Writes any buffered data through to the underlying file, without syncing it.
+ */
+couchstore_error_t couch_buffered_flush(couch_file_handle handle);
+
+/**
+ * Reads from the underlying file, bypassing the buffers without using or changing them.
+ * Buffered writes aren't visible, so flush them first with couch_buffered_flush.
+ * This can be called from several threads at once if the underlying pread is thread-safe.
+ */
+ssize_t couch_buffered_pread_direct(couch_file_handle handle, void *buf, size_t nbyte, cs_off_t offset);
+
+/**
+ * Returns nonzero if the underlying file ops of a buffered handle implement pread_batch.
+ */
+int couch_buffered_can_batch(couch_file_handle handle);
+
+/**
+ * Constructs a set of read-only file ops that several threads can read through at once.
+ * Reads are buffered in per-thread buffers rather than ones owned by the handle, so they're
+ * safe to make concurrently provided the raw ops' pread is.
+ * @param raw_ops the file ops callbacks to use for the underlying I/O
+ * @param handle on output, a constructed (but not opened) couch_file_handle
+ * @return the couch_file_ops to use, or NULL on failure
+ */
+const couch_file_ops *couch_get_shared_file_ops(const couch_file_ops* raw_ops,
+                                                couch_file_handle* handle);
+
+/**
+ * Returns nonzero if the ops are the shared ops returned by couch_get_shared_file_ops.
+ */
+int couch_is_shared_file_ops(const couch_file_ops *ops);
+
+/**
+ * Returns nonzero if the underlying file ops of a shared handle implement pread_batch.
+ */
+int couch_shared_can_batch(couch_file_handle handle);
+
 #endif // LIBCOUCHSTORE_IOBUFFER_H
@@ -0,0 +1,261 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#include "config.h"
+#include <stdlib.h>
+#include <string.h>
+
+#include "memtable.h"
+#include "util.h"
+
+#define MAX_LEVEL 24        // Enough for 4^24 entries
+#define ENTRY_OVERHEAD 64   // Rough size of an entry besides its DocInfo and forward pointers
+
+struct memtable_entry {
+    DocInfo *info;
+    memtable_entry *prev_seq;
+    memtable_entry *next_seq;
+    int height;
+    memtable_entry *next[1];    // Really 'height' forward pointers
+};
+
+struct memtable {
+    int refcount;
+    int height;                         // Highest height of any entry
+    memtable_entry *head[MAX_LEVEL];    // First entry at each level
+    memtable_entry *first_seq;
+    memtable_entry *last_seq;
+    size_t count;
+    size_t size;
+    time_t started;
+    uint32_t random;                    // xorshift state for picking heights
+};
+
+couchstore_error_t memtable_create(memtable **result)
+{
+    memtable *mt = calloc(1, sizeof(memtable));
+    if (!mt) {
+        return COUCHSTORE_ERROR_ALLOC_FAIL;
+    }
+    mt->refcount = 1;
+    mt->height = 1;
+    mt->random = 0x9e3779b9;
+    *result = mt;
+    return COUCHSTORE_SUCCESS;
+}
+
+memtable *memtable_retain(memtable *mt)
+{
+    mt->refcount++;
+    return mt;
+}
+
+void memtable_release(memtable *mt)
+{
+    if (mt && --mt->refcount == 0) {
+        memtable_entry *entry = mt->head[0];
+        while (entry) {
+            memtable_entry *next = entry->next[0];
+            couchstore_free_docinfo(entry->info);
+            free(entry);
+            entry = next;
+        }
+        free(mt);
+    }
+}
+
+static DocInfo *copy_info(const DocInfo *info)
+{
+    DocInfo *copy = couchstore_alloc_docinfo(&info->id, &info->rev_meta);
+    if (copy) {
+        sized_buf id = copy->id, rev_meta = copy->rev_meta;
+        *copy = *info;
+        copy->id = id;
+        copy->rev_meta = rev_meta;
+    }
+    return copy;
+}
+
+// Each level holds a quarter of the entries of the one below it
+static int random_height(memtable *mt)
+{
+    int height = 1;
+    uint32_t r = mt->random;
+    r ^= r << 13;
+    r ^= r >> 17;
+    r ^= r << 5;
+    mt->random = r;
+    while (height < MAX_LEVEL && (r & 3) == 0) {
+        height++;
+        r >>= 2;
+    }
+    return height;
+}
+
+// Finds, at each level, the last entry whose ID is less than 'key' (NULL meaning the head)
+static memtable_entry *find_less(const memtable *mt, const sized_buf *key,
+                                 memtable_entry *prev[MAX_LEVEL])
+{
+    memtable_entry *entry = NULL;
+    int level;
+    for (level = mt->height - 1; level >= 0; --level) {
+        memtable_entry *next = entry ? entry->next[level] : mt->head[level];
+        while (next && ebin_cmp(&next->info->id, key) < 0) {
+            entry = next;
+            next = entry->next[level];
+        }
+        if (prev) {
+            prev[level] = entry;
+        }
+    }
+    return entry;
+}
+
+static void unlink_seq(memtable *mt, memtable_entry *entry)
+{
+    if (entry->prev_seq) {
+        entry->prev_seq->next_seq = entry->next_seq;
+    } else {
+        mt->first_seq = entry->next_seq;
+    }
+    if (entry->next_seq) {
+        entry->next_seq->prev_seq = entry->prev_seq;
+    } else {
+        mt->last_seq = entry->prev_seq;
+    }
+}
+
+static void append_seq(memtable *mt, memtable_entry *entry)
+{
+    entry->prev_seq = mt->last_seq;
+    entry->next_seq = NULL;
+    if (mt->last_seq) {
+        mt->last_seq->next_seq = entry;
+    } else {
+        mt->first_seq = entry;
+    }
+    mt->last_seq = entry;
+}
+
+static size_t info_size(const DocInfo *info)
+{
+    return sizeof(DocInfo) + info->id.size + info->rev_meta.size;
+}
+
+couchstore_error_t memtable_add(memtable *mt, const DocInfo *info)
+{
+    memtable_entry *prev[MAX_LEVEL];
+    memtable_entry *entry = find_less(mt, &info->id, prev);
+    memtable_entry *found = entry ? entry->next[0] : mt->head[0];
+    DocInfo *copy = copy_info(info);
+    int level;
+    if (!copy) {
+        return COUCHSTORE_ERROR_ALLOC_FAIL;
+    }
+
+    if (found && ebin_cmp(&found->info->id, &info->id) == 0) {
+        // Replace the older revision, which moves to the end of the sequence order:
+        mt->size += info_size(copy) - info_size(found->info);
+        couchstore_free_docinfo(found->info);
+        found->info = copy;
+        unlink_seq(mt, found);
+        append_seq(mt, found);
+        return COUCHSTORE_SUCCESS;
+    }
+
+    int height = random_height(mt);
+    entry = malloc(sizeof(memtable_entry) + (height - 1) * sizeof(memtable_entry*));
+    if (!entry) {
+        couchstore_free_docinfo(copy);
+        return COUCHSTORE_ERROR_ALLOC_FAIL;
+    }
+    entry->info = copy;
+    entry->height = height;
+    for (; mt->height < height; mt->height++) {
+        prev[mt->height] = NULL;
+    }
+    for (level = 0; level < height; ++level) {
+        if (prev[level]) {
+            entry->next[level] = prev[level]->next[level];
+            prev[level]->next[level] = entry;
+        } else {
+            entry->next[level] = mt->head[level];
+            mt->head[level] = entry;
+        }
+    }
+    append_seq(mt, entry);
+
+    if (mt->count++ == 0) {
+        mt->started = time(NULL);
+    }
+    mt->size += ENTRY_OVERHEAD + height * sizeof(memtable_entry*) + info_size(copy);
+    return COUCHSTORE_SUCCESS;
+}
+
+const DocInfo *memtable_find(const memtable *mt, const sized_buf *id)
+{
+    const memtable_entry *entry = memtable_seek(mt, id);
+    if (entry && ebin_cmp(&entry->info->id, id) == 0) {
+        return entry->info;
+    }
+    return NULL;
+}
+
+memtable_entry *memtable_seek(const memtable *mt, const sized_buf *key)
+{
+    if (!key || key->size == 0) {
+        return mt->head[0];
+    }
+    memtable_entry *entry = find_less(mt, key, NULL);
+    return entry ? entry->next[0] : mt->head[0];
+}
+
+memtable_entry *memtable_next(const memtable_entry *entry)
+{
+    return entry->next[0];
+}
+
+memtable_entry *memtable_since(const memtable *mt, uint64_t since)
+{
+    // Recent changes are the likeliest to be asked for, so search from the end:
+    memtable_entry *entry = mt->last_seq;
+    if (!entry || entry->info->db_seq < since) {
+        return NULL;
+    }
+    while (entry->prev_seq && entry->prev_seq->info->db_seq >= since) {
+        entry = entry->prev_seq;
+    }
+    return entry;
+}
+
+memtable_entry *memtable_next_seq(const memtable_entry *entry)
+{
+    return entry->next_seq;
+}
+
+const DocInfo *memtable_entry_info(const memtable_entry *entry)
+{
+    return entry->info;
+}
+
+size_t memtable_count(const memtable *mt)
+{
+    return mt->count;
+}
+
+size_t memtable_size(const memtable *mt)
+{
+    return mt->size;
+}
+
+time_t memtable_started(const memtable *mt)
+{
+    return mt->started;
+}
+
+void memtable_infos(const memtable *mt, DocInfo *infos[])
+{
+    const memtable_entry *entry;
+    size_t i = 0;
+    for (entry = mt->head[0]; entry; entry = entry->next[0]) {
+        infos[i++] = entry->info;
+    }
+}
@@ -0,0 +1,72 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef LIBCOUCHSTORE_MEMTABLE_H
+#define LIBCOUCHSTORE_MEMTABLE_H 1
+
+#include <time.h>
+#include "internal.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    /*
+     * Saved DocInfos that haven't been added to the db's trees yet (see couchstore_set_memtable.)
+     * A skiplist keeps the latest DocInfo of each ID in ID order, and a list threaded through
+     * the same entries keeps them in sequence order. Entries are never removed, only replaced,
+     * so a cursor stays valid while more are added. A memtable is reference-counted, so an
+     * iteration can keep using one after the db has flushed it and moved on to a new one.
+     */
+
+    typedef struct memtable_entry memtable_entry;
+
+    /** Creates an empty memtable, with one reference. */
+    couchstore_error_t memtable_create(memtable **result);
+
+    /** Adds a reference to a memtable. */
+    memtable *memtable_retain(memtable *mt);
+
+    /** Removes a reference to a memtable, freeing it if it was the last. NULL is allowed. */
+    void memtable_release(memtable *mt);
+
+    /** Adds a copy of a DocInfo, replacing any with the same ID. Its sequence number must be
+        higher than any already in the memtable. */
+    couchstore_error_t memtable_add(memtable *mt, const DocInfo *info);
+
+    /** Returns the DocInfo with an ID, or NULL if there's none. */
+    const DocInfo *memtable_find(const memtable *mt, const sized_buf *id);
+
+    /** Returns the first entry whose ID is greater than or equal to a key (or the first entry
+        if the key is NULL or empty), or NULL if there's none. */
+    memtable_entry *memtable_seek(const memtable *mt, const sized_buf *key);
+
+    /** Returns the entry after one in ID order, or NULL. */
+    memtable_entry *memtable_next(const memtable_entry *entry);
+
+    /** Returns the first entry in sequence order whose sequence number is at least 'since',
+        or NULL. */
+    memtable_entry *memtable_since(const memtable *mt, uint64_t since);
+
+    /** Returns the entry after one in sequence order, or NULL. */
+    memtable_entry *memtable_next_seq(const memtable_entry *entry);
+
+    /** Returns an entry's DocInfo. */
+    const DocInfo *memtable_entry_info(const memtable_entry *entry);
+
+    /** Returns the number of IDs in a memtable. */
+    size_t memtable_count(const memtable *mt);
+
+    /** Returns roughly how much memory a memtable's entries use. */
+    size_t memtable_size(const memtable *mt);
+
+    /** Returns the time the first entry was added, or 0 if it's empty. */
+    time_t memtable_started(const memtable *mt);
+
+    /** Fills an array with a memtable's DocInfos, in ID order.
+        @param infos An array with room for memtable_count entries */
+    void memtable_infos(const memtable *mt, DocInfo *infos[]);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,598 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#include "config.h"
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "internal.h"
+#include "node_cache.h"
+#include "dirty_nodes.h"
+#include "crc32.h"
+
+/*
+ * Process-wide cache of decompressed B-tree nodes, shared by every open tree_file.
+ *
+ * Nodes are immutable once written (files are append-only), so an entry keyed by
+ * (file, position) stays valid as long as the file isn't truncated or replaced. The cache is
+ * split into shards, each with its own lock, hash table and LRU list, so concurrent readers
+ * only contend when they hit the same shard. The memory budget is divided evenly among the
+ * shards.
+ *
+ * A file's id comes from its device and inode, so every handle on the file shares its entries,
+ * and they outlive the handles. The registry of known files also remembers each one's size
+ * when a handle last opened or closed it, and a CRC of the bytes just before that point. If
+ * the file has since shrunk, or those bytes changed, it's been truncated or replaced (perhaps by
+ * a file that got the same inode), so it gets a new id and its old entries can't be found.
+ * Files that can't be identified, as when the file ops don't use real paths, get an id of their
+ * own for each handle, whose entries are dropped when it's closed.
+ */
+
+#define NODE_CACHE_SHARDS 16
+#define NODE_CACHE_MIN_BUCKETS 64
+#define NODE_CACHE_MAX_FILES 1024   // Files the registry remembers
+// Bytes before the remembered size that are checked. Headers start at block boundaries, so
+// this always takes in some data before the last header, not just the header and padding.
+#define FILE_TAIL_SIZE (2 * COUCH_BLOCK_SIZE)
+
+struct node_cache_entry {
+    node_cache_entry *hash_next;
+    node_cache_entry *lru_prev;     // Towards the most recently used end
+    node_cache_entry *lru_next;     // Towards the least recently used end
+    uint64_t file_id;
+    cs_off_t pos;
+    char *data;
+    size_t size;
+    unsigned refcount;
+    unsigned shard;
+    int cached;                     // Nonzero while reachable from the hash table
+};
+
+typedef struct node_cache_shard {
+    pthread_mutex_t lock;
+    node_cache_entry **buckets;
+    size_t nbuckets;
+    size_t count;
+    size_t size;                    // Bytes charged against the shard's capacity
+    node_cache_entry *lru_head;     // Most recently used
+    node_cache_entry *lru_tail;     // Least recently used
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+} node_cache_shard;
+
+static node_cache_shard shards[NODE_CACHE_SHARDS];
+static volatile size_t shard_capacity = 0;     // Zero means the cache is disabled
+static pthread_once_t node_cache_once = PTHREAD_ONCE_INIT;
+
+typedef struct known_file {
+    struct known_file *next;        // Towards the least recently opened
+    dev_t dev;
+    ino_t ino;
+    uint64_t file_id;
+    cs_off_t size;                  // File size when last opened or closed
+    uint32_t tail_crc;              // CRC of the FILE_TAIL_SIZE bytes (at most) before 'size'
+} known_file;
+
+static pthread_mutex_t file_id_lock = PTHREAD_MUTEX_INITIALIZER;   // Guards all below
+static uint64_t last_file_id = 0;
+static known_file *known_files = NULL;     // Most recently opened first
+static unsigned nknown_files = 0;
+
+
+static void init_node_cache(void)
+{
+    int i;
+    for (i = 0; i < NODE_CACHE_SHARDS; ++i) {
+        pthread_mutex_init(&shards[i].lock, NULL);
+    }
+}
+
+static inline uint64_t entry_hash(uint64_t file_id, cs_off_t pos)
+{
+    uint64_t h = (file_id * 0x9E3779B97F4A7C15ULL) ^ (uint64_t)pos;
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static inline size_t entry_charge(const node_cache_entry *e)
+{
+    return sizeof(node_cache_entry) + e->size;
+}
+
+static void free_entry(node_cache_entry *e)
+{
+    free(e->data);
+    free(e);
+}
+
+
+//////// LRU LIST:
+
+
+static void lru_unlink(node_cache_shard *s, node_cache_entry *e)
+{
+    if (e->lru_prev) {
+        e->lru_prev->lru_next = e->lru_next;
+    } else {
+        s->lru_head = e->lru_next;
+    }
+    if (e->lru_next) {
+        e->lru_next->lru_prev = e->lru_prev;
+    } else {
+        s->lru_tail = e->lru_prev;
+    }
+    e->lru_prev = e->lru_next = NULL;
+}
+
+static void lru_push_front(node_cache_shard *s, node_cache_entry *e)
+{
+    e->lru_prev = NULL;
+    e->lru_next = s->lru_head;
+    if (s->lru_head) {
+        s->lru_head->lru_prev = e;
+    } else {
+        s->lru_tail = e;
+    }
+    s->lru_head = e;
+}
+
+
+//////// HASH TABLE:
+
+
+static inline size_t bucket_of(const node_cache_shard *s, uint64_t hash)
+{
+    // The low bits of the hash select the shard, so use the higher ones here.
+    return (size_t)(hash >> 8) & (s->nbuckets - 1);
+}
+
+static node_cache_entry *shard_find(node_cache_shard *s, uint64_t hash,
+                                    uint64_t file_id, cs_off_t pos)
+{
+    if (s->nbuckets == 0) {
+        return NULL;
+    }
+    node_cache_entry *e = s->buckets[bucket_of(s, hash)];
+    while (e && (e->file_id != file_id || e->pos != pos)) {
+        e = e->hash_next;
+    }
+    return e;
+}
+
+static void shard_grow(node_cache_shard *s)
+{
+    size_t nbuckets = s->nbuckets ? s->nbuckets * 2 : NODE_CACHE_MIN_BUCKETS;
+    node_cache_entry **buckets = calloc(nbuckets, sizeof(node_cache_entry*));
+    if (!buckets) {
+        return;     // Chains just get longer; not fatal
+    }
+    size_t i;
+    for (i = 0; i < s->nbuckets; ++i) {
+        node_cache_entry *e = s->buckets[i], *next;
+        for (; e; e = next) {
+            next = e->hash_next;
+            size_t b = (size_t)(entry_hash(e->file_id, e->pos) >> 8) & (nbuckets - 1);
+            e->hash_next = buckets[b];
+            buckets[b] = e;
+        }
+    }
+    free(s->buckets);
+    s->buckets = buckets;
+    s->nbuckets = nbuckets;
+}
+
+static void shard_remove(node_cache_shard *s, node_cache_entry *e)
+{
+    node_cache_entry **link = &s->buckets[bucket_of(s, entry_hash(e->file_id, e->pos))];
+    while (*link != e) {
+        link = &(*link)->hash_next;
+    }
+    *link = e->hash_next;
+    e->hash_next = NULL;
+    lru_unlink(s, e);
+    s->count--;
+    s->size -= entry_charge(e);
+    e->cached = 0;
+    if (e->refcount == 0) {
+        free_entry(e);
+    }
+}
+
+// Evicts least-recently-used entries until the shard fits in the given capacity.
+static void shard_shrink(node_cache_shard *s, size_t capacity)
+{
+    while (s->size > capacity && s->lru_tail) {
+        shard_remove(s, s->lru_tail);
+        s->evictions++;
+    }
+}
+
+
+//////// INTERNAL API:
+
+
+static uint64_t new_file_id(void)
+{
+    pthread_mutex_lock(&file_id_lock);
+    uint64_t file_id = ++last_file_id;
+    pthread_mutex_unlock(&file_id_lock);
+    return file_id;
+}
+
+// Computes the CRC of the bytes just before 'size' in a file. Returns 0 on success.
+static int file_tail_crc(tree_file *file, cs_off_t size, uint32_t *crc)
+{
+    char buf[FILE_TAIL_SIZE];
+    size_t len = size < FILE_TAIL_SIZE ? (size_t)size : FILE_TAIL_SIZE;
+    size_t got = 0;
+    while (got < len) {
+        ssize_t n = file->ops->pread(file->handle, buf + got, len - got,
+                                     size - (cs_off_t)len + (cs_off_t)got);
+        if (n <= 0) {
+            return -1;
+        }
+        got += (size_t)n;
+    }
+    *crc = hash_crc32(buf, len);
+    return 0;
+}
+
+// Finds a file in the registry. Call with file_id_lock held.
+static known_file **find_known_file(dev_t dev, ino_t ino)
+{
+    known_file **link = &known_files;
+    while (*link && ((*link)->dev != dev || (*link)->ino != ino)) {
+        link = &(*link)->next;
+    }
+    return link;
+}
+
+// Gets the file's identity. Returns 0 if it has none the registry can use.
+static int identify_file(tree_file *file, struct stat *st, cs_off_t *size, uint32_t *crc)
+{
+    if (shard_capacity == 0 || stat(file->path, st) != 0 || st->st_ino == 0) {
+        return 0;
+    }
+    *size = file->ops->goto_eof(file->handle);
+    return *size >= 0 && file_tail_crc(file, *size, crc) == 0;
+}
+
+void node_cache_open_file(tree_file *file)
+{
+    struct stat st;
+    cs_off_t size;
+    uint32_t crc;
+    if (!identify_file(file, &st, &size, &crc)) {
+        file->cache_id = new_file_id();
+        return;
+    }
+
+    // See whether the file is unchanged since it was last seen, without holding the lock:
+    uint64_t known_id = 0, stale_id = 0;
+    cs_off_t known_size = 0;
+    uint32_t known_crc = 0, check_crc = 0;
+    pthread_mutex_lock(&file_id_lock);
+    known_file *k = *find_known_file(st.st_dev, st.st_ino);
+    if (k) {
+        known_id = k->file_id;
+        known_size = k->size;
+        known_crc = k->tail_crc;
+    }
+    pthread_mutex_unlock(&file_id_lock);
+    int unchanged = known_id && size >= known_size &&
+                    file_tail_crc(file, known_size, &check_crc) == 0 && check_crc == known_crc;
+
+    pthread_mutex_lock(&file_id_lock);
+    known_file **link = find_known_file(st.st_dev, st.st_ino);
+    k = *link;
+    if (k) {
+        *link = k->next;
+    } else {
+        k = calloc(1, sizeof(known_file));
+        if (!k) {
+            pthread_mutex_unlock(&file_id_lock);
+            file->cache_id = new_file_id();
+            return;
+        }
+        k->dev = st.st_dev;
+        k->ino = st.st_ino;
+        if (++nknown_files > NODE_CACHE_MAX_FILES) {
+            // Forget the least recently opened file. Its entries just age out of the cache.
+            known_file **last = &known_files;
+            while ((*last)->next) {
+                last = &(*last)->next;
+            }
+            free(*last);
+            *last = NULL;
+            --nknown_files;
+        }
+    }
+    if (!unchanged || k->file_id != known_id) {
+        stale_id = k->file_id;
+        k->file_id = ++last_file_id;
+    }
+    k->size = size;
+    k->tail_crc = crc;
+    k->next = known_files;
+    known_files = k;
+    file->cache_id = k->file_id;
+    pthread_mutex_unlock(&file_id_lock);
+
+    if (stale_id) {
+        node_cache_forget_file(stale_id);
+    }
+}
+
+void node_cache_close_file(tree_file *file)
+{
+    struct stat st;
+    cs_off_t size;
+    uint32_t crc;
+    int forget = 1;
+    if (tree_file_flush(file) == COUCHSTORE_SUCCESS && identify_file(file, &st, &size, &crc)) {
+        pthread_mutex_lock(&file_id_lock);
+        known_file *k = *find_known_file(st.st_dev, st.st_ino);
+        if (k && k->file_id == file->cache_id && size >= k->size) {
+            // Its entries stay cached, for the next handle that opens it:
+            k->size = size;
+            k->tail_crc = crc;
+            forget = 0;
+        }
+        pthread_mutex_unlock(&file_id_lock);
+    }
+    if (forget) {
+        node_cache_forget_file(file->cache_id);
+    }
+}
+
+void node_cache_forget_file(uint64_t file_id)
+{
+    pthread_once(&node_cache_once, init_node_cache);
+    int i;
+    for (i = 0; i < NODE_CACHE_SHARDS; ++i) {
+        node_cache_shard *s = &shards[i];
+        pthread_mutex_lock(&s->lock);
+        node_cache_entry *e = s->lru_head, *next;
+        for (; e && s->count > 0; e = next) {
+            next = e->lru_next;
+            if (e->file_id == file_id) {
+                shard_remove(s, e);
+            }
+        }
+        pthread_mutex_unlock(&s->lock);
+    }
+}
+
+// Looks up a cached node and pins it. Returns NULL if it's not cached.
+static node_cache_entry *cache_lookup(uint64_t file_id, cs_off_t pos)
+{
+    uint64_t hash = entry_hash(file_id, pos);
+    node_cache_shard *s = &shards[hash % NODE_CACHE_SHARDS];
+
+    pthread_mutex_lock(&s->lock);
+    node_cache_entry *e = shard_find(s, hash, file_id, pos);
+    if (e) {
+        e->refcount++;
+        lru_unlink(s, e);
+        lru_push_front(s, e);
+        s->hits++;
+    } else {
+        s->misses++;
+    }
+    pthread_mutex_unlock(&s->lock);
+    return e;
+}
+
+// Adds a node just read from the file to the cache, taking ownership of its (malloced) data.
+// Returns the pinned entry, which may be a different one if another thread got there first;
+// or NULL if the entry couldn't be allocated, in which case the data still belongs to the caller.
+static node_cache_entry *cache_insert(uint64_t file_id, cs_off_t pos, char *buf, size_t len)
+{
+    uint64_t hash = entry_hash(file_id, pos);
+    node_cache_shard *s = &shards[hash % NODE_CACHE_SHARDS];
+
+    node_cache_entry *e = malloc(sizeof(node_cache_entry));
+    if (!e) {
+        return NULL;
+    }
+    e->hash_next = e->lru_prev = e->lru_next = NULL;
+    e->file_id = file_id;
+    e->pos = pos;
+    e->data = buf;
+    e->size = len;
+    e->refcount = 1;
+    e->shard = (unsigned)(hash % NODE_CACHE_SHARDS);
+    e->cached = 1;
+
+    pthread_mutex_lock(&s->lock);
+    node_cache_entry *existing = shard_find(s, hash, file_id, pos);
+    if (existing) {
+        // Another thread read the same node meanwhile; use its copy.
+        existing->refcount++;
+        pthread_mutex_unlock(&s->lock);
+        free_entry(e);
+        return existing;
+    }
+    if (s->count >= s->nbuckets) {
+        shard_grow(s);
+    }
+    if (s->nbuckets > 0) {
+        size_t b = bucket_of(s, hash);
+        e->hash_next = s->buckets[b];
+        s->buckets[b] = e;
+        lru_push_front(s, e);
+        s->count++;
+        s->size += entry_charge(e);
+        shard_shrink(s, shard_capacity);
+    } else {
+        e->cached = 0;
+    }
+    pthread_mutex_unlock(&s->lock);
+    return e;
+}
+
+int pread_node(tree_file *file, cs_off_t pos, char **ret_ptr, node_cache_entry **entry)
+{
+    *entry = NULL;
+    if (file->dirty && is_dirty_node(pos)) {
+        return dirty_nodes_read(file->dirty, pos, ret_ptr);
+    }
+    if (shard_capacity == 0) {
+        return pread_compressed(file, pos, ret_ptr);
+    }
+
+    node_cache_entry *e = cache_lookup(file->cache_id, pos);
+    if (!e) {
+        // Read the node without holding any lock:
+        char *buf;
+        int len = pread_compressed(file, pos, &buf);
+        if (len < 0) {
+            return len;
+        }
+        e = cache_insert(file->cache_id, pos, buf, len);
+        if (!e) {
+            // Can't cache it, but the caller can still have it:
+            *ret_ptr = buf;
+            return len;
+        }
+    }
+    *ret_ptr = e->data;
+    *entry = e;
+    return (int) e->size;
+}
+
+void pread_nodes(tree_file *file, size_t count, const cs_off_t *positions,
+                 char **bufs, node_cache_entry **entries, int *lens)
+{
+    couch_file_read_request *reqs = NULL;
+    char *readbuf = NULL;
+    sized_buf scratch = {NULL, 0};
+    size_t *pending = NULL;
+    size_t npending = 0, i;
+
+    for (i = 0; i < count; ++i) {
+        entries[i] = NULL;
+        lens[i] = COUCHSTORE_ERROR_READ;
+    }
+    reqs = malloc(count * sizeof(couch_file_read_request));
+    pending = malloc(count * sizeof(size_t));
+    readbuf = malloc(count * NODE_PREFETCH_SIZE);
+    if (!reqs || !pending || !readbuf) {
+        goto cleanup;
+    }
+
+    for (i = 0; i < count; ++i) {
+        if (is_dirty_node(positions[i])) {
+            continue;   // In memory; leave it to pread_node
+        }
+        if (shard_capacity > 0) {
+            node_cache_entry *e = cache_lookup(file->cache_id, positions[i]);
+            if (e) {
+                bufs[i] = e->data;
+                entries[i] = e;
+                lens[i] = (int) e->size;
+                continue;
+            }
+        }
+        couch_file_read_request *req = &reqs[npending];
+        req->buf = readbuf + npending * NODE_PREFETCH_SIZE;
+        req->nbytes = NODE_PREFETCH_SIZE;
+        req->offset = positions[i];
+        req->result = 0;
+        pending[npending++] = i;
+    }
+    if (npending == 0 || tree_file_pread_batch(file, reqs, npending) < 0) {
+        goto cleanup;
+    }
+
+    for (i = 0; i < npending; ++i) {
+        const couch_file_read_request *req = &reqs[i];
+        size_t n = pending[i];
+        if (req->result <= 0) {
+            continue;
+        }
+        const char *chunk;
+        int len = decode_chunk_in_memory(req->buf, req->offset, (size_t)req->result,
+                                         req->offset, &scratch, &chunk, NULL);
+        if (len < 0) {
+            continue;   // Probably bigger than NODE_PREFETCH_SIZE; leave it to pread_node
+        }
+        sized_buf node = {NULL, 0};
+        len = decompress_reusing(file, chunk, len, &node);
+        if (len < 0) {
+            free(node.buf);
+            continue;
+        }
+        bufs[n] = node.buf;
+        lens[n] = len;
+        if (shard_capacity > 0) {
+            node_cache_entry *e = cache_insert(file->cache_id, positions[n], node.buf, len);
+            if (e) {
+                bufs[n] = e->data;
+                entries[n] = e;
+                lens[n] = (int) e->size;
+            }
+        }
+    }
+
+cleanup:
+    free(scratch.buf);
+    free(readbuf);
+    free(pending);
+    free(reqs);
+}
+
+void release_node(char *buf, node_cache_entry *entry)
+{
+    if (!entry) {
+        free(buf);
+        return;
+    }
+    node_cache_shard *s = &shards[entry->shard];
+    pthread_mutex_lock(&s->lock);
+    int dispose = (--entry->refcount == 0 && !entry->cached);
+    pthread_mutex_unlock(&s->lock);
+    if (dispose) {
+        free_entry(entry);
+    }
+}
+
+
+//////// PUBLIC API:
+
+
+LIBCOUCHSTORE_API
+void couchstore_set_node_cache_size(size_t capacity)
+{
+    pthread_once(&node_cache_once, init_node_cache);
+    shard_capacity = capacity / NODE_CACHE_SHARDS;
+    int i;
+    for (i = 0; i < NODE_CACHE_SHARDS; ++i) {
+        node_cache_shard *s = &shards[i];
+        pthread_mutex_lock(&s->lock);
+        shard_shrink(s, shard_capacity);
+        pthread_mutex_unlock(&s->lock);
+    }
+}
+
+LIBCOUCHSTORE_API
+void couchstore_get_node_cache_stats(NodeCacheStats *stats)
+{
+    pthread_once(&node_cache_once, init_node_cache);
+    memset(stats, 0, sizeof(*stats));
+    stats->capacity = (uint64_t)shard_capacity * NODE_CACHE_SHARDS;
+    int i;
+    for (i = 0; i < NODE_CACHE_SHARDS; ++i) {
+        node_cache_shard *s = &shards[i];
+        pthread_mutex_lock(&s->lock);
+        stats->size += s->size;
+        stats->entries += s->count;
+        stats->hits += s->hits;
+        stats->misses += s->misses;
+        stats->evictions += s->evictions;
+        pthread_mutex_unlock(&s->lock);
+    }
+}
@@ -0,0 +1,65 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef LIBCOUCHSTORE_NODE_CACHE_H
+#define LIBCOUCHSTORE_NODE_CACHE_H 1
+
+#include "internal.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    /**
+     * A decompressed B-tree node held in the process-wide node cache. Entries are
+     * reference-counted; a pinned entry stays valid even if it's evicted meanwhile.
+     */
+    typedef struct node_cache_entry node_cache_entry;
+
+    /** Number of bytes read for each node by pread_nodes. Enough for nearly all nodes. */
+#define NODE_PREFETCH_SIZE 4096
+
+    /** Sets the id that keys a newly opened file's cache entries. Handles on the same file
+        share an id, and keep it across closing and reopening, unless the file has been
+        truncated or replaced meanwhile. Called by tree_file_open. */
+    void node_cache_open_file(tree_file *file);
+
+    /** Notes a file's size as it's closed, so its cached nodes can be used when it's reopened.
+        A file that can't be identified has its cached nodes dropped. Called by
+        tree_file_close, before the handle is closed. */
+    void node_cache_close_file(tree_file *file);
+
+    /** Drops all cached nodes belonging to a file. */
+    void node_cache_forget_file(uint64_t file_id);
+
+    /** Reads a B-tree node (a compressed chunk) from a file, using the node cache if it's enabled.
+        A node the file is holding in memory (see dirty_nodes.h) is copied from there.
+        @param file The tree_file to read from
+        @param pos The byte position of the node's chunk
+        @param ret_ptr On success, will be set to point to the decompressed node data.
+        @param entry On success, will be set to the pinned cache entry holding the data, or to
+                NULL if the data is a malloced block owned by the caller.
+        @return The length of the node data, or a negative error code.
+                Release the data with release_node when done with it. */
+    int pread_node(tree_file *file, cs_off_t pos, char **ret_ptr, node_cache_entry **entry);
+
+    /** Reads several B-tree nodes at once, submitting the reads together with the file's
+        batch-read op so the device can service them in parallel. Nodes already in the cache
+        aren't read, and nodes that are read get added to it (if it's enabled.)
+        Each node is read with a single NODE_PREFETCH_SIZE read, so a larger node fails with a
+        negative length; the caller should fall back to pread_node for any that failed.
+        @param count The number of nodes
+        @param positions The nodes' file positions
+        @param bufs On output, the node data for each successful read
+        @param entries On output, the pinned cache entries, or NULLs (as for pread_node)
+        @param lens On output, each node's length, or a negative error code. Release each
+                successfully read node with release_node. */
+    void pread_nodes(tree_file *file, size_t count, const cs_off_t *positions,
+                     char **bufs, node_cache_entry **entries, int *lens);
+
+    /** Releases node data returned by pread_node or pread_nodes. */
+    void release_node(char *buf, node_cache_entry *entry);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
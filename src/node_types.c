@@ -7,6 +7,7 @@
 //
 
 #include "node_types.h"
+#include "couch_btree.h"
 #include <stdlib.h>
 
 size_t read_kv(const void *buf, sized_buf *key, sized_buf *value)
@@ -65,3 +66,79 @@ size_t encode_root(void *buf, node_pointer *node)
     }
     return sizeof(raw_btree_root) + node->reduce_value.size;
 }
+
+int parse_node(const char *buf, size_t len, node_layout *node)
+{
+    if (len < 1 || (buf[0] & ~NODE_SLOTTED) > KV_NODE) {
+        return 0;
+    }
+    node->buf = buf;
+    node->type = buf[0] & ~NODE_SLOTTED;
+    node->end = len;
+    node->slots = NULL;
+    node->count = 0;
+    if (buf[0] & NODE_SLOTTED) {
+        raw_32 raw_count;
+        if (len < 1 + sizeof(raw_32)) {
+            return 0;
+        }
+        memcpy(&raw_count, buf + len - sizeof(raw_32), sizeof(raw_32));
+        node->count = decode_raw32(raw_count);
+        if (node->count > (len - 1 - sizeof(raw_32)) / sizeof(raw_32)) {
+            return 0;
+        }
+        node->end = len - sizeof(raw_32) * (node->count + 1);
+        node->slots = (const raw_32*)(buf + node->end);
+        // Entries are written back to back, so each slot must point just past the entry before
+        // it, and the last entry must end where the directory starts. Then lookups can read any
+        // entry the directory points to without checking it.
+        size_t expected = 1;
+        uint32_t i;
+        for (i = 0; i < node->count; ++i) {
+            sized_buf key, value;
+            if (decode_raw32(node->slots[i]) != expected ||
+                    expected + sizeof(raw_kv_length) > node->end) {
+                return 0;
+            }
+            expected += read_kv(buf + expected, &key, &value);
+        }
+        if (expected != node->end) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+uint32_t node_lower_bound(const node_layout *node, uint32_t from, const sized_buf *key,
+                          int (*compare)(const sized_buf *k1, const sized_buf *k2))
+{
+    uint32_t lo = from, hi = node->count;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        sized_buf mid_key, mid_value;
+        read_kv(node->buf + node_entry_offset(node, mid), &mid_key, &mid_value);
+        if (compare(&mid_key, key) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+char *write_slot_directory(char *buf, char *end)
+{
+    char *pos = buf + 1, *dst = end;
+    uint32_t count = 0;
+    while (pos < end) {
+        sized_buf key, value;
+        raw_32 offset = encode_raw32((uint32_t)(pos - buf));
+        memcpy(dst, &offset, sizeof(offset));
+        dst += sizeof(offset);
+        pos += read_kv(pos, &key, &value);
+        count++;
+    }
+    raw_32 raw_count = encode_raw32(count);
+    memcpy(dst, &raw_count, sizeof(raw_count));
+    return dst + sizeof(raw_count);
+}
@@ -105,6 +105,55 @@ size_t read_kv(const void *buf, sized_buf *key, sized_buf *value);
 void* write_kv(void *buf, sized_buf key, sized_buf value);
 
 
+/**
+ * Set in a node's type byte (KP_NODE or KV_NODE) if the node ends with a slot directory: the
+ * 32-bit offset of each entry from the start of the node, then the 32-bit number of entries.
+ * Only version 12 files have nodes like this.
+ */
+#define NODE_SLOTTED 2
+
+/** The entries of a node read from the file, in either encoding. */
+typedef struct {
+    const char *buf;
+    int type;               // KP_NODE or KV_NODE
+    size_t end;             // Offset just past the last entry
+    const raw_32 *slots;    // The slot directory, or NULL if the node doesn't have one
+    uint32_t count;         // Number of entries, if there's a slot directory
+} node_layout;
+
+/**
+ * Finds where the entries of a node are. A slot directory is checked against the entries, so
+ * every offset node_entry_offset returns is that of an entry lying wholly within the node.
+ * @return Nonzero on success, zero if the node's type or slot directory is bad
+ */
+int parse_node(const char *buf, size_t len, node_layout *node);
+
+/**
+ * Returns the offset of the entry at an index in a node with a slot directory, or the end of
+ * the entries if the index is the number of entries.
+ */
+static inline size_t node_entry_offset(const node_layout *node, uint32_t index)
+{
+    return index < node->count ? decode_raw32(node->slots[index]) : node->end;
+}
+
+/**
+ * Binary-searches a node with a slot directory for the first entry, at or after index 'from',
+ * whose key is greater than or equal to a key.
+ * @return The entry's index, or the number of entries if there isn't one
+ */
+uint32_t node_lower_bound(const node_layout *node, uint32_t from, const sized_buf *key,
+                          int (*compare)(const sized_buf *k1, const sized_buf *k2));
+
+/**
+ * Appends a slot directory to a node whose type byte and entries have been written.
+ * The buffer needs room for 4 bytes per entry, plus 4.
+ * @param end The end of the entries
+ * @return The new end of the node
+ */
+char *write_slot_directory(char *buf, char *end);
+
+
 /**
  * Reads a 48-bit sequence number out of a sized_buf.
  */
@@ -5,6 +5,12 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 
 #include "internal.h"
 
@@ -63,6 +69,50 @@ static ssize_t couch_pwrite(couch_file_handle handle, const void *buf, size_t nb
     return rv;
 }
 
+#define PWRITEV_BATCH 256       // Max pieces passed to one pwritev call
+
+static ssize_t couch_pwritev(couch_file_handle handle, const couch_file_iovec *iov, int iovcnt,
+                             cs_off_t offset)
+{
+    int fd = handle_to_fd(handle);
+    struct iovec vec[PWRITEV_BATCH];
+    ssize_t total = 0;
+    size_t skip = 0;            // Bytes of iov[0] already written
+    while (iovcnt > 0) {
+        int n;
+        for (n = 0; n < PWRITEV_BATCH && n < iovcnt; ++n) {
+            vec[n].iov_base = (char*)iov[n].buf + (n == 0 ? skip : 0);
+            vec[n].iov_len = iov[n].nbytes - (n == 0 ? skip : 0);
+        }
+#ifdef LOG_IO
+        fprintf(stderr, "PWRITEV %8llx  (%d pieces)\n", offset, n);
+#endif
+        ssize_t rv;
+        do {
+            rv = pwritev(fd, vec, n, offset);
+        } while (rv == -1 && errno == EINTR);
+        if (rv < 0) {
+            save_errno();
+            return (ssize_t) COUCHSTORE_ERROR_WRITE;
+        }
+        offset += rv;
+        total += rv;
+        // Skip past the pieces that were written; a short write resumes partway into one:
+        size_t left = (size_t)rv;
+        while (iovcnt > 0 && left >= iov->nbytes - skip) {
+            left -= iov->nbytes - skip;
+            skip = 0;
+            ++iov;
+            --iovcnt;
+        }
+        if (iovcnt > 0 && rv == 0) {
+            return (ssize_t) COUCHSTORE_ERROR_WRITE;
+        }
+        skip += left;
+    }
+    return total;
+}
+
 static couchstore_error_t couch_open(couch_file_handle* handle, const char *path, int oflag)
 {
     int fd;
@@ -159,7 +209,7 @@ static couchstore_error_t couch_advise(couch_file_handle handle, cs_off_t offset
 }
 
 static const couch_file_ops default_file_ops = {
-    (uint64_t)4,
+    (uint64_t)7,
     couch_constructor,
     couch_open,
     couch_close,
@@ -169,7 +219,10 @@ static const couch_file_ops default_file_ops = {
     couch_sync,
     couch_advise,
     couch_destructor,
-    NULL
+    NULL,
+    NULL,
+    NULL,
+    couch_pwritev
 };
 
 LIBCOUCHSTORE_API
@@ -177,3 +230,231 @@ const couch_file_ops *couchstore_get_default_file_ops(void)
 {
     return &default_file_ops;
 }
+
+
+//////// MEMORY-MAPPED FILE OPS:
+
+/*
+ * Reads are served from a read-only shared mapping of the file. If a read goes past the end
+ * of the mapping (because the file has grown since it was mapped) the mapping is extended.
+ * Pointers handed out by mmap_pread_ptr must remain valid until the file is closed, so a
+ * mapping can't move: each one is placed in a reserved range of address space about twice
+ * the size of the file, and grows in place until it fills the range. Only then is the file
+ * mapped again in a new, twice as large range, so few ranges are ever kept alive. Writes go
+ * straight to the descriptor; the page cache keeps them coherent with the mapping.
+ */
+
+#define MMAP_MIN_RESERVE (64 * 1024 * 1024)   // Smallest range of address space to reserve
+
+typedef struct mmap_region {
+    struct mmap_region *next;
+    void *base;
+    size_t length;              // Length of the file mapped at 'base'
+    size_t reserved;            // Length of the address range reserved at 'base'
+} mmap_region;
+
+typedef struct {
+    int fd;
+    pthread_mutex_t lock;
+    mmap_region *regions;       // Most recent mapping first
+} mmap_file;
+
+static inline mmap_file *handle_to_mmap(couch_file_handle handle)
+{
+    return (mmap_file*)handle;
+}
+
+// Reserves a range of address space for a file of some size, and maps the file into it.
+static couchstore_error_t mmap_new_region(mmap_file *mf, size_t size)
+{
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    mmap_region *region = malloc(sizeof(mmap_region));
+    if (!region) {
+        return COUCHSTORE_ERROR_ALLOC_FAIL;
+    }
+    region->reserved = size < MMAP_MIN_RESERVE / 2 ? MMAP_MIN_RESERVE : 2 * size;
+    region->reserved = (region->reserved + page - 1) / page * page;
+    region->base = mmap(NULL, region->reserved, PROT_NONE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (region->base == MAP_FAILED) {
+        // Short of address space; just map the file as it is:
+        region->reserved = (size + page - 1) / page * page;
+        region->base = mmap(NULL, size, PROT_READ, MAP_SHARED, mf->fd, 0);
+    } else if (mmap(region->base, size, PROT_READ, MAP_SHARED | MAP_FIXED, mf->fd, 0)
+               == MAP_FAILED) {
+        munmap(region->base, region->reserved);
+        region->base = MAP_FAILED;
+    }
+    if (region->base == MAP_FAILED) {
+        save_errno();
+        free(region);
+        return COUCHSTORE_ERROR_READ;
+    }
+    region->length = size;
+    region->next = mf->regions;
+    mf->regions = region;
+    return COUCHSTORE_SUCCESS;
+}
+
+// Maps more of the file if it's grown past the current mapping. Call with the lock held.
+static couchstore_error_t mmap_remap(mmap_file *mf)
+{
+    struct stat st;
+    if (fstat(mf->fd, &st) < 0) {
+        save_errno();
+        return COUCHSTORE_ERROR_READ;
+    }
+    size_t size = (size_t)st.st_size;
+    mmap_region *region = mf->regions;
+    if (size <= (region ? region->length : 0)) {
+        return COUCHSTORE_SUCCESS;
+    }
+    if (!region || size > region->reserved) {
+        return mmap_new_region(mf, size);
+    }
+    // Extend the mapping in place, from the page the old one ended in:
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t start = region->length / page * page;
+    if (mmap((char*)region->base + start, size - start, PROT_READ, MAP_SHARED | MAP_FIXED,
+             mf->fd, (off_t)start) == MAP_FAILED) {
+        save_errno();
+        return COUCHSTORE_ERROR_READ;
+    }
+    region->length = size;
+    return COUCHSTORE_SUCCESS;
+}
+
+static ssize_t mmap_pread_ptr(couch_file_handle handle, const void **ptr, size_t nbyte, cs_off_t offset)
+{
+    mmap_file *mf = handle_to_mmap(handle);
+    pthread_mutex_lock(&mf->lock);
+    if (!mf->regions || (size_t)offset + nbyte > mf->regions->length) {
+        couchstore_error_t err = mmap_remap(mf);
+        if (err < 0) {
+            pthread_mutex_unlock(&mf->lock);
+            return err;
+        }
+    }
+    // (The region's length changes as it grows, so read it with the lock held)
+    const char *base = mf->regions ? mf->regions->base : NULL;
+    size_t length = mf->regions ? mf->regions->length : 0;
+    pthread_mutex_unlock(&mf->lock);
+
+    if ((size_t)offset >= length) {
+        return 0;
+    }
+    size_t avail = length - (size_t)offset;
+    *ptr = base + offset;
+    return avail < nbyte ? (ssize_t)avail : (ssize_t)nbyte;
+}
+
+static ssize_t mmap_pread(couch_file_handle handle, void *buf, size_t nbyte, cs_off_t offset)
+{
+    const void *ptr;
+    ssize_t got = mmap_pread_ptr(handle, &ptr, nbyte, offset);
+    if (got > 0) {
+        memcpy(buf, ptr, got);
+        return got;
+    }
+    // Couldn't map it; fall back to a regular read:
+    return couch_pread(fd_to_handle(handle_to_mmap(handle)->fd), buf, nbyte, offset);
+}
+
+static ssize_t mmap_pwrite(couch_file_handle handle, const void *buf, size_t nbyte, cs_off_t offset)
+{
+    return couch_pwrite(fd_to_handle(handle_to_mmap(handle)->fd), buf, nbyte, offset);
+}
+
+static ssize_t mmap_pwritev(couch_file_handle handle, const couch_file_iovec *iov, int iovcnt,
+                            cs_off_t offset)
+{
+    return couch_pwritev(fd_to_handle(handle_to_mmap(handle)->fd), iov, iovcnt, offset);
+}
+
+static couchstore_error_t mmap_open(couch_file_handle* handle, const char *path, int oflag)
+{
+    mmap_file *mf = handle_to_mmap(*handle);
+    if (!mf) {
+        return COUCHSTORE_ERROR_ALLOC_FAIL;
+    }
+    couch_file_handle fd_handle;
+    couchstore_error_t err = couch_open(&fd_handle, path, oflag);
+    if (err == COUCHSTORE_SUCCESS) {
+        mf->fd = handle_to_fd(fd_handle);
+    }
+    return err;
+}
+
+static void mmap_close(couch_file_handle handle)
+{
+    mmap_file *mf = handle_to_mmap(handle);
+    if (!mf) {
+        return;
+    }
+    while (mf->regions) {
+        mmap_region *region = mf->regions;
+        mf->regions = region->next;
+        munmap(region->base, region->reserved);
+        free(region);
+    }
+    couch_close(fd_to_handle(mf->fd));
+    mf->fd = -1;
+}
+
+static cs_off_t mmap_goto_eof(couch_file_handle handle)
+{
+    return couch_goto_eof(fd_to_handle(handle_to_mmap(handle)->fd));
+}
+
+static couchstore_error_t mmap_sync(couch_file_handle handle)
+{
+    return couch_sync(fd_to_handle(handle_to_mmap(handle)->fd));
+}
+
+static couchstore_error_t mmap_advise(couch_file_handle handle, cs_off_t offset, cs_off_t len, couchstore_file_advice_t advice)
+{
+    return couch_advise(fd_to_handle(handle_to_mmap(handle)->fd), offset, len, advice);
+}
+
+static couch_file_handle mmap_constructor(void* cookie)
+{
+    (void) cookie;
+    mmap_file *mf = calloc(1, sizeof(mmap_file));
+    if (mf) {
+        mf->fd = -1;
+        pthread_mutex_init(&mf->lock, NULL);
+    }
+    return (couch_file_handle)mf;
+}
+
+static void mmap_destructor(couch_file_handle handle)
+{
+    mmap_file *mf = handle_to_mmap(handle);
+    if (mf) {
+        pthread_mutex_destroy(&mf->lock);
+        free(mf);
+    }
+}
+
+static const couch_file_ops mmap_file_ops = {
+    (uint64_t)7,
+    mmap_constructor,
+    mmap_open,
+    mmap_close,
+    mmap_pread,
+    mmap_pwrite,
+    mmap_goto_eof,
+    mmap_sync,
+    mmap_advise,
+    mmap_destructor,
+    NULL,
+    mmap_pread_ptr,
+    NULL,
+    mmap_pwritev
+};
+
+LIBCOUCHSTORE_API
+const couch_file_ops *couchstore_get_mmap_file_ops(void)
+{
+    return &mmap_file_ops;
+}
@@ -0,0 +1,503 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#include "config.h"
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#if !defined(__NR_io_uring_setup) || !defined(__NR_io_uring_enter)
+#undef HAVE_LINUX_IO_URING_H
+#endif
+#endif
+
+#include "internal.h"
+
+/*
+ * File ops that can have many reads in flight at once, through pread_batch. On Linux a batch
+ * is submitted to an io_uring belonging to the file handle. Where io_uring isn't available
+ * (older kernels, or it's been disabled) the reads are handed to a small process-wide thread
+ * pool instead. Everything else is delegated to the default file ops. Setting the
+ * COUCHSTORE_NO_IO_URING environment variable disables io_uring too.
+ */
+
+#define URING_ENTRIES 64
+#define POOL_THREADS 8
+
+typedef struct uring uring;
+
+typedef struct {
+    couch_file_handle raw;          // Handle for the default ops
+    uring *ring;                    // NULL if io_uring isn't available
+} async_file;
+
+static inline async_file *handle_to_async(couch_file_handle handle)
+{
+    return (async_file*)handle;
+}
+
+static inline const couch_file_ops *raw_ops(void)
+{
+    return couchstore_get_default_file_ops();
+}
+
+
+//////// THREAD POOL:
+
+
+typedef struct pool_job {
+    struct pool_job *next;
+    couch_file_handle raw;
+    couch_file_read_request *req;
+    size_t *remaining;              // Count of unfinished jobs in the job's batch
+} pool_job;
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t work;            // Signaled when jobs are queued
+    pthread_cond_t done;            // Signaled when a job finishes
+    pool_job *head, *tail;
+} pool = {
+    PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, NULL
+};
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+
+// Takes the next job off the queue and runs it. Call with the lock held.
+static void pool_run_one(void)
+{
+    pool_job *job = pool.head;
+    pool.head = job->next;
+    if (!pool.head) {
+        pool.tail = NULL;
+    }
+    pthread_mutex_unlock(&pool.lock);
+
+    couch_file_read_request *req = job->req;
+    req->result = raw_ops()->pread(job->raw, req->buf, req->nbytes, req->offset);
+
+    pthread_mutex_lock(&pool.lock);
+    if (--*job->remaining == 0) {
+        pthread_cond_broadcast(&pool.done);
+    }
+}
+
+static void *pool_thread(void *arg)
+{
+    (void) arg;
+    pthread_mutex_lock(&pool.lock);
+    for (;;) {
+        while (!pool.head) {
+            pthread_cond_wait(&pool.work, &pool.lock);
+        }
+        pool_run_one();
+    }
+    return NULL;
+}
+
+static void start_pool(void)
+{
+    int i;
+    for (i = 0; i < POOL_THREADS; ++i) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, pool_thread, NULL) != 0) {
+            break;  // The calling threads will do the work themselves
+        }
+        pthread_detach(thread);
+    }
+}
+
+static couchstore_error_t pool_pread_batch(async_file *af, couch_file_read_request *reqs,
+                                           size_t count)
+{
+    pool_job *jobs = malloc(count * sizeof(pool_job));
+    size_t remaining = count, i;
+    if (!jobs) {
+        return COUCHSTORE_ERROR_ALLOC_FAIL;
+    }
+    pthread_once(&pool_once, start_pool);
+
+    pthread_mutex_lock(&pool.lock);
+    for (i = 0; i < count; ++i) {
+        jobs[i].next = NULL;
+        jobs[i].raw = af->raw;
+        jobs[i].req = &reqs[i];
+        jobs[i].remaining = &remaining;
+        if (pool.tail) {
+            pool.tail->next = &jobs[i];
+        } else {
+            pool.head = &jobs[i];
+        }
+        pool.tail = &jobs[i];
+    }
+    pthread_cond_broadcast(&pool.work);
+    // Help out while waiting, so the batch completes even if the pool is busy or empty:
+    while (remaining > 0) {
+        if (pool.head) {
+            pool_run_one();
+        } else {
+            pthread_cond_wait(&pool.done, &pool.lock);
+        }
+    }
+    pthread_mutex_unlock(&pool.lock);
+    free(jobs);
+    return COUCHSTORE_SUCCESS;
+}
+
+
+//////// IO_URING:
+
+
+#ifdef HAVE_LINUX_IO_URING_H
+
+struct uring {
+    int fd;
+    pthread_mutex_t lock;
+    int broken;                     // Set after an io_uring_enter error; the pool is used instead
+    unsigned entries;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ptr, *cq_ptr;
+    size_t sq_len, cq_len;
+};
+
+static void uring_free(uring *r)
+{
+    if (r->sqes && r->sqes != MAP_FAILED) {
+        munmap(r->sqes, r->entries * sizeof(struct io_uring_sqe));
+    }
+    if (r->cq_ptr && r->cq_ptr != MAP_FAILED && r->cq_ptr != r->sq_ptr) {
+        munmap(r->cq_ptr, r->cq_len);
+    }
+    if (r->sq_ptr && r->sq_ptr != MAP_FAILED) {
+        munmap(r->sq_ptr, r->sq_len);
+    }
+    close(r->fd);
+    pthread_mutex_destroy(&r->lock);
+    free(r);
+}
+
+// Sets up a ring. Returns NULL if io_uring isn't available.
+static uring *uring_create(void)
+{
+    struct io_uring_params p;
+    if (getenv("COUCHSTORE_NO_IO_URING")) {
+        return NULL;
+    }
+    memset(&p, 0, sizeof(p));
+    int fd = (int) syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+    if (fd < 0) {
+        return NULL;
+    }
+    uring *r = calloc(1, sizeof(uring));
+    if (!r) {
+        close(fd);
+        return NULL;
+    }
+    r->fd = fd;
+    pthread_mutex_init(&r->lock, NULL);
+    r->entries = p.sq_entries;
+
+    r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_len > r->sq_len) {
+            r->sq_len = r->cq_len;
+        }
+        r->cq_len = r->sq_len;
+    }
+    r->sq_ptr = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     fd, IORING_OFF_SQ_RING);
+    if (r->sq_ptr == MAP_FAILED) {
+        uring_free(r);
+        return NULL;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        r->cq_ptr = r->sq_ptr;
+    } else {
+        r->cq_ptr = mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         fd, IORING_OFF_CQ_RING);
+        if (r->cq_ptr == MAP_FAILED) {
+            uring_free(r);
+            return NULL;
+        }
+    }
+    r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+                   PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        uring_free(r);
+        return NULL;
+    }
+
+    char *sq = r->sq_ptr, *cq = r->cq_ptr;
+    r->sq_head = (unsigned*)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+    r->sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned*)(sq + p.sq_off.array);
+    r->cq_head = (unsigned*)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+    r->cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+    return r;
+}
+
+static int uring_enter(uring *r, unsigned to_submit, unsigned min_complete)
+{
+    return (int) syscall(__NR_io_uring_enter, r->fd, to_submit, min_complete,
+                         IORING_ENTER_GETEVENTS, NULL, 0);
+}
+
+// Moves the completions off the ring into the requests. Returns how many there were.
+static unsigned uring_reap(uring *r, couch_file_read_request *reqs)
+{
+    unsigned head = *r->cq_head, reaped = 0;
+    unsigned cq_tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != cq_tail; ++head, ++reaped) {
+        const struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+        couch_file_read_request *req = &reqs[cqe->user_data];
+        if (cqe->res < 0) {
+            get_os_error_store()->errno_err = -cqe->res;
+            req->result = COUCHSTORE_ERROR_READ;
+        } else {
+            req->result = cqe->res;
+        }
+    }
+    __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+    return reaped;
+}
+
+// Submits up to r->entries reads and waits for all of them. Call with the ring locked.
+// If io_uring_enter fails, marks the ring broken and returns an error, once none of the reads
+// are in flight any more.
+static couchstore_error_t uring_pread_some(uring *r, int fd, couch_file_read_request *reqs,
+                                           unsigned count)
+{
+    struct iovec iov[URING_ENTRIES];
+    unsigned old_tail = *r->sq_tail;
+    unsigned tail = old_tail, i;
+    for (i = 0; i < count; ++i) {
+        unsigned index = tail & *r->sq_mask;
+        struct io_uring_sqe *sqe = &r->sqes[index];
+        iov[i].iov_base = reqs[i].buf;
+        iov[i].iov_len = reqs[i].nbytes;
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_READV;
+        sqe->fd = fd;
+        sqe->addr = (uint64_t)(uintptr_t)&iov[i];
+        sqe->len = 1;
+        sqe->off = (uint64_t)reqs[i].offset;
+        sqe->user_data = i;
+        r->sq_array[index] = index;
+        ++tail;
+    }
+    __atomic_store_n(r->sq_tail, tail, __ATOMIC_RELEASE);
+
+    unsigned to_submit = count, completed = 0;
+    while (completed < count) {
+        int ret = uring_enter(r, to_submit, 1);
+        if (ret < 0) {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+                continue;
+            }
+            get_os_error_store()->errno_err = errno;
+            r->broken = 1;
+            if (to_submit == count) {
+                // Nothing was submitted, so the kernel hasn't looked at the entries yet:
+                __atomic_store_n(r->sq_tail, old_tail, __ATOMIC_RELEASE);
+            } else {
+                // The reads in flight write into the caller's buffers, so they have to finish
+                // before we return. Completions are posted without io_uring_enter:
+                while (completed < count - to_submit) {
+                    unsigned reaped = uring_reap(r, reqs);
+                    completed += reaped;
+                    if (reaped == 0) {
+                        sched_yield();
+                    }
+                }
+            }
+            return COUCHSTORE_ERROR_READ;
+        }
+        to_submit -= (unsigned)ret < to_submit ? (unsigned)ret : to_submit;
+        completed += uring_reap(r, reqs);
+    }
+    return COUCHSTORE_SUCCESS;
+}
+
+static couchstore_error_t uring_pread_batch(async_file *af, couch_file_read_request *reqs,
+                                            size_t count)
+{
+    uring *r = af->ring;
+    // The default ops' handle is the file descriptor:
+    int fd = (int)(intptr_t)af->raw;
+    couchstore_error_t err = COUCHSTORE_SUCCESS;
+    size_t done = 0;
+
+    pthread_mutex_lock(&r->lock);
+    if (r->broken) {
+        err = COUCHSTORE_ERROR_READ;
+    }
+    while (done < count && err == COUCHSTORE_SUCCESS) {
+        size_t n = count - done;
+        if (n > r->entries) {
+            n = r->entries;
+        }
+        if (n > URING_ENTRIES) {
+            n = URING_ENTRIES;
+        }
+        err = uring_pread_some(r, fd, reqs + done, (unsigned)n);
+        done += n;
+    }
+    pthread_mutex_unlock(&r->lock);
+    return err;
+}
+
+#else
+
+struct uring {
+    int unused;
+};
+
+static uring *uring_create(void)
+{
+    return NULL;
+}
+
+static void uring_free(uring *r)
+{
+    (void) r;
+}
+
+static couchstore_error_t uring_pread_batch(async_file *af, couch_file_read_request *reqs,
+                                            size_t count)
+{
+    (void) af; (void) reqs; (void) count;
+    return COUCHSTORE_ERROR_READ;
+}
+
+#endif
+
+
+//////// FILE OPS:
+
+
+static couchstore_error_t async_pread_batch(couch_file_handle handle,
+                                            couch_file_read_request *reqs, size_t count)
+{
+    async_file *af = handle_to_async(handle);
+    if (count == 0) {
+        return COUCHSTORE_SUCCESS;
+    } else if (count == 1) {
+        reqs[0].result = raw_ops()->pread(af->raw, reqs[0].buf, reqs[0].nbytes, reqs[0].offset);
+        return COUCHSTORE_SUCCESS;
+    }
+    if (af->ring && uring_pread_batch(af, reqs, count) == COUCHSTORE_SUCCESS) {
+        return COUCHSTORE_SUCCESS;
+    }
+    // (If the ring failed partway, the whole batch is read again by the pool)
+    return pool_pread_batch(af, reqs, count);
+}
+
+static ssize_t async_pread(couch_file_handle handle, void *buf, size_t nbyte, cs_off_t offset)
+{
+    return raw_ops()->pread(handle_to_async(handle)->raw, buf, nbyte, offset);
+}
+
+static ssize_t async_pwrite(couch_file_handle handle, const void *buf, size_t nbyte, cs_off_t offset)
+{
+    return raw_ops()->pwrite(handle_to_async(handle)->raw, buf, nbyte, offset);
+}
+
+static couchstore_error_t async_open(couch_file_handle* handle, const char *path, int oflag)
+{
+    async_file *af = handle_to_async(*handle);
+    if (!af) {
+        return COUCHSTORE_ERROR_ALLOC_FAIL;
+    }
+    couchstore_error_t err = raw_ops()->open(&af->raw, path, oflag);
+    if (err == COUCHSTORE_SUCCESS) {
+        af->ring = uring_create();
+    }
+    return err;
+}
+
+static void async_close(couch_file_handle handle)
+{
+    async_file *af = handle_to_async(handle);
+    if (!af) {
+        return;
+    }
+    if (af->ring) {
+        uring_free(af->ring);
+        af->ring = NULL;
+    }
+    raw_ops()->close(af->raw);
+}
+
+static cs_off_t async_goto_eof(couch_file_handle handle)
+{
+    return raw_ops()->goto_eof(handle_to_async(handle)->raw);
+}
+
+static couchstore_error_t async_sync(couch_file_handle handle)
+{
+    return raw_ops()->sync(handle_to_async(handle)->raw);
+}
+
+static couchstore_error_t async_advise(couch_file_handle handle, cs_off_t offset, cs_off_t len, couchstore_file_advice_t advice)
+{
+    return raw_ops()->advise(handle_to_async(handle)->raw, offset, len, advice);
+}
+
+static ssize_t async_pwritev(couch_file_handle handle, const couch_file_iovec *iov, int iovcnt,
+                             cs_off_t offset)
+{
+    return raw_ops()->pwritev(handle_to_async(handle)->raw, iov, iovcnt, offset);
+}
+
+static couch_file_handle async_constructor(void* cookie)
+{
+    async_file *af = calloc(1, sizeof(async_file));
+    if (af) {
+        af->raw = raw_ops()->constructor(cookie);
+    }
+    return (couch_file_handle)af;
+}
+
+static void async_destructor(couch_file_handle handle)
+{
+    async_file *af = handle_to_async(handle);
+    if (af) {
+        raw_ops()->destructor(af->raw);
+        free(af);
+    }
+}
+
+static const couch_file_ops async_file_ops = {
+    (uint64_t)7,
+    async_constructor,
+    async_open,
+    async_close,
+    async_pread,
+    async_pwrite,
+    async_goto_eof,
+    async_sync,
+    async_advise,
+    async_destructor,
+    NULL,
+    NULL,
+    async_pread_batch,
+    async_pwritev
+};
+
+LIBCOUCHSTORE_API
+const couch_file_ops *couchstore_get_async_file_ops(void)
+{
+    return &async_file_ops;
+}
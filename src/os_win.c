@@ -144,7 +144,7 @@ static couchstore_error_t couch_advise(couch_file_handle handle, cs_off_t offset
 }
 
 static const couch_file_ops default_file_ops = {
-    (uint64_t)4,
+    (uint64_t)6,
     couch_constructor,
     couch_open,
     couch_close,
@@ -154,6 +154,8 @@ static const couch_file_ops default_file_ops = {
     couch_sync,
     couch_advise,
     couch_destructor,
+    NULL,
+    NULL,
     NULL
 };
 
@@ -162,3 +164,17 @@ const couch_file_ops *couchstore_get_default_file_ops(void)
 {
     return &default_file_ops;
 }
+
+LIBCOUCHSTORE_API
+const couch_file_ops *couchstore_get_mmap_file_ops(void)
+{
+    // Memory-mapped reads aren't implemented on Windows yet.
+    return &default_file_ops;
+}
+
+LIBCOUCHSTORE_API
+const couch_file_ops *couchstore_get_async_file_ops(void)
+{
+    // Batched reads aren't implemented on Windows yet.
+    return &default_file_ops;
+}
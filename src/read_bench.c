@@ -0,0 +1,179 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Measures how random-read throughput scales with the number of reader threads, comparing
+ * one handle per thread against a single handle opened with COUCHSTORE_OPEN_FLAG_SHARED.
+ * Each read looks up a random doc by ID and reads its body.
+ *
+ * Usage: read_bench [max_threads] [num_docs]
+ */
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <libcouchstore/couch_db.h>
+
+#define BENCH_FILE "read_bench.couch"
+#define READS_PER_THREAD 100000
+#define BODY_SIZE 200
+#define SAVE_BATCH 1000
+
+typedef struct {
+    Db *db;                 // Shared handle, or NULL to open one per thread
+    unsigned seed;
+    int num_docs;
+    couchstore_error_t errcode;
+} reader;
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static couchstore_error_t create_file(int num_docs)
+{
+    couchstore_error_t errcode;
+    Db *db = NULL;
+    Doc docs[SAVE_BATCH];
+    DocInfo infos[SAVE_BATCH];
+    Doc *docptrs[SAVE_BATCH];
+    DocInfo *infoptrs[SAVE_BATCH];
+    char ids[SAVE_BATCH][16], body[BODY_SIZE];
+    int i, n;
+
+    unlink(BENCH_FILE);
+    errcode = couchstore_open_db(BENCH_FILE, COUCHSTORE_OPEN_FLAG_CREATE, &db);
+    if (errcode != COUCHSTORE_SUCCESS) {
+        return errcode;
+    }
+    memset(body, 'x', sizeof(body));
+    for (i = 0; i < num_docs && errcode == COUCHSTORE_SUCCESS; i += n) {
+        for (n = 0; n < SAVE_BATCH && i + n < num_docs; ++n) {
+            memset(&docs[n], 0, sizeof(Doc));
+            memset(&infos[n], 0, sizeof(DocInfo));
+            sprintf(ids[n], "doc%08d", i + n);
+            docs[n].id.buf = infos[n].id.buf = ids[n];
+            docs[n].id.size = infos[n].id.size = strlen(ids[n]);
+            docs[n].data.buf = body;
+            docs[n].data.size = sizeof(body);
+            infos[n].rev_seq = 1;
+            docptrs[n] = &docs[n];
+            infoptrs[n] = &infos[n];
+        }
+        errcode = couchstore_save_documents(db, docptrs, infoptrs, n, 0);
+        if (errcode == COUCHSTORE_SUCCESS) {
+            errcode = couchstore_commit(db);
+        }
+    }
+    couchstore_close_db(db);
+    return errcode;
+}
+
+static void *reader_thread(void *arg)
+{
+    reader *r = arg;
+    Db *db = r->db;
+    char id[16];
+    int i;
+
+    if (db == NULL) {
+        r->errcode = couchstore_open_db(BENCH_FILE, COUCHSTORE_OPEN_FLAG_RDONLY, &db);
+    }
+    for (i = 0; i < READS_PER_THREAD && r->errcode == COUCHSTORE_SUCCESS; ++i) {
+        DocInfo *info = NULL;
+        Doc *doc = NULL;
+        sprintf(id, "doc%08d", (int)(rand_r(&r->seed) % r->num_docs));
+        r->errcode = couchstore_docinfo_by_id(db, id, strlen(id), &info);
+        if (r->errcode == COUCHSTORE_SUCCESS) {
+            r->errcode = couchstore_open_doc_with_docinfo(db, info, &doc, 0);
+            couchstore_free_document(doc);
+        }
+        couchstore_free_docinfo(info);
+    }
+    if (db != r->db && db != NULL) {
+        couchstore_close_db(db);
+    }
+    return NULL;
+}
+
+// Runs the readers and returns their combined reads per second, or a negative error code.
+static double run(int nthreads, int shared, int num_docs)
+{
+    pthread_t threads[256];
+    reader readers[256];
+    Db *db = NULL;
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    int t;
+
+    if (shared) {
+        errcode = couchstore_open_db(BENCH_FILE, COUCHSTORE_OPEN_FLAG_RDONLY |
+                                     COUCHSTORE_OPEN_FLAG_SHARED, &db);
+        if (errcode != COUCHSTORE_SUCCESS) {
+            return errcode;
+        }
+    }
+    double start = now();
+    for (t = 0; t < nthreads; ++t) {
+        readers[t].db = db;
+        readers[t].seed = (unsigned)t + 1;
+        readers[t].num_docs = num_docs;
+        readers[t].errcode = COUCHSTORE_SUCCESS;
+        pthread_create(&threads[t], NULL, reader_thread, &readers[t]);
+    }
+    for (t = 0; t < nthreads; ++t) {
+        pthread_join(threads[t], NULL);
+        if (readers[t].errcode != COUCHSTORE_SUCCESS) {
+            errcode = readers[t].errcode;
+        }
+    }
+    double elapsed = now() - start;
+    if (db) {
+        couchstore_close_db(db);
+    }
+    if (errcode != COUCHSTORE_SUCCESS) {
+        return errcode;
+    }
+    return (double)nthreads * READS_PER_THREAD / elapsed;
+}
+
+int main(int argc, char **argv)
+{
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int max_threads = argc > 1 ? atoi(argv[1]) : (int)(ncpus > 0 ? ncpus : 4);
+    int num_docs = argc > 2 ? atoi(argv[2]) : 100000;
+    int nthreads, next_threads;
+    couchstore_error_t errcode;
+
+    if (max_threads < 1 || max_threads > 256 || num_docs < 1) {
+        fprintf(stderr, "Usage: %s [max_threads] [num_docs]\n", argv[0]);
+        return 1;
+    }
+    errcode = create_file(num_docs);
+    if (errcode != COUCHSTORE_SUCCESS) {
+        fprintf(stderr, "Couldn't create %s: %s\n", BENCH_FILE, couchstore_strerror(errcode));
+        return 1;
+    }
+
+    printf("%-10s%16s%16s   (reads/s)\n", "threads", "per-thread", "shared");
+    for (nthreads = 1; nthreads <= max_threads; nthreads = next_threads) {
+        double separate = run(nthreads, 0, num_docs);
+        double shared = run(nthreads, 1, num_docs);
+        if (separate < 0 || shared < 0) {
+            errcode = (couchstore_error_t)(separate < 0 ? separate : shared);
+            fprintf(stderr, "\nRead failed: %s\n", couchstore_strerror(errcode));
+            unlink(BENCH_FILE);
+            return 1;
+        }
+        printf("%-10d%16.0f%16.0f\n", nthreads, separate, shared);
+        next_threads = nthreads * 2;
+        if (nthreads < max_threads && next_threads > max_threads) {
+            next_threads = max_threads;     // so the last run uses max_threads
+        }
+    }
+    unlink(BENCH_FILE);
+    return 0;
+}
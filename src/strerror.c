@@ -31,6 +31,8 @@ const char *couchstore_strerror(couchstore_error_t errcode)
         return "invalid arguments";
     case COUCHSTORE_ERROR_NO_SUCH_FILE:
         return "no such file";
+    case COUCHSTORE_ERROR_UNSUPPORTED_CODEC:
+        return "compression codec not supported";
     default:
         return NULL;
     }
@@ -11,10 +11,16 @@
 #include "util.h"
 
 #include <stdlib.h>
+#include <pthread.h>
+#ifndef _WIN32
+#include <unistd.h>
+#endif
 
 
 #define ID_SORT_CHUNK_SIZE (100 * 1024 * 1024) // 100MB. Make tuneable?
+#define ID_SORT_BACKGROUND_CHUNK_SIZE (512 * 1024)  // Items per run sorted while items arrive
 #define ID_SORT_MAX_RECORD_SIZE 4196
+#define ID_SORT_PIPE_BUFFER_SIZE (64 * 1024)
 
 
 static int read_id_record(FILE *in, void *buf, void *ctx);
@@ -27,6 +33,14 @@ struct TreeWriter {
     compare_callback key_compare;
     reduce_fn reduce;
     reduce_fn rereduce;
+    int unique_keys;
+    // For background sorting (TreeWriterStartSort), 'file' is the write end of a pipe that
+    // the sort thread reads from, and the sorted items go to 'sorted_file'.
+    int sorting;
+    pthread_t sort_thread;
+    FILE* sort_input;
+    FILE* sorted_file;
+    couchstore_error_t sort_errcode;
 };
 
 
@@ -56,8 +70,84 @@ cleanup:
 }
 
 
+// merge_sort sorts a run in memory each time it has read 'block_size' items, and merges the
+// runs once the input ends. With ID_SORT_CHUNK_SIZE nearly any input would be one run, sorted
+// only after the last item arrived, so the background sort uses smaller runs.
+static void* sort_thread_main(void* arg)
+{
+    TreeWriter* writer = arg;
+    writer->sort_errcode = merge_sort(writer->sort_input, writer->sorted_file,
+                                      read_id_record, write_id_record, compare_id_record,
+                                      writer, ID_SORT_MAX_RECORD_SIZE,
+                                      ID_SORT_BACKGROUND_CHUNK_SIZE, NULL);
+    // If the sort failed early, keep draining the pipe so the writer doesn't block:
+    char buf[4096];
+    while (fread(buf, 1, sizeof(buf), writer->sort_input) > 0) {
+    }
+    return NULL;
+}
+
+couchstore_error_t TreeWriterStartSort(TreeWriter* writer)
+{
+#ifndef _WIN32
+    int fds[2];
+    if (writer->sorting || ftell(writer->file) != 0 || pipe(fds) != 0) {
+        return COUCHSTORE_SUCCESS;
+    }
+    FILE* input = fdopen(fds[0], "rb");
+    FILE* output = fdopen(fds[1], "wb");
+    FILE* sorted = tmpfile();
+    if (input && output && sorted) {
+        setvbuf(input, NULL, _IOFBF, ID_SORT_PIPE_BUFFER_SIZE);
+        setvbuf(output, NULL, _IOFBF, ID_SORT_PIPE_BUFFER_SIZE);
+        writer->sort_input = input;
+        writer->sorted_file = sorted;
+        if (pthread_create(&writer->sort_thread, NULL, sort_thread_main, writer) == 0) {
+            fclose(writer->file);
+            writer->file = output;
+            writer->sorting = 1;
+            return COUCHSTORE_SUCCESS;
+        }
+        writer->sort_input = writer->sorted_file = NULL;
+    }
+    // Couldn't start the thread; TreeWriterSort will sort synchronously instead.
+    if (input) {
+        fclose(input);
+    } else {
+        close(fds[0]);
+    }
+    if (output) {
+        fclose(output);
+    } else {
+        close(fds[1]);
+    }
+    if (sorted) {
+        fclose(sorted);
+    }
+#else
+    (void) writer;
+#endif
+    return COUCHSTORE_SUCCESS;
+}
+
+// Signals end of input to the sort thread and waits for it to finish.
+static void finish_background_sort(TreeWriter* writer)
+{
+    fclose(writer->file);
+    writer->file = NULL;
+    pthread_join(writer->sort_thread, NULL);
+    fclose(writer->sort_input);
+    writer->sort_input = NULL;
+    writer->file = writer->sorted_file;
+    writer->sorted_file = NULL;
+    writer->sorting = 0;
+}
+
 void TreeWriterFree(TreeWriter* writer)
 {
+    if (writer && writer->sorting) {
+        finish_background_sort(writer);
+    }
     if (writer && writer->file) {
         fclose(writer->file);
     }
@@ -65,6 +155,12 @@ void TreeWriterFree(TreeWriter* writer)
 }
 
 
+void TreeWriterRequireUniqueKeys(TreeWriter* writer)
+{
+    writer->unique_keys = 1;
+}
+
+
 couchstore_error_t TreeWriterAddItem(TreeWriter* writer, sized_buf key, sized_buf value)
 {
     couchstore_error_t errcode = COUCHSTORE_SUCCESS;
@@ -83,6 +179,10 @@ cleanup:
 
 couchstore_error_t TreeWriterSort(TreeWriter* writer)
 {
+    if (writer->sorting) {
+        finish_background_sort(writer);
+        return writer->sort_errcode;
+    }
     rewind(writer->file);
     return merge_sort(writer->file, writer->file,
                       read_id_record, write_id_record, compare_id_record,
@@ -98,6 +198,8 @@ couchstore_error_t TreeWriterWrite(TreeWriter* writer,
     couchstore_error_t errcode = COUCHSTORE_SUCCESS;
     arena* transient_arena = new_arena(0);
     arena* persistent_arena = new_arena(0);
+    sized_buf prev = {NULL, 0};     // Last key written, for unique_keys
+    int have_prev_key = 0;
     error_unless(transient_arena && persistent_arena, COUCHSTORE_ERROR_ALLOC_FAIL);
 
     rewind(writer->file);
@@ -120,6 +222,10 @@ couchstore_error_t TreeWriterWrite(TreeWriter* writer,
     uint16_t klen;
     uint32_t vlen;
     sized_buf k, v;
+    if(writer->unique_keys) {
+        prev.buf = malloc(UINT16_MAX);
+        error_unless(prev.buf, COUCHSTORE_ERROR_ALLOC_FAIL);
+    }
     while(1) {
         if(fread(&klen, sizeof(klen), 1, writer->file) != 1) {
             break;
@@ -138,6 +244,13 @@ couchstore_error_t TreeWriterWrite(TreeWriter* writer,
             error_pass(COUCHSTORE_ERROR_READ);
         }
         //printf("K: '%.*s'\n", k.size, k.buf);
+        if(writer->unique_keys) {
+            error_unless(!have_prev_key || writer->key_compare(&prev, &k) != 0,
+                         COUCHSTORE_ERROR_INVALID_ARGUMENTS);
+            memcpy(prev.buf, k.buf, k.size);
+            prev.size = k.size;
+            have_prev_key = 1;
+        }
         mr_push_item(&k, &v, target_mr);
         if(target_mr->count == 0) {
             /* No items queued, we must have just flushed. We can safely rewind the transient arena. */
@@ -155,6 +268,7 @@ couchstore_error_t TreeWriterWrite(TreeWriter* writer,
     *out_root = complete_new_btree(target_mr, &errcode);
 
 cleanup:
+    free(prev.buf);
     delete_arena(transient_arena);
     delete_arena(persistent_arena);
     return errcode;
@@ -33,6 +33,21 @@ void TreeWriterFree(TreeWriter* writer);
  */
 couchstore_error_t TreeWriterAddItem(TreeWriter* writer, sized_buf key, sized_buf value);
 
+/**
+ * Makes TreeWriterWrite fail with COUCHSTORE_ERROR_INVALID_ARGUMENTS if two items have equal
+ * keys, instead of writing both.
+ */
+void TreeWriterRequireUniqueKeys(TreeWriter* writer);
+
+/**
+ * Starts sorting on a background thread, so that the sort's first pass (sorting runs of
+ * items in memory and spilling them to temporary files) overlaps with adding the items. The
+ * runs are merged once all the items are in. Call this before adding any items;
+ * TreeWriterSort then waits for the sort to finish. If the thread can't be started, the items
+ * are sorted by TreeWriterSort as usual.
+ */
+couchstore_error_t TreeWriterStartSort(TreeWriter* writer);
+
 /**
  * Sorts the key/value pairs already added.
  * The keys are sorted by ebin_cmp (basic lexicographic order by byte values).
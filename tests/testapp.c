@@ -1,15 +1,19 @@
 /* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
 #include "config.h"
 #include <unistd.h>
+#include <fcntl.h>
 #include <libcouchstore/couch_db.h>
 #include "../src/fatbuf.h"
 #include "../src/internal.h"
 #include "../src/node_types.h"
 #include "../src/reduces.h"
+#include "../src/crc32.h"
+#include "../src/id_filter.h"
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <snappy-c.h>
 #include "macros.h"
 
 extern void TestCollateJSON(void);  // collate_json_test.c
@@ -674,6 +678,3341 @@ static void test_huge_revseq(void)
     assert(remove("bigrevseq.couch") == 0);
 }
 
+static void test_node_cache(void)
+{
+    fprintf(stderr, "node cache... ");
+    fflush(stderr);
+    int errcode = 0;
+    int i;
+    char ids[500][12];
+    Db *db = NULL, *db2 = NULL;
+    DocInfo *info;
+    NodeCacheStats before, after;
+    char otherpath[1100];
+    char copybuf[4096];
+    FILE *src, *dst;
+    size_t len;
+
+    couchstore_set_node_cache_size(1024 * 1024);
+    docset_init(500);
+    for (i = 0; i < 500; ++i) {
+        sprintf(ids[i], "doc%05d", i);
+        setdoc(&testdocset.docs[i], &testdocset.infos[i], ids[i], strlen(ids[i]),
+               "{}", 2, zerometa, sizeof(zerometa));
+    }
+    unlink(testfilepath);
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_CREATE, &db));
+    Doc *docptrs[500];
+    DocInfo *infoptrs[500];
+    for (i = 0; i < 500; ++i) {
+        docptrs[i] = &testdocset.docs[i];
+        infoptrs[i] = &testdocset.infos[i];
+    }
+    try(couchstore_save_documents(db, docptrs, infoptrs, 500, 0));
+    try(couchstore_commit(db));
+
+    // The first pass may miss; the second must be served entirely from the cache.
+    for (i = 0; i < 500; ++i) {
+        try(couchstore_docinfo_by_id(db, ids[i], strlen(ids[i]), &info));
+        couchstore_free_docinfo(info);
+    }
+    couchstore_get_node_cache_stats(&before);
+    assert(before.entries > 0);
+    assert(before.size <= before.capacity);
+    for (i = 0; i < 500; ++i) {
+        try(couchstore_docinfo_by_id(db, ids[i], strlen(ids[i]), &info));
+        assert(info->db_seq == (uint64_t)i + 1);
+        couchstore_free_docinfo(info);
+    }
+    couchstore_get_node_cache_stats(&after);
+    assert(after.misses == before.misses);
+    assert(after.hits > before.hits);
+
+    // Updates write new nodes; lookups must see them, not stale cached ones.
+    try(couchstore_save_document(db, docptrs[7], infoptrs[7], 0));
+    try(couchstore_commit(db));
+    try(couchstore_docinfo_by_id(db, ids[7], strlen(ids[7]), &info));
+    assert(info->db_seq == 501);
+    couchstore_free_docinfo(info);
+
+    // Another handle on the file, or one opened after closing it, uses the same nodes.
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_RDONLY, &db2));
+    couchstore_get_node_cache_stats(&before);
+    for (i = 0; i < 500; ++i) {
+        try(couchstore_docinfo_by_id(db2, ids[i], strlen(ids[i]), &info));
+        couchstore_free_docinfo(info);
+    }
+    couchstore_get_node_cache_stats(&after);
+    assert(after.misses == before.misses);
+    couchstore_close_db(db);
+    couchstore_close_db(db2);
+    db = db2 = NULL;
+    couchstore_get_node_cache_stats(&after);
+    assert(after.entries > 0);
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_RDONLY, &db));
+    try(couchstore_docinfo_by_id(db, ids[7], strlen(ids[7]), &info));
+    assert(info->db_seq == 501);
+    couchstore_free_docinfo(info);
+    couchstore_get_node_cache_stats(&before);
+    assert(before.misses == after.misses);
+    couchstore_close_db(db);
+    db = NULL;
+
+    // If something else rewrites the file in place, the old nodes aren't used. The new file
+    // is written the same way, so its nodes are at the same positions, but its IDs differ.
+    sprintf(otherpath, "%s.other", testfilepath);
+    unlink(otherpath);
+    try(couchstore_open_db(otherpath, COUCHSTORE_OPEN_FLAG_CREATE, &db));
+    for (i = 0; i < 500; ++i) {
+        ids[i][0] = 'x';
+    }
+    try(couchstore_save_documents(db, docptrs, infoptrs, 500, 0));
+    try(couchstore_commit(db));
+    try(couchstore_save_document(db, docptrs[7], infoptrs[7], 0));
+    try(couchstore_commit(db));
+    couchstore_close_db(db);
+    db = NULL;
+    src = fopen(otherpath, "rb");
+    dst = fopen(testfilepath, "r+b");
+    assert(src && dst);
+    while ((len = fread(copybuf, 1, sizeof(copybuf), src)) > 0) {
+        assert(fwrite(copybuf, 1, len, dst) == len);
+    }
+    fclose(src);
+    fclose(dst);
+    unlink(otherpath);
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_RDONLY, &db));
+    for (i = 0; i < 500; ++i) {
+        try(couchstore_docinfo_by_id(db, ids[i], strlen(ids[i]), &info));
+        assert(info->db_seq == (uint64_t)(i == 7 ? 501 : i + 1));
+        couchstore_free_docinfo(info);
+    }
+
+    // Shrinking the cache evicts.
+    couchstore_set_node_cache_size(4096);
+    couchstore_get_node_cache_stats(&after);
+    assert(after.size <= 4096);
+    assert(after.evictions > 0);
+
+cleanup:
+    if (db) {
+        couchstore_close_db(db);
+    }
+    if (db2) {
+        couchstore_close_db(db2);
+    }
+    couchstore_set_node_cache_size(0);
+    assert(errcode == 0);
+}
+
+static void test_mmap_read(void)
+{
+    fprintf(stderr, "mmap reads... ");
+    fflush(stderr);
+    int errcode = 0;
+    int i;
+    char ids[200][12];
+    char *bodies[200];
+    Db *db = NULL;
+    Doc *doc;
+
+    // Bodies of varying length, so some chunks straddle block boundaries:
+    docset_init(200);
+    for (i = 0; i < 200; ++i) {
+        size_t len = 10 + (i * 97) % 6000;
+        sprintf(ids[i], "doc%05d", i);
+        bodies[i] = malloc(len);
+        memset(bodies[i], 'a' + i % 26, len);
+        setdoc(&testdocset.docs[i], &testdocset.infos[i], ids[i], strlen(ids[i]),
+               bodies[i], len, zerometa, sizeof(zerometa));
+        if (i % 3 == 0) {
+            testdocset.infos[i].content_meta = COUCH_DOC_IS_COMPRESSED;
+        }
+    }
+    unlink(testfilepath);
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_CREATE, &db));
+    for (i = 0; i < 200; ++i) {
+        try(couchstore_save_document(db, &testdocset.docs[i], &testdocset.infos[i],
+                                     COMPRESS_DOC_BODIES));
+    }
+    try(couchstore_commit(db));
+    couchstore_close_db(db);
+    db = NULL;
+
+    assert(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_MMAP, &db)
+           == COUCHSTORE_ERROR_INVALID_ARGUMENTS);
+    db = NULL;
+    try(couchstore_open_db(testfilepath,
+                           COUCHSTORE_OPEN_FLAG_RDONLY | COUCHSTORE_OPEN_FLAG_MMAP, &db));
+    for (i = 0; i < 200; ++i) {
+        try(couchstore_open_document(db, ids[i], strlen(ids[i]), &doc, DECOMPRESS_DOC_BODIES));
+        assert(doc->data.size == testdocset.docs[i].data.size);
+        assert(memcmp(doc->data.buf, bodies[i], doc->data.size) == 0);
+        couchstore_free_document(doc);
+        if (i % 3 != 0) {
+            // Uncompressed bodies are read in place when possible:
+            try(couchstore_open_document(db, ids[i], strlen(ids[i]), &doc, 0));
+            assert(memcmp(doc->data.buf, bodies[i], doc->data.size) == 0);
+            couchstore_free_document(doc);
+        }
+    }
+    testdocset.pos = 0;
+    try(couchstore_changes_since(db, 0, 0, docset_check, &testdocset));
+    assert(testdocset.counters.totaldocs == 200);
+    couchstore_close_db(db);
+    db = NULL;
+
+    // When the file grows the mapping is extended, and earlier pointers stay valid:
+    {
+        const couch_file_ops *ops = couchstore_get_mmap_file_ops();
+        couch_file_handle handle = ops->constructor(ops->cookie);
+        const void *start, *grown;
+        char first[64], more[100000];
+        cs_off_t size;
+        try(ops->open(&handle, testfilepath, O_RDONLY));
+        size = ops->goto_eof(handle);
+        assert(ops->pread_ptr(handle, &start, sizeof(first), 0) == sizeof(first));
+        memcpy(first, start, sizeof(first));
+        int fd = open(testfilepath, O_WRONLY | O_APPEND);
+        assert(fd >= 0);
+        memset(more, 'm', sizeof(more));
+        assert(write(fd, more, sizeof(more)) == sizeof(more));
+        close(fd);
+        assert(ops->pread_ptr(handle, &grown, sizeof(more), size) == sizeof(more));
+        assert(memcmp(grown, more, sizeof(more)) == 0);
+        assert(memcmp(start, first, sizeof(first)) == 0);
+        ops->close(handle);
+        ops->destructor(handle);
+    }
+
+cleanup:
+    if (db) {
+        couchstore_close_db(db);
+    }
+    for (i = 0; i < 200; ++i) {
+        free(bodies[i]);
+    }
+    assert(errcode == 0);
+}
+
+static int body_check(Db *db, const DocInfo *info, const sized_buf *body, void *ctx)
+{
+    (void)db;
+    const Doc *expected = ctx;
+    assert(info->id.size == expected->id.size);
+    assert(body->size == expected->data.size);
+    assert(memcmp(body->buf, expected->data.buf, body->size) == 0);
+    return 0;
+}
+
+static int body_fail(Db *db, const DocInfo *info, const sized_buf *body, void *ctx)
+{
+    (void)db; (void)info; (void)body; (void)ctx;
+    return COUCHSTORE_ERROR_CANCEL;
+}
+
+static void test_doc_body_reads(void)
+{
+    fprintf(stderr, "doc body visitor... ");
+    fflush(stderr);
+    int errcode = 0;
+    int i, pass;
+    Db *db = NULL;
+    DocInfo *info;
+    sized_buf buffer = {NULL, 0};
+    sized_buf body;
+
+    docset_init(4);
+    SETDOC(0, "doc1", "{\"test_doc_index\":1}", zerometa);
+    SETDOC(1, "doc2", "{\"test_doc_index\":2, \"val\":\"blah blah blah blah blah blah\"}", zerometa);
+    SETDOC(2, "doc3", "{\"test_doc_index\":3, \"val\":\"blah blah blah blah blah blah blah blah\"}", zerometa);
+    SETDOC(3, "doc4", "{}", zerometa);
+    testdocset.infos[1].content_meta = COUCH_DOC_IS_COMPRESSED;
+    testdocset.infos[2].content_meta = COUCH_DOC_IS_COMPRESSED;
+    unlink(testfilepath);
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_CREATE, &db));
+    for (i = 0; i < 4; ++i) {
+        try(couchstore_save_document(db, &testdocset.docs[i], &testdocset.infos[i],
+                                     COMPRESS_DOC_BODIES));
+    }
+    try(couchstore_commit(db));
+    couchstore_close_db(db);
+    db = NULL;
+
+    for (pass = 0; pass < 2; ++pass) {
+        couchstore_open_flags flags = COUCHSTORE_OPEN_FLAG_RDONLY;
+        if (pass == 1) {
+            flags |= COUCHSTORE_OPEN_FLAG_MMAP;
+        }
+        try(couchstore_open_db(testfilepath, flags, &db));
+        for (i = 0; i < 4; ++i) {
+            const Doc *expected = &testdocset.docs[i];
+            try(couchstore_docinfo_by_id(db, expected->id.buf, expected->id.size, &info));
+            try(couchstore_visit_doc_body(db, info, DECOMPRESS_DOC_BODIES, body_check,
+                                          (void *)expected));
+            try(couchstore_read_doc_body(db, info, &buffer, &body, DECOMPRESS_DOC_BODIES));
+            assert(body.size == expected->data.size);
+            assert(memcmp(body.buf, expected->data.buf, body.size) == 0);
+            assert(couchstore_visit_doc_body(db, info, 0, body_fail, NULL)
+                   == COUCHSTORE_ERROR_CANCEL);
+            couchstore_free_docinfo(info);
+        }
+        couchstore_close_db(db);
+        db = NULL;
+    }
+    assert(buffer.buf != NULL);
+
+cleanup:
+    if (db) {
+        couchstore_close_db(db);
+    }
+    free(buffer.buf);
+    assert(errcode == 0);
+}
+
+typedef struct {
+    DocInfo *infos[1000];
+    int count;
+    int seen[1000];
+} bulk_read_state;
+
+static int collect_docinfo(Db *db, DocInfo *info, void *ctx)
+{
+    (void)db;
+    bulk_read_state *state = ctx;
+    state->infos[state->count++] = info;
+    return 1;   // keep the DocInfo
+}
+
+static int bulk_body_check(Db *db, const DocInfo *info, const sized_buf *body, void *ctx)
+{
+    (void)db;
+    bulk_read_state *state = ctx;
+    int i = atoi(info->id.buf + 3);
+    char expected[64];
+    size_t len = 20 + i % 2000;
+    assert(body && body->size == len);
+    sprintf(expected, "{\"doc\":%d}", i);
+    assert(memcmp(body->buf, expected, strlen(expected)) == 0);
+    state->seen[i]++;
+    return 0;
+}
+
+static void test_open_documents(void)
+{
+    fprintf(stderr, "bulk open documents... ");
+    fflush(stderr);
+    int errcode = 0;
+    int i, pass;
+    Db *db = NULL;
+    char ids[1000][12];
+    char *bodies[1000];
+    sized_buf keys[1000];
+    static bulk_read_state state;
+
+    memset(bodies, 0, sizeof(bodies));
+    docset_init(1000);
+    for (i = 0; i < 1000; ++i) {
+        size_t len = 20 + i % 2000;
+        sprintf(ids[i], "doc%05d", i);
+        bodies[i] = calloc(1, len + 1);
+        memset(bodies[i], ' ', len);
+        sprintf(bodies[i], "{\"doc\":%d}", i);
+        bodies[i][strlen(bodies[i])] = ' ';
+        setdoc(&testdocset.docs[i], &testdocset.infos[i], ids[i], strlen(ids[i]),
+               bodies[i], len, zerometa, sizeof(zerometa));
+        testdocset.infos[i].content_meta = (i % 2) ? COUCH_DOC_IS_COMPRESSED : 0;
+        keys[i].buf = ids[i];
+        keys[i].size = strlen(ids[i]);
+    }
+    unlink(testfilepath);
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_CREATE, &db));
+    // Save in an order that doesn't match the key order, so bodies are scattered:
+    for (i = 0; i < 1000; ++i) {
+        int n = (i * 7) % 1000;
+        try(couchstore_save_document(db, &testdocset.docs[n], &testdocset.infos[n],
+                                     COMPRESS_DOC_BODIES));
+    }
+    try(couchstore_commit(db));
+    couchstore_close_db(db);
+    db = NULL;
+
+    for (pass = 0; pass < 3; ++pass) {
+        couchstore_open_flags flags = COUCHSTORE_OPEN_FLAG_RDONLY;
+        couchstore_open_options options = DECOMPRESS_DOC_BODIES;
+        if (pass == 1) {
+            options |= PARALLEL_DOC_READS;
+        } else if (pass == 2) {
+            flags |= COUCHSTORE_OPEN_FLAG_MMAP;
+        }
+        memset(&state, 0, sizeof(state));
+        try(couchstore_open_db(testfilepath, flags, &db));
+        try(couchstore_docinfos_by_id(db, keys, 1000, 0, collect_docinfo, &state));
+        assert(state.count == 1000);
+        try(couchstore_open_documents(db, state.infos, state.count, options,
+                                      bulk_body_check, &state));
+        for (i = 0; i < 1000; ++i) {
+            assert(state.seen[i] == 1);
+        }
+        assert(couchstore_open_documents(db, state.infos, state.count, options,
+                                         body_fail, NULL) == COUCHSTORE_ERROR_CANCEL);
+        for (i = 0; i < state.count; ++i) {
+            couchstore_free_docinfo(state.infos[i]);
+        }
+        couchstore_close_db(db);
+        db = NULL;
+    }
+
+cleanup:
+    if (db) {
+        couchstore_close_db(db);
+    }
+    for (i = 0; i < 1000; ++i) {
+        free(bodies[i]);
+    }
+    assert(errcode == 0);
+}
+
+static void test_async_reads(void)
+{
+    fprintf(stderr, "async batched reads... ");
+    fflush(stderr);
+    int errcode = 0;
+    int i, pass;
+    Db *db = NULL;
+    char ids[2000][12];
+    char bodies[2000][32];
+    sized_buf keys[1000];
+    static bulk_read_state state;
+
+    docset_init(2000);
+    for (i = 0; i < 2000; ++i) {
+        sprintf(ids[i], "doc%05d", i);
+        sprintf(bodies[i], "{\"doc\":%d}", i);
+        setdoc(&testdocset.docs[i], &testdocset.infos[i], ids[i], strlen(ids[i]),
+               bodies[i], strlen(bodies[i]), zerometa, sizeof(zerometa));
+    }
+    for (i = 0; i < 1000; ++i) {
+        // Look up every other doc, so the lookup needs most but not all of the leaves:
+        keys[i].buf = ids[2 * i];
+        keys[i].size = strlen(ids[2 * i]);
+    }
+    unlink(testfilepath);
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_CREATE, &db));
+    Doc *docptrs[2000];
+    DocInfo *infoptrs[2000];
+    for (i = 0; i < 2000; ++i) {
+        docptrs[i] = &testdocset.docs[i];
+        infoptrs[i] = &testdocset.infos[i];
+    }
+    try(couchstore_save_documents(db, docptrs, infoptrs, 2000, 0));
+    try(couchstore_commit(db));
+    couchstore_close_db(db);
+    db = NULL;
+
+    // The second pass uses the node cache; the third can't use io_uring, so the thread pool
+    // reads the nodes:
+    for (pass = 0; pass < 3; ++pass) {
+        couchstore_set_node_cache_size(pass == 1 ? 1024 * 1024 : 0);
+        if (pass == 2) {
+            setenv("COUCHSTORE_NO_IO_URING", "1", 1);
+        }
+        memset(&state, 0, sizeof(state));
+        try(couchstore_open_db_ex(testfilepath, COUCHSTORE_OPEN_FLAG_RDONLY,
+                                  couchstore_get_async_file_ops(), &db));
+        unsetenv("COUCHSTORE_NO_IO_URING");
+        try(couchstore_docinfos_by_id(db, keys, 1000, 0, collect_docinfo, &state));
+        assert(state.count == 1000);
+        for (i = 0; i < state.count; ++i) {
+            DocInfo *info = state.infos[i];
+            int n = atoi(info->id.buf + 3);
+            assert(n == 2 * i);
+            assert(info->size > strlen(bodies[n]));
+            couchstore_free_docinfo(info);
+        }
+        couchstore_close_db(db);
+        db = NULL;
+    }
+
+cleanup:
+    unsetenv("COUCHSTORE_NO_IO_URING");
+    couchstore_set_node_cache_size(0);
+    if (db) {
+        couchstore_close_db(db);
+    }
+    assert(errcode == 0);
+}
+
+
+#define GROUP_COMMIT_THREADS 8
+#define GROUP_COMMIT_BATCHES 40
+
+typedef struct {
+    Db *db;
+    int thread;
+    couchstore_error_t errcode;
+    uint64_t seqs[GROUP_COMMIT_BATCHES];
+} group_commit_writer;
+
+static void *group_commit_thread(void *arg)
+{
+    group_commit_writer *w = arg;
+    int i;
+    for (i = 0; i < GROUP_COMMIT_BATCHES && w->errcode == COUCHSTORE_SUCCESS; ++i) {
+        char id[16], body[32];
+        Doc doc;
+        DocInfo info;
+        Doc *docp = &doc;
+        DocInfo *infop = &info;
+        // Every thread also keeps updating a shared doc, so some batches collide:
+        if (i % 4 == 0) {
+            strcpy(id, "shared");
+        } else {
+            sprintf(id, "t%d-%d", w->thread, i);
+        }
+        sprintf(body, "{\"t\":%d,\"i\":%d}", w->thread, i);
+        setdoc(&doc, &info, id, strlen(id), body, strlen(body), zerometa, sizeof(zerometa));
+        info.rev_seq = 1;
+        w->errcode = couchstore_save_documents_and_commit(w->db, &docp, &infop, 1, 0);
+        w->seqs[i] = info.db_seq;
+    }
+    return NULL;
+}
+
+static void test_group_commit(void)
+{
+    fprintf(stderr, "group commit... ");
+    fflush(stderr);
+    int errcode = 0;
+    int t, i;
+    Db *db = NULL;
+    DbInfo dbinfo;
+    DocInfo *info = NULL;
+    pthread_t threads[GROUP_COMMIT_THREADS];
+    static group_commit_writer writers[GROUP_COMMIT_THREADS];
+    static char seen[GROUP_COMMIT_THREADS * GROUP_COMMIT_BATCHES + 1];
+
+    unlink(testfilepath);
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_CREATE, &db));
+    for (t = 0; t < GROUP_COMMIT_THREADS; ++t) {
+        writers[t].db = db;
+        writers[t].thread = t;
+        writers[t].errcode = COUCHSTORE_SUCCESS;
+        assert(pthread_create(&threads[t], NULL, group_commit_thread, &writers[t]) == 0);
+    }
+    for (t = 0; t < GROUP_COMMIT_THREADS; ++t) {
+        pthread_join(threads[t], NULL);
+        try(writers[t].errcode);
+    }
+    // Every batch got its own sequence number:
+    memset(seen, 0, sizeof(seen));
+    for (t = 0; t < GROUP_COMMIT_THREADS; ++t) {
+        for (i = 0; i < GROUP_COMMIT_BATCHES; ++i) {
+            uint64_t seq = writers[t].seqs[i];
+            assert(seq >= 1 && seq <= GROUP_COMMIT_THREADS * GROUP_COMMIT_BATCHES);
+            assert(!seen[seq]);
+            seen[seq] = 1;
+        }
+    }
+    couchstore_close_db(db);
+    db = NULL;
+
+    // Everything was committed:
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_RDONLY, &db));
+    try(couchstore_db_info(db, &dbinfo));
+    assert(dbinfo.last_sequence == GROUP_COMMIT_THREADS * GROUP_COMMIT_BATCHES);
+    assert(dbinfo.doc_count == GROUP_COMMIT_THREADS * GROUP_COMMIT_BATCHES * 3 / 4 + 1);
+    for (t = 0; t < GROUP_COMMIT_THREADS; ++t) {
+        for (i = 1; i < GROUP_COMMIT_BATCHES; i += 4) {
+            char id[16];
+            sprintf(id, "t%d-%d", t, i);
+            try(couchstore_docinfo_by_id(db, id, strlen(id), &info));
+            assert(info->db_seq == writers[t].seqs[i]);
+            couchstore_free_docinfo(info);
+            info = NULL;
+        }
+    }
+    // The shared doc ended up with whichever update was saved last:
+    try(couchstore_docinfo_by_id(db, "shared", 6, &info));
+    for (t = 0; t < GROUP_COMMIT_THREADS; ++t) {
+        assert(writers[t].seqs[GROUP_COMMIT_BATCHES - 4] <= info->db_seq);
+    }
+
+cleanup:
+    couchstore_free_docinfo(info);
+    if (db) {
+        couchstore_close_db(db);
+    }
+    assert(errcode == 0);
+}
+
+
+/* File ops that simulate a power failure: once 'crash' is set, syncs silently do nothing, so
+   everything written after the last real sync is at risk. 'synced_eof' is the file size as of
+   the last real sync. They also count reads, and note the largest one. While 'fail_writes' is
+   set, writes fail. */
+static struct {
+    int syncs;
+    int crash;
+    cs_off_t synced_eof;
+    int reads;
+    size_t largest_read;
+    int fail_writes;
+} fault_state;
+
+static couch_file_handle fault_constructor(void *cookie)
+{
+    return couchstore_get_default_file_ops()->constructor(cookie);
+}
+
+static couchstore_error_t fault_open(couch_file_handle *handle, const char *path, int oflag)
+{
+    return couchstore_get_default_file_ops()->open(handle, path, oflag);
+}
+
+static void fault_close(couch_file_handle handle)
+{
+    couchstore_get_default_file_ops()->close(handle);
+}
+
+static ssize_t fault_pread(couch_file_handle handle, void *buf, size_t nbyte, cs_off_t offset)
+{
+    fault_state.reads++;
+    if (nbyte > fault_state.largest_read) {
+        fault_state.largest_read = nbyte;
+    }
+    return couchstore_get_default_file_ops()->pread(handle, buf, nbyte, offset);
+}
+
+static ssize_t fault_pwrite(couch_file_handle handle, const void *buf, size_t nbyte,
+                            cs_off_t offset)
+{
+    if (fault_state.fail_writes) {
+        return COUCHSTORE_ERROR_WRITE;
+    }
+    return couchstore_get_default_file_ops()->pwrite(handle, buf, nbyte, offset);
+}
+
+static cs_off_t fault_goto_eof(couch_file_handle handle)
+{
+    return couchstore_get_default_file_ops()->goto_eof(handle);
+}
+
+static couchstore_error_t fault_sync(couch_file_handle handle)
+{
+    fault_state.syncs++;
+    if (fault_state.crash) {
+        return COUCHSTORE_SUCCESS;
+    }
+    fault_state.synced_eof = fault_goto_eof(handle);
+    return couchstore_get_default_file_ops()->sync(handle);
+}
+
+static couchstore_error_t fault_advise(couch_file_handle handle, cs_off_t offset, cs_off_t len,
+                                       couchstore_file_advice_t advice)
+{
+    return couchstore_get_default_file_ops()->advise(handle, offset, len, advice);
+}
+
+static void fault_destructor(couch_file_handle handle)
+{
+    couchstore_get_default_file_ops()->destructor(handle);
+}
+
+static const couch_file_ops fault_file_ops = {
+    (uint64_t)4,
+    fault_constructor,
+    fault_open,
+    fault_close,
+    fault_pread,
+    fault_pwrite,
+    fault_goto_eof,
+    fault_sync,
+    fault_advise,
+    fault_destructor,
+    NULL,   // cookie
+    NULL,   // pread_ptr
+    NULL,   // pread_batch
+    NULL    // pwritev
+};
+
+// Zeroes a range of the test file, as though those writes never reached the disk.
+static void lose_writes(cs_off_t start, cs_off_t end)
+{
+    static const char zeros[COUCH_BLOCK_SIZE];
+    int fd = open(testfilepath, O_WRONLY);
+    assert(fd >= 0);
+    while (start < end) {
+        size_t len = (end - start) < COUCH_BLOCK_SIZE ? (size_t)(end - start) : COUCH_BLOCK_SIZE;
+        assert(pwrite(fd, zeros, len, start) == (ssize_t)len);
+        start += len;
+    }
+    close(fd);
+}
+
+static void test_single_sync_commit(void)
+{
+    fprintf(stderr, "single-sync commit crashes... ");
+    fflush(stderr);
+    int errcode = 0;
+    int i, mode;
+    char ids[100][12];
+    Db *db = NULL;
+    DbInfo dbinfo;
+    DocInfo *info = NULL;
+    Doc *docptrs[100];
+    DocInfo *infoptrs[100];
+
+    docset_init(100);
+    for (i = 0; i < 100; ++i) {
+        sprintf(ids[i], "doc%05d", i);
+        setdoc(&testdocset.docs[i], &testdocset.infos[i], ids[i], strlen(ids[i]),
+               "{\"crash\":\"test\"}", 17, zerometa, sizeof(zerometa));
+        docptrs[i] = &testdocset.docs[i];
+        infoptrs[i] = &testdocset.infos[i];
+    }
+
+    // Modes: 0 = lose all unsynced writes, 1 = only the header survives,
+    // 2 = only the block before the header is lost, 3 = everything survives.
+    for (mode = 0; mode < 4; ++mode) {
+        unlink(testfilepath);
+        memset(&fault_state, 0, sizeof(fault_state));
+        try(couchstore_open_db_ex(testfilepath,
+                                  COUCHSTORE_OPEN_FLAG_CREATE | COUCHSTORE_OPEN_FLAG_SINGLE_SYNC,
+                                  &fault_file_ops, &db));
+        try(couchstore_save_documents(db, docptrs, infoptrs, 50, 0));
+        fault_state.syncs = 0;
+        try(couchstore_commit(db));
+        assert(fault_state.syncs == 1);
+
+        fault_state.crash = 1;
+        try(couchstore_save_documents(db, docptrs + 50, infoptrs + 50, 50, 0));
+        try(couchstore_commit(db));
+        cs_off_t header_pos = (cs_off_t)couchstore_get_header_position(db);
+        couchstore_close_db(db);
+        db = NULL;
+        assert(header_pos > fault_state.synced_eof);
+
+        if (mode == 0) {
+            assert(truncate(testfilepath, fault_state.synced_eof) == 0);
+        } else if (mode == 1) {
+            lose_writes(fault_state.synced_eof, header_pos);
+        } else if (mode == 2) {
+            cs_off_t start = header_pos - COUCH_BLOCK_SIZE;
+            lose_writes(start > fault_state.synced_eof ? start : fault_state.synced_eof,
+                        header_pos);
+        }
+
+        // Recovery must land on a header whose data is all there:
+        int expected = (mode == 3) ? 100 : 50;
+        try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_RDONLY, &db));
+        try(couchstore_db_info(db, &dbinfo));
+        assert(dbinfo.last_sequence == (uint64_t)expected);
+        assert(dbinfo.doc_count == (uint64_t)expected);
+        for (i = 0; i < 100; ++i) {
+            couchstore_error_t err = couchstore_docinfo_by_id(db, ids[i], strlen(ids[i]), &info);
+            if (i < expected) {
+                try(err);
+                couchstore_free_docinfo(info);
+                info = NULL;
+            } else {
+                assert(err == COUCHSTORE_ERROR_DOC_NOT_FOUND);
+            }
+        }
+        couchstore_close_db(db);
+        db = NULL;
+    }
+
+cleanup:
+    if (db) {
+        couchstore_close_db(db);
+    }
+    assert(errcode == 0);
+}
+
+
+// A single-sync commit must be rejected if any node it wrote is lost, not just a root.
+static void test_single_sync_lost_node(void)
+{
+    fprintf(stderr, "single-sync commit losing a leaf node... ");
+    fflush(stderr);
+    const int numdocs = 3000, deleted = 10;
+    int errcode = 0;
+    int i;
+    char ids[3000][12];
+    Doc *docptrs[3000];
+    DocInfo *infoptrs[3000];
+    Db *db = NULL;
+    DbInfo dbinfo;
+    Doc *doc = NULL;
+
+    docset_init(numdocs);
+    for (i = 0; i < numdocs; ++i) {
+        sprintf(ids[i], "doc%05d", i);
+        setdoc(&testdocset.docs[i], &testdocset.infos[i], ids[i], strlen(ids[i]),
+               "{\"crash\":\"test\"}", 17, zerometa, sizeof(zerometa));
+        docptrs[i] = &testdocset.docs[i];
+        infoptrs[i] = &testdocset.infos[i];
+    }
+
+    unlink(testfilepath);
+    memset(&fault_state, 0, sizeof(fault_state));
+    try(couchstore_open_db_ex(testfilepath,
+                              COUCHSTORE_OPEN_FLAG_CREATE | COUCHSTORE_OPEN_FLAG_SINGLE_SYNC,
+                              &fault_file_ops, &db));
+    assert(db->header.disk_version == COUCH_DISK_VERSION);
+    try(couchstore_save_documents(db, docptrs, infoptrs, numdocs, 0));
+    try(couchstore_commit(db));
+
+    // Deleting the first few docs writes no bodies, so the first chunk after the last synced
+    // header is the by-ID leaf holding them; the roots above it come later.
+    fault_state.crash = 1;
+    for (i = 0; i < deleted; ++i) {
+        docptrs[i] = NULL;
+        testdocset.infos[i].deleted = 1;
+    }
+    try(couchstore_save_documents(db, docptrs, infoptrs, deleted, 0));
+    try(couchstore_commit(db));
+    cs_off_t leaf_end = fault_state.synced_eof + 9;   // Its chunk header, and any block prefix
+    assert(db->header.by_id_root->pointer >= (uint64_t)leaf_end &&
+           db->header.by_seq_root->pointer >= (uint64_t)leaf_end);
+    assert(db->header.by_id_root->subtreesize > COUCH_BLOCK_SIZE);    // i.e. it has children
+    couchstore_close_db(db);
+    db = NULL;
+
+    // The roots all survive, but the leaf doesn't:
+    lose_writes(fault_state.synced_eof, leaf_end);
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_RDONLY, &db));
+    try(couchstore_db_info(db, &dbinfo));
+    assert(dbinfo.last_sequence == (uint64_t)numdocs);
+    assert(dbinfo.doc_count == (uint64_t)numdocs);
+    try(couchstore_open_document(db, "doc00000", 8, &doc, 0));
+
+cleanup:
+    couchstore_free_document(doc);
+    if (db) {
+        couchstore_close_db(db);
+    }
+    assert(errcode == 0);
+}
+
+
+// Commits only sync once when the header can record what they wrote, and opening can check it.
+static void test_single_sync_fallback(void)
+{
+    fprintf(stderr, "single-sync commit fallbacks... ");
+    fflush(stderr);
+    const int numdocs = 17;
+    const size_t bodysize = 1024 * 1024;
+    int errcode = 0;
+    int i;
+    char ids[17][12];
+    char *body = malloc(bodysize);
+    Doc *docptrs[17];
+    DocInfo *infoptrs[17];
+    Db *db = NULL;
+
+    docset_init(numdocs);
+    memset(body, 'b', bodysize);
+    for (i = 0; i < numdocs; ++i) {
+        sprintf(ids[i], "doc%05d", i);
+        setdoc(&testdocset.docs[i], &testdocset.infos[i], ids[i], strlen(ids[i]),
+               body, bodysize, zerometa, sizeof(zerometa));
+        docptrs[i] = &testdocset.docs[i];
+        infoptrs[i] = &testdocset.infos[i];
+    }
+
+    // A file in the older format syncs twice:
+    unlink(testfilepath);
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_CREATE, &db));
+    assert(db->header.disk_version == COUCH_SNAPPY_DISK_VERSION);
+    couchstore_close_db(db);
+    db = NULL;
+    memset(&fault_state, 0, sizeof(fault_state));
+    try(couchstore_open_db_ex(testfilepath, COUCHSTORE_OPEN_FLAG_SINGLE_SYNC,
+                              &fault_file_ops, &db));
+    try(couchstore_save_documents(db, docptrs, infoptrs, 1, 0));
+    try(couchstore_commit(db));
+    assert(fault_state.syncs == 2);
+    assert(db->header.commit_end == 0);
+    couchstore_close_db(db);
+    db = NULL;
+
+    // In the newer format a small commit syncs once, but a huge one twice:
+    unlink(testfilepath);
+    try(couchstore_open_db_ex(testfilepath,
+                              COUCHSTORE_OPEN_FLAG_CREATE | COUCHSTORE_OPEN_FLAG_SINGLE_SYNC,
+                              &fault_file_ops, &db));
+    memset(&fault_state, 0, sizeof(fault_state));
+    try(couchstore_save_documents(db, docptrs, infoptrs, 1, 0));
+    try(couchstore_commit(db));
+    assert(fault_state.syncs == 1);
+    assert(db->header.commit_end > db->header.commit_start);
+    fault_state.syncs = 0;
+    try(couchstore_save_documents(db, docptrs + 1, infoptrs + 1, numdocs - 1, 0));
+    try(couchstore_commit(db));
+    assert(fault_state.syncs == 2);
+    assert(db->header.commit_end == 0);
+    couchstore_close_db(db);
+    db = NULL;
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_RDONLY, &db));
+    assert(db->header.update_seq == (uint64_t)numdocs);
+
+cleanup:
+    if (db) {
+        couchstore_close_db(db);
+    }
+    free(body);
+    assert(errcode == 0);
+}
+
+static void test_parallel_compaction(void)
+{
+    fprintf(stderr, "parallel compaction... ");
+    fflush(stderr);
+    const int numdocs = 3000;
+    int errcode = 0;
+    int i, pass;
+    char ids[3000][12];
+    char *bodies[3000];
+    char target[1100];
+    Db *db = NULL, *compacted = NULL;
+    DbInfo before, after;
+    Doc *docptrs[3000];
+    DocInfo *infoptrs[3000];
+    DocInfo *info = NULL, *compacted_info = NULL;
+    Doc *doc = NULL;
+    LocalDoc local, *local_read = NULL;
+
+    sprintf(target, "%s.compact", testfilepath);
+    docset_init(numdocs);
+    for (i = 0; i < numdocs; ++i) {
+        size_t len = 10 + (i * 37) % 3000;
+        sprintf(ids[i], "doc%05d", i);
+        bodies[i] = malloc(len);
+        memset(bodies[i], 'a' + i % 26, len);
+        setdoc(&testdocset.docs[i], &testdocset.infos[i], ids[i], strlen(ids[i]),
+               bodies[i], len, zerometa, sizeof(zerometa));
+        if (i % 3 == 0) {
+            testdocset.infos[i].content_meta = COUCH_DOC_IS_COMPRESSED;
+        }
+        docptrs[i] = &testdocset.docs[i];
+        infoptrs[i] = &testdocset.infos[i];
+    }
+    unlink(testfilepath);
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_CREATE, &db));
+    for (i = 0; i < numdocs; i += 500) {
+        try(couchstore_save_documents(db, docptrs + i, infoptrs + i, 500, COMPRESS_DOC_BODIES));
+        try(couchstore_commit(db));
+    }
+    // Update some docs and delete others, leaving garbage behind:
+    for (i = 0; i < numdocs; ++i) {
+        if (i % 5 == 0) {
+            memset(bodies[i], 'A' + i % 26, testdocset.docs[i].data.size);
+            testdocset.infos[i].rev_seq++;
+            try(couchstore_save_document(db, docptrs[i], infoptrs[i], COMPRESS_DOC_BODIES));
+        } else if (i % 7 == 0) {
+            testdocset.infos[i].deleted = 1;
+            testdocset.infos[i].rev_seq++;
+            try(couchstore_save_document(db, NULL, infoptrs[i], 0));
+        }
+    }
+    local.id.buf = "_local/compact";
+    local.id.size = 14;
+    local.json.buf = "{\"local\":true}";
+    local.json.size = 14;
+    local.deleted = 0;
+    try(couchstore_save_local_document(db, &local));
+    try(couchstore_commit(db));
+    try(couchstore_db_info(db, &before));
+
+    // Pass 0 is the serial compactor, for comparison:
+    for (pass = 0; pass < 3; ++pass) {
+        couchstore_compact_flags flags = 0;
+        if (pass >= 1) {
+            flags |= COUCHSTORE_COMPACT_FLAG_PARALLEL;
+        }
+        if (pass == 2) {
+            flags |= COUCHSTORE_COMPACT_FLAG_DROP_DELETES;
+        }
+        unlink(target);
+        try(couchstore_compact_db_ex(db, target, flags, couchstore_get_default_file_ops()));
+        try(couchstore_open_db(target, COUCHSTORE_OPEN_FLAG_RDONLY, &compacted));
+        try(couchstore_db_info(compacted, &after));
+        assert(after.last_sequence == before.last_sequence);
+        assert(after.doc_count == before.doc_count);
+        assert(after.deleted_count == (pass == 2 ? 0 : before.deleted_count));
+        assert(after.header_position < before.header_position);
+
+        for (i = 0; i < numdocs; ++i) {
+            try(couchstore_docinfo_by_id(db, ids[i], strlen(ids[i]), &info));
+            couchstore_error_t err = couchstore_docinfo_by_id(compacted, ids[i], strlen(ids[i]),
+                                                               &compacted_info);
+            if (info->deleted && pass == 2) {
+                assert(err == COUCHSTORE_ERROR_DOC_NOT_FOUND);
+            } else {
+                try(err);
+                assert(compacted_info->db_seq == info->db_seq);
+                assert(compacted_info->rev_seq == info->rev_seq);
+                assert(compacted_info->deleted == info->deleted);
+                assert(compacted_info->content_meta == info->content_meta);
+                if (!info->deleted) {
+                    try(couchstore_open_doc_with_docinfo(compacted, compacted_info, &doc,
+                                                         DECOMPRESS_DOC_BODIES));
+                    assert(doc->data.size == testdocset.docs[i].data.size);
+                    assert(memcmp(doc->data.buf, bodies[i], doc->data.size) == 0);
+                    couchstore_free_document(doc);
+                    doc = NULL;
+                }
+                couchstore_free_docinfo(compacted_info);
+            }
+            compacted_info = NULL;
+            couchstore_free_docinfo(info);
+            info = NULL;
+        }
+        try(couchstore_open_local_document(compacted, "_local/compact", 14, &local_read));
+        assert(local_read->json.size == 14);
+        couchstore_free_local_document(local_read);
+        local_read = NULL;
+        couchstore_close_db(compacted);
+        compacted = NULL;
+    }
+
+cleanup:
+    couchstore_free_docinfo(info);
+    couchstore_free_docinfo(compacted_info);
+    couchstore_free_document(doc);
+    if (compacted) {
+        couchstore_close_db(compacted);
+    }
+    if (db) {
+        couchstore_close_db(db);
+    }
+    unlink(target);
+    for (i = 0; i < numdocs; ++i) {
+        free(bodies[i]);
+    }
+    assert(errcode == 0);
+}
+
+
+static void test_compaction_checksums(void)
+{
+    fprintf(stderr, "compaction checksums... ");
+    fflush(stderr);
+    int errcode = 0;
+    int pass, fd = -1;
+    char body[100], target[1100];
+    Db *db = NULL, *compacted = NULL;
+    DocInfo *info = NULL;
+    Doc *doc = NULL;
+
+    sprintf(target, "%s.compact", testfilepath);
+    memset(body, 'x', sizeof(body));
+    docset_init(2);
+    setdoc(&testdocset.docs[0], &testdocset.infos[0], "doc", 3,
+           body, sizeof(body), zerometa, sizeof(zerometa));
+    setdoc(&testdocset.docs[1], &testdocset.infos[1], "zdoc", 4,
+           body, sizeof(body), zerometa, sizeof(zerometa));
+    testdocset.infos[1].content_meta = COUCH_DOC_IS_COMPRESSED;
+    Doc *docptrs[2] = {&testdocset.docs[0], &testdocset.docs[1]};
+    DocInfo *infoptrs[2] = {&testdocset.infos[0], &testdocset.infos[1]};
+    unlink(testfilepath);
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_CREATE, &db));
+    try(couchstore_save_documents(db, docptrs, infoptrs, 2, COMPRESS_DOC_BODIES));
+    try(couchstore_commit(db));
+
+    // Clean bodies compact fine with or without verification:
+    for (pass = 0; pass < 2; ++pass) {
+        couchstore_compact_flags flags = COUCHSTORE_COMPACT_FLAG_VERIFY_CHECKSUMS;
+        if (pass == 1) {
+            flags |= COUCHSTORE_COMPACT_FLAG_PARALLEL;
+        }
+        unlink(target);
+        try(couchstore_compact_db_ex(db, target, flags, couchstore_get_default_file_ops()));
+    }
+
+    // Corrupt a byte of each stored body (the chunk header is 8 bytes), and reopen the db so
+    // it doesn't have the original bytes buffered:
+    try(couchstore_docinfo_by_id(db, "doc", 3, &info));
+    cs_off_t pos = (cs_off_t)info->bp + 8 + 10;
+    couchstore_free_docinfo(info);
+    info = NULL;
+    try(couchstore_docinfo_by_id(db, "zdoc", 4, &info));
+    cs_off_t zpos = (cs_off_t)info->bp + 8 + 3;
+    couchstore_close_db(db);
+    db = NULL;
+    char c = 0;
+    fd = open(testfilepath, O_RDWR);
+    assert(fd >= 0);
+    assert(pread(fd, &c, 1, pos) == 1 && c == 'x');
+    c = 'y';
+    assert(pwrite(fd, &c, 1, pos) == 1);
+    assert(pread(fd, &c, 1, zpos) == 1);
+    c ^= 0x40;
+    assert(pwrite(fd, &c, 1, zpos) == 1);
+    close(fd);
+    fd = -1;
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_RDONLY, &db));
+
+    // With verification, compaction detects the damage:
+    for (pass = 0; pass < 2; ++pass) {
+        couchstore_compact_flags flags = COUCHSTORE_COMPACT_FLAG_VERIFY_CHECKSUMS;
+        if (pass == 1) {
+            flags |= COUCHSTORE_COMPACT_FLAG_PARALLEL;
+        }
+        unlink(target);
+        assert(couchstore_compact_db_ex(db, target, flags, couchstore_get_default_file_ops())
+               == COUCHSTORE_ERROR_CHECKSUM_FAIL);
+    }
+
+    // Without it, the body is copied with its original CRC, so the damage is still detectable:
+    for (pass = 0; pass < 2; ++pass) {
+        unlink(target);
+        try(couchstore_compact_db_ex(db, target, pass ? COUCHSTORE_COMPACT_FLAG_PARALLEL : 0,
+                                     couchstore_get_default_file_ops()));
+        try(couchstore_open_db(target, COUCHSTORE_OPEN_FLAG_RDONLY, &compacted));
+        assert(couchstore_open_document(compacted, "doc", 3, &doc, 0)
+               == COUCHSTORE_ERROR_CHECKSUM_FAIL);
+        couchstore_close_db(compacted);
+        compacted = NULL;
+    }
+
+    // A body that has to be re-encoded gets a new CRC, so its old one is always checked first:
+    for (pass = 0; pass < 2; ++pass) {
+        couchstore_compact_flags flags = COUCHSTORE_COMPACT_FLAG_BODY_CODEC(COUCHSTORE_CODEC_LZ4);
+        if (pass == 1) {
+            flags |= COUCHSTORE_COMPACT_FLAG_PARALLEL;
+        }
+        unlink(target);
+        errcode = couchstore_compact_db_ex(db, target, flags, couchstore_get_default_file_ops());
+        if (errcode == COUCHSTORE_ERROR_UNSUPPORTED_CODEC) {
+            errcode = 0;
+            break;          // Not built with LZ4
+        }
+        assert(errcode == COUCHSTORE_ERROR_CHECKSUM_FAIL);
+        errcode = 0;
+    }
+
+cleanup:
+    couchstore_free_docinfo(info);
+    couchstore_free_document(doc);
+    if (fd >= 0) {
+        close(fd);
+    }
+    if (compacted) {
+        couchstore_close_db(compacted);
+    }
+    if (db) {
+        couchstore_close_db(db);
+    }
+    unlink(target);
+    assert(errcode == 0);
+}
+
+
+#define CATCHUP_DOCS 1000
+#define CATCHUP_WRITER_COMMITS 60
+
+typedef struct {
+    Db *db;
+    couchstore_error_t errcode;
+} catchup_writer;
+
+// Keeps updating, adding and deleting docs (and a local doc) while the db is compacted.
+static void *catchup_writer_thread(void *arg)
+{
+    catchup_writer *w = arg;
+    int errcode = 0;
+    int r;
+    char id[16], body[32], json[32];
+    Doc doc;
+    DocInfo info;
+    LocalDoc local;
+    for (r = 0; r < CATCHUP_WRITER_COMMITS; ++r) {
+        int n = (r * 37) % CATCHUP_DOCS;
+        sprintf(id, "doc%05d", n);
+        sprintf(body, "updated in round %d", r);
+        setdoc(&doc, &info, id, strlen(id), body, strlen(body), zerometa, sizeof(zerometa));
+        info.rev_seq = r + 2;
+        try(couchstore_save_document(w->db, &doc, &info, 0));
+        sprintf(id, "new%05d", r);
+        setdoc(&doc, &info, id, strlen(id), body, strlen(body), zerometa, sizeof(zerometa));
+        try(couchstore_save_document(w->db, &doc, &info, 0));
+        if (r % 3 == 0) {
+            sprintf(id, "doc%05d", (r * 53 + 1) % CATCHUP_DOCS);
+            setdoc(&doc, &info, id, strlen(id), NULL, 0, zerometa, sizeof(zerometa));
+            info.deleted = 1;
+            try(couchstore_save_document(w->db, NULL, &info, 0));
+        }
+        sprintf(json, "{\"round\":%d}", r);
+        local.id.buf = "_local/catchup";
+        local.id.size = 14;
+        local.json.buf = json;
+        local.json.size = strlen(json);
+        local.deleted = 0;
+        try(couchstore_save_local_document(w->db, &local));
+        try(couchstore_commit(w->db));
+    }
+cleanup:
+    w->errcode = errcode;
+    return NULL;
+}
+
+static void test_catchup_compaction(void)
+{
+    fprintf(stderr, "catch-up compaction... ");
+    fflush(stderr);
+    int errcode = 0;
+    int i, pass;
+    char ids[CATCHUP_DOCS][12];
+    Doc *docptrs[CATCHUP_DOCS];
+    DocInfo *infoptrs[CATCHUP_DOCS];
+    char id[16], target_path[1100];
+    Db *db = NULL, *source = NULL, *target = NULL;
+    DbInfo before, after;
+    Doc *doc = NULL, *compacted_doc = NULL;
+    DocInfo *info = NULL, *compacted_info = NULL;
+    LocalDoc *local = NULL;
+    uint64_t changes;
+    pthread_t writer_thread;
+    catchup_writer writer;
+
+    sprintf(target_path, "%s.compact", testfilepath);
+    for (pass = 0; pass < 2; ++pass) {
+        couchstore_compact_flags flags = pass ? COUCHSTORE_COMPACT_FLAG_PARALLEL : 0;
+        docset_init(CATCHUP_DOCS);
+        for (i = 0; i < CATCHUP_DOCS; ++i) {
+            sprintf(ids[i], "doc%05d", i);
+            setdoc(&testdocset.docs[i], &testdocset.infos[i], ids[i], strlen(ids[i]),
+                   ids[i], strlen(ids[i]), zerometa, sizeof(zerometa));
+            testdocset.infos[i].rev_seq = 1;
+        }
+        unlink(testfilepath);
+        unlink(target_path);
+        try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_CREATE, &db));
+        for (i = 0; i < CATCHUP_DOCS; ++i) {
+            docptrs[i] = &testdocset.docs[i];
+            infoptrs[i] = &testdocset.infos[i];
+        }
+        try(couchstore_save_documents(db, docptrs, infoptrs, CATCHUP_DOCS, 0));
+        try(couchstore_commit(db));
+
+        // Compact a read-only handle while the writer keeps going:
+        try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_RDONLY, &source));
+        writer.db = db;
+        writer.errcode = COUCHSTORE_SUCCESS;
+        assert(pthread_create(&writer_thread, NULL, catchup_writer_thread, &writer) == 0);
+        errcode = couchstore_compact_db_catchup(source, target_path, flags,
+                                                couchstore_get_default_file_ops(), 5, &target);
+        pthread_join(writer_thread, NULL);
+        try(errcode);
+        try(writer.errcode);
+
+        // The final round, with the writer stopped, picks up everything:
+        try(couchstore_compact_catchup(source, target, flags, &changes));
+        try(couchstore_compact_catchup(source, target, flags, &changes));
+        assert(changes == 0);
+        couchstore_close_db(target);
+        target = NULL;
+        couchstore_close_db(source);
+        source = NULL;
+
+        try(couchstore_open_db(target_path, COUCHSTORE_OPEN_FLAG_RDONLY, &target));
+        try(couchstore_db_info(db, &before));
+        try(couchstore_db_info(target, &after));
+        assert(after.last_sequence == before.last_sequence);
+        assert(after.doc_count == before.doc_count);
+        assert(after.deleted_count == before.deleted_count);
+        for (i = 0; i < CATCHUP_DOCS + CATCHUP_WRITER_COMMITS; ++i) {
+            if (i < CATCHUP_DOCS) {
+                strcpy(id, ids[i]);
+            } else {
+                sprintf(id, "new%05d", i - CATCHUP_DOCS);
+            }
+            try(couchstore_docinfo_by_id(db, id, strlen(id), &info));
+            try(couchstore_docinfo_by_id(target, id, strlen(id), &compacted_info));
+            assert(compacted_info->db_seq == info->db_seq);
+            assert(compacted_info->rev_seq == info->rev_seq);
+            assert(compacted_info->deleted == info->deleted);
+            if (!info->deleted) {
+                try(couchstore_open_doc_with_docinfo(db, info, &doc, 0));
+                try(couchstore_open_doc_with_docinfo(target, compacted_info, &compacted_doc, 0));
+                assert(compacted_doc->data.size == doc->data.size);
+                assert(memcmp(compacted_doc->data.buf, doc->data.buf, doc->data.size) == 0);
+                couchstore_free_document(doc);
+                couchstore_free_document(compacted_doc);
+                doc = compacted_doc = NULL;
+            }
+            couchstore_free_docinfo(info);
+            couchstore_free_docinfo(compacted_info);
+            info = compacted_info = NULL;
+        }
+        try(couchstore_open_local_document(target, "_local/catchup", 14, &local));
+        assert(local->json.size == 12 && memcmp(local->json.buf, "{\"round\":59}", 12) == 0);
+        couchstore_free_local_document(local);
+        local = NULL;
+        couchstore_close_db(target);
+        target = NULL;
+        couchstore_close_db(db);
+        db = NULL;
+    }
+
+cleanup:
+    couchstore_free_document(doc);
+    couchstore_free_document(compacted_doc);
+    couchstore_free_docinfo(info);
+    couchstore_free_docinfo(compacted_info);
+    if (local) {
+        couchstore_free_local_document(local);
+    }
+    if (target) {
+        couchstore_close_db(target);
+    }
+    if (source) {
+        couchstore_close_db(source);
+    }
+    if (db) {
+        couchstore_close_db(db);
+    }
+    unlink(target_path);
+    assert(errcode == 0);
+}
+
+// A catch-up round whose writes to the target fail reports the error (and frees each DocInfo
+// once.)
+static void test_catchup_write_failure(void)
+{
+    fprintf(stderr, "catch-up compaction write failure... ");
+    fflush(stderr);
+    int errcode = 0;
+    int i;
+    char id[16], target_path[1100];
+    static char body[8192];
+    Db *db = NULL, *source = NULL, *target = NULL;
+    Doc doc;
+    DocInfo info;
+    uint64_t changes;
+
+    sprintf(target_path, "%s.compact", testfilepath);
+    memset(body, 'b', sizeof(body));
+    memset(&fault_state, 0, sizeof(fault_state));
+    unlink(testfilepath);
+    unlink(target_path);
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_CREATE, &db));
+    for (i = 0; i < 10; ++i) {
+        sprintf(id, "doc%05d", i);
+        setdoc(&doc, &info, id, strlen(id), body, 100, zerometa, sizeof(zerometa));
+        try(couchstore_save_document(db, &doc, &info, 0));
+    }
+    try(couchstore_commit(db));
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_RDONLY, &source));
+    try(couchstore_compact_db_catchup(source, target_path, 0, &fault_file_ops, 0, &target));
+
+    // More changes than fit in the target's write buffer, or in one catch-up batch:
+    for (i = 0; i < 300; ++i) {
+        sprintf(id, "new%05d", i);
+        setdoc(&doc, &info, id, strlen(id), body, sizeof(body), zerometa, sizeof(zerometa));
+        try(couchstore_save_document(db, &doc, &info, 0));
+    }
+    try(couchstore_commit(db));
+
+    fault_state.fail_writes = 1;
+    assert(couchstore_compact_catchup(source, target, 0, &changes) == COUCHSTORE_ERROR_WRITE);
+    fault_state.fail_writes = 0;
+
+cleanup:
+    fault_state.fail_writes = 0;
+    if (target) {
+        couchstore_close_db(target);
+    }
+    if (source) {
+        couchstore_close_db(source);
+    }
+    if (db) {
+        couchstore_close_db(db);
+    }
+    unlink(target_path);
+    assert(errcode == 0);
+}
+
+
+static void test_crc32_kernels(void)
+{
+    fprintf(stderr, "crc32 kernels... ");
+    fflush(stderr);
+    size_t num_kernels, k, len, offset;
+    const crc32_kernel *kernels = crc32_get_kernels(&num_kernels);
+    char *buf = malloc(70000);
+    assert(buf);
+    for (len = 0; len < 70000; ++len) {
+        buf[len] = (char)(len * 7919 + (len >> 8));
+    }
+    assert(num_kernels >= 2);
+    assert(hash_crc32("123456789", 9) == 0xCBF43926);
+    for (k = 0; k < num_kernels; ++k) {
+        assert(crc32_with_kernel(&kernels[k], "123456789", 9) == 0xCBF43926);
+        // Every length up to a few blocks, at every alignment, plus some large sizes:
+        for (offset = 0; offset < 16; ++offset) {
+            for (len = 0; len < 300; ++len) {
+                assert(crc32_with_kernel(&kernels[k], buf + offset, len) ==
+                       crc32_with_kernel(&kernels[0], buf + offset, len));
+            }
+        }
+        for (len = 4000; len < 70000; len = len * 2 + 13) {
+            assert(crc32_with_kernel(&kernels[k], buf + 1, len) ==
+                   crc32_with_kernel(&kernels[0], buf + 1, len));
+        }
+    }
+    free(buf);
+}
+
+
+static int count_changes_cb(Db *db, DocInfo *info, void *ctx)
+{
+    (void)db;
+    (void)info;
+    ++*(int*)ctx;
+    return 0;
+}
+
+static void test_bulk_load(void)
+{
+    fprintf(stderr, "bulk load... ");
+    fflush(stderr);
+    const int numdocs = 5000;
+    int errcode = 0;
+    int i, changes = 0;
+    char ids[5000][12], bodies[5000][24];
+    BulkLoader *loader = NULL;
+    Db *db = NULL;
+    DbInfo info;
+    DocInfo *docinfo = NULL;
+    Doc *doc = NULL;
+
+    docset_init(numdocs);
+    unlink(testfilepath);
+    try(couchstore_bulk_load_open(testfilepath, NULL, &loader));
+    for (i = 0; i < numdocs; ++i) {
+        // Add the docs in a scrambled ID order:
+        int n = (i * 2999) % numdocs;
+        sprintf(ids[n], "doc%05d", n);
+        sprintf(bodies[n], "body of doc %d", n);
+        setdoc(&testdocset.docs[n], &testdocset.infos[n], ids[n], strlen(ids[n]),
+               bodies[n], strlen(bodies[n]), zerometa, sizeof(zerometa));
+        testdocset.infos[n].rev_seq = n + 1;
+        if (n % 2 == 0) {
+            testdocset.infos[n].content_meta = COUCH_DOC_IS_COMPRESSED;
+        }
+        if (n % 10 == 0) {
+            try(couchstore_bulk_load_add(loader, NULL, &testdocset.infos[n], 0));
+        } else {
+            try(couchstore_bulk_load_add(loader, &testdocset.docs[n], &testdocset.infos[n],
+                                         COMPRESS_DOC_BODIES));
+        }
+        assert(testdocset.infos[n].db_seq == (uint64_t)i + 1);
+    }
+    errcode = couchstore_bulk_load_finish(loader);
+    loader = NULL;
+    try(errcode);
+
+    try(couchstore_open_db(testfilepath, 0, &db));
+    try(couchstore_db_info(db, &info));
+    assert(info.last_sequence == (uint64_t)numdocs);
+    assert(info.doc_count == (uint64_t)numdocs * 9 / 10);
+    assert(info.deleted_count == (uint64_t)numdocs / 10);
+    try(couchstore_changes_since(db, 0, 0, count_changes_cb, &changes));
+    assert(changes == numdocs);
+    for (i = 0; i < numdocs; ++i) {
+        try(couchstore_docinfo_by_id(db, ids[i], strlen(ids[i]), &docinfo));
+        assert(docinfo->db_seq == testdocset.infos[i].db_seq);
+        assert(docinfo->rev_seq == (uint64_t)i + 1);
+        assert(docinfo->deleted == (i % 10 == 0));
+        if (!docinfo->deleted) {
+            try(couchstore_open_doc_with_docinfo(db, docinfo, &doc, DECOMPRESS_DOC_BODIES));
+            assert(doc->data.size == strlen(bodies[i]));
+            assert(memcmp(doc->data.buf, bodies[i], doc->data.size) == 0);
+            couchstore_free_document(doc);
+            doc = NULL;
+        }
+        couchstore_free_docinfo(docinfo);
+        docinfo = NULL;
+    }
+    // The trees can be updated as usual:
+    testdocset.infos[1].rev_seq = 100;
+    try(couchstore_save_document(db, &testdocset.docs[1], &testdocset.infos[1], 0));
+    try(couchstore_commit(db));
+    try(couchstore_docinfo_by_id(db, ids[1], strlen(ids[1]), &docinfo));
+    assert(docinfo->db_seq == (uint64_t)numdocs + 1 && docinfo->rev_seq == 100);
+    couchstore_free_docinfo(docinfo);
+    docinfo = NULL;
+
+    // A bulk load won't overwrite an existing database:
+    assert(couchstore_bulk_load_open(testfilepath, NULL, &loader) ==
+           COUCHSTORE_ERROR_INVALID_ARGUMENTS);
+    loader = NULL;
+    couchstore_close_db(db);
+    db = NULL;
+
+    // Duplicate IDs make the load fail:
+    unlink(testfilepath);
+    try(couchstore_bulk_load_open(testfilepath, NULL, &loader));
+    try(couchstore_bulk_load_add(loader, &testdocset.docs[1], &testdocset.infos[1], 0));
+    try(couchstore_bulk_load_add(loader, &testdocset.docs[2], &testdocset.infos[2], 0));
+    try(couchstore_bulk_load_add(loader, &testdocset.docs[1], &testdocset.infos[1], 0));
+    errcode = couchstore_bulk_load_finish(loader);
+    loader = NULL;
+    assert(errcode == COUCHSTORE_ERROR_INVALID_ARGUMENTS);
+    errcode = 0;
+    assert(access(testfilepath, F_OK) != 0);
+
+cleanup:
+    if (loader) {
+        couchstore_bulk_load_abort(loader);
+    }
+    couchstore_free_docinfo(docinfo);
+    couchstore_free_document(doc);
+    if (db) {
+        couchstore_close_db(db);
+    }
+    assert(errcode == 0);
+}
+
+
+static int collect_header(Db *db, const HeaderInfo *header, void *ctx)
+{
+    HeaderInfo *headers = ctx;
+    int n = 0;
+    while (headers[n].update_seq != 0) {
+        ++n;
+    }
+    headers[n] = *header;
+    return n >= 5;      // stop after the first six
+}
+
+static void test_snapshots(void)
+{
+    fprintf(stderr, "snapshots... ");
+    fflush(stderr);
+    const int numversions = 8;
+    int errcode = 0;
+    int i, changes;
+    char ids[8][12], bodies[8][24];
+    uint64_t positions[8], seqs[8];
+    HeaderInfo headers[8];
+    Db *db = NULL, *snap = NULL;
+    DocInfo *docinfo = NULL;
+    Doc *doc = NULL;
+
+    docset_init(numversions);
+    unlink(testfilepath);
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_CREATE, &db));
+    for (i = 0; i < numversions; ++i) {
+        // Each commit updates "doc" and adds one new doc:
+        sprintf(ids[i], "new%d", i);
+        sprintf(bodies[i], "version %d", i);
+        setdoc(&testdocset.docs[i], &testdocset.infos[i], "doc", 3,
+               bodies[i], strlen(bodies[i]), zerometa, sizeof(zerometa));
+        try(couchstore_save_document(db, &testdocset.docs[i], &testdocset.infos[i], 0));
+        setdoc(&testdocset.docs[i], &testdocset.infos[i], ids[i], strlen(ids[i]),
+               bodies[i], strlen(bodies[i]), zerometa, sizeof(zerometa));
+        try(couchstore_save_document(db, &testdocset.docs[i], &testdocset.infos[i], 0));
+        try(couchstore_commit(db));
+        positions[i] = couchstore_get_header_position(db);
+        seqs[i] = (uint64_t)(i + 1) * 2;
+    }
+
+    // A snapshot sees the database as it was at that header, while the writer goes on:
+    try(couchstore_open_snapshot(testfilepath, 0, positions[2], &snap));
+    try(couchstore_save_document(db, &testdocset.docs[0], &testdocset.infos[0], 0));
+    try(couchstore_commit(db));
+    try(couchstore_open_document(snap, "doc", 3, &doc, 0));
+    assert(doc->data.size == strlen(bodies[2]));
+    assert(memcmp(doc->data.buf, bodies[2], doc->data.size) == 0);
+    couchstore_free_document(doc);
+    doc = NULL;
+    assert(couchstore_docinfo_by_id(snap, ids[3], strlen(ids[3]), &docinfo) ==
+           COUCHSTORE_ERROR_DOC_NOT_FOUND);
+    changes = 0;
+    try(couchstore_changes_since(snap, 0, 0, count_changes_cb, &changes));
+    assert(changes == 4);   // "doc" and new0..new2
+    assert(couchstore_get_header_position(snap) == positions[2]);
+    couchstore_close_db(snap);
+    snap = NULL;
+
+    // By sequence, the latest header at or below it is used:
+    try(couchstore_open_snapshot_by_seq(testfilepath, 0, seqs[4] + 1, &snap));
+    assert(couchstore_get_header_position(snap) == positions[4]);
+    try(couchstore_docinfo_by_id(snap, "doc", 3, &docinfo));
+    assert(docinfo->db_seq == seqs[4] - 1);
+    couchstore_free_docinfo(docinfo);
+    docinfo = NULL;
+    couchstore_close_db(snap);
+    snap = NULL;
+    // Below the first commit, that's the empty header written when the file was created:
+    try(couchstore_open_snapshot_by_seq(testfilepath, 0, 1, &snap));
+    changes = 0;
+    try(couchstore_changes_since(snap, 0, 0, count_changes_cb, &changes));
+    assert(changes == 0);
+    couchstore_close_db(snap);
+    snap = NULL;
+
+    // Positions that aren't headers are rejected:
+    assert(couchstore_open_snapshot(testfilepath, 0, positions[2] + 1, &snap) ==
+           COUCHSTORE_ERROR_NO_HEADER);
+    snap = NULL;
+    assert(couchstore_open_snapshot(testfilepath, 0,
+                                    couchstore_get_header_position(db) + COUCH_BLOCK_SIZE,
+                                    &snap) == COUCHSTORE_ERROR_NO_HEADER);
+    snap = NULL;
+
+    // Walking the headers goes from newest to oldest:
+    memset(headers, 0, sizeof(headers));
+    try(couchstore_walk_headers(db, collect_header, headers));
+    assert(headers[0].position == couchstore_get_header_position(db));
+    assert(headers[0].update_seq == seqs[numversions - 1] + 1);
+    for (i = 1; i < 6; ++i) {
+        assert(headers[i].position == positions[numversions - i]);
+        assert(headers[i].update_seq == seqs[numversions - i]);
+    }
+    assert(headers[6].update_seq == 0);
+
+cleanup:
+    couchstore_free_docinfo(docinfo);
+    couchstore_free_document(doc);
+    if (snap) {
+        couchstore_close_db(snap);
+    }
+    if (db) {
+        couchstore_close_db(db);
+    }
+    assert(errcode == 0);
+}
+
+
+#define SHARED_HANDLE_DOCS 2000
+#define SHARED_HANDLE_THREADS 4
+
+typedef struct {
+    Db *db;
+    int thread;
+    couchstore_error_t errcode;
+} shared_reader;
+
+// Each doc's body is its ID repeated, to a length that varies up to about 10k.
+static size_t shared_handle_body(int n, char *buf)
+{
+    size_t len = 0, target = 20 + (size_t)(n * 37) % 10000;
+    while (len < target) {
+        len += sprintf(buf + len, "doc%05d;", n);
+    }
+    return len;
+}
+
+static int shared_body_check(Db *db, const DocInfo *info, const sized_buf *body, void *ctx)
+{
+    (void)db;
+    char *expected = ctx;
+    int n = atoi(info->id.buf + 3);
+    size_t len = shared_handle_body(n, expected);
+    return (body->size == len && memcmp(body->buf, expected, len) == 0) ? 0
+                                                                       : COUCHSTORE_ERROR_CORRUPT;
+}
+
+static void *shared_reader_thread(void *arg)
+{
+    shared_reader *r = arg;
+    char id[16];
+    char *expected = malloc(10100);
+    int i, changes;
+    DocInfo *info = NULL;
+    Doc *doc = NULL;
+    unsigned seed = (unsigned)r->thread;
+
+    for (i = 0; i < 2000 && r->errcode == COUCHSTORE_SUCCESS; ++i) {
+        int n = (int)(rand_r(&seed) % SHARED_HANDLE_DOCS);
+        sprintf(id, "doc%05d", n);
+        r->errcode = couchstore_docinfo_by_id(r->db, id, strlen(id), &info);
+        if (r->errcode != COUCHSTORE_SUCCESS) {
+            break;
+        }
+        if (i % 2 == 0) {
+            r->errcode = couchstore_visit_doc_body(r->db, info, DECOMPRESS_DOC_BODIES,
+                                                   shared_body_check, expected);
+        } else {
+            r->errcode = couchstore_open_doc_with_docinfo(r->db, info, &doc,
+                                                          DECOMPRESS_DOC_BODIES);
+            if (r->errcode == COUCHSTORE_SUCCESS) {
+                size_t len = shared_handle_body(n, expected);
+                if (doc->data.size != len || memcmp(doc->data.buf, expected, len) != 0) {
+                    r->errcode = COUCHSTORE_ERROR_CORRUPT;
+                }
+                couchstore_free_document(doc);
+            }
+        }
+        couchstore_free_docinfo(info);
+        if (i % 500 == 0 && r->errcode == COUCHSTORE_SUCCESS) {
+            changes = 0;
+            r->errcode = couchstore_changes_since(r->db, 0, 0, count_changes_cb, &changes);
+            if (changes != SHARED_HANDLE_DOCS) {
+                r->errcode = COUCHSTORE_ERROR_CORRUPT;
+            }
+        }
+    }
+    free(expected);
+    return NULL;
+}
+
+static void test_shared_handle(void)
+{
+    fprintf(stderr, "shared read handle... ");
+    fflush(stderr);
+    int errcode = 0;
+    int i, t;
+    Db *db = NULL, *shared = NULL;
+    char (*ids)[12] = malloc(SHARED_HANDLE_DOCS * sizeof(*ids));
+    char **bodies = calloc(SHARED_HANDLE_DOCS, sizeof(char*));
+    Doc **docptrs = malloc(SHARED_HANDLE_DOCS * sizeof(Doc*));
+    DocInfo **infoptrs = malloc(SHARED_HANDLE_DOCS * sizeof(DocInfo*));
+    pthread_t threads[SHARED_HANDLE_THREADS];
+    shared_reader readers[SHARED_HANDLE_THREADS];
+
+    docset_init(SHARED_HANDLE_DOCS);
+    for (i = 0; i < SHARED_HANDLE_DOCS; ++i) {
+        sprintf(ids[i], "doc%05d", i);
+        bodies[i] = malloc(10100);
+        size_t len = shared_handle_body(i, bodies[i]);
+        setdoc(&testdocset.docs[i], &testdocset.infos[i], ids[i], strlen(ids[i]),
+               bodies[i], len, zerometa, sizeof(zerometa));
+        if (i % 3 == 0) {
+            testdocset.infos[i].content_meta = COUCH_DOC_IS_COMPRESSED;
+        }
+        docptrs[i] = &testdocset.docs[i];
+        infoptrs[i] = &testdocset.infos[i];
+    }
+    unlink(testfilepath);
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_CREATE, &db));
+    try(couchstore_save_documents(db, docptrs, infoptrs, SHARED_HANDLE_DOCS,
+                                  COMPRESS_DOC_BODIES));
+    try(couchstore_commit(db));
+
+    // Sharing is only allowed for read-only handles:
+    assert(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_SHARED, &shared) ==
+           COUCHSTORE_ERROR_INVALID_ARGUMENTS);
+    shared = NULL;
+    try(couchstore_open_db(testfilepath,
+                           COUCHSTORE_OPEN_FLAG_RDONLY | COUCHSTORE_OPEN_FLAG_SHARED, &shared));
+
+    for (t = 0; t < SHARED_HANDLE_THREADS; ++t) {
+        readers[t].db = shared;
+        readers[t].thread = t + 1;
+        readers[t].errcode = COUCHSTORE_SUCCESS;
+        assert(pthread_create(&threads[t], NULL, shared_reader_thread, &readers[t]) == 0);
+    }
+    // The writer carries on meanwhile; the shared handle keeps reading its own header:
+    for (i = 0; i < 50; ++i) {
+        try(couchstore_save_document(db, docptrs[i], infoptrs[i], COMPRESS_DOC_BODIES));
+        try(couchstore_commit(db));
+    }
+    for (t = 0; t < SHARED_HANDLE_THREADS; ++t) {
+        pthread_join(threads[t], NULL);
+        try(readers[t].errcode);
+    }
+
+cleanup:
+    if (shared) {
+        couchstore_close_db(shared);
+    }
+    if (db) {
+        couchstore_close_db(db);
+    }
+    for (i = 0; i < SHARED_HANDLE_DOCS; ++i) {
+        free(bodies[i]);
+    }
+    free(bodies);
+    free(ids);
+    free(docptrs);
+    free(infoptrs);
+    assert(errcode == 0);
+}
+
+static void test_readahead(void)
+{
+    fprintf(stderr, "sequential readahead... ");
+    fflush(stderr);
+    const int numdocs = 20000, smalldocs = 200;
+    int errcode = 0;
+    int i, n, changes;
+    char (*ids)[12] = malloc(numdocs * sizeof(*ids));
+    char body[100];
+    Doc **docptrs = malloc(numdocs * sizeof(Doc*));
+    DocInfo **infoptrs = malloc(numdocs * sizeof(DocInfo*));
+    DocInfo *docinfo = NULL;
+    Db *db = NULL;
+    cs_off_t filesize;
+    char target[1100];
+
+    docset_init(numdocs);
+    memset(body, 'r', sizeof(body));
+    for (i = 0; i < numdocs; ++i) {
+        sprintf(ids[i], "doc%05d", i);
+        setdoc(&testdocset.docs[i], &testdocset.infos[i], ids[i], strlen(ids[i]),
+               body, sizeof(body), zerometa, sizeof(zerometa));
+        docptrs[i] = &testdocset.docs[i];
+        infoptrs[i] = &testdocset.infos[i];
+    }
+    unlink(testfilepath);
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_CREATE, &db));
+    for (i = 0; i < numdocs; i += 1000) {
+        try(couchstore_save_documents(db, docptrs + i, infoptrs + i, 1000, 0));
+        try(couchstore_commit(db));
+    }
+    // Compact it, so the trees are laid out in order as a scan will read them:
+    sprintf(target, "%s.compact", testfilepath);
+    unlink(target);
+    try(couchstore_compact_db(db, target));
+    couchstore_close_db(db);
+    db = NULL;
+    assert(rename(target, testfilepath) == 0);
+
+    try(couchstore_open_db_ex(testfilepath, COUCHSTORE_OPEN_FLAG_RDONLY,
+                              &fault_file_ops, &db));
+    filesize = couchstore_get_header_position(db);
+
+    // A full scan soon switches to large reads:
+    memset(&fault_state, 0, sizeof(fault_state));
+    changes = 0;
+    try(couchstore_changes_since(db, 0, 0, count_changes_cb, &changes));
+    assert(changes == numdocs);
+    assert(fault_state.largest_read >= 256 * 1024);
+    assert(fault_state.reads < filesize / (8 * 1024) / 4);
+
+    // Random lookups soon go back to small reads:
+    for (i = 0; i < 250; ++i) {
+        if (i == 50) {
+            memset(&fault_state, 0, sizeof(fault_state));
+        }
+        n = (i * 7919) % numdocs;
+        try(couchstore_docinfo_by_id(db, ids[n], strlen(ids[n]), &docinfo));
+        assert(docinfo->db_seq == (uint64_t)n + 1);
+        couchstore_free_docinfo(docinfo);
+        docinfo = NULL;
+    }
+    assert(fault_state.reads > 0);
+    assert(fault_state.largest_read <= 8 * 1024);
+
+    // And a second scan after them is still correct:
+    changes = 0;
+    try(couchstore_changes_since(db, numdocs / 2, 0, count_changes_cb, &changes));
+    assert(changes == numdocs / 2 + 1);
+    couchstore_close_db(db);
+    db = NULL;
+
+    // Random lookups stay small even in a file so small that every node is near the root
+    // (whatever the compressor makes of it), as each lookup goes back to the root:
+    unlink(testfilepath);
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_CREATE, &db));
+    try(couchstore_save_documents(db, docptrs, infoptrs, smalldocs, 0));
+    try(couchstore_commit(db));
+    couchstore_close_db(db);
+    db = NULL;
+    try(couchstore_open_db_ex(testfilepath, COUCHSTORE_OPEN_FLAG_RDONLY,
+                              &fault_file_ops, &db));
+    assert(couchstore_get_header_position(db) < 64 * 1024);     // iobuffer.c READAHEAD_MAX_GAP
+    memset(&fault_state, 0, sizeof(fault_state));
+    for (i = 0; i < 200; ++i) {
+        n = (i * 7919) % smalldocs;
+        try(couchstore_docinfo_by_id(db, ids[n], strlen(ids[n]), &docinfo));
+        couchstore_free_docinfo(docinfo);
+        docinfo = NULL;
+    }
+    assert(fault_state.reads > 0);
+    assert(fault_state.largest_read <= 8 * 1024);
+
+cleanup:
+    couchstore_free_docinfo(docinfo);
+    if (db) {
+        couchstore_close_db(db);
+    }
+    free(ids);
+    free(docptrs);
+    free(infoptrs);
+    assert(errcode == 0);
+}
+
+// Reads a whole file into a malloced buffer; returns its size.
+static size_t read_whole_file(const char *path, char **buf)
+{
+    FILE *f = fopen(path, "rb");
+    assert(f != NULL);
+    fseek(f, 0, SEEK_END);
+    size_t size = (size_t)ftell(f);
+    fseek(f, 0, SEEK_SET);
+    *buf = malloc(size + 1);
+    assert(*buf != NULL);
+    assert(fread(*buf, 1, size, f) == size);
+    fclose(f);
+    return size;
+}
+
+static void test_vectored_writes(void)
+{
+    fprintf(stderr, "vectored writes... ");
+    fflush(stderr);
+    // Sizes around block boundaries, and ones big enough to bypass the write buffer:
+    static const size_t sizes[] = { 10, 4091, 4095, 4096, 5000, 40000, 1024 * 1024 + 17 };
+    const int numdocs = sizeof(sizes) / sizeof(sizes[0]);
+    int errcode = 0;
+    int i, pass;
+    char ids[sizeof(sizes) / sizeof(sizes[0])][8];
+    char *bodies[sizeof(sizes) / sizeof(sizes[0])];
+    Doc *docptrs[sizeof(sizes) / sizeof(sizes[0])];
+    DocInfo *infoptrs[sizeof(sizes) / sizeof(sizes[0])];
+    Doc *doc = NULL;
+    Db *db = NULL;
+    char oldpath[1100];
+    char *vectored = NULL, *unvectored = NULL;
+    size_t vectored_size, unvectored_size;
+
+    docset_init(numdocs);
+    for (i = 0; i < numdocs; ++i) {
+        sprintf(ids[i], "doc%d", i);
+        bodies[i] = malloc(sizes[i]);
+        memset(bodies[i], 'a' + i, sizes[i]);
+        setdoc(&testdocset.docs[i], &testdocset.infos[i], ids[i], strlen(ids[i]),
+               bodies[i], sizes[i], zerometa, sizeof(zerometa));
+        docptrs[i] = &testdocset.docs[i];
+        infoptrs[i] = &testdocset.infos[i];
+    }
+
+    // Write the same docs with the default ops, which have pwritev, and with older ops that
+    // don't; the files should come out identical.
+    sprintf(oldpath, "%s.old", testfilepath);
+    for (pass = 0; pass < 2; ++pass) {
+        const char *path = pass == 0 ? testfilepath : oldpath;
+        unlink(path);
+        try(couchstore_open_db_ex(path, COUCHSTORE_OPEN_FLAG_CREATE,
+                                  pass == 0 ? couchstore_get_default_file_ops() : &fault_file_ops,
+                                  &db));
+        try(couchstore_save_documents(db, docptrs, infoptrs, numdocs, 0));
+        try(couchstore_commit(db));
+        for (i = 0; i < numdocs; ++i) {
+            try(couchstore_save_document(db, docptrs[i], infoptrs[i], 0));
+        }
+        try(couchstore_commit(db));
+        couchstore_close_db(db);
+        db = NULL;
+    }
+    vectored_size = read_whole_file(testfilepath, &vectored);
+    unvectored_size = read_whole_file(oldpath, &unvectored);
+    assert(vectored_size == unvectored_size);
+    assert(memcmp(vectored, unvectored, vectored_size) == 0);
+
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_RDONLY, &db));
+    for (i = 0; i < numdocs; ++i) {
+        try(couchstore_open_document(db, ids[i], strlen(ids[i]), &doc, 0));
+        assert(doc->data.size == sizes[i]);
+        assert(memcmp(doc->data.buf, bodies[i], sizes[i]) == 0);
+        couchstore_free_document(doc);
+        doc = NULL;
+    }
+
+cleanup:
+    couchstore_free_document(doc);
+    if (db) {
+        couchstore_close_db(db);
+    }
+    for (i = 0; i < numdocs; ++i) {
+        free(bodies[i]);
+    }
+    free(vectored);
+    free(unvectored);
+    unlink(oldpath);
+    assert(errcode == 0);
+}
+
+#define CODEC_TEST_DOCS 300
+
+// Fills in the body of doc number i of the codec test; returns its length.
+static size_t codec_test_body(char *buf, int i)
+{
+    return sprintf(buf, "{\"index\":%d,\"text\":\"%s\",\"more\":\"%s\"}", i,
+                   "the quick brown fox jumps over the lazy dog, again and again",
+                   "the quick brown fox jumps over the lazy dog, again and again");
+}
+
+static int codec_test_index(const DocInfo *info)
+{
+    char id[16];
+    assert(info->id.size < sizeof(id));
+    memcpy(id, info->id.buf, info->id.size);
+    id[info->id.size] = '\0';
+    return atoi(id + 4);
+}
+
+// Checks a body read without DECOMPRESS_DOC_BODIES; compressed ones must be in snappy format.
+static void check_codec_body(const DocInfo *info, const char *data, size_t size)
+{
+    char expected[256], plain[256];
+    size_t len = codec_test_body(expected, codec_test_index(info));
+    if (info->content_meta & COUCH_DOC_IS_COMPRESSED) {
+        size_t plain_len = sizeof(plain);
+        assert(snappy_uncompress(data, size, plain, &plain_len) == SNAPPY_OK);
+        data = plain;
+        size = plain_len;
+    }
+    assert(size == len);
+    assert(memcmp(data, expected, len) == 0);
+}
+
+static couchstore_error_t codec_visit_cb(Db *db, const DocInfo *info, const sized_buf *body,
+                                         void *ctx)
+{
+    (void)db;
+    (void)ctx;
+    check_codec_body(info, body->buf, body->size);
+    return COUCHSTORE_SUCCESS;
+}
+
+typedef struct {
+    DocInfo *infos[CODEC_TEST_DOCS];
+    int count;
+} codec_check_ctx;
+
+static int codec_check_cb(Db *db, DocInfo *info, void *ctx)
+{
+    int errcode = 0;
+    codec_check_ctx *check = ctx;
+    Doc *doc = NULL;
+    char expected[256];
+    size_t len = codec_test_body(expected, codec_test_index(info));
+
+    try(couchstore_open_doc_with_docinfo(db, info, &doc, DECOMPRESS_DOC_BODIES));
+    assert(doc->data.size == len);
+    assert(memcmp(doc->data.buf, expected, len) == 0);
+    couchstore_free_document(doc);
+    doc = NULL;
+    try(couchstore_open_doc_with_docinfo(db, info, &doc, 0));
+    check_codec_body(info, doc->data.buf, doc->data.size);
+    try(couchstore_visit_doc_body(db, info, 0, codec_visit_cb, NULL));
+    assert(check->count < CODEC_TEST_DOCS);
+    check->infos[check->count++] = info;
+
+cleanup:
+    couchstore_free_document(doc);
+    assert(errcode == 0);
+    return 1;   // Keep the DocInfo
+}
+
+// Reads every doc in a codec test file, in each of the ways bodies can be read.
+static void check_codec_file(const char *path, uint64_t disk_version)
+{
+    int errcode = 0;
+    Db *db = NULL;
+    codec_check_ctx check;
+    int i;
+    check.count = 0;
+
+    try(couchstore_open_db(path, COUCHSTORE_OPEN_FLAG_RDONLY, &db));
+    assert(db->header.disk_version == disk_version);
+    try(couchstore_changes_since(db, 0, 0, codec_check_cb, &check));
+    assert(check.count == CODEC_TEST_DOCS);
+    try(couchstore_open_documents(db, check.infos, check.count, 0, codec_visit_cb, NULL));
+
+cleanup:
+    for (i = 0; i < check.count; ++i) {
+        couchstore_free_docinfo(check.infos[i]);
+    }
+    if (db) {
+        couchstore_close_db(db);
+    }
+    assert(errcode == 0);
+}
+
+static void test_codecs(void)
+{
+    fprintf(stderr, "compression codecs... ");
+    fflush(stderr);
+    static const couchstore_codec_t codecs[][2] = {
+        { COUCHSTORE_CODEC_LZ4, COUCHSTORE_CODEC_ZSTD },
+        { COUCHSTORE_CODEC_ZSTD, COUCHSTORE_CODEC_LZ4 },
+        { COUCHSTORE_CODEC_LZ4, COUCHSTORE_CODEC_SNAPPY }
+    };
+    int errcode = 0;
+    unsigned c;
+    int i;
+    char ids[CODEC_TEST_DOCS][12], bodies[CODEC_TEST_DOCS][256];
+    char precompressed[256];
+    Doc *docptrs[CODEC_TEST_DOCS];
+    DocInfo *infoptrs[CODEC_TEST_DOCS];
+    Db *db = NULL;
+    char target[1100], target2[1100];
+
+    sprintf(target, "%s.compact", testfilepath);
+    sprintf(target2, "%s.compact2", testfilepath);
+    docset_init(CODEC_TEST_DOCS);
+    for (i = 0; i < CODEC_TEST_DOCS; ++i) {
+        sprintf(ids[i], "cdoc%04d", i);
+        size_t len = codec_test_body(bodies[i], i);
+        setdoc(&testdocset.docs[i], &testdocset.infos[i], ids[i], strlen(ids[i]),
+               bodies[i], len, zerometa, sizeof(zerometa));
+        if (i % 3 != 0) {
+            testdocset.infos[i].content_meta = COUCH_DOC_IS_COMPRESSED;
+        }
+        docptrs[i] = &testdocset.docs[i];
+        infoptrs[i] = &testdocset.infos[i];
+    }
+    // The last doc is compressed by the caller instead:
+    size_t precompressed_len = sizeof(precompressed);
+    assert(snappy_compress(bodies[CODEC_TEST_DOCS - 1],
+                           testdocset.docs[CODEC_TEST_DOCS - 1].data.size,
+                           precompressed, &precompressed_len) == SNAPPY_OK);
+    testdocset.docs[CODEC_TEST_DOCS - 1].data.buf = precompressed;
+    testdocset.docs[CODEC_TEST_DOCS - 1].data.size = precompressed_len;
+
+    // Out-of-range codecs are rejected:
+    assert(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_CREATE |
+                              COUCHSTORE_OPEN_FLAG_NODE_CODEC(9), &db) ==
+           COUCHSTORE_ERROR_INVALID_ARGUMENTS);
+
+    for (c = 0; c < sizeof(codecs) / sizeof(codecs[0]); ++c) {
+        unlink(testfilepath);
+        errcode = couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_CREATE |
+                                     COUCHSTORE_OPEN_FLAG_NODE_CODEC(codecs[c][0]) |
+                                     COUCHSTORE_OPEN_FLAG_BODY_CODEC(codecs[c][1]), &db);
+        if (errcode == COUCHSTORE_ERROR_UNSUPPORTED_CODEC) {
+            errcode = 0;
+            continue;       // Not built with this codec
+        }
+        try(errcode);
+        try(couchstore_save_documents(db, docptrs, infoptrs, CODEC_TEST_DOCS - 1,
+                                      COMPRESS_DOC_BODIES));
+        try(couchstore_save_document(db, docptrs[CODEC_TEST_DOCS - 1],
+                                     infoptrs[CODEC_TEST_DOCS - 1], 0));
+        try(couchstore_commit(db));
+        couchstore_close_db(db);
+        db = NULL;
+        check_codec_file(testfilepath, 12);
+
+        // Reopened without codec flags it's still in the tagged format, using snappy:
+        try(couchstore_open_db(testfilepath, 0, &db));
+        assert(db->header.disk_version == 12);
+        try(couchstore_save_documents(db, docptrs, infoptrs, 10, COMPRESS_DOC_BODIES));
+        try(couchstore_commit(db));
+        check_codec_file(testfilepath, 12);
+
+        // Compacting to snappy converts it to the old format:
+        unlink(target);
+        try(couchstore_compact_db_ex(db, target,
+                                     COUCHSTORE_COMPACT_FLAG_NODE_CODEC(COUCHSTORE_CODEC_SNAPPY) |
+                                     COUCHSTORE_COMPACT_FLAG_BODY_CODEC(COUCHSTORE_CODEC_SNAPPY),
+                                     couchstore_get_default_file_ops()));
+        couchstore_close_db(db);
+        db = NULL;
+        check_codec_file(target, 11);
+
+        // ...and compacting that with the original codecs, in parallel, converts it back:
+        try(couchstore_open_db(target, 0, &db));
+        unlink(target2);
+        try(couchstore_compact_db_ex(db, target2, COUCHSTORE_COMPACT_FLAG_PARALLEL |
+                                     COUCHSTORE_COMPACT_FLAG_NODE_CODEC(codecs[c][0]) |
+                                     COUCHSTORE_COMPACT_FLAG_BODY_CODEC(codecs[c][1]),
+                                     couchstore_get_default_file_ops()));
+        couchstore_close_db(db);
+        db = NULL;
+        check_codec_file(target2, 12);
+
+        // A file opened with codecs keeps them when compacted by default:
+        try(couchstore_open_db(target2, COUCHSTORE_OPEN_FLAG_NODE_CODEC(codecs[c][0]) |
+                               COUCHSTORE_OPEN_FLAG_BODY_CODEC(codecs[c][1]), &db));
+        unlink(target);
+        try(couchstore_compact_db(db, target));
+        couchstore_close_db(db);
+        db = NULL;
+        check_codec_file(target, 12);
+    }
+
+cleanup:
+    if (db) {
+        couchstore_close_db(db);
+    }
+    unlink(target);
+    unlink(target2);
+    assert(errcode == 0);
+}
+
+#define DICT_TEST_DOCS 3000
+
+// Fills in the body of doc number i of the dictionary test: small JSON of a common shape.
+static size_t dict_test_body(char *buf, int i)
+{
+    static const char *cities[] = { "Berlin", "Lisbon", "Osaka", "Toronto", "Nairobi" };
+    static const char *plans[] = { "free", "standard", "premium" };
+    unsigned r = (unsigned)i * 2654435761u;
+    return sprintf(buf, "{\"id\":\"user::%06d\",\"type\":\"user\",\"name\":\"User %d\","
+                   "\"email\":\"user%d@example.com\",\"age\":%u,\"plan\":\"%s\","
+                   "\"address\":{\"street\":\"%u Main Street\",\"city\":\"%s\","
+                   "\"postcode\":\"%05u\"},\"created\":\"2014-%02u-%02uT%02u:%02u:00Z\","
+                   "\"active\":%s,\"logins\":%u,\"preferences\":{\"newsletter\":%s,"
+                   "\"theme\":\"%s\",\"language\":\"en\"}}",
+                   i, i, i, 18 + r % 60, plans[r % 3], r % 900 + 1, cities[r % 5], r % 100000,
+                   1 + r % 12, 1 + r % 28, r % 24, r % 60, (r & 1) ? "true" : "false",
+                   r % 5000, (r & 2) ? "true" : "false", (r & 4) ? "dark" : "light");
+}
+
+typedef struct {
+    int count;
+    uint64_t body_bytes;    // Total size of the bodies on disk
+} dict_check_ctx;
+
+static int dict_check_cb(Db *db, DocInfo *info, void *ctx)
+{
+    int errcode = 0;
+    dict_check_ctx *check = ctx;
+    Doc *doc = NULL;
+    char expected[1024], plain[1024];
+    size_t plain_len = sizeof(plain);
+    size_t len = dict_test_body(expected, atoi((const char*)info->id.buf + 4));
+
+    try(couchstore_open_doc_with_docinfo(db, info, &doc, DECOMPRESS_DOC_BODIES));
+    assert(doc->data.size == len);
+    assert(memcmp(doc->data.buf, expected, len) == 0);
+    couchstore_free_document(doc);
+    doc = NULL;
+    // Clients still get compressed bodies in snappy format:
+    try(couchstore_open_doc_with_docinfo(db, info, &doc, 0));
+    assert(snappy_uncompress(doc->data.buf, doc->data.size, plain, &plain_len) == SNAPPY_OK);
+    assert(plain_len == len);
+    assert(memcmp(plain, expected, len) == 0);
+    check->count++;
+    check->body_bytes += info->size;
+
+cleanup:
+    couchstore_free_document(doc);
+    assert(errcode == 0);
+    return 0;
+}
+
+// Reads every doc in a dictionary test file, and returns the total size of their bodies.
+static uint64_t check_dict_file(const char *path, int has_dict, int num_docs)
+{
+    int errcode = 0;
+    Db *db = NULL;
+    dict_check_ctx check = { 0, 0 };
+
+    try(couchstore_open_db(path, COUCHSTORE_OPEN_FLAG_RDONLY, &db));
+    assert((db->header.dict_pos != 0) == has_dict);
+    assert((db->file.dict != NULL) == has_dict);
+    try(couchstore_changes_since(db, 0, 0, dict_check_cb, &check));
+    assert(check.count == num_docs);
+
+cleanup:
+    if (db) {
+        couchstore_close_db(db);
+    }
+    assert(errcode == 0);
+    return check.body_bytes;
+}
+
+static void test_zstd_dictionary(void)
+{
+    fprintf(stderr, "trained zstd dictionary... ");
+    fflush(stderr);
+    int errcode = 0;
+    int i;
+    char ids[DICT_TEST_DOCS][12];
+    char (*bodies)[512] = malloc(DICT_TEST_DOCS * sizeof(*bodies));
+    Doc *docptrs[DICT_TEST_DOCS];
+    DocInfo *infoptrs[DICT_TEST_DOCS];
+    Db *db = NULL;
+    char target[1100], target2[1100];
+    uint64_t snappy_bytes, dict_bytes;
+
+    assert(bodies);
+    sprintf(target, "%s.compact", testfilepath);
+    sprintf(target2, "%s.compact2", testfilepath);
+    docset_init(DICT_TEST_DOCS);
+    for (i = 0; i < DICT_TEST_DOCS; ++i) {
+        sprintf(ids[i], "user%06d", i);
+        size_t len = dict_test_body(bodies[i], i);
+        assert(len < sizeof(bodies[i]));
+        setdoc(&testdocset.docs[i], &testdocset.infos[i], ids[i], strlen(ids[i]),
+               bodies[i], len, zerometa, sizeof(zerometa));
+        testdocset.infos[i].content_meta = COUCH_DOC_IS_COMPRESSED;
+        docptrs[i] = &testdocset.docs[i];
+        infoptrs[i] = &testdocset.infos[i];
+    }
+
+    unlink(testfilepath);
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_CREATE, &db));
+    try(couchstore_save_documents(db, docptrs, infoptrs, DICT_TEST_DOCS, COMPRESS_DOC_BODIES));
+    try(couchstore_commit(db));
+    snappy_bytes = check_dict_file(testfilepath, 0, DICT_TEST_DOCS);
+
+    // Only zstd can use a dictionary:
+    unlink(target);
+    assert(couchstore_compact_db_ex(db, target, COUCHSTORE_COMPACT_FLAG_TRAIN_DICTIONARY |
+                                    COUCHSTORE_COMPACT_FLAG_BODY_CODEC(COUCHSTORE_CODEC_LZ4),
+                                    couchstore_get_default_file_ops()) ==
+           COUCHSTORE_ERROR_INVALID_ARGUMENTS);
+    errcode = couchstore_compact_db_ex(db, target, COUCHSTORE_COMPACT_FLAG_TRAIN_DICTIONARY,
+                                       couchstore_get_default_file_ops());
+    couchstore_close_db(db);
+    db = NULL;
+    if (errcode == COUCHSTORE_ERROR_UNSUPPORTED_CODEC) {
+        errcode = 0;
+        goto cleanup;       // Not built with zstd
+    }
+    try(errcode);
+    dict_bytes = check_dict_file(target, 1, DICT_TEST_DOCS);
+    assert(dict_bytes * 2 < snappy_bytes);
+
+    // Reopened without codec flags, new bodies are compressed with the dictionary too:
+    try(couchstore_open_db(target, 0, &db));
+    assert(db->body_codec == COUCHSTORE_CODEC_ZSTD);
+    try(couchstore_save_documents(db, docptrs, infoptrs, 100, COMPRESS_DOC_BODIES));
+    try(couchstore_commit(db));
+    couchstore_close_db(db);
+    db = NULL;
+    assert(check_dict_file(target, 1, DICT_TEST_DOCS) < dict_bytes * 11 / 10);
+
+    // Compaction carries the dictionary over, and copies its bodies as they are:
+    try(couchstore_open_db(target, 0, &db));
+    unlink(target2);
+    try(couchstore_compact_db_ex(db, target2, COUCHSTORE_COMPACT_FLAG_PARALLEL,
+                                 couchstore_get_default_file_ops()));
+    assert(check_dict_file(target2, 1, DICT_TEST_DOCS) == dict_bytes);
+
+    // ...unless the body codec changes:
+    unlink(target2);
+    try(couchstore_compact_db_ex(db, target2,
+                                 COUCHSTORE_COMPACT_FLAG_BODY_CODEC(COUCHSTORE_CODEC_SNAPPY),
+                                 couchstore_get_default_file_ops()));
+    check_dict_file(target2, 0, DICT_TEST_DOCS);
+
+    // Retraining replaces the dictionary, re-encoding the bodies compressed with the old one:
+    unlink(target2);
+    try(couchstore_compact_db_ex(db, target2, COUCHSTORE_COMPACT_FLAG_TRAIN_DICTIONARY |
+                                 COUCHSTORE_COMPACT_FLAG_PARALLEL,
+                                 couchstore_get_default_file_ops()));
+    check_dict_file(target2, 1, DICT_TEST_DOCS);
+
+cleanup:
+    if (db) {
+        couchstore_close_db(db);
+    }
+    free(bodies);
+    unlink(target);
+    unlink(target2);
+    assert(errcode == 0);
+}
+
+#define ID_FILTER_TEST_DOCS 5000
+
+// Checks that the docs numbered [0, num_docs) are found, and that absent IDs usually aren't
+// even looked up.
+static void check_id_filter(Db *db, int num_docs)
+{
+    int errcode = 0;
+    DocInfo *info = NULL;
+    char id[16];
+    int i, false_positives = 0;
+
+    assert(db->id_filter != NULL);
+    for (i = 0; i < num_docs; ++i) {
+        sprintf(id, "fdoc%05d", i);
+        try(couchstore_docinfo_by_id(db, id, strlen(id), &info));
+        couchstore_free_docinfo(info);
+        info = NULL;
+    }
+    for (i = 0; i < 10000; ++i) {
+        sprintf(id, "absent%05d", i);
+        if (id_filter_may_contain(db->id_filter, id, strlen(id))) {
+            false_positives++;
+        }
+        assert(couchstore_docinfo_by_id(db, id, strlen(id), &info) ==
+               COUCHSTORE_ERROR_DOC_NOT_FOUND);
+    }
+    assert(false_positives < 300);     // Asked for 1%
+
+cleanup:
+    couchstore_free_docinfo(info);
+    assert(errcode == 0);
+}
+
+static void test_id_filter(void)
+{
+    fprintf(stderr, "doc ID filter... ");
+    fflush(stderr);
+    int errcode = 0;
+    int i, batch;
+    char ids[ID_FILTER_TEST_DOCS][12];
+    Doc *docptrs[ID_FILTER_TEST_DOCS];
+    DocInfo *infoptrs[ID_FILTER_TEST_DOCS];
+    DocInfo *info = NULL;
+    Db *db = NULL;
+    char target[1100];
+    uint64_t filter_pos;
+
+    sprintf(target, "%s.compact", testfilepath);
+    docset_init(ID_FILTER_TEST_DOCS);
+    for (i = 0; i < ID_FILTER_TEST_DOCS; ++i) {
+        sprintf(ids[i], "fdoc%05d", i);
+        setdoc(&testdocset.docs[i], &testdocset.infos[i], ids[i], strlen(ids[i]),
+               (char*)"{\"a\":1}", 7, zerometa, sizeof(zerometa));
+        docptrs[i] = &testdocset.docs[i];
+        infoptrs[i] = &testdocset.infos[i];
+    }
+
+    // Setting a filter on a new file switches it to the format that can save one:
+    unlink(testfilepath);
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_CREATE, &db));
+    assert(db->header.disk_version == 11);
+    assert(couchstore_set_id_filter(db, 1.5, 0) == COUCHSTORE_ERROR_INVALID_ARGUMENTS);
+    try(couchstore_set_id_filter(db, 0.01, 0));
+    assert(db->header.disk_version == 12);
+    // Saving in batches grows the filter past the size it started at:
+    for (batch = 0; batch < ID_FILTER_TEST_DOCS; batch += 500) {
+        try(couchstore_save_documents(db, docptrs + batch, infoptrs + batch, 500, 0));
+        try(couchstore_commit(db));
+    }
+    assert(db->id_filter->capacity >= ID_FILTER_TEST_DOCS);
+    check_id_filter(db, ID_FILTER_TEST_DOCS);
+    couchstore_close_db(db);
+    db = NULL;
+
+    // It's loaded from the file, along with the changes made since it was saved:
+    try(couchstore_open_db(testfilepath, 0, &db));
+    assert(db->header.id_filter_pos != 0);
+    filter_pos = db->header.id_filter_pos;
+    check_id_filter(db, ID_FILTER_TEST_DOCS);
+    try(couchstore_save_documents(db, docptrs, infoptrs, 10, 0));
+    try(couchstore_save_documents(db, NULL, infoptrs + 10, 1, 0));   // Deletes fdoc00010
+    try(couchstore_commit(db));
+    assert(db->header.id_filter_pos == filter_pos);     // Too few changes to resave it
+    couchstore_close_db(db);
+    db = NULL;
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_RDONLY, &db));
+    assert(db->id_filter_unsaved >= 11);
+    check_id_filter(db, ID_FILTER_TEST_DOCS);
+    try(couchstore_docinfo_by_id(db, ids[10], strlen(ids[10]), &info));
+    assert(info->deleted);
+    couchstore_free_docinfo(info);
+    info = NULL;
+
+    // Compaction gives the target a filter:
+    unlink(target);
+    try(couchstore_compact_db_ex(db, target, COUCHSTORE_COMPACT_FLAG_PARALLEL,
+                                 couchstore_get_default_file_ops()));
+    couchstore_close_db(db);
+    db = NULL;
+    try(couchstore_open_db(target, 0, &db));
+    assert(db->id_filter_unsaved == 0);
+    check_id_filter(db, ID_FILTER_TEST_DOCS);
+
+    // Removing the filter removes it from the file:
+    try(couchstore_set_id_filter(db, 0, 0));
+    try(couchstore_commit(db));
+    couchstore_close_db(db);
+    db = NULL;
+    try(couchstore_open_db(target, 0, &db));
+    assert(db->id_filter == NULL && db->header.id_filter_pos == 0);
+    couchstore_close_db(db);
+    db = NULL;
+
+    // A file in the older format that already has data can only keep one in memory:
+    unlink(target);
+    try(couchstore_open_db(target, COUCHSTORE_OPEN_FLAG_CREATE, &db));
+    try(couchstore_save_documents(db, docptrs, infoptrs, 100, 0));
+    try(couchstore_set_id_filter(db, 0.01, 4096));
+    assert(db->header.disk_version == 11);
+    try(couchstore_save_documents(db, docptrs + 100, infoptrs + 100, 100, 0));
+    try(couchstore_commit(db));
+    check_id_filter(db, 200);
+    couchstore_close_db(db);
+    db = NULL;
+    try(couchstore_open_db(target, 0, &db));
+    assert(db->id_filter == NULL);
+
+cleanup:
+    couchstore_free_docinfo(info);
+    if (db) {
+        couchstore_close_db(db);
+    }
+    unlink(target);
+    assert(errcode == 0);
+}
+
+#define SLOTTED_TEST_DOCS 2000
+
+static int slot_test_compare(const sized_buf *k1, const sized_buf *k2)
+{
+    size_t size = k1->size < k2->size ? k1->size : k2->size;
+    int cmp = memcmp(k1->buf, k2->buf, size);
+    return cmp ? cmp : (int)k1->size - (int)k2->size;
+}
+
+// Checks lookups in a file whose docs have the even-numbered IDs up to 2 * num_docs.
+static void check_slotted_file(Db *db, int num_docs)
+{
+    int errcode = 0;
+    DocInfo *info = NULL;
+    sized_buf keys[SLOTTED_TEST_DOCS];
+    char ids[SLOTTED_TEST_DOCS][12];
+    int i, count = 0;
+
+    for (i = 0; i < num_docs; ++i) {
+        sprintf(ids[i], "sdoc%05d", 2 * i);
+        keys[i].buf = ids[i];
+        keys[i].size = strlen(ids[i]);
+    }
+    try(couchstore_docinfos_by_id(db, keys, num_docs, 0, count_changes_cb, &count));
+    assert(count == num_docs);
+    for (i = 0; i < num_docs; i += 7) {
+        try(couchstore_docinfo_by_id(db, ids[i], strlen(ids[i]), &info));
+        couchstore_free_docinfo(info);
+        info = NULL;
+        ids[i][8]++;    // The odd-numbered ID after it
+        assert(couchstore_docinfo_by_id(db, ids[i], strlen(ids[i]), &info) ==
+               COUCHSTORE_ERROR_DOC_NOT_FOUND);
+    }
+    // Iterating from an absent ID starts at the next one:
+    sized_buf start = {(char*)"sdoc01001", 9};
+    count = 0;
+    try(couchstore_all_docs(db, &start, 0, count_changes_cb, &count));
+    assert(count == num_docs - 501);
+
+cleanup:
+    couchstore_free_docinfo(info);
+    assert(errcode == 0);
+}
+
+static void test_slotted_nodes(void)
+{
+    fprintf(stderr, "slotted nodes... ");
+    fflush(stderr);
+    int errcode = 0;
+    int i;
+    char node[4096], *end;
+    node_layout layout;
+    char ids[SLOTTED_TEST_DOCS][12];
+    Doc *docptrs[SLOTTED_TEST_DOCS];
+    DocInfo *infoptrs[SLOTTED_TEST_DOCS];
+    Db *db = NULL;
+
+    // A node with keys k000, k002, ... k198:
+    end = node;
+    *end++ = KV_NODE | NODE_SLOTTED;
+    for (i = 0; i < 100; ++i) {
+        char key[8];
+        sized_buf k = {key, 4}, v = {(char*)"value", 5};
+        sprintf(key, "k%03d", 2 * i);
+        end = write_kv(end, k, v);
+    }
+    end = write_slot_directory(node, end);
+    assert(end - node == 1 + 100 * 14 + 101 * 4);
+    assert(parse_node(node, end - node, &layout));
+    assert(layout.type == KV_NODE && layout.count == 100 && layout.end == 1 + 100 * 14);
+    sized_buf k050 = {(char*)"k050", 4}, k051 = {(char*)"k051", 4}, k999 = {(char*)"k999", 4};
+    assert(node_lower_bound(&layout, 0, &k050, slot_test_compare) == 25);
+    assert(node_lower_bound(&layout, 0, &k051, slot_test_compare) == 26);
+    assert(node_lower_bound(&layout, 30, &k050, slot_test_compare) == 30);
+    assert(node_lower_bound(&layout, 0, &k999, slot_test_compare) == 100);
+    assert(node_entry_offset(&layout, 100) == layout.end);
+    // A slot directory can't claim more entries than fit:
+    node[end - node - 3] = 1;
+    assert(!parse_node(node, end - node, &layout));
+    node[end - node - 3] = 0;
+    // Nor point outside the node, or into the middle of an entry:
+    char *slot = node + 1 + 100 * 14 + 10 * sizeof(raw_32);
+    raw_32 good_slot, bad_slot;
+    memcpy(&good_slot, slot, sizeof(raw_32));
+    bad_slot = encode_raw32(1000000);
+    memcpy(slot, &bad_slot, sizeof(raw_32));
+    assert(!parse_node(node, end - node, &layout));
+    bad_slot = encode_raw32(decode_raw32(good_slot) + 1);
+    memcpy(slot, &bad_slot, sizeof(raw_32));
+    assert(!parse_node(node, end - node, &layout));
+    memcpy(slot, &good_slot, sizeof(raw_32));
+    assert(parse_node(node, end - node, &layout));
+
+    docset_init(SLOTTED_TEST_DOCS);
+    for (i = 0; i < SLOTTED_TEST_DOCS; ++i) {
+        sprintf(ids[i], "sdoc%05d", 2 * i);
+        setdoc(&testdocset.docs[i], &testdocset.infos[i], ids[i], strlen(ids[i]),
+               (char*)"{\"a\":1}", 7, zerometa, sizeof(zerometa));
+        docptrs[i] = &testdocset.docs[i];
+        infoptrs[i] = &testdocset.infos[i];
+    }
+
+    // Setting an ID filter on a new file switches it to version 12, which has slotted nodes:
+    unlink(testfilepath);
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_CREATE, &db));
+    try(couchstore_set_id_filter(db, 0.01, 0));
+    try(couchstore_set_id_filter(db, 0, 0));
+    assert(db->header.disk_version == 12);
+    try(couchstore_save_documents(db, docptrs, infoptrs, SLOTTED_TEST_DOCS / 2, 0));
+    try(couchstore_commit(db));
+    check_slotted_file(db, SLOTTED_TEST_DOCS / 2);
+
+    // Updating the slotted nodes:
+    try(couchstore_save_documents(db, docptrs + SLOTTED_TEST_DOCS / 2,
+                                  infoptrs + SLOTTED_TEST_DOCS / 2, SLOTTED_TEST_DOCS / 2, 0));
+    try(couchstore_save_documents(db, docptrs, infoptrs, 100, 0));
+    try(couchstore_commit(db));
+    couchstore_close_db(db);
+    db = NULL;
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_RDONLY, &db));
+    check_slotted_file(db, SLOTTED_TEST_DOCS);
+
+cleanup:
+    if (db) {
+        couchstore_close_db(db);
+    }
+    assert(errcode == 0);
+}
+
+#define DEFERRED_TEST_BATCHES 100
+#define DEFERRED_TEST_BATCH_SIZE 10
+#define DEFERRED_TEST_DOCS (DEFERRED_TEST_BATCHES * DEFERRED_TEST_BATCH_SIZE)
+
+// Saves the deferred-write test docs in small batches with one commit, and returns the size of
+// the file's data (past the initial header.)
+static cs_off_t save_in_batches(couchstore_open_flags flags, Doc **docptrs, DocInfo **infoptrs)
+{
+    int errcode = 0;
+    int batch, count = 0;
+    Db *db = NULL;
+    cs_off_t size = 0;
+
+    unlink(testfilepath);
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_CREATE | flags, &db));
+    for (batch = 0; batch < DEFERRED_TEST_DOCS; batch += DEFERRED_TEST_BATCH_SIZE) {
+        try(couchstore_save_documents(db, docptrs + batch, infoptrs + batch,
+                                      DEFERRED_TEST_BATCH_SIZE, 0));
+    }
+    // Uncommitted changes can be read back:
+    try(couchstore_changes_since(db, 0, 0, count_changes_cb, &count));
+    assert(count == DEFERRED_TEST_DOCS);
+    try(couchstore_commit(db));
+    size = db->file.pos;
+    couchstore_close_db(db);
+    db = NULL;
+
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_RDONLY, &db));
+    check_slotted_file(db, DEFERRED_TEST_DOCS);
+
+cleanup:
+    if (db) {
+        couchstore_close_db(db);
+    }
+    assert(errcode == 0);
+    return size;
+}
+
+static void test_deferred_node_writes(void)
+{
+    fprintf(stderr, "deferred node writes... ");
+    fflush(stderr);
+    int errcode = 0;
+    int i, count = 0;
+    char ids[DEFERRED_TEST_DOCS][12];
+    Doc *docptrs[DEFERRED_TEST_DOCS];
+    DocInfo *infoptrs[DEFERRED_TEST_DOCS];
+    LocalDoc ldoc, *lout = NULL;
+    Db *db = NULL;
+    DbInfo info;
+    char target[1100];
+    cs_off_t immediate_size, deferred_size;
+
+    sprintf(target, "%s.compact", testfilepath);
+    assert(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_RDONLY |
+                              COUCHSTORE_OPEN_FLAG_DEFER_NODE_WRITES, &db) ==
+           COUCHSTORE_ERROR_INVALID_ARGUMENTS);
+
+    // Random order, so each batch touches many leaves:
+    docset_init(DEFERRED_TEST_DOCS);
+    for (i = 0; i < DEFERRED_TEST_DOCS; ++i) {
+        sprintf(ids[i], "sdoc%05d", 2 * (int)((i * 7919L) % DEFERRED_TEST_DOCS));
+        setdoc(&testdocset.docs[i], &testdocset.infos[i], ids[i], strlen(ids[i]),
+               (char*)"{\"a\":1}", 7, zerometa, sizeof(zerometa));
+        docptrs[i] = &testdocset.docs[i];
+        infoptrs[i] = &testdocset.infos[i];
+    }
+
+    immediate_size = save_in_batches(0, docptrs, infoptrs);
+    deferred_size = save_in_batches(COUCHSTORE_OPEN_FLAG_DEFER_NODE_WRITES, docptrs, infoptrs);
+    assert(deferred_size * 3 < immediate_size);
+
+    // The deferred nodes' sizes are right once they're written:
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_DEFER_NODE_WRITES, &db));
+    try(couchstore_db_info(db, &info));
+    assert(info.doc_count == DEFERRED_TEST_DOCS && info.space_used < (uint64_t)deferred_size);
+
+    // Local docs, and compacting a db with uncommitted changes:
+    ldoc.id.buf = (char*)"_local/deferred";
+    ldoc.id.size = strlen(ldoc.id.buf);
+    ldoc.json.buf = (char*)"{}";
+    ldoc.json.size = 2;
+    ldoc.deleted = 0;
+    try(couchstore_save_local_document(db, &ldoc));
+    try(couchstore_save_documents(db, NULL, infoptrs, 10, 0));   // Deletes
+    unlink(target);
+    try(couchstore_compact_db(db, target));
+    couchstore_close_db(db);
+    db = NULL;
+    try(couchstore_open_db(target, COUCHSTORE_OPEN_FLAG_RDONLY, &db));
+    try(couchstore_open_local_document(db, ldoc.id.buf, ldoc.id.size, &lout));
+    try(couchstore_changes_since(db, 0, COUCHSTORE_NO_DELETES, count_changes_cb, &count));
+    assert(count == DEFERRED_TEST_DOCS - 10);
+
+cleanup:
+    couchstore_free_local_document(lout);
+    if (db) {
+        couchstore_close_db(db);
+    }
+    unlink(target);
+    assert(errcode == 0);
+}
+
+#define MEMTABLE_TEST_DOCS 200
+
+typedef struct {
+    char last[16];
+    uint64_t last_seq;
+    int count;
+    int deleted;
+} memtable_check;
+
+// Checks that all_docs delivers each ID once, in order
+static int memtable_id_order_cb(Db *db, DocInfo *info, void *ctx)
+{
+    memtable_check *check = ctx;
+    (void)db;
+    assert(info->id.size < sizeof(check->last));
+    assert(check->count == 0 || strncmp(info->id.buf, check->last, info->id.size) > 0 ||
+           strlen(check->last) > info->id.size);
+    memcpy(check->last, info->id.buf, info->id.size);
+    check->last[info->id.size] = 0;
+    check->count++;
+    check->deleted += info->deleted;
+    return 0;
+}
+
+// Checks that changes_since delivers sequences in order
+static int memtable_seq_order_cb(Db *db, DocInfo *info, void *ctx)
+{
+    memtable_check *check = ctx;
+    (void)db;
+    assert(info->db_seq > check->last_seq);
+    check->last_seq = info->db_seq;
+    check->count++;
+    check->deleted += info->deleted;
+    return 0;
+}
+
+typedef struct {
+    memtable_check check;
+    Doc *resave_doc;
+    DocInfo *resave_info;
+} memtable_resave_check;
+
+// Like memtable_seq_order_cb, but saves one doc again when it's reached
+static int memtable_resave_cb(Db *db, DocInfo *info, void *ctx)
+{
+    memtable_resave_check *rc = ctx;
+    DocInfo *resave = rc->resave_info;
+    if (resave && info->id.size == resave->id.size &&
+            !memcmp(info->id.buf, resave->id.buf, info->id.size)) {
+        rc->resave_info = NULL;
+        assert(couchstore_save_documents(db, &rc->resave_doc, &resave, 1, 0) ==
+               COUCHSTORE_SUCCESS);
+    }
+    return memtable_seq_order_cb(db, info, &rc->check);
+}
+
+static void test_memtable(void)
+{
+    fprintf(stderr, "memtable... ");
+    fflush(stderr);
+    int errcode = 0;
+    int i;
+    char ids[MEMTABLE_TEST_DOCS + 100][12];
+    Doc *docptrs[MEMTABLE_TEST_DOCS + 100];
+    DocInfo *infoptrs[MEMTABLE_TEST_DOCS + 100];
+    DocInfo *info = NULL;
+    Db *db = NULL;
+    DbInfo dbinfo;
+    memtable_check check;
+    memtable_resave_check resave_check;
+    uint64_t disk_root, old_seq;
+    sized_buf start;
+
+    docset_init(MEMTABLE_TEST_DOCS + 100);
+    for (i = 0; i < MEMTABLE_TEST_DOCS + 100; ++i) {
+        sprintf(ids[i], "mdoc%04d", i);
+        setdoc(&testdocset.docs[i], &testdocset.infos[i], ids[i], strlen(ids[i]),
+               (char*)"{\"a\":1}", 7, zerometa, sizeof(zerometa));
+        docptrs[i] = &testdocset.docs[i];
+        infoptrs[i] = &testdocset.infos[i];
+    }
+
+    // The first half goes straight into the trees:
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_CREATE, &db));
+    try(couchstore_save_documents(db, docptrs, infoptrs, MEMTABLE_TEST_DOCS / 2, 0));
+    try(couchstore_commit(db));
+    disk_root = db->header.by_id_root->pointer;
+    old_seq = infoptrs[5]->db_seq;
+
+    // The rest, a resave, a delete and a repeated save go into the memtable, in reverse order:
+    try(couchstore_set_memtable(db, 1 << 20, 0));
+    for (i = MEMTABLE_TEST_DOCS - 10; i >= MEMTABLE_TEST_DOCS / 2; i -= 10) {
+        try(couchstore_save_documents(db, docptrs + i, infoptrs + i, 10, 0));
+    }
+    try(couchstore_save_documents(db, docptrs + 5, infoptrs + 5, 1, 0));
+    try(couchstore_save_documents(db, NULL, infoptrs + 7, 1, 0));
+    try(couchstore_save_documents(db, docptrs + 150, infoptrs + 150, 1, 0));
+    assert(db->header.by_id_root->pointer == disk_root);
+
+    // Reads see the memtable merged with the trees:
+    try(couchstore_docinfo_by_id(db, ids[150], strlen(ids[150]), &info));
+    assert(info->db_seq == infoptrs[150]->db_seq && !info->deleted);
+    couchstore_free_docinfo(info);
+    info = NULL;
+    try(couchstore_docinfo_by_id(db, ids[7], strlen(ids[7]), &info));
+    assert(info->deleted);
+    couchstore_free_docinfo(info);
+    info = NULL;
+    try(couchstore_docinfo_by_sequence(db, infoptrs[5]->db_seq, &info));
+    assert(info->id.size == strlen(ids[5]) && !memcmp(info->id.buf, ids[5], info->id.size));
+    couchstore_free_docinfo(info);
+    info = NULL;
+    assert(couchstore_docinfo_by_sequence(db, old_seq, &info) == COUCHSTORE_ERROR_DOC_NOT_FOUND);
+
+    memset(&check, 0, sizeof(check));
+    try(couchstore_all_docs(db, NULL, 0, memtable_id_order_cb, &check));
+    assert(check.count == MEMTABLE_TEST_DOCS && check.deleted == 1);
+    memset(&check, 0, sizeof(check));
+    start.buf = ids[150];
+    start.size = strlen(ids[150]);
+    try(couchstore_all_docs(db, &start, 0, memtable_id_order_cb, &check));
+    assert(check.count == MEMTABLE_TEST_DOCS - 150);
+    memset(&check, 0, sizeof(check));
+    try(couchstore_changes_since(db, 0, 0, memtable_seq_order_cb, &check));
+    assert(check.count == MEMTABLE_TEST_DOCS && check.deleted == 1);
+    assert(check.last_seq == db->header.update_seq);
+    // Past doc 5's old sequence: 93 saved docs on disk (less 7, deleted), 101 in the memtable
+    memset(&check, 0, sizeof(check));
+    try(couchstore_changes_since(db, old_seq + 1, COUCHSTORE_NO_DELETES,
+                                 memtable_seq_order_cb, &check));
+    assert(check.count == MEMTABLE_TEST_DOCS - 6);
+    // Saving a doc from the callback doesn't cut the walk short. Doc 100 is followed in the
+    // memtable by 101-109, 5, 7 and 150, and the new revision isn't seen:
+    memset(&resave_check, 0, sizeof(resave_check));
+    resave_check.resave_doc = docptrs[100];
+    resave_check.resave_info = infoptrs[100];
+    try(couchstore_changes_since(db, 0, 0, memtable_resave_cb, &resave_check));
+    assert(resave_check.resave_info == NULL);
+    assert(resave_check.check.count == MEMTABLE_TEST_DOCS);
+    assert(resave_check.check.last_seq == infoptrs[150]->db_seq);
+
+    // A small memtable is flushed into the trees as it fills:
+    try(couchstore_set_memtable(db, 4096, 0));
+    assert(db->header.by_id_root->pointer != disk_root);
+    disk_root = db->header.by_id_root->pointer;
+    for (i = MEMTABLE_TEST_DOCS; i < MEMTABLE_TEST_DOCS + 100; ++i) {
+        try(couchstore_save_documents(db, docptrs + i, infoptrs + i, 1, 0));
+    }
+    assert(db->header.by_id_root->pointer != disk_root);
+
+    try(couchstore_commit(db));
+    couchstore_close_db(db);
+    db = NULL;
+
+    try(couchstore_open_db(testfilepath, 0, &db));
+    try(couchstore_db_info(db, &dbinfo));
+    assert(dbinfo.doc_count == MEMTABLE_TEST_DOCS + 99 && dbinfo.deleted_count == 1);
+    assert(dbinfo.last_sequence == infoptrs[MEMTABLE_TEST_DOCS + 99]->db_seq);
+    try(couchstore_docinfo_by_id(db, ids[7], strlen(ids[7]), &info));
+    assert(info->deleted);
+
+    // Removing the memtable flushes it:
+    try(couchstore_set_memtable(db, 1 << 20, 0));
+    try(couchstore_save_documents(db, NULL, infoptrs + 8, 1, 0));
+    try(couchstore_set_memtable(db, 0, 0));
+    assert(db->memtable == NULL);
+    try(couchstore_db_info(db, &dbinfo));
+    assert(dbinfo.deleted_count == 2);
+
+cleanup:
+    couchstore_free_docinfo(info);
+    if (db) {
+        couchstore_close_db(db);
+    }
+    assert(errcode == 0);
+}
+
+#define RANGE_TEST_DOCS 500
+
+typedef struct {
+    int count;
+    int ids[RANGE_TEST_DOCS];       // The numbers in the IDs, in the order passed on
+    uint64_t seqs[RANGE_TEST_DOCS];
+} range_results;
+
+static int range_collect_cb(Db *db, DocInfo *info, void *ctx)
+{
+    range_results *results = ctx;
+    char id[12];
+    (void)db;
+    assert(results->count < RANGE_TEST_DOCS && info->id.size < sizeof(id));
+    memcpy(id, info->id.buf, info->id.size);
+    id[info->id.size] = 0;
+    results->ids[results->count] = atoi(id + 4);
+    results->seqs[results->count] = info->db_seq;
+    results->count++;
+    return 0;
+}
+
+static void check_id_range(Db *db, const char *start, const char *end, uint64_t limit,
+                           couchstore_docinfos_options options, int first, int count)
+{
+    range_results results;
+    sized_buf startKey = {(char*)start, start ? strlen(start) : 0};
+    sized_buf endKey = {(char*)end, end ? strlen(end) : 0};
+    int i, step = (options & COUCHSTORE_DESCENDING) ? -1 : 1;
+    results.count = 0;
+    assert(couchstore_all_docs_range(db, start ? &startKey : NULL, end ? &endKey : NULL, limit,
+                                     options, range_collect_cb, &results) == COUCHSTORE_SUCCESS);
+    assert(results.count == count);
+    for (i = 0; i < count; ++i) {
+        assert(results.ids[i] == first + i * step);
+    }
+}
+
+static void check_seq_range(Db *db, uint64_t start, uint64_t end, uint64_t limit,
+                            couchstore_docinfos_options options, uint64_t first, int count)
+{
+    range_results results;
+    int i, step = (options & COUCHSTORE_DESCENDING) ? -1 : 1;
+    results.count = 0;
+    assert(couchstore_changes_range(db, start, end, limit, options, range_collect_cb,
+                                    &results) == COUCHSTORE_SUCCESS);
+    assert(results.count == count);
+    for (i = 0; i < count; ++i) {
+        assert(results.seqs[i] == first + i * step);
+    }
+}
+
+// Doc n has ID rdocNNNN and sequence n + 1
+static void check_ranges(Db *db)
+{
+    const couchstore_docinfos_options desc = COUCHSTORE_DESCENDING;
+    const couchstore_docinfos_options excl = COUCHSTORE_EXCLUSIVE_END;
+    const uint64_t last = RANGE_TEST_DOCS;
+
+    check_id_range(db, NULL, NULL, 0, 0, 0, RANGE_TEST_DOCS);
+    check_id_range(db, "rdoc0100", "rdoc0199", 0, 0, 100, 100);
+    check_id_range(db, "rdoc0100", "rdoc0199", 0, excl, 100, 99);
+    check_id_range(db, "rdoc0100", "rdoc0199", 10, 0, 100, 10);
+    check_id_range(db, "rdoc0100", NULL, 1000, 0, 100, RANGE_TEST_DOCS - 100);
+    check_id_range(db, "rdoc0199", "rdoc0100", 0, 0, 0, 0);
+    check_id_range(db, NULL, NULL, 0, desc, RANGE_TEST_DOCS - 1, RANGE_TEST_DOCS);
+    check_id_range(db, NULL, NULL, 5, desc, RANGE_TEST_DOCS - 1, 5);
+    check_id_range(db, "rdoc0200", "rdoc0100", 0, desc, 200, 101);
+    check_id_range(db, "rdoc0200", "rdoc0100", 0, desc | excl, 200, 100);
+    check_id_range(db, "rdoc0150x", NULL, 3, desc, 150, 3);
+    check_id_range(db, "rdoc0", NULL, 0, desc, 0, 0);
+    check_id_range(db, "rdoc0100", "rdoc0200", 0, desc, 0, 0);
+
+    check_seq_range(db, 0, UINT64_MAX, 0, 0, 1, RANGE_TEST_DOCS);
+    check_seq_range(db, 50, 60, 0, 0, 50, 11);
+    check_seq_range(db, 50, 60, 0, excl, 50, 10);
+    check_seq_range(db, 50, 60, 4, 0, 50, 4);
+    check_seq_range(db, UINT64_MAX, 0, 10, desc, last, 10);
+    check_seq_range(db, UINT64_MAX, 0, 0, desc, last, RANGE_TEST_DOCS);
+    check_seq_range(db, 60, 50, 0, desc | excl, 60, 10);
+}
+
+static void test_range_iteration(void)
+{
+    fprintf(stderr, "range iteration... ");
+    fflush(stderr);
+    int errcode = 0;
+    int i;
+    char ids[RANGE_TEST_DOCS][12];
+    Doc *docptrs[RANGE_TEST_DOCS];
+    DocInfo *infoptrs[RANGE_TEST_DOCS];
+    range_results results;
+    sized_buf start;
+    Db *db = NULL;
+
+    docset_init(RANGE_TEST_DOCS);
+    for (i = 0; i < RANGE_TEST_DOCS; ++i) {
+        sprintf(ids[i], "rdoc%04d", i);
+        setdoc(&testdocset.docs[i], &testdocset.infos[i], ids[i], strlen(ids[i]),
+               (char*)"{\"a\":1}", 7, zerometa, sizeof(zerometa));
+        docptrs[i] = &testdocset.docs[i];
+        infoptrs[i] = &testdocset.infos[i];
+    }
+
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_CREATE, &db));
+    try(couchstore_save_documents(db, docptrs, infoptrs, RANGE_TEST_DOCS, 0));
+    try(couchstore_commit(db));
+    check_ranges(db);
+    couchstore_close_db(db);
+    db = NULL;
+
+    // The same, with slotted nodes:
+    unlink(testfilepath);
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_CREATE, &db));
+    try(couchstore_set_id_filter(db, 0.01, 0));
+    assert(db->header.disk_version == 12);
+    try(couchstore_save_documents(db, docptrs, infoptrs, RANGE_TEST_DOCS, 0));
+    try(couchstore_commit(db));
+    check_ranges(db);
+
+    // Deletions are filtered out before the limit is applied:
+    try(couchstore_save_documents(db, NULL, infoptrs + 1, 2, 0));
+    results.count = 0;
+    try(couchstore_all_docs_range(db, NULL, NULL, 2, COUCHSTORE_NO_DELETES,
+                                  range_collect_cb, &results));
+    assert(results.count == 2 && results.ids[0] == 0 && results.ids[1] == 3);
+
+    // Ascending ranges merge the memtable; descending ones flush it first:
+    try(couchstore_set_memtable(db, 1 << 20, 0));
+    try(couchstore_save_documents(db, docptrs + 10, infoptrs + 10, 5, 0));
+    results.count = 0;
+    start.buf = ids[8];
+    start.size = strlen(ids[8]);
+    try(couchstore_all_docs_range(db, &start, NULL, 5, 0, range_collect_cb, &results));
+    assert(results.count == 5 && results.ids[0] == 8 && results.ids[4] == 12);
+    assert(results.seqs[2] == RANGE_TEST_DOCS + 3);
+    results.count = 0;
+    try(couchstore_changes_range(db, RANGE_TEST_DOCS, UINT64_MAX, 3, 0, range_collect_cb,
+                                 &results));
+    assert(results.count == 3 && results.ids[0] == 499 && results.ids[1] == 1);
+    assert(results.seqs[2] == RANGE_TEST_DOCS + 2);
+    check_seq_range(db, UINT64_MAX, 0, 3, COUCHSTORE_DESCENDING, RANGE_TEST_DOCS + 7, 3);
+    i = 0;
+    try(couchstore_all_docs_range(db, NULL, NULL, 0, COUCHSTORE_DESCENDING,
+                                  count_changes_cb, &i));
+    assert(i == RANGE_TEST_DOCS);
+
+cleanup:
+    if (db) {
+        couchstore_close_db(db);
+    }
+    assert(errcode == 0);
+}
+
+#define COUNT_TEST_DOCS 3000
+
+typedef struct {
+    int count;
+    int deleted[COUNT_TEST_DOCS];
+    uint64_t sizes[COUNT_TEST_DOCS];
+} count_test_docs;
+
+static int count_collect_cb(Db *db, DocInfo *info, void *ctx)
+{
+    count_test_docs *docs = ctx;
+    (void)db;
+    docs->deleted[docs->count] = info->deleted;
+    docs->sizes[docs->count] = info->size;
+    docs->count++;
+    return 0;
+}
+
+// Checks the counts for the range of docs 'first' through 'last', against those of 'docs'
+static void check_count_range(Db *db, char ids[][12], const count_test_docs *docs,
+                              int first, int last, couchstore_docinfos_options options)
+{
+    DocRangeInfo info, expected;
+    sized_buf start = {ids[first], strlen(ids[first])}, end = {ids[last], strlen(ids[last])};
+    uint64_t changes;
+    int i;
+    memset(&expected, 0, sizeof(expected));
+    for (i = first; i <= last; ++i) {
+        if (i == last && (options & COUCHSTORE_EXCLUSIVE_END)) {
+            break;
+        }
+        if (docs->deleted[i]) {
+            expected.deleted_count++;
+        } else {
+            expected.doc_count++;
+        }
+        expected.size += docs->sizes[i];
+    }
+    assert(couchstore_count_docs_range(db, &start, &end, options, &info) == COUCHSTORE_SUCCESS);
+    assert(info.doc_count == expected.doc_count && info.deleted_count == expected.deleted_count);
+    assert(info.size == expected.size);
+
+    // Doc n has sequence n + 1:
+    assert(couchstore_count_changes_range(db, first + 1, last + 1, options, &changes) ==
+           COUCHSTORE_SUCCESS);
+    assert(changes == expected.doc_count + expected.deleted_count);
+}
+
+static void check_counts(Db *db, char ids[][12])
+{
+    count_test_docs docs;
+    DocRangeInfo info;
+    DocInfo *docinfo = NULL;
+    uint64_t changes;
+    sized_buf key = {ids[100], strlen(ids[100])};
+    int i, live = 0;
+
+    docs.count = 0;
+    assert(couchstore_all_docs(db, NULL, 0, count_collect_cb, &docs) == COUCHSTORE_SUCCESS);
+    assert(docs.count == COUNT_TEST_DOCS);
+
+    for (i = 0; i < 200; ++i) {
+        int first = (i * 7919) % COUNT_TEST_DOCS;
+        int last = first + (i * i * 31) % (COUNT_TEST_DOCS - first);
+        check_count_range(db, ids, &docs, first, last, 0);
+        check_count_range(db, ids, &docs, first, last, COUCHSTORE_EXCLUSIVE_END);
+    }
+    check_count_range(db, ids, &docs, 0, COUNT_TEST_DOCS - 1, 0);
+
+    // Open-ended ranges, and keys that aren't in the tree:
+    assert(couchstore_count_docs_range(db, NULL, NULL, 0, &info) == COUCHSTORE_SUCCESS);
+    assert(info.doc_count + info.deleted_count == COUNT_TEST_DOCS);
+    assert(couchstore_count_docs_range(db, NULL, &key, COUCHSTORE_EXCLUSIVE_END, &info) ==
+           COUCHSTORE_SUCCESS);
+    assert(info.doc_count + info.deleted_count == 100);
+    key.size--;     // "cdoc0010", just before "cdoc00100"
+    assert(couchstore_count_docs_range(db, &key, NULL, 0, &info) == COUCHSTORE_SUCCESS);
+    assert(info.doc_count + info.deleted_count == COUNT_TEST_DOCS - 100);
+    assert(couchstore_count_changes_range(db, 101, UINT64_MAX, 0, &changes) ==
+           COUCHSTORE_SUCCESS);
+    assert(changes == COUNT_TEST_DOCS - 100);
+
+    // Seeking by offset:
+    for (i = 0; i < COUNT_TEST_DOCS; i += 37) {
+        assert(couchstore_docinfo_by_offset(db, i, 0, &docinfo) == COUCHSTORE_SUCCESS);
+        assert(docinfo->id.size == strlen(ids[i]) && !memcmp(docinfo->id.buf, ids[i],
+                                                             docinfo->id.size));
+        couchstore_free_docinfo(docinfo);
+        assert(couchstore_docinfo_by_offset(db, i, COUCHSTORE_DESCENDING, &docinfo) ==
+               COUCHSTORE_SUCCESS);
+        assert(!memcmp(docinfo->id.buf, ids[COUNT_TEST_DOCS - 1 - i], docinfo->id.size));
+        couchstore_free_docinfo(docinfo);
+    }
+    for (i = 0; i < COUNT_TEST_DOCS; ++i) {
+        if (docs.deleted[i]) {
+            continue;
+        }
+        if (live % 29 == 0) {
+            assert(couchstore_docinfo_by_offset(db, live, COUCHSTORE_NO_DELETES, &docinfo) ==
+                   COUCHSTORE_SUCCESS);
+            assert(!docinfo->deleted && !memcmp(docinfo->id.buf, ids[i], docinfo->id.size));
+            couchstore_free_docinfo(docinfo);
+        }
+        live++;
+    }
+    assert(couchstore_docinfo_by_offset(db, live, COUCHSTORE_NO_DELETES, &docinfo) ==
+           COUCHSTORE_ERROR_DOC_NOT_FOUND);
+    assert(couchstore_docinfo_by_offset(db, COUNT_TEST_DOCS - live - 1, COUCHSTORE_DELETES_ONLY,
+                                        &docinfo) == COUCHSTORE_SUCCESS);
+    assert(docinfo->deleted);
+    couchstore_free_docinfo(docinfo);
+}
+
+static void test_range_counts(void)
+{
+    fprintf(stderr, "range counts... ");
+    fflush(stderr);
+    int errcode = 0;
+    int i;
+    char ids[COUNT_TEST_DOCS][12];
+    char bodies[COUNT_TEST_DOCS][16];
+    Doc *docptrs[COUNT_TEST_DOCS];
+    DocInfo *infoptrs[COUNT_TEST_DOCS];
+    Db *db = NULL;
+
+    docset_init(COUNT_TEST_DOCS);
+    for (i = 0; i < COUNT_TEST_DOCS; ++i) {
+        sprintf(ids[i], "cdoc%05d", i);
+        sprintf(bodies[i], "{\"a\":%d}", i * i);
+        setdoc(&testdocset.docs[i], &testdocset.infos[i], ids[i], strlen(ids[i]),
+               bodies[i], strlen(bodies[i]), zerometa, sizeof(zerometa));
+        docptrs[i] = &testdocset.docs[i];
+        infoptrs[i] = &testdocset.infos[i];
+        // Every seventh doc is deleted:
+        if (i % 7 == 3) {
+            docptrs[i] = NULL;
+            testdocset.infos[i].deleted = 1;
+        }
+    }
+
+    // (A NULL Doc pointer saves a deletion)
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_CREATE, &db));
+    try(couchstore_save_documents(db, docptrs, infoptrs, COUNT_TEST_DOCS, 0));
+    try(couchstore_commit(db));
+    check_counts(db, ids);
+    couchstore_close_db(db);
+    db = NULL;
+
+    // The same, with slotted nodes:
+    unlink(testfilepath);
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_CREATE, &db));
+    try(couchstore_set_id_filter(db, 0.01, 0));
+    assert(db->header.disk_version == 12);
+    for (i = 0; i < COUNT_TEST_DOCS; i += 100) {
+        try(couchstore_save_documents(db, docptrs + i, infoptrs + i, 100, 0));
+    }
+    try(couchstore_commit(db));
+    check_counts(db, ids);
+
+cleanup:
+    if (db) {
+        couchstore_close_db(db);
+    }
+    assert(errcode == 0);
+}
+
+#define SCAN_TEST_DOCS 6000
+#define SCAN_TEST_PARTITIONS 8
+
+typedef struct {
+    int count[SCAN_TEST_PARTITIONS];
+    uint64_t first[SCAN_TEST_PARTITIONS];   // Doc number, or sequence
+    uint64_t last[SCAN_TEST_PARTITIONS];
+    int by_seq;
+    int fail_at;                            // Return an error at this doc number, if nonzero
+} scan_results;
+
+static int scan_collect_cb(Db *db, int partition, DocInfo *info, void *ctx)
+{
+    scan_results *results = ctx;
+    char id[12];
+    uint64_t n;
+    (void)db;
+    assert(partition >= 0 && partition < SCAN_TEST_PARTITIONS && info->id.size < sizeof(id));
+    memcpy(id, info->id.buf, info->id.size);
+    id[info->id.size] = 0;
+    n = results->by_seq ? info->db_seq : (uint64_t)atoi(id + 4);
+    if (results->fail_at && atoi(id + 4) == results->fail_at) {
+        return COUCHSTORE_ERROR_CANCEL;
+    }
+    // Each partition is in order:
+    assert(results->count[partition] == 0 || n > results->last[partition]);
+    if (results->count[partition]++ == 0) {
+        results->first[partition] = n;
+    }
+    results->last[partition] = n;
+    return 0;
+}
+
+// Checks that the partitions are disjoint and in order, and returns the number of docs in them
+static int check_scan_results(const scan_results *results)
+{
+    int p, total = 0, largest = 0;
+    uint64_t last = 0;
+    for (p = 0; p < SCAN_TEST_PARTITIONS; ++p) {
+        if (results->count[p] > 0) {
+            assert(total == 0 || results->first[p] > last);
+            last = results->last[p];
+            total += results->count[p];
+            largest = results->count[p] > largest ? results->count[p] : largest;
+        }
+    }
+    // Roughly balanced:
+    assert(largest < total / 3);
+    return total;
+}
+
+static void check_parallel_scans(Db *db, int num_docs, int num_deleted)
+{
+    scan_results results;
+    unsigned threads;
+    for (threads = 1; threads <= 4; threads += 3) {
+        memset(&results, 0, sizeof(results));
+        assert(couchstore_all_docs_parallel(db, SCAN_TEST_PARTITIONS, threads, 0,
+                                            scan_collect_cb, &results) == COUCHSTORE_SUCCESS);
+        assert(check_scan_results(&results) == num_docs);
+
+        memset(&results, 0, sizeof(results));
+        assert(couchstore_all_docs_parallel(db, SCAN_TEST_PARTITIONS, threads,
+                                            COUCHSTORE_NO_DELETES, scan_collect_cb,
+                                            &results) == COUCHSTORE_SUCCESS);
+        assert(check_scan_results(&results) == num_docs - num_deleted);
+
+        memset(&results, 0, sizeof(results));
+        results.by_seq = 1;
+        assert(couchstore_changes_parallel(db, SCAN_TEST_PARTITIONS, threads, 0,
+                                           scan_collect_cb, &results) == COUCHSTORE_SUCCESS);
+        assert(check_scan_results(&results) == num_docs);
+
+        // A callback's error stops the scan:
+        memset(&results, 0, sizeof(results));
+        results.fail_at = num_docs / 2;
+        assert(couchstore_all_docs_parallel(db, SCAN_TEST_PARTITIONS, threads, 0,
+                                            scan_collect_cb, &results) ==
+               COUCHSTORE_ERROR_CANCEL);
+    }
+}
+
+static void test_parallel_scan(void)
+{
+    fprintf(stderr, "parallel scan... ");
+    fflush(stderr);
+    int errcode = 0;
+    int i;
+    char ids[SCAN_TEST_DOCS][12];
+    Doc *docptrs[SCAN_TEST_DOCS];
+    DocInfo *infoptrs[SCAN_TEST_DOCS];
+    scan_results results;
+    Db *db = NULL;
+
+    docset_init(SCAN_TEST_DOCS);
+    for (i = 0; i < SCAN_TEST_DOCS; ++i) {
+        sprintf(ids[i], "pdoc%05d", i);
+        setdoc(&testdocset.docs[i], &testdocset.infos[i], ids[i], strlen(ids[i]),
+               (char*)"{\"a\":1}", 7, zerometa, sizeof(zerometa));
+        docptrs[i] = &testdocset.docs[i];
+        infoptrs[i] = &testdocset.infos[i];
+        if (i % 10 == 5) {
+            docptrs[i] = NULL;      // Deleted
+        }
+    }
+
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_CREATE, &db));
+    assert(couchstore_all_docs_parallel(db, 0, 1, 0, scan_collect_cb, &results) ==
+           COUCHSTORE_ERROR_INVALID_ARGUMENTS);
+    memset(&results, 0, sizeof(results));
+    try(couchstore_all_docs_parallel(db, SCAN_TEST_PARTITIONS, 4, 0, scan_collect_cb,
+                                     &results));
+    assert(results.count[0] == 0);
+    try(couchstore_save_documents(db, docptrs, infoptrs, SCAN_TEST_DOCS, 0));
+    try(couchstore_commit(db));
+    check_parallel_scans(db, SCAN_TEST_DOCS, SCAN_TEST_DOCS / 10);
+    couchstore_close_db(db);
+    db = NULL;
+
+    // A shared handle is read from directly:
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_RDONLY |
+                           COUCHSTORE_OPEN_FLAG_SHARED, &db));
+    check_parallel_scans(db, SCAN_TEST_DOCS, SCAN_TEST_DOCS / 10);
+    couchstore_close_db(db);
+    db = NULL;
+
+    // Uncommitted changes, in deferred nodes and in a memtable, are included. Docs 0-99 are
+    // deleted (ten already were), then doc 5 is saved again:
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_DEFER_NODE_WRITES, &db));
+    try(couchstore_save_documents(db, NULL, infoptrs, 100, 0));
+    try(couchstore_set_memtable(db, 1 << 20, 0));
+    docptrs[5] = &testdocset.docs[5];
+    try(couchstore_save_documents(db, docptrs + 5, infoptrs + 5, 1, 0));
+    check_parallel_scans(db, SCAN_TEST_DOCS, SCAN_TEST_DOCS / 10 + 89);
+
+cleanup:
+    if (db) {
+        couchstore_close_db(db);
+    }
+    assert(errcode == 0);
+}
 
 int main(int argc, const char *argv[])
 {
@@ -724,6 +4063,89 @@ int main(int argc, const char *argv[])
     test_huge_revseq();
     fprintf(stderr, " OK\n");
     unlink(testfilepath);
+    test_node_cache();
+    fprintf(stderr, " OK\n");
+    unlink(testfilepath);
+    test_mmap_read();
+    fprintf(stderr, " OK\n");
+    unlink(testfilepath);
+    test_doc_body_reads();
+    fprintf(stderr, " OK\n");
+    unlink(testfilepath);
+    test_open_documents();
+    fprintf(stderr, " OK\n");
+    unlink(testfilepath);
+    test_async_reads();
+    fprintf(stderr, " OK\n");
+    unlink(testfilepath);
+    test_group_commit();
+    fprintf(stderr, " OK\n");
+    unlink(testfilepath);
+    test_single_sync_commit();
+    fprintf(stderr, " OK\n");
+    unlink(testfilepath);
+    test_single_sync_lost_node();
+    fprintf(stderr, " OK\n");
+    unlink(testfilepath);
+    test_single_sync_fallback();
+    fprintf(stderr, " OK\n");
+    unlink(testfilepath);
+    test_parallel_compaction();
+    fprintf(stderr, " OK\n");
+    unlink(testfilepath);
+    test_compaction_checksums();
+    fprintf(stderr, " OK\n");
+    unlink(testfilepath);
+    test_catchup_compaction();
+    fprintf(stderr, " OK\n");
+    unlink(testfilepath);
+    test_catchup_write_failure();
+    fprintf(stderr, " OK\n");
+    unlink(testfilepath);
+    test_crc32_kernels();
+    fprintf(stderr, " OK\n");
+    test_bulk_load();
+    fprintf(stderr, " OK\n");
+    unlink(testfilepath);
+    test_snapshots();
+    fprintf(stderr, " OK\n");
+    unlink(testfilepath);
+    test_shared_handle();
+    fprintf(stderr, " OK\n");
+    unlink(testfilepath);
+    test_readahead();
+    fprintf(stderr, " OK\n");
+    unlink(testfilepath);
+    test_vectored_writes();
+    fprintf(stderr, " OK\n");
+    unlink(testfilepath);
+    test_codecs();
+    fprintf(stderr, " OK\n");
+    unlink(testfilepath);
+    test_zstd_dictionary();
+    fprintf(stderr, " OK\n");
+    unlink(testfilepath);
+    test_id_filter();
+    fprintf(stderr, " OK\n");
+    unlink(testfilepath);
+    test_slotted_nodes();
+    fprintf(stderr, " OK\n");
+    unlink(testfilepath);
+    test_deferred_node_writes();
+    fprintf(stderr, " OK\n");
+    unlink(testfilepath);
+    test_memtable();
+    fprintf(stderr, " OK\n");
+    unlink(testfilepath);
+    test_range_iteration();
+    fprintf(stderr, " OK\n");
+    unlink(testfilepath);
+    test_range_counts();
+    fprintf(stderr, " OK\n");
+    unlink(testfilepath);
+    test_parallel_scan();
+    fprintf(stderr, " OK\n");
+    unlink(testfilepath);
     
     TestCollateJSON();
     TestCouchIndexer();